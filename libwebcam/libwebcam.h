@@ -56,6 +56,9 @@ typedef struct webcam {
 	/* Width and height of the image: */
 	unsigned width, height;
 
+	/* Format of frames: WEBCAM_RGB24 (converted to image) or WEBCAM_JPEG (only passed to webcam_wait_frame_cb) */
+	webcam_colorspace_t colorspace;
+
 	/* Image data */
 	webcam_color_t *image;
 
@@ -73,6 +76,10 @@ char* webcam_name(int id);
 /* Try to open camera with number =num. Width and height is recomended values so you must look inside webcam_t for actual sizes. */
 webcam_t* webcam_open(int id, unsigned width, unsigned height);
 
+/* Open camera which gives frames in colorspace (WEBCAM_RGB24 or WEBCAM_JPEG). If camera doesn't support it
+ * RGB24 is used, so look at cam->colorspace. */
+webcam_t* webcam_open_ex(int id, unsigned width, unsigned height, webcam_colorspace_t colorspace);
+
 /* Close device and free resources */
 void webcam_close(webcam_t *cam);
 
@@ -85,7 +92,8 @@ int webcam_stop(webcam_t *cam);
 /* Wait for next frame for maximum =delay ms (0 = forever) */
 int webcam_wait_frame(webcam_t *cam, unsigned delay);
 
-/* Wait for next frame but call function with arguments with data not copy it */
+/* Wait for next frame but call function with arguments with data not copy it. Data is in cam->colorspace format
+ * (JPEG frame of size bytes or RGB24 rows). Returns the same as webcam_wait_frame or -1 if callback failed. */
 int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned delay);
 
 /* Set control to camera. Value must be in interval [0-100] */
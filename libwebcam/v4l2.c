@@ -132,6 +132,11 @@ char* webcam_name(int id)
 
 /* Try to open camera with number =num. Width and height is recomended values so you must look inside webcam_t for actual sizes. */
 webcam_t* webcam_open(int id, unsigned width, unsigned height)
+{
+	return webcam_open_ex(id, width, height, WEBCAM_RGB24);
+}
+
+webcam_t* webcam_open_ex(int id, unsigned width, unsigned height, webcam_colorspace_t colorspace)
 {
 	char namebuf[128];
 	struct stat st;
@@ -154,6 +159,11 @@ webcam_t* webcam_open(int id, unsigned width, unsigned height)
 		height = 480;
 	}
 
+	if (colorspace != WEBCAM_RGB24 && colorspace != WEBCAM_JPEG) {
+		log("Unsupported colorspace");
+		return NULL;
+	}
+
 	/* Ok now we can allocate webcam structure and open device: */
 	res = calloc(1, sizeof(webcam_t));
 	if (!res) {
@@ -163,6 +173,7 @@ webcam_t* webcam_open(int id, unsigned width, unsigned height)
 
 	res->width = width;
 	res->height = height;
+	res->colorspace = colorspace;
 	/* res->image = calloc(width * height, sizeof(uint32_t)); */
 
 	priv = res->priv = calloc(1, sizeof(priv_t));
@@ -313,14 +324,25 @@ int webcam_stop(webcam_t *cam)
 	return 0;
 }
 
-/* Wait for next frame for maximum =delay ms (0 = forever) */
-int webcam_wait_frame(webcam_t *cam, unsigned delay)
+/* Give frame to callback or convert it to cam->image */
+static int frame(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned char *img, size_t img_len)
+{
+	if (cb)
+		return cb(arg, cam, img, img_len);
+
+	if (cam->colorspace == WEBCAM_RGB24)
+		process_image(cam, img, img_len);
+
+	return 0;
+}
+
+static int wait_frame(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned delay)
 {
 	struct v4l2_buffer buf;
 	priv_t *priv;
 	fd_set fds;
 	struct timeval tv;
-	int rv;
+	int rv, res;
 
 	if (!cam || !cam->priv) {
 		return -1;
@@ -351,7 +373,8 @@ int webcam_wait_frame(webcam_t *cam, unsigned delay)
 			return -1;
 		}
 
-		process_image(cam, priv->buf, priv->img_len);
+		if (frame(cam, cb, arg, priv->buf, cam->colorspace == WEBCAM_JPEG? (size_t)rv: priv->img_len))
+			return -1;
 	} else if (priv->io_method == IO_METHOD_MMAP) {
 		memset(&buf, 0, sizeof(buf));
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -373,9 +396,13 @@ int webcam_wait_frame(webcam_t *cam, unsigned delay)
 			log("Invalid frame");
 			return -1;
 		}
-		process_image(cam, priv->buffers[buf.index].start, priv->buffers[buf.index].len);
+		/* Compressed frames are shorter than buffer */
+		res = frame(cam, cb, arg, priv->buffers[buf.index].start,
+				buf.bytesused? buf.bytesused: priv->buffers[buf.index].len);
 
 		REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_QBUF, &buf));
+		if (res)
+			return -1;
 	} else {
 		log("Invalid IO method");
 		return -1;
@@ -384,6 +411,20 @@ int webcam_wait_frame(webcam_t *cam, unsigned delay)
 	return 1;
 }
 
+/* Wait for next frame for maximum =delay ms (0 = forever) */
+int webcam_wait_frame(webcam_t *cam, unsigned delay)
+{
+	return wait_frame(cam, NULL, NULL, delay);
+}
+
+int webcam_wait_frame_cb(webcam_t *cam, webcam_frame_cb cb, void *arg, unsigned delay)
+{
+	if (!cb)
+		return -1;
+
+	return wait_frame(cam, cb, arg, delay);
+}
+
 /* Set control to camera. Value must be in interval [0-100] */
 static int id_conv(int id)
 {
@@ -510,19 +551,42 @@ static int init_cam(webcam_t *cam, const char *devname)
 /* TODO: determine format to use */
 	}
 
-	/* Querry for video format: */
-	memset(&fmt, 0, sizeof(fmt));
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = cam->width;
-	fmt.fmt.pix.height = cam->height;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
-	fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+	/* Querry for video format: compressed frames are taken as is if camera gives them */
+	rv = -1;
+	if (cam->colorspace == WEBCAM_JPEG) {
+		for (i = 0; i < 2 && rv < 0; i++) {
+			memset(&fmt, 0, sizeof(fmt));
+			fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			fmt.fmt.pix.width = cam->width;
+			fmt.fmt.pix.height = cam->height;
+			fmt.fmt.pix.pixelformat = i? V4L2_PIX_FMT_JPEG: V4L2_PIX_FMT_MJPEG;
+			fmt.fmt.pix.field = V4L2_FIELD_ANY;
+
+			REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_S_FMT, &fmt));
+			if (rv == 0 && fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG && fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG)
+				rv = -1;
+		}
+
+		if (rv < 0) {
+			log("JPEG frames are not supported: using RGB24");
+			cam->colorspace = WEBCAM_RGB24;
+		}
+	}
 
-	REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_S_FMT, &fmt));
 	if (rv < 0) {
-		log("video format RGB24 is not supported");
-		/* TODO: try another format??? */
-		return -1;
+		memset(&fmt, 0, sizeof(fmt));
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		fmt.fmt.pix.width = cam->width;
+		fmt.fmt.pix.height = cam->height;
+		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
+		fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+
+		REINTR(rv, v4l2_ioctl(priv->fd, VIDIOC_S_FMT, &fmt));
+		if (rv < 0) {
+			log("video format RGB24 is not supported");
+			/* TODO: try another format??? */
+			return -1;
+		}
 	}
 
 	/* Next lines had taken from capture.c. It is dark magic so we must not change them :) */
@@ -15,21 +15,36 @@ static void sigint(int sig)
 	}
 }
 
-#if 0
 static void draw_image(webcam_t *cam, trfb_server_t *srv)
 {
-	unsigned x, y;
-	webcam_color_t *data = cam->image;
+	unsigned y;
+	unsigned w = cam->width < srv->fb->width? cam->width: srv->fb->width;
+	unsigned h = cam->height < srv->fb->height? cam->height: srv->fb->height;
+	unsigned char *dst = srv->fb->pixels;
+
+	/* Both are 0x00rrggbb */
+	for (y = 0; y < h; y++)
+		memcpy(dst + y * srv->fb->width * 4, cam->image + y * cam->width, w * 4);
+	trfb_server_mark_dirty(srv, 0, 0, w, h);
+}
+
+/* Camera gives us MJPEG frame: decode it into framebuffer and pass it to Tight clients as is */
+static int jpeg_frame(void *ctx, webcam_t *cam, void *data, size_t size)
+{
+	trfb_server_t *srv = ctx;
+
+	/* Broken frames are usual for cameras, just skip them */
+	trfb_server_update_jpeg(srv, data, size);
+
+	return 0;
 }
-#endif
 
 int main(int argc, char *argv[])
 {
 	trfb_server_t *srv;
 	webcam_t *cam;
-	const unsigned width = 640;
-	const unsigned height = 480;
 	trfb_event_t event;
+	int mjpeg = 0;
 	int brightness;
 	int contrast;
 	int saturation;
@@ -43,13 +58,24 @@ int main(int argc, char *argv[])
 	signal(SIGUSR2, sigint);
 	signal(SIGCHLD, SIG_IGN);
 
-	cam = webcam_open(0, 640, 480);
+	if (argc > 1 && !strcmp(argv[1], "-m")) {
+		mjpeg = 1;
+		argc--;
+		argv++;
+	}
+
+	cam = webcam_open_ex(0, 640, 480, mjpeg? WEBCAM_JPEG: WEBCAM_RGB24);
 	if (!cam) {
 		fprintf(stderr, "Error: can't open webcam!\n");
 		return 1;
 	}
 
-	srv = trfb_server_create(width, height, 4);
+	if (mjpeg && cam->colorspace != WEBCAM_JPEG) {
+		fprintf(stderr, "Warning: camera doesn't support MJPEG, using RGB\n");
+		mjpeg = 0;
+	}
+
+	srv = trfb_server_create(cam->width, cam->height, 4);
 	if (!srv) {
 		fprintf(stderr, "Error: can't create server!\n");
 		return 1;
@@ -72,13 +98,13 @@ int main(int argc, char *argv[])
 	webcam_start(cam);
 	for (;;) {
 		if (trfb_server_updated(srv)) {
-			trfb_server_lock_fb(srv, 0);
-			if (webcam_wait_frame(cam, 10) > 0) {
-				trfb_server_unlock_fb(srv);
+			if (mjpeg) {
+				webcam_wait_frame_cb(cam, jpeg_frame, srv, 10);
+			} else if (webcam_wait_frame(cam, 10) > 0) {
 				trfb_server_lock_fb(srv, 1);
-				/* draw_image(cam, srv); */
+				draw_image(cam, srv);
+				trfb_server_unlock_fb(srv);
 			}
-			trfb_server_unlock_fb(srv);
 		}
 
 		while (trfb_server_poll_event(srv, &event)) {
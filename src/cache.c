@@ -0,0 +1,314 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Encode-once cache. Connection converts rectangles it sends from server framebuffer, so rectangle of the
+ * same frame without cursor drawn into it has the same pixels for all connections with the same format.
+ * Output of encoder which depends only on pixels and parameters is captured to entry and other connections
+ * queue the same bytes instead of encoding them again.
+ *
+ * Entry is referenced by cache while it is in hash table and by output queues of connections. Connection
+ * which encodes entry marks it pending: other connections wait for it instead of doing the same work.
+ * Entries of old frames are dropped because nobody could ask for them.
+ */
+
+#define CACHE_BUCKETS 1024
+/* Maximum size of encoded data in cache */
+#define CACHE_SIZE (64 * 1024 * 1024)
+/* Entries of frames older than the last one by this count are dropped */
+#define CACHE_FRAMES 2
+
+#define ENTRY_PENDING 0
+#define ENTRY_READY   1
+/* Encoder has used state of connection: rectangle is encoded by every connection itself */
+#define ENTRY_PRIVATE 2
+
+typedef struct cache_key {
+	trfb_format_t format;
+	int32_t encoding;
+	int compress_level;
+	int jpeg_quality;
+	int jpeg_subsampling;
+	unsigned long long frame;
+	unsigned x, y, width, height;
+} cache_key_t;
+
+struct trfb_cache_entry {
+	cache_key_t key;
+	uint64_t hash;
+	int state;
+	unsigned refs;
+
+	unsigned char *data;
+	size_t len, size;
+
+	trfb_cache_entry_t *next;
+	/* List of entries from the oldest one */
+	trfb_cache_entry_t *older, *newer;
+};
+
+struct trfb_cache {
+	mtx_t lock;
+	cnd_t ready;
+	trfb_cache_entry_t *buckets[CACHE_BUCKETS];
+	trfb_cache_entry_t *oldest, *newest;
+	size_t size;
+	/* The last frame encoded */
+	unsigned long long frame;
+};
+
+trfb_cache_t* trfb_cache_create(void)
+{
+	trfb_cache_t *cache;
+
+	cache = calloc(1, sizeof(trfb_cache_t));
+	if (!cache)
+		return NULL;
+
+	mtx_init(&cache->lock, mtx_plain);
+	cnd_init(&cache->ready);
+
+	return cache;
+}
+
+/* Cache must be locked */
+static void entry_unref(trfb_cache_entry_t *e)
+{
+	if (--e->refs)
+		return;
+
+	free(e->data);
+	free(e);
+}
+
+/* Remove entry from hash table. Cache must be locked. */
+static void entry_unlink(trfb_cache_t *cache, trfb_cache_entry_t *e)
+{
+	trfb_cache_entry_t **p;
+
+	for (p = &cache->buckets[e->hash % CACHE_BUCKETS]; *p; p = &(*p)->next) {
+		if (*p == e) {
+			*p = e->next;
+			break;
+		}
+	}
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		cache->oldest = e->newer;
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		cache->newest = e->older;
+
+	if (e->state != ENTRY_PENDING)
+		cache->size -= e->len;
+
+	entry_unref(e);
+}
+
+void trfb_cache_free(trfb_cache_t *cache)
+{
+	if (!cache)
+		return;
+
+	while (cache->oldest)
+		entry_unlink(cache, cache->oldest);
+
+	cnd_destroy(&cache->ready);
+	mtx_destroy(&cache->lock);
+	free(cache);
+}
+
+/* Drop entries of old frames and the oldest ones if cache is too big. Cache must be locked. */
+static void evict(trfb_cache_t *cache)
+{
+	trfb_cache_entry_t *e;
+
+	while ((e = cache->oldest) && e->state != ENTRY_PENDING &&
+			(cache->size > CACHE_SIZE || e->key.frame + CACHE_FRAMES <= cache->frame))
+		entry_unlink(cache, e);
+}
+
+static trfb_cache_entry_t* lookup(trfb_cache_t *cache, const cache_key_t *key, uint64_t hash)
+{
+	trfb_cache_entry_t *e;
+
+	for (e = cache->buckets[hash % CACHE_BUCKETS]; e; e = e->next)
+		if (e->hash == hash && !memcmp(&e->key, key, sizeof(cache_key_t)))
+			return e;
+
+	return NULL;
+}
+
+int trfb_cache_append(trfb_cache_entry_t *e, const void *buf, size_t len)
+{
+	unsigned char *p;
+	size_t sz;
+
+	if (e->size - e->len < len) {
+		sz = e->size? e->size: 4096;
+		while (sz - e->len < len)
+			sz *= 2;
+
+		p = realloc(e->data, sz);
+		if (!p)
+			return -1;
+		e->data = p;
+		e->size = sz;
+	}
+
+	memcpy(e->data + e->len, buf, len);
+	e->len += len;
+
+	return 0;
+}
+
+static void make_key(trfb_connection_t *con, const trfb_encoder_t *enc, unsigned long long frame,
+		unsigned x, unsigned y, unsigned width, unsigned height, cache_key_t *key)
+{
+	/* Key is compared by memcmp: padding must be zero */
+	memset(key, 0, sizeof(cache_key_t));
+	key->format.bpp = con->format.bpp;
+	key->format.depth = con->format.depth;
+	key->format.big_endian = con->format.big_endian;
+	key->format.true_color = con->format.true_color;
+	key->format.rmax = con->format.rmax;
+	key->format.gmax = con->format.gmax;
+	key->format.bmax = con->format.bmax;
+	key->format.rshift = con->format.rshift;
+	key->format.gshift = con->format.gshift;
+	key->format.bshift = con->format.bshift;
+	key->encoding = enc->encoding;
+	key->compress_level = con->compress_level;
+	if (trfb_connection_jpeg_allowed(con)) {
+		key->jpeg_quality = con->jpeg_quality;
+		key->jpeg_subsampling = con->jpeg_subsampling;
+	}
+	key->frame = frame;
+	key->x = x;
+	key->y = y;
+	key->width = width;
+	key->height = height;
+}
+
+/* Queue data of entry. Reference of caller is moved to connection. */
+static int queue_entry(trfb_connection_t *con, trfb_cache_entry_t *e)
+{
+	trfb_cache_entry_t **p;
+	unsigned sz;
+
+	if (con->shared_cnt == con->shared_size) {
+		sz = con->shared_size? con->shared_size * 2: 16;
+		p = realloc(con->shared, sz * sizeof(trfb_cache_entry_t*));
+		if (!p) {
+			mtx_lock(&con->server->cache->lock);
+			entry_unref(e);
+			mtx_unlock(&con->server->cache->lock);
+			trfb_msg("[%s] Not enought memory", con->name);
+			return -1;
+		}
+		con->shared = p;
+		con->shared_size = sz;
+	}
+
+	con->shared[con->shared_cnt++] = e;
+
+	return trfb_connection_queue_ref(con, e->data, e->len);
+}
+
+int trfb_connection_encode_shared(trfb_connection_t *con, const trfb_encoder_t *enc, unsigned long long frame,
+		unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	trfb_cache_t *cache = con->server->cache;
+	trfb_cache_entry_t *e;
+	cache_key_t key;
+	uint64_t hash;
+	int rv;
+
+	if (!cache || !(enc->flags & TRFB_ENCODER_SHARED))
+		return trfb_connection_encode(con, enc, x, y, width, height);
+
+	make_key(con, enc, frame, x, y, width, height, &key);
+	hash = trfb_hash(&key, sizeof(key));
+
+	mtx_lock(&cache->lock);
+	/* Other connection encodes the same rectangle right now */
+	while ((e = lookup(cache, &key, hash)) && e->state == ENTRY_PENDING)
+		cnd_wait(&cache->ready, &cache->lock);
+
+	if (e && e->state == ENTRY_PRIVATE) {
+		mtx_unlock(&cache->lock);
+		return trfb_connection_encode(con, enc, x, y, width, height);
+	}
+
+	if (e) {
+		e->refs++;
+		mtx_unlock(&cache->lock);
+		return queue_entry(con, e);
+	}
+
+	e = calloc(1, sizeof(trfb_cache_entry_t));
+	if (!e) {
+		mtx_unlock(&cache->lock);
+		return trfb_connection_encode(con, enc, x, y, width, height);
+	}
+
+	/* References of cache and of this connection */
+	e->key = key;
+	e->hash = hash;
+	e->state = ENTRY_PENDING;
+	e->refs = 2;
+	e->next = cache->buckets[hash % CACHE_BUCKETS];
+	cache->buckets[hash % CACHE_BUCKETS] = e;
+	e->older = cache->newest;
+	if (cache->newest)
+		cache->newest->newer = e;
+	else
+		cache->oldest = e;
+	cache->newest = e;
+	if (frame > cache->frame)
+		cache->frame = frame;
+	mtx_unlock(&cache->lock);
+
+	con->capture = e;
+	con->capture_private = 0;
+	rv = trfb_connection_encode(con, enc, x, y, width, height);
+	con->capture = NULL;
+
+	mtx_lock(&cache->lock);
+	if (rv) {
+		/* Entry is freed with the reference of this connection */
+		e->refs--;
+		entry_unlink(cache, e);
+	} else {
+		e->state = con->capture_private? ENTRY_PRIVATE: ENTRY_READY;
+		cache->size += e->len;
+		evict(cache);
+	}
+	cnd_broadcast(&cache->ready);
+	mtx_unlock(&cache->lock);
+
+	if (rv)
+		return -1;
+
+	return queue_entry(con, e);
+}
+
+void trfb_connection_release_shared(trfb_connection_t *con)
+{
+	trfb_cache_t *cache = con->server->cache;
+	unsigned i;
+
+	if (!con->shared_cnt)
+		return;
+
+	mtx_lock(&cache->lock);
+	for (i = 0; i < con->shared_cnt; i++)
+		entry_unref(con->shared[i]);
+	mtx_unlock(&cache->lock);
+
+	con->shared_cnt = 0;
+}
@@ -0,0 +1,949 @@
+#include <trfb.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Headless RFB client. Server messages are parsed from input buffer in the same way as client
+ * messages in connection.c. Rectangles are decoded by parts so big updates are not buffered.
+ */
+
+/* Maximum length of one server message we are ready to buffer */
+#define MAX_MESSAGE_LEN (16 * 1024 * 1024)
+
+/* Decoders registry */
+static const trfb_decoder_t *decoders[TRFB_MAX_ENCODERS] = {
+	&trfb_decoder_raw,
+	&trfb_decoder_copyrect,
+	&trfb_decoder_rre,
+	&trfb_decoder_corre,
+	&trfb_decoder_hextile,
+#if HAVE_ZLIB_H
+	&trfb_decoder_zrle,
+	&trfb_decoder_tight,
+#endif
+	&trfb_decoder_extended_desktop_size,
+	&trfb_decoder_desktop_size,
+	&trfb_decoder_cursor,
+	NULL
+};
+
+const trfb_decoder_t* trfb_decoder_find(int32_t encoding)
+{
+	unsigned i;
+
+	for (i = 0; i < TRFB_MAX_ENCODERS && decoders[i]; i++)
+		if (decoders[i]->encoding == encoding)
+			return decoders[i];
+
+	return NULL;
+}
+
+const trfb_decoder_t* trfb_decoder_get(unsigned idx)
+{
+	if (idx >= TRFB_MAX_ENCODERS)
+		return NULL;
+
+	return decoders[idx];
+}
+
+static int decoder_index(const trfb_decoder_t *dec)
+{
+	int i;
+
+	for (i = 0; i < TRFB_MAX_ENCODERS && decoders[i]; i++)
+		if (decoders[i] == dec)
+			return i;
+
+	return -1;
+}
+
+double trfb_client_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int set_nonblock(int sock)
+{
+	int flags;
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int connect_unix(const char *path, int nonblock)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		trfb_msg("Unix socket path is too long: %s", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		trfb_msg("Can't create Unix socket");
+		return -1;
+	}
+
+	/* Non-blocking connect to Unix socket fails if backlog is full so connect is always blocking */
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) || (nonblock && set_nonblock(sock))) {
+		trfb_msg("Can't connect to %s: %s", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int trfb_client_connect(const char *host, const char *port, int nonblock)
+{
+	struct addrinfo hints;
+	struct addrinfo *addr;
+	struct addrinfo *addrs;
+	int sock = -1;
+	int one = 1;
+	int res;
+
+	if (host[0] == '/')
+		return connect_unix(host, nonblock);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	res = getaddrinfo(host, port, &hints, &addrs);
+	if (res) {
+		trfb_msg("getaddrinfo failed: %s", gai_strerror(res));
+		return -1;
+	}
+
+	for (addr = addrs; addr; addr = addr->ai_next) {
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock < 0)
+			continue;
+
+		if (!nonblock || !set_nonblock(sock)) {
+			if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0 || (nonblock && errno == EINPROGRESS))
+				break;
+		}
+
+		close(sock);
+		sock = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (sock < 0) {
+		trfb_msg("Can't connect to %s:%s", host, port);
+		return -1;
+	}
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return sock;
+}
+
+trfb_client_t* trfb_client_create(int sock)
+{
+	trfb_client_t *cl;
+	int flags;
+
+	cl = calloc(1, sizeof(trfb_client_t));
+	if (!cl) {
+		trfb_msg("Not enought memory to create client");
+		return NULL;
+	}
+
+	cl->in = malloc(TRFB_BUFSIZ);
+	if (!cl->in) {
+		free(cl);
+		trfb_msg("Not enought memory to create client");
+		return NULL;
+	}
+	cl->insize = TRFB_BUFSIZ;
+
+	cl->io = trfb_io_socket_wrap(sock);
+	if (!cl->io) {
+		free(cl->in);
+		free(cl);
+		trfb_msg("Can not wrap socket");
+		return NULL;
+	}
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (flags >= 0 && (flags & O_NONBLOCK))
+		cl->io->flags |= TRFB_IO_NONBLOCK;
+
+	cl->sock = sock;
+	cl->phase = TRFB_CLIENT_VERSION;
+	snprintf(cl->name, sizeof(cl->name), "client-%d", sock);
+
+	return cl;
+}
+
+void trfb_client_free(trfb_client_t *cl)
+{
+	unsigned i;
+
+	if (!cl)
+		return;
+
+	for (i = 0; i < TRFB_MAX_ENCODERS; i++) {
+		if (cl->decoder_state[i] && decoders[i] && decoders[i]->destroy)
+			decoders[i]->destroy(cl->decoder_state[i]);
+	}
+
+	trfb_framebuffer_free(cl->fb);
+	trfb_io_free(cl->io);
+	free(cl->encodings);
+	free(cl->desktop);
+	free(cl->in);
+	free(cl);
+}
+
+static int queue(trfb_client_t *cl, const void *buf, size_t len)
+{
+	if (trfb_io_queue(cl->io, buf, len)) {
+		trfb_msg("[%s] Not enought memory for output", cl->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int send_format(trfb_client_t *cl)
+{
+	unsigned char buf[20];
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = 0; /* SetPixelFormat */
+	buf[4] = cl->format.bpp;
+	buf[5] = cl->format.depth;
+	buf[6] = cl->format.big_endian;
+	buf[7] = cl->format.true_color;
+	buf[8] = cl->format.rmax >> 8;
+	buf[9] = cl->format.rmax;
+	buf[10] = cl->format.gmax >> 8;
+	buf[11] = cl->format.gmax;
+	buf[12] = cl->format.bmax >> 8;
+	buf[13] = cl->format.bmax;
+	buf[14] = cl->format.rshift;
+	buf[15] = cl->format.gshift;
+	buf[16] = cl->format.bshift;
+
+	return queue(cl, buf, sizeof(buf));
+}
+
+static int send_encodings(trfb_client_t *cl)
+{
+	unsigned char buf[4 + 4 * TRFB_MAX_ENCODERS];
+	unsigned i;
+
+	buf[0] = 2; /* SetEncodings */
+	buf[1] = 0;
+	buf[2] = cl->encodings_cnt >> 8;
+	buf[3] = cl->encodings_cnt;
+	for (i = 0; i < cl->encodings_cnt; i++) {
+		buf[4 + 4 * i] = (uint32_t)cl->encodings[i] >> 24;
+		buf[5 + 4 * i] = (uint32_t)cl->encodings[i] >> 16;
+		buf[6 + 4 * i] = (uint32_t)cl->encodings[i] >> 8;
+		buf[7 + 4 * i] = (uint32_t)cl->encodings[i];
+	}
+
+	return queue(cl, buf, 4 + 4 * cl->encodings_cnt);
+}
+
+/* Create framebuffer of client format */
+static int create_fb(trfb_client_t *cl)
+{
+	trfb_framebuffer_t *fb;
+
+	fb = trfb_framebuffer_create_of_format(cl->width, cl->height, &cl->format);
+	if (!fb) {
+		trfb_msg("[%s] Can not create framebuffer", cl->name);
+		return -1;
+	}
+
+	trfb_framebuffer_free(cl->fb);
+	cl->fb = fb;
+
+	return 0;
+}
+
+int trfb_client_set_format(trfb_client_t *cl, const trfb_format_t *fmt)
+{
+	if (fmt->bpp != 8 && fmt->bpp != 16 && fmt->bpp != 32) {
+		trfb_msg("[%s] Invalid pixel format", cl->name);
+		return -1;
+	}
+
+	cl->format = *fmt;
+	cl->format_set = 1;
+
+	if (cl->phase != TRFB_CLIENT_NORMAL)
+		return 0;
+
+	if (send_format(cl))
+		return -1;
+
+	return create_fb(cl);
+}
+
+int trfb_client_set_encodings(trfb_client_t *cl, const int32_t *encodings, unsigned cnt)
+{
+	int32_t *p = NULL;
+
+	if (cnt > TRFB_MAX_ENCODERS) {
+		trfb_msg("[%s] Too many encodings", cl->name);
+		return -1;
+	}
+
+	if (cnt) {
+		p = malloc(cnt * sizeof(int32_t));
+		if (!p) {
+			trfb_msg("Not enought memory");
+			return -1;
+		}
+		memcpy(p, encodings, cnt * sizeof(int32_t));
+	}
+
+	free(cl->encodings);
+	cl->encodings = p;
+	cl->encodings_cnt = cnt;
+
+	if (cl->phase != TRFB_CLIENT_NORMAL)
+		return 0;
+
+	return send_encodings(cl);
+}
+
+int trfb_client_request(trfb_client_t *cl, int incremental)
+{
+	unsigned char buf[10];
+
+	if (cl->phase != TRFB_CLIENT_NORMAL) {
+		trfb_msg("[%s] Update request before ServerInit", cl->name);
+		return -1;
+	}
+
+	buf[0] = 3; /* FramebufferUpdateRequest */
+	buf[1] = incremental? 1: 0;
+	buf[2] = buf[3] = buf[4] = buf[5] = 0;
+	buf[6] = cl->width >> 8;
+	buf[7] = cl->width;
+	buf[8] = cl->height >> 8;
+	buf[9] = cl->height;
+
+	if (!cl->requested) {
+		cl->requested = 1;
+		cl->request_time = trfb_client_time();
+	}
+
+	return queue(cl, buf, sizeof(buf));
+}
+
+int trfb_client_continuous(trfb_client_t *cl, int enable)
+{
+	unsigned char buf[10];
+
+	if (!cl->cu_supported) {
+		trfb_msg("[%s] Server does not support continuous updates", cl->name);
+		return -1;
+	}
+
+	buf[0] = 150; /* EnableContinuousUpdates */
+	buf[1] = enable? 1: 0;
+	buf[2] = buf[3] = buf[4] = buf[5] = 0;
+	buf[6] = cl->width >> 8;
+	buf[7] = cl->width;
+	buf[8] = cl->height >> 8;
+	buf[9] = cl->height;
+	cl->cu_enabled = enable? 1: 0;
+
+	return queue(cl, buf, sizeof(buf));
+}
+
+int trfb_client_flush(trfb_client_t *cl, unsigned timeout)
+{
+	return trfb_io_flush(cl->io, timeout);
+}
+
+static int send_init(trfb_client_t *cl)
+{
+	unsigned char shared = 1;
+
+	cl->phase = TRFB_CLIENT_INIT;
+
+	return queue(cl, &shared, 1);
+}
+
+static int ProtocolVersion(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	trfb_msg_protocol_version_t ver;
+	unsigned char buf[16];
+	size_t l;
+
+	if (trfb_msg_protocol_version_decode(&ver, msg, 12)) {
+		trfb_msg("[%s] Can't decode ProtocolVersion message from server", cl->name);
+		return -1;
+	}
+
+	cl->version = ver.proto;
+	cl->phase = TRFB_CLIENT_SECURITY;
+
+	l = sizeof(buf);
+	if (trfb_msg_protocol_version_encode(&ver, buf, &l))
+		return -1;
+
+	return queue(cl, buf, l);
+}
+
+static size_t Security_len(trfb_client_t *cl, const unsigned char *msg)
+{
+	/* Version 3.3: server chooses security type (uint32). Later: list of types. */
+	return cl->version < trfb_v7? 3: msg[0];
+}
+
+static int Security(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	unsigned char none = 1;
+	unsigned i;
+
+	if (cl->version < trfb_v7) {
+		if (get32(msg) != 1) {
+			trfb_msg("[%s] Server requires unsupported security type %u", cl->name, (unsigned)get32(msg));
+			return -1;
+		}
+
+		return send_init(cl);
+	}
+
+	for (i = 1; i < len; i++)
+		if (msg[i] == 1)
+			break;
+
+	if (i >= len) {
+		trfb_msg("[%s] Server does not support security type None", cl->name);
+		return -1;
+	}
+
+	if (queue(cl, &none, 1))
+		return -1;
+
+	if (cl->version >= trfb_v8) {
+		cl->phase = TRFB_CLIENT_RESULT;
+		return 0;
+	}
+
+	return send_init(cl);
+}
+
+static int SecurityResult(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	if (get32(msg)) {
+		trfb_msg("[%s] Security handshake failed", cl->name);
+		return -1;
+	}
+
+	return send_init(cl);
+}
+
+static size_t ServerInit_len(trfb_client_t *cl, const unsigned char *msg)
+{
+	return get32(msg + 20);
+}
+
+static int ServerInit(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	trfb_format_t *fmt = &cl->server_format;
+
+	cl->width = get16(msg);
+	cl->height = get16(msg + 2);
+	fmt->bpp = msg[4];
+	fmt->depth = msg[5];
+	fmt->big_endian = msg[6]? 1: 0;
+	fmt->true_color = msg[7]? 1: 0;
+	fmt->rmax = get16(msg + 8);
+	fmt->gmax = get16(msg + 10);
+	fmt->bmax = get16(msg + 12);
+	fmt->rshift = msg[14];
+	fmt->gshift = msg[15];
+	fmt->bshift = msg[16];
+
+	free(cl->desktop);
+	cl->desktop = malloc(len - 24 + 1);
+	if (!cl->desktop) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+	memcpy(cl->desktop, msg + 24, len - 24);
+	cl->desktop[len - 24] = 0;
+
+	if (!cl->format_set)
+		cl->format = cl->server_format;
+
+	if (create_fb(cl))
+		return -1;
+
+	cl->phase = TRFB_CLIENT_NORMAL;
+
+	if (cl->format_set && send_format(cl))
+		return -1;
+
+	if (cl->encodings_cnt && send_encodings(cl))
+		return -1;
+
+	if (cl->on_init)
+		cl->on_init(cl);
+
+	return 0;
+}
+
+static void update_done(trfb_client_t *cl)
+{
+	double t;
+
+	cl->stats.updates++;
+
+	if (cl->requested) {
+		t = trfb_client_time() - cl->request_time;
+		if (!cl->stats.latency_cnt || t < cl->stats.latency_min)
+			cl->stats.latency_min = t;
+		if (t > cl->stats.latency_max)
+			cl->stats.latency_max = t;
+		cl->stats.latency_sum += t;
+		cl->stats.latency_cnt++;
+		cl->requested = 0;
+	}
+
+	if (cl->on_update)
+		cl->on_update(cl);
+}
+
+static int FramebufferUpdate(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	cl->rects_left = get16(msg + 2);
+	cl->decoder = NULL;
+
+	if (!cl->rects_left)
+		update_done(cl);
+
+	return 0;
+}
+
+static size_t SetColourMapEntries_len(trfb_client_t *cl, const unsigned char *msg)
+{
+	return 6 * get16(msg + 4);
+}
+
+static int Ignore(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	return 0;
+}
+
+static size_t ServerCutText_len(trfb_client_t *cl, const unsigned char *msg)
+{
+	return get32(msg + 4);
+}
+
+static int EndOfContinuousUpdates(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	cl->cu_supported = 1;
+	cl->cu_enabled = 0;
+
+	return 0;
+}
+
+static size_t Fence_len(trfb_client_t *cl, const unsigned char *msg)
+{
+	return msg[8];
+}
+
+static int Fence(trfb_client_t *cl, const unsigned char *msg, size_t len)
+{
+	unsigned char buf[9 + 64];
+	uint32_t flags = get32(msg + 4);
+
+	if (len - 9 > 64) {
+		trfb_msg("[%s] Fence data is too long", cl->name);
+		return -1;
+	}
+
+	if (!(flags & TRFB_FENCE_REQUEST))
+		return 0;
+
+	/* Everything before fence is processed: answer with the same data */
+	flags &= TRFB_FENCE_BLOCK_BEFORE | TRFB_FENCE_BLOCK_AFTER | TRFB_FENCE_SYNC_NEXT;
+	memcpy(buf, msg, len);
+	buf[0] = 248; /* ClientFence */
+	buf[4] = flags >> 24;
+	buf[5] = flags >> 16;
+	buf[6] = flags >> 8;
+	buf[7] = flags;
+
+	return queue(cl, buf, len);
+}
+
+static struct msg_types {
+	unsigned char type;
+	/* Length of fixed part of message (including type) */
+	size_t len;
+	/* Length of variable part. Function is called when fixed part is received. */
+	size_t (*extra)(trfb_client_t *cl, const unsigned char *msg);
+	int (*process)(trfb_client_t *cl, const unsigned char *msg, size_t len);
+} msg_types[] = {
+	{ 0, 4, NULL, FramebufferUpdate },
+	{ 1, 6, SetColourMapEntries_len, Ignore },
+	{ 2, 1, NULL, Ignore }, /* Bell */
+	{ 3, 8, ServerCutText_len, Ignore },
+	{ 150, 1, NULL, EndOfContinuousUpdates },
+	{ 248, 9, Fence_len, Fence },
+	{ 0, 0, NULL, NULL }
+};
+
+/* Handshake messages in order of phases */
+static struct msg_types phases[] = {
+	{ TRFB_CLIENT_VERSION, 12, NULL, ProtocolVersion },
+	{ TRFB_CLIENT_SECURITY, 1, Security_len, Security },
+	{ TRFB_CLIENT_RESULT, 4, NULL, SecurityResult },
+	{ TRFB_CLIENT_INIT, 24, ServerInit_len, ServerInit }
+};
+
+/* Rectangle header or part of rectangle data. Returns the same as process_message. */
+static ssize_t process_rect(trfb_client_t *cl, const unsigned char *buf, size_t len, size_t *need)
+{
+	const trfb_decoder_t *dec;
+	size_t hdr = 0;
+	size_t n;
+	ssize_t l;
+	int32_t encoding;
+	int i;
+
+	if (!cl->decoder) {
+		if (len < 12) {
+			*need = 12;
+			return 0;
+		}
+
+		cl->rect.x = get16(buf);
+		cl->rect.y = get16(buf + 2);
+		cl->rect.width = get16(buf + 4);
+		cl->rect.height = get16(buf + 6);
+		encoding = (int32_t)get32(buf + 8);
+
+		dec = trfb_decoder_find(encoding);
+		if (!dec) {
+			trfb_msg("[%s] Rectangle of unsupported encoding %d", cl->name, encoding);
+			return -1;
+		}
+
+		/* Pseudo-rectangles don't contain pixels */
+		if (encoding >= 0 && (cl->rect.x + cl->rect.width > cl->width || cl->rect.y + cl->rect.height > cl->height)) {
+			trfb_msg("[%s] Rectangle is out of screen", cl->name);
+			return -1;
+		}
+
+		cl->decoder = dec;
+		cl->rect_row = 0;
+		hdr = 12;
+		buf += hdr;
+		len -= hdr;
+	}
+
+	dec = cl->decoder;
+	i = decoder_index(dec);
+	if (dec->create && !cl->decoder_state[i]) {
+		cl->decoder_state[i] = dec->create(cl);
+		if (!cl->decoder_state[i]) {
+			trfb_msg("[%s] Can not create state for decoder %s", cl->name, dec->name);
+			return -1;
+		}
+	}
+
+	l = dec->decode(cl, cl->decoder_state[i], buf, len, &n);
+	if (l < 0)
+		return -1;
+
+	if (n == 0) {
+		/* Rectangle is complete */
+		cl->decoder = NULL;
+		cl->stats.rects++;
+		if (--cl->rects_left == 0)
+			update_done(cl);
+	} else if (l == 0 && hdr == 0) {
+		*need = n;
+	}
+
+	return hdr + l;
+}
+
+/*
+ * Process one message from buf. Returns length of processed data, 0 if message is not complete or -1 on error.
+ * If message is not complete *need is set to minimal length of data required.
+ */
+static ssize_t process_message(trfb_client_t *cl, const unsigned char *buf, size_t len, size_t *need)
+{
+	struct msg_types *msg;
+	size_t l;
+	int i;
+
+	if (cl->phase < TRFB_CLIENT_NORMAL) {
+		msg = phases + cl->phase;
+	} else if (cl->rects_left) {
+		return process_rect(cl, buf, len, need);
+	} else {
+		for (i = 0; msg_types[i].process; i++)
+			if (msg_types[i].type == buf[0])
+				break;
+
+		if (!msg_types[i].process) {
+			trfb_msg("[%s] Message of unknown type: %d", cl->name, buf[0]);
+			return -1;
+		}
+		msg = msg_types + i;
+	}
+
+	l = msg->len;
+	if (len >= l && msg->extra) {
+		l += msg->extra(cl, buf);
+		if (l > MAX_MESSAGE_LEN) {
+			trfb_msg("[%s] Message is too long: %lu bytes", cl->name, (unsigned long)l);
+			return -1;
+		}
+	}
+
+	if (len < l) {
+		*need = l;
+		return 0;
+	}
+
+	if (msg->process(cl, buf, l)) {
+		return -1;
+	}
+
+	return l;
+}
+
+static int process(trfb_client_t *cl)
+{
+	size_t pos = 0;
+	size_t need = 0;
+	ssize_t l;
+	unsigned char *p;
+	size_t sz;
+
+	while (pos < cl->inlen) {
+		l = process_message(cl, cl->in + pos, cl->inlen - pos, &need);
+		if (l < 0) {
+			return -1;
+		}
+
+		if (l == 0) {
+			break;
+		}
+
+		pos += l;
+	}
+
+	if (pos > 0) {
+		memmove(cl->in, cl->in + pos, cl->inlen - pos);
+		cl->inlen -= pos;
+	}
+
+	/* Message does not fit to buffer so we need more space */
+	if (need > cl->insize) {
+		sz = cl->insize;
+		while (sz < need)
+			sz *= 2;
+		p = realloc(cl->in, sz);
+		if (!p) {
+			trfb_msg("[%s] Not enought memory for input message", cl->name);
+			return -1;
+		}
+		cl->in = p;
+		cl->insize = sz;
+	}
+
+	return 0;
+}
+
+int trfb_client_read(trfb_client_t *cl, unsigned timeout)
+{
+	ssize_t l;
+
+	l = trfb_io_read(cl->io, cl->in + cl->inlen, cl->insize - cl->inlen, timeout);
+	if (l <= 0)
+		return l;
+
+	cl->stats.bytes += l;
+	cl->inlen += l;
+
+	if (process(cl))
+		return -1;
+
+	return 1;
+}
+
+/* Raw encoding: rows of pixels. Complete rows are decoded as soon as they are received. */
+static ssize_t raw_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	trfb_framebuffer_t *fb = cl->fb;
+	size_t row = (size_t)cl->rect.width * fb->bpp;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	unsigned char *p;
+	unsigned rows, i;
+
+	if (!row) {
+		*need = 0;
+		return 0;
+	}
+
+	rows = len / row;
+	if (rows > cl->rect.height - cl->rect_row)
+		rows = cl->rect.height - cl->rect_row;
+
+	p = (unsigned char*)fb->pixels + (cl->rect.y + cl->rect_row) * stride + cl->rect.x * fb->bpp;
+	for (i = 0; i < rows; i++, p += stride)
+		memcpy(p, buf + i * row, row);
+
+	cl->rect_row += rows;
+	*need = cl->rect_row < cl->rect.height? row: 0;
+
+	return rows * row;
+}
+
+const trfb_decoder_t trfb_decoder_raw = {
+	TRFB_ENCODING_RAW,
+	"Raw",
+	NULL,
+	NULL,
+	raw_decode
+};
+
+/* New size of framebuffer is size of rectangle: contents of framebuffer are lost */
+static int resize(trfb_client_t *cl)
+{
+	if (!cl->rect.width || !cl->rect.height) {
+		trfb_msg("[%s] Invalid desktop size", cl->name);
+		return -1;
+	}
+
+	if (cl->rect.width == cl->width && cl->rect.height == cl->height)
+		return 0;
+
+	cl->width = cl->rect.width;
+	cl->height = cl->rect.height;
+	if (create_fb(cl))
+		return -1;
+
+	/* Continuous updates of the old screen don't cover the new one */
+	if (cl->cu_enabled)
+		return trfb_client_continuous(cl, 1);
+
+	return 0;
+}
+
+static ssize_t desktop_size_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	*need = 0;
+
+	return resize(cl)? -1: 0;
+}
+
+const trfb_decoder_t trfb_decoder_desktop_size = {
+	TRFB_ENCODING_DESKTOP_SIZE,
+	"DesktopSize",
+	NULL,
+	NULL,
+	desktop_size_decode
+};
+
+static ssize_t extended_desktop_size_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len,
+		size_t *need)
+{
+	size_t total;
+
+	if (len < 4) {
+		*need = 4;
+		return 0;
+	}
+
+	/* Screens are not used: the whole framebuffer is one screen */
+	total = 4 + 16 * (size_t)buf[0];
+	if (len < total) {
+		*need = total;
+		return 0;
+	}
+
+	if (resize(cl))
+		return -1;
+	*need = 0;
+
+	return total;
+}
+
+const trfb_decoder_t trfb_decoder_extended_desktop_size = {
+	TRFB_ENCODING_EXTENDED_DESKTOP_SIZE,
+	"ExtendedDesktopSize",
+	NULL,
+	NULL,
+	extended_desktop_size_decode
+};
+
+static ssize_t cursor_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	size_t total;
+
+	/* Cursor is not drawn by headless client: pixels and mask are skipped */
+	total = (size_t)cl->rect.width * cl->rect.height * cl->fb->bpp + (size_t)(cl->rect.width + 7) / 8 * cl->rect.height;
+	if (total > MAX_MESSAGE_LEN) {
+		trfb_msg("[%s] Cursor is too big", cl->name);
+		return -1;
+	}
+
+	if (len < total) {
+		*need = total;
+		return 0;
+	}
+
+	*need = 0;
+
+	return total;
+}
+
+const trfb_decoder_t trfb_decoder_cursor = {
+	TRFB_ENCODING_CURSOR,
+	"Cursor",
+	NULL,
+	NULL,
+	cursor_decode
+};
@@ -5,14 +5,44 @@
 #include <sys/types.h>
 #include <sys/select.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 static int connection(void *con_in);
+static int send_version(trfb_connection_t *con);
+
+static int set_nonblock(int sock)
+{
+	int flags;
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
 
 void trfb_connection_free(trfb_connection_t *con)
 {
+	trfb_connection_release_shared(con);
+	free(con->shared);
+	trfb_connection_leave_pool(con);
+	trfb_connection_encoders_free(con);
+	trfb_region_free(&con->damage);
 	trfb_framebuffer_free(con->fb);
+	trfb_framebuffer_free(con->cursor);
+	free(con->cursor_mask);
+	free(con->converter);
 	trfb_io_free(con->io);
+	free(con->in);
+	if (con->wake[0] >= 0) {
+		close(con->wake[0]);
+		close(con->wake[1]);
+	}
 	mtx_destroy(&con->lock);
 	free(con);
 }
@@ -22,12 +52,18 @@ trfb_connection_t* trfb_connection_create(trfb_server_t *srv, int sock, struct s
 	trfb_connection_t *C = calloc(1, sizeof(trfb_connection_t));
 	char host[NI_MAXHOST];
 	char port[NI_MAXSERV];
+	size_t rsize, wsize;
+	int one = 1;
 	int rv;
 
 	if (!C) {
 		trfb_msg("Not enought memory to create connection");
 		return NULL;
 	}
+	C->wake[0] = C->wake[1] = -1;
+
+	/* Updates are sent by parts: last part must not wait for acknowledge of previous ones */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
 	C->io = trfb_io_socket_wrap(sock);
 	if (!C->io) {
@@ -36,17 +72,65 @@ trfb_connection_t* trfb_connection_create(trfb_server_t *srv, int sock, struct s
 		return NULL;
 	}
 
+	mtx_lock(&srv->lock);
+	rsize = srv->rbuf_size;
+	wsize = srv->wbuf_size;
+	C->compress_level = srv->compress_level;
+	C->jpeg_quality = srv->jpeg_quality;
+	C->jpeg_subsampling = TRFB_SUBSAMPLING_420;
+	C->target_latency = srv->target_latency;
+	C->pointer_x = srv->pointer_x;
+	C->pointer_y = srv->pointer_y;
+	mtx_unlock(&srv->lock);
+	C->cursor_changed = 1;
+	if (trfb_io_set_buffers(C->io, rsize, wsize)) {
+		trfb_io_free(C->io);
+		free(C);
+		trfb_msg("Not enought memory to create connection");
+		return NULL;
+	}
+
+	C->in = malloc(TRFB_BUFSIZ);
+	if (!C->in) {
+		trfb_io_free(C->io);
+		free(C);
+		trfb_msg("Not enought memory to create connection");
+		return NULL;
+	}
+	C->insize = TRFB_BUFSIZ;
+	C->inlen = 0;
+
+	/* New client has not seen anything so everything is damaged */
+	if (trfb_region_init(&C->damage, srv->fb->width, srv->fb->height)) {
+		free(C->in);
+		trfb_io_free(C->io);
+		free(C);
+		return NULL;
+	}
+	trfb_region_add_rect(&C->damage, 0, 0, srv->fb->width, srv->fb->height);
+
 	C->fb = NULL;
+	C->encoder = &trfb_encoder_raw;
 	C->server = srv;
+	C->sock = sock;
+	C->phase = TRFB_PHASE_VERSION;
 
 	mtx_init(&C->lock, mtx_plain);
 	C->next = NULL;
 	C->state = TRFB_STATE_WORKING;
+	if (addrlen > sizeof(C->addr))
+		addrlen = sizeof(C->addr);
 	memcpy(&C->addr, addr, addrlen);
 	C->addrlen = addrlen;
 
 	/* Get name information in user-friendly form: */
-	rv = getnameinfo(addr, addrlen, host, sizeof(host), port, sizeof(port), 0);
+	if (addr->sa_family == AF_UNIX) {
+		snprintf(host, sizeof(host), "unix");
+		snprintf(port, sizeof(port), "%d", sock);
+		rv = 0;
+	} else {
+		rv = getnameinfo(addr, addrlen, host, sizeof(host), port, sizeof(port), 0);
+	}
 	if (rv != 0) {
 		rv = getnameinfo(addr, addrlen, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
 	}
@@ -60,9 +144,39 @@ trfb_connection_t* trfb_connection_create(trfb_server_t *srv, int sock, struct s
 
 	trfb_msg("I:starting operationing with client [%s]", C->name);
 
+	if (send_version(C)) {
+		trfb_connection_free(C);
+		return NULL;
+	}
+
+	if ((srv->flags & TRFB_SERVER_ZEROCOPY) && trfb_io_zerocopy(C->io)) {
+		trfb_msg("W:[%s] zero-copy send is not supported", C->name);
+	}
+
+	if (srv->flags & TRFB_SERVER_EVENT_LOOP) {
+		/* Connection will be processed by event loop */
+		C->io->flags |= TRFB_IO_NONBLOCK;
+		return C;
+	}
+
+	/* Thread waits for socket itself: input is read while previous update is sent */
+	if (set_nonblock(sock)) {
+		trfb_connection_free(C);
+		trfb_msg("Can not set client socket to non-blocking mode");
+		return NULL;
+	}
+	C->io->flags |= TRFB_IO_NONBLOCK;
+
+	/* Damage from other threads wakes thread up: it sleeps in poll while there is nothing to send */
+	if (pipe(C->wake) || set_nonblock(C->wake[0]) || set_nonblock(C->wake[1])) {
+		trfb_msg("Can not create wakeup pipe: %s", strerror(errno));
+		trfb_connection_free(C);
+		return NULL;
+	}
+
 	/* Run connection processing thread: */
 	if (thrd_create(&C->thread, connection, C) != thrd_success) {
-		free(C);
+		trfb_connection_free(C);
 		trfb_msg("Can't start thread");
 		return NULL;
 	}
@@ -74,10 +188,63 @@ trfb_connection_t* trfb_connection_create(trfb_server_t *srv, int sock, struct s
 # define BUFSIZ 8192
 #endif
 
-static int negotiate(trfb_connection_t* con)
+/* Maximum length of one client message we are ready to buffer */
+#define MAX_MESSAGE_LEN (16 * 1024 * 1024)
+
+static inline unsigned get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+int trfb_connection_queue(trfb_connection_t *con, const void *buf, size_t len)
+{
+	/* Output is encoded for cache: it is queued when rectangle is complete */
+	if (con->capture) {
+		if (trfb_cache_append(con->capture, buf, len)) {
+			trfb_msg("[%s] Not enought memory for output", con->name);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (trfb_io_queue(con->io, buf, len)) {
+		trfb_msg("[%s] Not enought memory for output", con->name);
+		return -1;
+	}
+	con->queued += len;
+
+	return 0;
+}
+
+int trfb_connection_queue_ref(trfb_connection_t *con, const void *buf, size_t len)
+{
+	/* Small parts are cheaper to copy */
+	if (len < TRFB_QUEUE_REF_MIN || con->capture)
+		return trfb_connection_queue(con, buf, len);
+
+	if (trfb_io_queue_ref(con->io, buf, len)) {
+		trfb_msg("[%s] Not enought memory for output", con->name);
+		return -1;
+	}
+	con->queued += len;
+
+	/* Shared image must be kept until queue is sent */
+	if (con->shared_fb && (const char*)buf >= (const char*)con->fb->pixels &&
+			(const char*)buf < (const char*)con->fb->pixels + (size_t)con->fb->width * con->fb->height * con->fb->bpp)
+		con->shared_fb_ref = 1;
+
+	return 0;
+}
+
+static int send_version(trfb_connection_t *con)
 {
 	trfb_msg_protocol_version_t msg;
-	unsigned char buf[256];
+	unsigned char buf[16];
 	size_t len;
 
 	msg.proto = trfb_v8;
@@ -88,17 +255,25 @@ static int negotiate(trfb_connection_t* con)
 		return -1;
 	}
 
-	trfb_connection_write_all(con, buf, len);
-	trfb_connection_read_all(con, buf, 12);
-	buf[12] = 0;
-	trfb_msg("I:[%s] client wants version: %s", con->name, buf);
+	return trfb_connection_queue(con, buf, len);
+}
+
+static int ProtocolVersion(trfb_connection_t *con, const unsigned char *msg, size_t len)
+{
+	trfb_msg_protocol_version_t ver;
+	unsigned char buf[4];
+	char name[13];
+
+	memcpy(name, msg, 12);
+	name[12] = 0;
+	trfb_msg("I:[%s] client wants version: %s", con->name, name);
 
-	if (trfb_msg_protocol_version_decode(&msg, buf, 12)) {
+	if (trfb_msg_protocol_version_decode(&ver, msg, 12)) {
 		trfb_msg("[%s] Can't decode ProtocolVersion message from client", con->name);
 		return -1;
 	}
 
-	con->version = msg.proto;
+	con->version = ver.proto;
 
 	/* TODO: security */
 	if (con->version < trfb_v7) {
@@ -106,58 +281,83 @@ static int negotiate(trfb_connection_t* con)
 		buf[1] = 0;
 		buf[2] = 0;
 		buf[3] = 1;
-		trfb_connection_write_all(con, buf, 4);
-	} else {
-		buf[0] = 1;
-		buf[1] = 1; /* NONE */
-		trfb_connection_write_all(con, buf, 2);
-
-		trfb_connection_read_all(con, buf, 1);
-		trfb_msg("I:[%s] client security type %d", con->name, buf[0]);
-		if (buf[0] != 1) {
-			trfb_msg("[%s] Client has sent invalid security type", con->name);
-			return -1;
-		}
+		con->phase = TRFB_PHASE_INIT;
+		return trfb_connection_queue(con, buf, 4);
+	}
+
+	buf[0] = 1;
+	buf[1] = 1; /* NONE */
+	con->phase = TRFB_PHASE_SECURITY;
+
+	return trfb_connection_queue(con, buf, 2);
+}
+
+static int SecurityType(trfb_connection_t *con, const unsigned char *msg, size_t len)
+{
+	unsigned char buf[4];
+
+	trfb_msg("I:[%s] client security type %d", con->name, msg[0]);
+	if (msg[0] != 1) {
+		trfb_msg("[%s] Client has sent invalid security type", con->name);
+		return -1;
 	}
 
+	con->phase = TRFB_PHASE_INIT;
+
 	if (con->version >= trfb_v8) {
 		memset(buf, 0, 4); /* Security Ok */
-		trfb_connection_write_all(con, buf, 4);
 		trfb_msg("I:[%s] sent security Ok", con->name);
+		return trfb_connection_queue(con, buf, 4);
 	}
 
-	trfb_connection_read_all(con, buf, 1);
-	trfb_msg("I:ClientInit: %02X", buf[0]);
+	return 0;
+}
+
+static int ClientInit(trfb_connection_t *con, const unsigned char *msg, size_t len)
+{
+	unsigned char buf[32];
+	unsigned width, height;
+
+	trfb_msg("I:ClientInit: %02X", msg[0]);
+
+	/* Client receives pixels in format of server framebuffer until SetPixelFormat */
+	trfb_server_lock_fb(con->server, 0);
+	trfb_framebuffer_format(con->server->fb, &con->format);
+	width = con->server->fb->width;
+	height = con->server->fb->height;
+	trfb_server_unlock_fb(con->server);
+	con->width = width;
+	con->height = height;
 
 	/* Sending ServerInit: */
-	buf[0] = con->server->fb->width / 256;
-	buf[1] = con->server->fb->width % 256;
-	buf[2] = con->server->fb->height / 256;
-	buf[3] = con->server->fb->height % 256;
-	buf[4] = 32; /* bits per pixel */
-	buf[5] = 24; /* depth */
-	buf[6] = 0; /* big-endian */
-	buf[7] = 1; /* true-color */
-	buf[8] = 0x00; /* red-max */
-	buf[9] = 0xff;
-	buf[10] = 0x00; /* green-max */
-	buf[11] = 0xff;
-	buf[12] = 0x00; /* blue-max */
-	buf[13] = 0xff;
-	buf[14] = 16; /* red-shift */
-	buf[15] = 8;  /* green-shift */
-	buf[16] = 0;  /* blue-shift */
+	buf[0] = width / 256;
+	buf[1] = width % 256;
+	buf[2] = height / 256;
+	buf[3] = height % 256;
+	buf[4] = con->format.bpp; /* bits per pixel */
+	buf[5] = con->format.depth;
+	buf[6] = con->format.big_endian;
+	buf[7] = con->format.true_color;
+	buf[8] = con->format.rmax / 256; /* red-max */
+	buf[9] = con->format.rmax % 256;
+	buf[10] = con->format.gmax / 256; /* green-max */
+	buf[11] = con->format.gmax % 256;
+	buf[12] = con->format.bmax / 256; /* blue-max */
+	buf[13] = con->format.bmax % 256;
+	buf[14] = con->format.rshift; /* red-shift */
+	buf[15] = con->format.gshift; /* green-shift */
+	buf[16] = con->format.bshift; /* blue-shift */
 	buf[17] = buf[18] = buf[19] = 0; /* padding */
 	buf[20] = 0;
 	buf[21] = 0;
 	buf[22] = 0;
 	buf[23] = 4; /* name length */
 	buf[24] = 'T'; buf[25] = 'E'; buf[26] = 'S'; buf[27] = 'T';
-	trfb_connection_write_all(con, buf, 28);
 
+	con->phase = TRFB_PHASE_NORMAL;
 	trfb_msg("I:Sent framebuffer information to client");
 
-	return 0;
+	return trfb_connection_queue(con, buf, 28);
 }
 
 #if 0
@@ -188,32 +388,168 @@ static void check_stopped(trfb_connection_t *con)
 	mtx_unlock(&con->lock);
 }
 
-static void SetEncodings(trfb_connection_t *con);
-static void SetPixelFormat(trfb_connection_t *con);
-static void UpdateRequest(trfb_connection_t *con);
-static void KeyEvent(trfb_connection_t *con);
-static void PointerEvent(trfb_connection_t *con);
-static void ClientCutText(trfb_connection_t *con);
+static size_t SetEncodings_len(const unsigned char *msg);
+static size_t ClientCutText_len(const unsigned char *msg);
+static size_t Fence_len(const unsigned char *msg);
+static size_t SetDesktopSize_len(const unsigned char *msg);
+static int SetEncodings(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int SetPixelFormat(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int UpdateRequest(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int KeyEvent(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int PointerEvent(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int ClientCutText(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int EnableContinuousUpdates(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int Fence(trfb_connection_t *con, const unsigned char *msg, size_t len);
+static int SetDesktopSize(trfb_connection_t *con, const unsigned char *msg, size_t len);
 
 static struct msg_types {
 	unsigned char type;
-	void (*process)(trfb_connection_t *con);
+	/* Length of fixed part of message (including type) */
+	size_t len;
+	/* Length of variable part. Function is called when fixed part is received. */
+	size_t (*extra)(const unsigned char *msg);
+	int (*process)(trfb_connection_t *con, const unsigned char *msg, size_t len);
 } msg_types[] = {
-	{ 0, SetPixelFormat },
-	{ 2, SetEncodings },
-	{ 3, UpdateRequest },
-	{ 4, KeyEvent },
-	{ 5, PointerEvent },
-	{ 6, ClientCutText },
-	{ 0, NULL }
+	{ 0, 20, NULL, SetPixelFormat },
+	{ 2, 4, SetEncodings_len, SetEncodings },
+	{ 3, 10, NULL, UpdateRequest },
+	{ 4, 8, NULL, KeyEvent },
+	{ 5, 6, NULL, PointerEvent },
+	{ 6, 8, ClientCutText_len, ClientCutText },
+	{ 150, 10, NULL, EnableContinuousUpdates },
+	{ 248, 9, Fence_len, Fence },
+	{ 251, 8, SetDesktopSize_len, SetDesktopSize },
+	{ 0, 0, NULL, NULL }
 };
 
+/* Handshake messages in order of phases */
+static struct msg_types phases[] = {
+	{ TRFB_PHASE_VERSION, 12, NULL, ProtocolVersion },
+	{ TRFB_PHASE_SECURITY, 1, NULL, SecurityType },
+	{ TRFB_PHASE_INIT, 1, NULL, ClientInit }
+};
+
+/*
+ * Process one message from buf. Returns length of processed message, 0 if message is not complete or -1 on error.
+ * If message is not complete *need is set to minimal length of data required.
+ */
+static ssize_t process_message(trfb_connection_t *con, const unsigned char *buf, size_t len, size_t *need)
+{
+	struct msg_types *msg;
+	size_t l;
+	int i;
+
+	if (con->phase < TRFB_PHASE_NORMAL) {
+		msg = phases + con->phase;
+	} else {
+		for (i = 0; msg_types[i].process; i++)
+			if (msg_types[i].type == buf[0])
+				break;
+
+		if (!msg_types[i].process) {
+			trfb_msg("Message of unknown type: %d", buf[0]);
+			return -1;
+		}
+		msg = msg_types + i;
+	}
+
+	l = msg->len;
+	if (len >= l && msg->extra) {
+		l += msg->extra(buf);
+		if (l > MAX_MESSAGE_LEN) {
+			trfb_msg("[%s] Message is too long: %lu bytes", con->name, (unsigned long)l);
+			return -1;
+		}
+	}
+
+	if (len < l) {
+		*need = l;
+		return 0;
+	}
+
+#if EXTRA_DEBUG
+	trfb_msg("I:message[%d]", buf[0]);
+#endif
+
+	if (msg->process(con, buf, l)) {
+		return -1;
+	}
+
+	return l;
+}
+
+int trfb_connection_process(trfb_connection_t *con)
+{
+	size_t pos = 0;
+	size_t need = 0;
+	ssize_t l;
+	unsigned char *p;
+	size_t sz;
+
+	while (pos < con->inlen) {
+		l = process_message(con, con->in + pos, con->inlen - pos, &need);
+		if (l < 0) {
+			return -1;
+		}
+
+		if (l == 0) {
+			break;
+		}
+
+		pos += l;
+	}
+
+	if (pos > 0) {
+		memmove(con->in, con->in + pos, con->inlen - pos);
+		con->inlen -= pos;
+	}
+
+	/* Message does not fit to buffer so we need more space */
+	if (need > con->insize) {
+		sz = con->insize;
+		while (sz < need)
+			sz *= 2;
+		p = realloc(con->in, sz);
+		if (!p) {
+			trfb_msg("[%s] Not enought memory for input message", con->name);
+			return -1;
+		}
+		con->in = p;
+		con->insize = sz;
+	}
+
+	return 0;
+}
+
+/* Wait until socket of connection is ready or for timeout (ms). Returns revents, 0 on timeout and -1 on error. */
+static int wait_sock(trfb_connection_t *con, short events, int timeout)
+{
+	struct pollfd pfd;
+	int rv;
+
+	do {
+		pfd.fd = con->sock;
+		pfd.events = events;
+		pfd.revents = 0;
+		rv = poll(&pfd, 1, timeout);
+	} while (rv < 0 && errno == EINTR);
+
+	if (rv < 0) {
+		trfb_msg("[%s] poll failed: %s", con->name, strerror(errno));
+		return -1;
+	}
+
+	return rv? pfd.revents: 0;
+}
+
 static int connection(void *con_in)
 {
 	trfb_connection_t *con = con_in;
-	ssize_t l;
-	int i;
-	unsigned char type;
+	struct pollfd pfd[2];
+	char buf[64];
+	double wait;
+	int timeout;
+	int rv;
 
 #define EXIT_THREAD(s) \
 	do { \
@@ -227,34 +563,89 @@ static int connection(void *con_in)
 	con->state = TRFB_STATE_WORKING;
 	mtx_unlock(&con->lock);
 
-	if (negotiate(con)) {
-		EXIT_THREAD(TRFB_STATE_ERROR);
-	}
-	trfb_msg("I:negotiation done");
-
 	for (;;) {
 		check_stopped(con);
 
-		l = trfb_connection_read(con, &type, 1);
-		if (l < 0) {
+		/* Send as much as socket accepts. The next update is taken when previous one is sent: damage
+		 * accumulates meanwhile, so only the latest pixels are encoded and output never exceeds one update. */
+		if (trfb_connection_on_write(con)) {
 			EXIT_THREAD(TRFB_STATE_ERROR);
 		}
 
-		if (l == 1) {
-#if EXTRA_DEBUG
-			trfb_msg("I:message[%d]", type);
-#endif
+		/* Damage wakes thread up by pipe, so it sleeps until update delayed by adaptive rate is due */
+		timeout = 1000;
+		if (con->delayed) {
+			con->delayed = 0;
+			wait = con->delay_time - trfb_client_time();
+			timeout = wait <= 0? 0: wait < 1? (int)(wait * 1000) + 1: 1000;
+		}
+
+		pfd[0].fd = con->sock;
+		pfd[0].events = POLLIN;
+		if (trfb_io_pending(con->io))
+			pfd[0].events |= POLLOUT;
+		pfd[1].fd = con->wake[0];
+		pfd[1].events = POLLIN;
+
+		do {
+			pfd[0].revents = pfd[1].revents = 0;
+			rv = poll(pfd, 2, timeout);
+		} while (rv < 0 && errno == EINTR);
+
+		if (rv < 0) {
+			trfb_msg("[%s] poll failed: %s", con->name, strerror(errno));
+			EXIT_THREAD(TRFB_STATE_ERROR);
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			while (read(con->wake[0], buf, sizeof(buf)) > 0)
+				;
+		}
 
-			for (i = 0; msg_types[i].process; i++)
-				if (msg_types[i].type == type)
-					break;
+		if ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) && trfb_connection_on_read(con)) {
+			EXIT_THREAD(TRFB_STATE_ERROR);
+		}
+	}
+
+	return 0;
+}
+
+int trfb_connection_on_read(trfb_connection_t *con)
+{
+	ssize_t l;
+
+	for (;;) {
+		l = trfb_io_read(con->io, con->in + con->inlen, con->insize - con->inlen, 0);
+		if (l < 0) {
+			return -1;
+		}
 
-			if (!msg_types[i].process) {
-				trfb_msg("Message of unknown type: %d\n", type);
-				EXIT_THREAD(TRFB_STATE_ERROR);
-			}
+		if (l == 0) { /* Would block */
+			break;
+		}
+
+		con->inlen += l;
+		if (trfb_connection_process(con)) {
+			return -1;
+		}
+	}
+
+	return trfb_connection_on_write(con);
+}
 
-			msg_types[i].process(con);
+int trfb_connection_on_write(trfb_connection_t *con)
+{
+	int r;
+
+	r = trfb_io_flush(con->io, 0);
+	if (r < 0) {
+		return -1;
+	}
+
+	/* Update request could wait for sending of previous update */
+	if (r == 0 && (con->update_pending || con->cu_enabled)) {
+		if (trfb_connection_update(con) || trfb_io_flush(con->io, 0) < 0) {
+			return -1;
 		}
 	}
 
@@ -274,6 +665,10 @@ ssize_t trfb_connection_read(trfb_connection_t *con, void *buf, ssize_t len)
 			return -1;
 		}
 
+		/* Socket of threaded engine is non-blocking too */
+		if ((con->io->flags & TRFB_IO_NONBLOCK) && wait_sock(con, POLLIN, 1000) < 0)
+			return -1;
+
 		check_stopped(con);
 	}
 
@@ -313,6 +708,9 @@ ssize_t trfb_connection_write(trfb_connection_t *con, const void *buf, ssize_t l
 			return -1;
 		}
 
+		if ((con->io->flags & TRFB_IO_NONBLOCK) && wait_sock(con, POLLOUT, 1000) < 0)
+			return -1;
+
 		check_stopped(con);
 	}
 
@@ -333,6 +731,10 @@ void trfb_connection_flush(trfb_connection_t *con)
 			return;
 		}
 
+		if ((con->io->flags & TRFB_IO_NONBLOCK) && wait_sock(con, POLLOUT, 1000) < 0) {
+			EXIT_THREAD(TRFB_STATE_ERROR);
+		}
+
 		check_stopped(con);
 	}
 }
@@ -358,196 +760,730 @@ void trfb_connection_write_all(trfb_connection_t *con, const void *buf, ssize_t
 	return;
 }
 
-uint16_t trfb_connection_read_u16(trfb_connection_t *con)
-{
-	unsigned char buf[2];
-	trfb_connection_read_all(con, buf, 2);
-	return buf[0] * 256 + buf[1];
-}
-
-uint16_t trfb_connection_read_u32(trfb_connection_t *con)
+static size_t SetEncodings_len(const unsigned char *msg)
 {
-	unsigned char buf[4];
-	trfb_connection_read_all(con, buf, 4);
-	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+	return 4 * get16(msg + 2);
 }
 
-static void SetEncodings(trfb_connection_t *con)
+static int SetEncodings(trfb_connection_t *con, const unsigned char *msg, size_t len)
 {
+	unsigned char buf[1];
 	unsigned cnt;
 	unsigned i;
-	uint32_t enc;
-	unsigned char buf[4];
+	int32_t *encodings;
+	int local;
+	int rv;
 
-	trfb_connection_read_all(con, buf, 3);
-	cnt = buf[1] * 256 + buf[2];
+	cnt = get16(msg + 2);
 
 	trfb_msg("I:client supports %d encodings...", (int)cnt);
 
+	encodings = malloc((cnt + 1) * sizeof(int32_t));
+	if (!encodings) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+
 	for (i = 0; i < cnt; i++) {
-		enc = trfb_connection_read_u32(con);
-		trfb_msg("I:Supported encoding: %08x", (int)enc);
+		encodings[i] = (int32_t)get32(msg + 4 + 4 * i);
+		trfb_msg("I:Supported encoding: %08x", (unsigned)encodings[i]);
+	}
+
+	rv = trfb_connection_set_encodings(con, encodings, cnt);
+	free(encodings);
+	if (rv)
+		return rv;
+
+	/* Client learns that server supports extensions from the first message of them */
+	if (!con->fence_announced && trfb_connection_has_encoding(con, TRFB_ENCODING_FENCE)) {
+		con->fence_announced = 1;
+		if (trfb_connection_fence(con, TRFB_FENCE_REQUEST, NULL, 0))
+			return -1;
+	}
+
+	/* Client learns screen layout from ExtendedDesktopSize */
+	if (trfb_connection_has_encoding(con, TRFB_ENCODING_EXTENDED_DESKTOP_SIZE)) {
+		con->desktop_pending = 1;
+		con->desktop_reason = 0;
+		con->desktop_status = 0;
+	}
+
+	/* Cursor is sent to client or drawn into its pixels on the next update */
+	local = trfb_connection_has_encoding(con, TRFB_ENCODING_CURSOR);
+	mtx_lock(&con->lock);
+	if (con->cursor_local != local) {
+		con->cursor_local = local;
+		con->cursor_changed = 1;
+	}
+	mtx_unlock(&con->lock);
+
+	if (!con->cu_announced && trfb_connection_has_encoding(con, TRFB_ENCODING_CONTINUOUS_UPDATES)) {
+		con->cu_announced = 1;
+		buf[0] = 150; /* EndOfContinuousUpdates */
+		if (trfb_connection_queue(con, buf, 1))
+			return -1;
 	}
+
+	return 0;
 }
 
-static void SetPixelFormat(trfb_connection_t *con)
+static int SetPixelFormat(trfb_connection_t *con, const unsigned char *buf, size_t len)
 {
-	unsigned char buf[20];
-
-	trfb_connection_read_all(con, buf + 1, 19);
-	con->format.bpp = buf[4];
-	con->format.depth = buf[5];
-	con->format.big_endian = buf[6];
-	con->format.true_color = buf[7];
-	con->format.rmax = buf[8] * 256 + buf[9];
-	con->format.gmax = buf[10] * 256 + buf[11];
-	con->format.bmax = buf[12] * 256 + buf[13];
-	con->format.rshift = buf[14];
-	con->format.gshift = buf[15];
-	con->format.bshift = buf[16];
+	trfb_format_t fmt;
+
+	fmt.bpp = buf[4];
+	fmt.depth = buf[5];
+	fmt.big_endian = buf[6];
+	fmt.true_color = buf[7];
+	fmt.rmax = buf[8] * 256 + buf[9];
+	fmt.gmax = buf[10] * 256 + buf[11];
+	fmt.bmax = buf[12] * 256 + buf[13];
+	fmt.rshift = buf[14];
+	fmt.gshift = buf[15];
+	fmt.bshift = buf[16];
 
 	trfb_msg("I:[%s] FORMAT: bpp = %d, depth = %d, big_endian = %d, true_color = %d", con->name,
-			con->format.bpp,
-			con->format.depth,
-			con->format.big_endian,
-			con->format.true_color);
+			fmt.bpp,
+			fmt.depth,
+			fmt.big_endian,
+			fmt.true_color);
 
-	if (con->fb)
-		trfb_framebuffer_free(con->fb);
-	trfb_server_lock_fb(con->server, 0);
-	con->fb = trfb_framebuffer_create_of_format(con->server->fb->width, con->server->fb->width, &con->format);
-	trfb_server_unlock_fb(con->server);
+	if (!fmt.true_color) {
+		trfb_msg("[%s] Color map formats are not supported", con->name);
+		return -1;
+	}
 
-	if (!con->fb) {
-		trfb_msg("Can not create framebuffer for requested format.");
-		EXIT_THREAD(TRFB_STATE_ERROR);
+	if ((fmt.bpp != 8 && fmt.bpp != 16 && fmt.bpp != 32) ||
+			fmt.rshift >= fmt.bpp || fmt.gshift >= fmt.bpp || fmt.bshift >= fmt.bpp) {
+		trfb_msg("[%s] Invalid pixel format", con->name);
+		return -1;
 	}
+
+	/* Framebuffer of new format will be created on next update: old one could be referenced by output */
+	con->format = fmt;
+	free(con->converter);
+	con->converter = NULL;
+
+	/* Client has to receive everything in new format */
+	mtx_lock(&con->lock);
+	trfb_region_add_rect(&con->damage, 0, 0, con->damage.width, con->damage.height);
+	con->cursor_changed = 1;
+	mtx_unlock(&con->lock);
+
+	return 0;
 }
 
-static void UpdateRequest(trfb_connection_t *con)
+static int UpdateRequest(trfb_connection_t *con, const unsigned char *msg, size_t len)
 {
-	unsigned char buf[256];
-	unsigned char incr;
-	unsigned xpos, ypos, width, height;
-
-	trfb_connection_read_all(con, buf, 9);
-	incr = buf[0];
-	(void)incr; /* used :) */
-	xpos = buf[1] * 256 + buf[2];
-	ypos = buf[3] * 256 + buf[4];
-	width = buf[5] * 256 + buf[6];
-	height = buf[7] * 256 + buf[8];
+	mtx_lock(&con->lock);
+	con->update_pending = 1;
+	con->update_incremental = msg[1];
+	con->update_rect.x = get16(msg + 2);
+	con->update_rect.y = get16(msg + 4);
+	con->update_rect.width = get16(msg + 6);
+	con->update_rect.height = get16(msg + 8);
+	mtx_unlock(&con->lock);
 
 #if EXTRA_DEBUG
-	trfb_msg("I:client requested update: (%d, %d) - (%d, %d)", (int)xpos, (int)ypos, (int)width, (int)height);
+	trfb_msg("I:client requested update: (%d, %d) - (%d, %d)", (int)con->update_rect.x, (int)con->update_rect.y,
+			(int)con->update_rect.width, (int)con->update_rect.height);
 #endif
 
+	return trfb_connection_update(con);
+}
+
+void trfb_connection_damage(trfb_connection_t *con, const trfb_region_t *damage)
+{
+	int wakeup;
+
+	mtx_lock(&con->lock);
+	if (con->damage.width != damage->width || con->damage.height != damage->height) {
+		/* Framebuffer is resized: client receives everything again */
+		if (!trfb_region_resize(&con->damage, damage->width, damage->height))
+			trfb_region_add_rect(&con->damage, 0, 0, damage->width, damage->height);
+		con->copy_pending = 0;
+	} else {
+		trfb_region_add(&con->damage, damage);
+	}
+	wakeup = con->update_pending || con->cu_enabled;
+	mtx_unlock(&con->lock);
+
+	if (wakeup)
+		trfb_connection_wakeup(con);
+}
+
+void trfb_connection_wakeup(trfb_connection_t *con)
+{
+	static const char c = 0;
+
+	if (con->loop) {
+		trfb_loop_schedule(con);
+	} else if (con->wake[1] >= 0) {
+		/* Pipe is full only if thread has not been woken up yet */
+		if (write(con->wake[1], &c, 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			trfb_msg("W:[%s] can not wake up connection: %s", con->name, strerror(errno));
+	}
+}
+
+/* Shared image of the last update is kept as old image for scroll detection while it is image of client */
+static int keep_shared_fb(trfb_connection_t *con)
+{
+	return !con->fb_stale && trfb_connection_has_encoding(con, TRFB_ENCODING_COPYRECT);
+}
+
+/* Create client framebuffer and converter for it. Server framebuffer must be locked. */
+static int prepare_fb(trfb_connection_t *con)
+{
+	trfb_framebuffer_t *sfb = con->server->fb;
+
+	if (con->fb && con->fb->width == sfb->width && con->fb->height == sfb->height && con->converter)
+		return 0;
+
+	/* Client receives the whole framebuffer in new format. Cursor drawn by client is kept if connection
+	 * used shared image before. */
+	if (con->fb)
+		memset(&con->cursor_drawn, 0, sizeof(trfb_rect_t));
+	trfb_framebuffer_free(con->fb);
+	free(con->converter);
+	con->converter = NULL;
+
+	con->fb = trfb_framebuffer_create_of_format(sfb->width, sfb->height, &con->format);
+	con->fb_stale = 1;
 	if (!con->fb) {
-		trfb_server_lock_fb(con->server, 0);
-		con->fb = trfb_framebuffer_copy(con->server->fb);
-		trfb_server_unlock_fb(con->server);
+		trfb_msg("Can not create framebuffer for client format");
+		return -1;
+	}
 
-		if (!con->fb) {
-			trfb_msg("Can not copy server framebuffer");
-			EXIT_THREAD(TRFB_STATE_ERROR);
+	con->converter = malloc(sizeof(trfb_converter_t));
+	if (!con->converter) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+
+	if (trfb_converter_init(con->converter, con->fb, sfb)) {
+		free(con->converter);
+		con->converter = NULL;
+		trfb_msg("Can not convert server framebuffer to client format");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int overlaps(const trfb_rect_t *a, const trfb_rect_t *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width && a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* Pixels of taken damage are converted: trfb_server_copy_rect could rely on client framebuffer again */
+static void converted(trfb_connection_t *con)
+{
+	mtx_lock(&con->lock);
+	con->converting = 0;
+	mtx_unlock(&con->lock);
+}
+
+/* Send update with DesktopSize or ExtendedDesktopSize rectangle */
+static int desktop_size(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	unsigned char buf[4 + 12 + 20];
+	unsigned x = 0, y = 0;
+	size_t len = 4 + 12;
+	int32_t encoding;
+
+	if (trfb_connection_has_encoding(con, TRFB_ENCODING_EXTENDED_DESKTOP_SIZE)) {
+		encoding = TRFB_ENCODING_EXTENDED_DESKTOP_SIZE;
+		x = con->desktop_reason;
+		y = con->desktop_status;
+	} else if (trfb_connection_has_encoding(con, TRFB_ENCODING_DESKTOP_SIZE)) {
+		encoding = TRFB_ENCODING_DESKTOP_SIZE;
+	} else {
+		trfb_msg("[%s] Client does not support resizing of desktop", con->name);
+		return -1;
+	}
+
+	con->width = width;
+	con->height = height;
+	con->desktop_pending = 0;
+	/* New framebuffer of client has no cursor */
+	memset(&con->cursor_drawn, 0, sizeof(trfb_rect_t));
+
+	buf[0] = 0; /* message type */
+	buf[1] = 0; /* pad */
+	buf[2] = 0;
+	buf[3] = 1; /* count of rects */
+	buf[4] = x >> 8;
+	buf[5] = x;
+	buf[6] = y >> 8;
+	buf[7] = y;
+	buf[8] = width >> 8;
+	buf[9] = width;
+	buf[10] = height >> 8;
+	buf[11] = height;
+	buf[12] = (uint32_t)encoding >> 24;
+	buf[13] = (uint32_t)encoding >> 16;
+	buf[14] = (uint32_t)encoding >> 8;
+	buf[15] = (uint32_t)encoding;
+
+	if (encoding == TRFB_ENCODING_EXTENDED_DESKTOP_SIZE) {
+		/* One screen which covers the whole framebuffer */
+		memset(buf + len, 0, 20);
+		buf[len] = 1; /* count of screens */
+		buf[len + 12] = width >> 8;
+		buf[len + 13] = width;
+		buf[len + 14] = height >> 8;
+		buf[len + 15] = height;
+		len += 20;
+	}
+
+	trfb_msg("I:[%s] desktop size is %ux%u", con->name, width, height);
+
+	return trfb_connection_queue(con, buf, len);
+}
+
+int trfb_connection_update(trfb_connection_t *con)
+{
+	unsigned char buf[4];
+	const trfb_encoder_t *enc;
+	unsigned long long queued, frame;
+	trfb_rect_t rect;
+	trfb_rect_t *rects = NULL;
+	trfb_rect_t copy;
+	unsigned copy_sx = 0, copy_sy = 0;
+	unsigned width, height;
+	trfb_rect_t area;
+	unsigned px, py;
+	int have_copy = 0;
+	int share, users;
+	int incremental;
+	int changed;
+	int continuous = 0;
+	int rects_cnt;
+	double wait;
+	unsigned cnt;
+	int rv;
+	int i;
+
+	/* Previous update could reference client framebuffer */
+	if (trfb_io_busy(con->io)) {
+		return 0;
+	}
+	trfb_connection_release_shared(con);
+	if (!keep_shared_fb(con))
+		trfb_connection_release_fb(con);
+
+	/* Cursor is copied from server before connection is locked. Format of client is known after handshake. */
+	changed = 0;
+	if (con->phase == TRFB_PHASE_NORMAL) {
+		mtx_lock(&con->lock);
+		changed = con->cursor_changed;
+		con->cursor_changed = 0;
+		mtx_unlock(&con->lock);
+	}
+	if (changed) {
+		if (trfb_connection_sync_cursor(con))
+			return -1;
+		mtx_lock(&con->lock);
+		trfb_connection_cursor_damage(con, con->pointer_x, con->pointer_y, 1, &area);
+		mtx_unlock(&con->lock);
+	}
+
+	mtx_lock(&con->lock);
+	if (con->update_pending && !(con->cu_enabled && con->update_incremental)) {
+		rect = con->update_rect;
+		incremental = con->update_incremental;
+	} else if (con->cu_enabled) {
+		/* Incremental requests are not needed for continuous updates */
+		con->update_pending = 0;
+		rect = con->cu_rect;
+		incremental = 1;
+		continuous = 1;
+	} else {
+		mtx_unlock(&con->lock);
+		return 0;
+	}
+
+	/* Client has not received previous updates yet */
+	if (continuous && (con->copy_pending || trfb_region_intersects(&con->damage, rect.x, rect.y, rect.width,
+				rect.height)) && trfb_connection_congested(con)) {
+		mtx_unlock(&con->lock);
+		return 0;
+	}
+
+	/* Update would reach client too late: link must deliver queued data first */
+	if ((con->server->flags & TRFB_SERVER_ADAPTIVE) && (con->copy_pending || trfb_region_intersects(&con->damage,
+				rect.x, rect.y, rect.width, rect.height)) && (wait = trfb_connection_rate(con)) > 0) {
+		mtx_unlock(&con->lock);
+		if (con->loop) {
+			trfb_loop_delay(con, wait);
+		} else {
+			con->delayed = 1;
+			con->delay_time = trfb_client_time() + wait;
+		}
+		return 0;
+	}
+
+	if (rect.x >= con->damage.width || rect.y >= con->damage.height) {
+		if (!continuous) {
+			con->update_pending = 0;
+			trfb_msg("I:Client wants rect out of range. Ignoring...");
+		}
+		mtx_unlock(&con->lock);
+		return 0;
+	}
+
+	if (rect.width > con->damage.width - rect.x) {
+		rect.width = con->damage.width - rect.x;
+	}
+
+	if (rect.height > con->damage.height - rect.y) {
+		rect.height = con->damage.height - rect.y;
+	}
+
+	px = con->pointer_x;
+	py = con->pointer_y;
+	trfb_connection_cursor_damage(con, px, py, 0, &area);
+
+	if (con->copy_pending) {
+		con->copy_pending = 0;
+		if (incremental && trfb_connection_has_encoding(con, TRFB_ENCODING_COPYRECT) &&
+				con->copy.x >= rect.x && con->copy.x + con->copy.width <= rect.x + rect.width &&
+				con->copy.y >= rect.y && con->copy.y + con->copy.height <= rect.y + rect.height) {
+			copy = con->copy;
+			copy_sx = con->copy_sx;
+			copy_sy = con->copy_sy;
+			have_copy = 1;
+		} else {
+			/* Client can't copy it: send pixels */
+			trfb_region_add_rect(&con->damage, con->copy.x, con->copy.y, con->copy.width, con->copy.height);
+		}
+	}
+
+	if (incremental) {
+		/* Send only damaged part of requested rectangle */
+		rects_cnt = trfb_region_rects(&con->damage, &rect, &rects);
+		if (rects_cnt < 0) {
+			mtx_unlock(&con->lock);
+			return -1;
+		}
+
+		if (rects_cnt == 0 && !have_copy && !con->desktop_pending && !con->cursor_send) { /* Nothing changed: wait for damage */
+			mtx_unlock(&con->lock);
+			return 0;
 		}
+	} else {
+		rects = malloc(sizeof(trfb_rect_t));
+		if (!rects) {
+			mtx_unlock(&con->lock);
+			trfb_msg("Not enought memory");
+			return -1;
+		}
+		rects[0] = rect;
+		rects_cnt = 1;
 	}
 
+	trfb_region_clear_rect(&con->damage, rect.x, rect.y, rect.width, rect.height);
+	con->update_pending = 0;
+	con->converting = 1;
+	mtx_unlock(&con->lock);
+
 	trfb_server_lock_fb(con->server, 0);
-	if (trfb_framebuffer_convert(con->fb, con->server->fb)) {
+	frame = con->server->frame;
+	/* Client must know new size of framebuffer before pixels: they will be sent in the next update */
+	if (con->desktop_pending || con->width != con->server->fb->width || con->height != con->server->fb->height) {
+		width = con->server->fb->width;
+		height = con->server->fb->height;
 		trfb_server_unlock_fb(con->server);
-		trfb_msg("Can not convert server framebuffer");
-		EXIT_THREAD(TRFB_STATE_ERROR);
+
+		mtx_lock(&con->lock);
+		for (i = 0; i < rects_cnt; i++)
+			trfb_region_add_rect(&con->damage, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+		if (have_copy)
+			trfb_region_add_rect(&con->damage, copy.x, copy.y, copy.width, copy.height);
+		con->converting = 0;
+		mtx_unlock(&con->lock);
+		free(rects);
+
+		return desktop_size(con, width, height);
 	}
-	trfb_server_unlock_fb(con->server);
 
-	if (width > con->fb->width) {
-		width = con->fb->width;
+	/* The whole JPEG frame is sent as is: it is not converted and encoded for each client */
+	if (con->server->jpeg_len && rect.x == 0 && rect.y == 0 && rect.width == con->server->fb->width &&
+			rect.height == con->server->fb->height && !area.width && trfb_connection_jpeg_allowed(con)) {
+		con->fb_stale = 1;
+		memset(&con->cursor_drawn, 0, sizeof(trfb_rect_t));
+		buf[0] = 0; /* message type */
+		buf[1] = 0; /* pad */
+		buf[2] = 0;
+		buf[3] = 1 + con->cursor_send; /* count of rects */
+		i = trfb_connection_queue(con, buf, 4) ||
+			trfb_connection_tight_jpeg(con, 0, 0, rect.width, rect.height, con->server->jpeg, con->server->jpeg_len) ||
+			(con->cursor_send && trfb_connection_send_cursor(con)) ||
+			(continuous && trfb_connection_fence_ping(con));
+		trfb_server_unlock_fb(con->server);
+		converted(con);
+		free(rects);
+		return i? -1: 0;
 	}
 
-	if (height > con->fb->height) {
-		height = con->fb->height;
+	/* Connections of the same format share converted image if cursor is not drawn into it. Single client
+	 * keeps its own framebuffer: it is needed for scroll detection. */
+	users = trfb_connection_pool_users(con);
+	if (users < 0) {
+		trfb_server_unlock_fb(con->server);
+		free(rects);
+		return -1;
+	}
+	share = !area.width && users > 1;
+
+	/* Only rectangles which will be sent are converted. Own framebuffer or shared image of other size is
+	 * not image of client anymore. */
+	if (share) {
+		if (!con->shared_fb || con->fb->width != con->server->fb->width ||
+				con->fb->height != con->server->fb->height) {
+			trfb_connection_release_fb(con);
+			trfb_framebuffer_free(con->fb);
+			free(con->converter);
+			con->fb = NULL;
+			con->converter = NULL;
+			con->fb_stale = 1;
+		}
+	} else {
+		trfb_connection_release_fb(con);
+		if (prepare_fb(con)) {
+			trfb_server_unlock_fb(con->server);
+			free(rects);
+			return -1;
+		}
 	}
 
-	if (xpos > width || ypos > height) {
-		trfb_msg("I:Client wants rect out of range. Ignoring...");
-		return;
+	if (!have_copy && incremental && !con->fb_stale && trfb_connection_has_encoding(con, TRFB_ENCODING_COPYRECT)) {
+		if (share)
+			have_copy = trfb_connection_shared_scroll(con, &rects, &rects_cnt, &copy, &copy_sx, &copy_sy);
+		else
+			have_copy = trfb_connection_find_scroll(con, &rects, &rects_cnt, &copy, &copy_sx, &copy_sy);
+		if (have_copy < 0) {
+			trfb_server_unlock_fb(con->server);
+			free(rects);
+			return -1;
+		}
+	}
+
+	/* Client framebuffer must be the same as image of client before conversion of new pixels. Shared image
+	 * is never changed: copied pixels are converted into the next one. */
+	if (have_copy && !share)
+		trfb_framebuffer_copy_rect(con->fb, copy_sx, copy_sy, copy.x, copy.y, copy.width, copy.height);
+
+	if (have_copy && trfb_connection_cursor_copy(con, &rects, &rects_cnt, &area, &copy, copy_sx, copy_sy)) {
+		trfb_server_unlock_fb(con->server);
+		free(rects);
+		return -1;
 	}
 
-	trfb_framebuffer_endian(con->fb, con->format.big_endian);
+	/* Adaptive rate chooses Raw if link is fast enough */
+	enc = con->rate_raw? &trfb_encoder_raw: con->encoder;
+	cnt = have_copy + con->cursor_send;
+	con->rate_frame = 0;
+	for (i = 0; i < rects_cnt; i++) {
+		cnt += trfb_encoder_count(enc, rects[i].width, rects[i].height);
+		con->rate_frame += (size_t)rects[i].width * rects[i].height * (con->format.bpp / 8);
+	}
+
+	if (cnt > 0xffff) {
+		/* Too many rectangles: send bounding box of requested rectangle */
+		rects[0] = rect;
+		rects_cnt = 1;
+		cnt = have_copy + con->cursor_send + trfb_encoder_count(enc, rect.width, rect.height);
+	}
+
+	if (share && trfb_connection_share_fb(con, frame, rects, rects_cnt, have_copy? &copy: NULL)) {
+		trfb_server_unlock_fb(con->server);
+		free(rects);
+		return -1;
+	}
 
-	/* TODO: send response */
+	/* Shared image is image of client after update if client had the previous one or gets the whole image.
+	 * Damage outside of requested rectangle is not sent, but image has it. */
+	for (i = 0; share && i < rects_cnt; i++) {
+		if (rects[i].width == con->fb->width && rects[i].height == con->fb->height)
+			con->fb_stale = 0;
+	}
+	if (share && (rect.x || rect.y || rect.width != con->fb->width || rect.height != con->fb->height))
+		con->fb_stale = 1;
+
+	for (i = 0; !share && i < rects_cnt; i++) {
+		trfb_converter_rect(con->converter, con->fb, con->server->fb, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+		trfb_connection_draw_cursor(con, &area, px, py, rects + i);
+		if (rects[i].width == con->fb->width && rects[i].height == con->fb->height)
+			con->fb_stale = 0;
+	}
+	trfb_connection_cursor_drawn(con, &area, &rect);
+	trfb_server_unlock_fb(con->server);
+	converted(con);
+
+	queued = con->queued;
 	buf[0] = 0; /* message type */
 	buf[1] = 0; /* pad */
-	buf[2] = 0;
-	buf[3] = 1; /* 1 rect */
-	buf[4] = xpos / 256;
-	buf[5] = xpos % 256; /* x-position */
-	buf[6] = ypos / 256;
-	buf[7] = ypos % 256; /* y-position */
-	buf[8] = width / 256;
-	buf[9] = width % 256;
-	buf[10] = height / 256;
-	buf[11] = height % 256;
-	buf[12] = 0;
-	buf[13] = 0;
-	buf[14] = 0;
-	buf[15] = 0;
-	trfb_connection_write_all(con, buf, 16);
-
-	trfb_connection_write_all(con, con->fb->pixels, con->fb->width * con->fb->height * con->fb->bpp);
-}
-
-static void KeyEvent(trfb_connection_t *con)
-{
-	unsigned char buf[8];
-	unsigned char down;
-	uint32_t code;
-	trfb_event_t event;
+	buf[2] = cnt / 256;
+	buf[3] = cnt % 256; /* count of rects */
+	if (trfb_connection_queue(con, buf, 4)) {
+		free(rects);
+		return -1;
+	}
+
+	if (have_copy && trfb_connection_copy_rect(con, &copy, copy_sx, copy_sy)) {
+		free(rects);
+		return -1;
+	}
+
+	for (i = 0; i < rects_cnt; i++) {
+		/* Rectangle without cursor is the same for all connections with this format */
+		if (overlaps(&area, rects + i))
+			rv = trfb_connection_encode(con, enc, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+		else
+			rv = trfb_connection_encode_shared(con, enc, frame, rects[i].x, rects[i].y, rects[i].width,
+					rects[i].height);
+		if (rv) {
+			free(rects);
+			return -1;
+		}
+	}
+
+	free(rects);
+	con->rate_update = con->queued - queued;
+
+	/* Other connections could convert the next frame in place if output doesn't reference shared image */
+	if (!con->shared_fb_ref && !keep_shared_fb(con))
+		trfb_connection_release_fb(con);
+
+	if (con->cursor_send && trfb_connection_send_cursor(con))
+		return -1;
+
+	/* Response to fence tells when client has received the update */
+	if (continuous && trfb_connection_fence_ping(con))
+		return -1;
 
-	trfb_connection_read_all(con, buf, 7);
-	down = buf[0];
-	code = (buf[3] << 24) | (buf[4] << 16) | (buf[5] << 8) | buf[6];
+	return 0;
+}
+
+static int KeyEvent(trfb_connection_t *con, const unsigned char *msg, size_t len)
+{
+	trfb_event_t event;
 
 	event.type = TRFB_EVENT_KEY;
-	event.event.key.down = down;
-	event.event.key.code = code;
+	event.event.key.down = msg[1];
+	event.event.key.code = get32(msg + 4);
 
 	trfb_server_add_event(con->server, &event);
+
+	return 0;
 }
 
-static void PointerEvent(trfb_connection_t *con)
+static int PointerEvent(trfb_connection_t *con, const unsigned char *msg, size_t len)
 {
-	unsigned char buf[5];
 	trfb_event_t event;
 
-	trfb_connection_read_all(con, buf, 5);
-
-	event.event.pointer.button = buf[0];
-	event.event.pointer.x = buf[1] * 256 + buf[2];
-	event.event.pointer.y = buf[3] * 256 + buf[4];
+	event.event.pointer.button = msg[1];
+	event.event.pointer.x = get16(msg + 2);
+	event.event.pointer.y = get16(msg + 4);
 	event.type = TRFB_EVENT_POINTER;
 
+	trfb_server_set_pointer(con->server, event.event.pointer.x, event.event.pointer.y);
 	trfb_server_add_event(con->server, &event);
+
+	return 0;
+}
+
+static size_t ClientCutText_len(const unsigned char *msg)
+{
+	return get32(msg + 4);
 }
 
-static void ClientCutText(trfb_connection_t *con)
+static int ClientCutText(trfb_connection_t *con, const unsigned char *msg, size_t len)
 {
-	unsigned char buf[7];
 	trfb_event_t event;
 
-	trfb_connection_read_all(con, buf, 7);
 	event.type = TRFB_EVENT_CUT_TEXT;
-	event.event.cut_text.len = (buf[3] << 24) | (buf[4] << 16) | (buf[5] << 8) | buf[6];
+	event.event.cut_text.len = len - 8;
 	event.event.cut_text.text = malloc(event.event.cut_text.len + 1);
 	if (!event.event.cut_text.text) {
 		trfb_msg("Not enought memory");
-		EXIT_THREAD(TRFB_STATE_ERROR);
+		return -1;
 	}
 
-	/* WARNING: this could cause memory leak. This is very so bad and we need to find an solution. */
-	trfb_connection_read_all(con, event.event.cut_text.text, event.event.cut_text.len);
+	memcpy(event.event.cut_text.text, msg + 8, event.event.cut_text.len);
+	event.event.cut_text.text[event.event.cut_text.len] = 0;
 
-	trfb_server_add_event(con->server, &event);
+	if (trfb_server_add_event(con->server, &event)) {
+		trfb_event_clear(&event);
+	}
+
+	return 0;
 }
 
+static int EnableContinuousUpdates(trfb_connection_t *con, const unsigned char *msg, size_t len)
+{
+	unsigned char buf[1];
+
+	mtx_lock(&con->lock);
+	con->cu_enabled = msg[1];
+	con->cu_rect.x = get16(msg + 2);
+	con->cu_rect.y = get16(msg + 4);
+	con->cu_rect.width = get16(msg + 6);
+	con->cu_rect.height = get16(msg + 8);
+	mtx_unlock(&con->lock);
+
+	trfb_msg("I:[%s] continuous updates are %s", con->name, msg[1]? "enabled": "disabled");
+
+	if (!msg[1]) {
+		/* Updates are sent by requests again */
+		buf[0] = 150; /* EndOfContinuousUpdates */
+		return trfb_connection_queue(con, buf, 1);
+	}
+
+	return trfb_connection_update(con);
+}
+
+static size_t Fence_len(const unsigned char *msg)
+{
+	return msg[8];
+}
+
+static int Fence(trfb_connection_t *con, const unsigned char *msg, size_t len)
+{
+	uint32_t flags = get32(msg + 4);
+
+	if (len - 9 > 64) {
+		trfb_msg("[%s] Fence data is too long", con->name);
+		return -1;
+	}
+
+	/* Messages are processed in order so blocking flags are satisfied by answering immediately */
+	if (flags & TRFB_FENCE_REQUEST)
+		return trfb_connection_fence(con, flags & (TRFB_FENCE_BLOCK_BEFORE | TRFB_FENCE_BLOCK_AFTER |
+					TRFB_FENCE_SYNC_NEXT), msg + 9, len - 9);
+
+	trfb_connection_fence_response(con, msg + 9, len - 9);
+
+	/* Window could be opened */
+	return trfb_connection_update(con);
+}
+
+static size_t SetDesktopSize_len(const unsigned char *msg)
+{
+	return 16 * msg[6];
+}
+
+static int SetDesktopSize(trfb_connection_t *con, const unsigned char *msg, size_t len)
+{
+	/* Size of framebuffer is defined by application: request is prohibited */
+	trfb_msg("I:[%s] client wants desktop size %ux%u", con->name, get16(msg + 2), get16(msg + 4));
+	if (!trfb_connection_has_encoding(con, TRFB_ENCODING_EXTENDED_DESKTOP_SIZE))
+		return 0;
+
+	con->desktop_pending = 1;
+	con->desktop_reason = 1;
+	con->desktop_status = 1;
+
+	return trfb_connection_update(con);
+}
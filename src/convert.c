@@ -0,0 +1,550 @@
+#include <trfb.h>
+#include <string.h>
+
+/*
+ * Pixel format conversion.
+ *
+ * Every channel conversion is selection of bits: ((((p >> shift) & mask) << norm) >> dnorm) & dmask) << dshift.
+ * So destination pixel is OR of values for every byte of source pixel and generic kernels use 4 tables
+ * of 256 entries (one lookup per source byte). When source has 8-bit channels (usual 32-bit server
+ * framebuffer) SIMD kernels are used: byte shuffle for 32-bit destination and shift/mask/pack for others.
+ *
+ * Byte order is a part of the format: tables are indexed by bytes in memory order and contain swapped
+ * values, shuffles move bytes to their places and 16-bit kernels swap bytes after packing. So there is
+ * no separate pass for big-endian clients.
+ */
+
+static int isBE(void)
+{
+	union {
+		unsigned value;
+		unsigned char data[sizeof(unsigned)];
+	} test;
+
+	test.value = 1;
+
+	return !test.data[0];
+}
+
+static inline uint32_t swap_pixel(uint32_t p, unsigned bpp)
+{
+	if (bpp == 2)
+		return ((p & 0xff) << 8) | ((p >> 8) & 0xff);
+	if (bpp == 4)
+		return (p << 24) | ((p & 0xff00) << 8) | ((p >> 8) & 0xff00) | (p >> 24);
+	return p;
+}
+
+#define LOOKUP1(t, p) ((t)[0][p])
+#define LOOKUP2(t, p) ((t)[0][(p) & 0xff] | (t)[1][(p) >> 8])
+#define LOOKUP4(t, p) ((t)[0][(p) & 0xff] | (t)[1][((p) >> 8) & 0xff] | (t)[2][((p) >> 16) & 0xff] | (t)[3][(p) >> 24])
+
+#define TABLE_KERNEL(sbpp, stype, dbpp, dtype) \
+static void convert_table_##sbpp##_##dbpp(void *dst, const void *src, unsigned n, const trfb_converter_t *cv) \
+{ \
+	const stype *s = src; \
+	dtype *d = dst; \
+	unsigned i; \
+ \
+	for (i = 0; i < n; i++) \
+		d[i] = LOOKUP##sbpp(cv->tab, s[i]); \
+}
+
+TABLE_KERNEL(1, uint8_t, 1, uint8_t)
+TABLE_KERNEL(1, uint8_t, 2, uint16_t)
+TABLE_KERNEL(1, uint8_t, 4, uint32_t)
+TABLE_KERNEL(2, uint16_t, 1, uint8_t)
+TABLE_KERNEL(2, uint16_t, 2, uint16_t)
+TABLE_KERNEL(2, uint16_t, 4, uint32_t)
+TABLE_KERNEL(4, uint32_t, 1, uint8_t)
+TABLE_KERNEL(4, uint32_t, 2, uint16_t)
+TABLE_KERNEL(4, uint32_t, 4, uint32_t)
+
+static trfb_convert_fn table_kernel(unsigned sbpp, unsigned dbpp)
+{
+	static const trfb_convert_fn kernels[3][3] = {
+		{ convert_table_1_1, convert_table_1_2, convert_table_1_4 },
+		{ convert_table_2_1, convert_table_2_2, convert_table_2_4 },
+		{ convert_table_4_1, convert_table_4_2, convert_table_4_4 }
+	};
+
+	return kernels[sbpp / 2][dbpp / 2];
+}
+
+static void convert_copy(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	memcpy(dst, src, (size_t)n * cv->dbpp);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static void convert_shuffle_ssse3(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	__m128i shuf = _mm_loadu_si128((const __m128i*)cv->shuffle);
+	unsigned i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i*)(d + 4 * i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(s + 4 * i)), shuf));
+
+	cv->tail(d + 4 * i, s + 4 * i, n - i, cv);
+}
+
+__attribute__((target("avx2")))
+static void convert_shuffle_avx2(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	__m256i shuf = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cv->shuffle));
+	unsigned i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i*)(d + 4 * i), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + 4 * i)), shuf));
+
+	cv->tail(d + 4 * i, s + 4 * i, n - i, cv);
+}
+
+/* Channels of 4 pixels in 32-bit lanes */
+__attribute__((target("sse2")))
+static inline __m128i channels_sse2(__m128i p, const __m128i *shr, const __m128i *mask, const __m128i *shl)
+{
+	__m128i r, g, b;
+
+	r = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, shr[0]), mask[0]), shl[0]);
+	g = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, shr[1]), mask[1]), shl[1]);
+	b = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, shr[2]), mask[2]), shl[2]);
+
+	return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+#define CHANNELS_SSE2_INIT \
+	__m128i shr[3], mask[3], shl[3]; \
+	unsigned c; \
+	for (c = 0; c < 3; c++) { \
+		shr[c] = _mm_cvtsi32_si128(cv->shr[c]); \
+		mask[c] = _mm_set1_epi32(cv->mask[c]); \
+		shl[c] = _mm_cvtsi32_si128(cv->shl[c]); \
+	}
+
+/* Signed saturation does not change values if they are sign extended from 16 bits */
+#define SEXT16_SSE2(v) _mm_srai_epi32(_mm_slli_epi32(v, 16), 16)
+
+__attribute__((target("sse2")))
+static void convert_channels_sse2_4(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint32_t *d = dst;
+	unsigned i;
+	CHANNELS_SSE2_INIT
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i*)(d + i), channels_sse2(_mm_loadu_si128((const __m128i*)(s + i)), shr, mask, shl));
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+
+__attribute__((target("sse2")))
+static void convert_channels_sse2_2(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint16_t *d = dst;
+	__m128i a, b;
+	unsigned i;
+	CHANNELS_SSE2_INIT
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = channels_sse2(_mm_loadu_si128((const __m128i*)(s + i)), shr, mask, shl);
+		b = channels_sse2(_mm_loadu_si128((const __m128i*)(s + i + 4)), shr, mask, shl);
+		a = _mm_packs_epi32(SEXT16_SSE2(a), SEXT16_SSE2(b));
+		if (cv->swap)
+			a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		_mm_storeu_si128((__m128i*)(d + i), a);
+	}
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+
+__attribute__((target("sse2")))
+static void convert_channels_sse2_1(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint8_t *d = dst;
+	__m128i a, b, e, f;
+	unsigned i;
+	CHANNELS_SSE2_INIT
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = channels_sse2(_mm_loadu_si128((const __m128i*)(s + i)), shr, mask, shl);
+		b = channels_sse2(_mm_loadu_si128((const __m128i*)(s + i + 4)), shr, mask, shl);
+		e = channels_sse2(_mm_loadu_si128((const __m128i*)(s + i + 8)), shr, mask, shl);
+		f = channels_sse2(_mm_loadu_si128((const __m128i*)(s + i + 12)), shr, mask, shl);
+		_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(e, f)));
+	}
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i channels_avx2(__m256i p, const __m128i *shr, const __m256i *mask, const __m128i *shl)
+{
+	__m256i r, g, b;
+
+	r = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, shr[0]), mask[0]), shl[0]);
+	g = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, shr[1]), mask[1]), shl[1]);
+	b = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, shr[2]), mask[2]), shl[2]);
+
+	return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+#define CHANNELS_AVX2_INIT \
+	__m128i shr[3], shl[3]; \
+	__m256i mask[3]; \
+	unsigned c; \
+	for (c = 0; c < 3; c++) { \
+		shr[c] = _mm_cvtsi32_si128(cv->shr[c]); \
+		mask[c] = _mm256_set1_epi32(cv->mask[c]); \
+		shl[c] = _mm_cvtsi32_si128(cv->shl[c]); \
+	}
+
+#define SEXT16_AVX2(v) _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16)
+
+__attribute__((target("avx2")))
+static void convert_channels_avx2_4(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint32_t *d = dst;
+	unsigned i;
+	CHANNELS_AVX2_INIT
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i*)(d + i), channels_avx2(_mm256_loadu_si256((const __m256i*)(s + i)), shr, mask, shl));
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+
+__attribute__((target("avx2")))
+static void convert_channels_avx2_2(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint16_t *d = dst;
+	__m256i a, b;
+	unsigned i;
+	CHANNELS_AVX2_INIT
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = channels_avx2(_mm256_loadu_si256((const __m256i*)(s + i)), shr, mask, shl);
+		b = channels_avx2(_mm256_loadu_si256((const __m256i*)(s + i + 8)), shr, mask, shl);
+		/* Packing works in 128-bit lanes: restore order of 64-bit parts */
+		a = _mm256_packs_epi32(SEXT16_AVX2(a), SEXT16_AVX2(b));
+		if (cv->swap)
+			a = _mm256_or_si256(_mm256_slli_epi16(a, 8), _mm256_srli_epi16(a, 8));
+		_mm256_storeu_si256((__m256i*)(d + i), _mm256_permute4x64_epi64(a, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+
+__attribute__((target("avx2")))
+static void convert_channels_avx2_1(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint8_t *d = dst;
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	__m256i a, b, e, f;
+	unsigned i;
+	CHANNELS_AVX2_INIT
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		a = channels_avx2(_mm256_loadu_si256((const __m256i*)(s + i)), shr, mask, shl);
+		b = channels_avx2(_mm256_loadu_si256((const __m256i*)(s + i + 8)), shr, mask, shl);
+		e = channels_avx2(_mm256_loadu_si256((const __m256i*)(s + i + 16)), shr, mask, shl);
+		f = channels_avx2(_mm256_loadu_si256((const __m256i*)(s + i + 24)), shr, mask, shl);
+		a = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(e, f));
+		_mm256_storeu_si256((__m256i*)(d + i), _mm256_permutevar8x32_epi32(a, order));
+	}
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+#if defined(__aarch64__)
+static void convert_shuffle_neon(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	/* Out of range indexes give zero like 0x80 in pshufb */
+	uint8x16_t shuf = vld1q_u8(cv->shuffle);
+	unsigned i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		vst1q_u8(d + 4 * i, vqtbl1q_u8(vld1q_u8(s + 4 * i), shuf));
+
+	cv->tail(d + 4 * i, s + 4 * i, n - i, cv);
+}
+#endif
+
+static inline uint32x4_t channels_neon(uint32x4_t p, const int32x4_t *shr, const uint32x4_t *mask, const int32x4_t *shl)
+{
+	uint32x4_t r, g, b;
+
+	r = vshlq_u32(vandq_u32(vshlq_u32(p, shr[0]), mask[0]), shl[0]);
+	g = vshlq_u32(vandq_u32(vshlq_u32(p, shr[1]), mask[1]), shl[1]);
+	b = vshlq_u32(vandq_u32(vshlq_u32(p, shr[2]), mask[2]), shl[2]);
+
+	return vorrq_u32(vorrq_u32(r, g), b);
+}
+
+/* Right shift is shift by negative value */
+#define CHANNELS_NEON_INIT \
+	int32x4_t shr[3], shl[3]; \
+	uint32x4_t mask[3]; \
+	unsigned c; \
+	for (c = 0; c < 3; c++) { \
+		shr[c] = vdupq_n_s32(-(int)cv->shr[c]); \
+		mask[c] = vdupq_n_u32(cv->mask[c]); \
+		shl[c] = vdupq_n_s32(cv->shl[c]); \
+	}
+
+static void convert_channels_neon_4(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint32_t *d = dst;
+	unsigned i;
+	CHANNELS_NEON_INIT
+
+	for (i = 0; i + 4 <= n; i += 4)
+		vst1q_u32(d + i, channels_neon(vld1q_u32(s + i), shr, mask, shl));
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+
+static void convert_channels_neon_2(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint16_t *d = dst;
+	uint32x4_t a, b;
+	uint16x8_t r;
+	unsigned i;
+	CHANNELS_NEON_INIT
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = channels_neon(vld1q_u32(s + i), shr, mask, shl);
+		b = channels_neon(vld1q_u32(s + i + 4), shr, mask, shl);
+		r = vcombine_u16(vmovn_u32(a), vmovn_u32(b));
+		if (cv->swap)
+			r = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(r)));
+		vst1q_u16(d + i, r);
+	}
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+
+static void convert_channels_neon_1(void *dst, const void *src, unsigned n, const trfb_converter_t *cv)
+{
+	const uint32_t *s = src;
+	uint8_t *d = dst;
+	uint16x8_t a, b;
+	unsigned i;
+	CHANNELS_NEON_INIT
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = vcombine_u16(vmovn_u32(channels_neon(vld1q_u32(s + i), shr, mask, shl)),
+				vmovn_u32(channels_neon(vld1q_u32(s + i + 4), shr, mask, shl)));
+		b = vcombine_u16(vmovn_u32(channels_neon(vld1q_u32(s + i + 8), shr, mask, shl)),
+				vmovn_u32(channels_neon(vld1q_u32(s + i + 12), shr, mask, shl)));
+		vst1q_u8(d + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+	}
+
+	cv->tail(d + i, s + i, n - i, cv);
+}
+#endif
+
+/* Count of bits of channel mask */
+static unsigned channel_bits(uint32_t mask)
+{
+	unsigned n = 0;
+
+	while (n < 32 && mask >> n)
+		n++;
+
+	return n;
+}
+
+/* Source channel converted to destination channel: the most significant bits are kept (channels could be
+ * wider than 8 bits) */
+static uint32_t convert_channel(uint32_t p, uint32_t mask, unsigned shift, uint32_t dmask, unsigned dshift)
+{
+	unsigned bits = channel_bits(mask);
+	unsigned dbits = channel_bits(dmask);
+	uint32_t v;
+
+	if (shift >= 32 || dshift >= 32)
+		return 0;
+
+	v = (p >> shift) & mask;
+	v = bits > dbits? v >> (bits - dbits): v << (dbits - bits);
+
+	return (v & dmask) << dshift;
+}
+
+/* Mask is 2^n - 1 with n <= 8 */
+static int is_channel_mask(uint32_t mask)
+{
+	return mask && mask <= 0xff && !(mask & (mask + 1));
+}
+
+/* 8-bit channel at byte boundary */
+static int is_byte_channel(uint32_t mask, unsigned shift)
+{
+	return mask == 0xff && shift % 8 == 0 && shift < 32;
+}
+
+int trfb_converter_init(trfb_converter_t *cv, const trfb_framebuffer_t *dst, const trfb_framebuffer_t *src)
+{
+	const uint32_t smask[3] = { src->rmask, src->gmask, src->bmask };
+	const unsigned sshift[3] = { src->rshift, src->gshift, src->bshift };
+	const uint32_t dmask[3] = { dst->rmask, dst->gmask, dst->bmask };
+	const unsigned dshift[3] = { dst->rshift, dst->gshift, dst->bshift };
+	const unsigned dnorm[3] = { dst->rnorm, dst->gnorm, dst->bnorm };
+	unsigned features;
+	unsigned k, v, c;
+	unsigned sb, db;
+	uint32_t p;
+	int sswap, dswap;
+	int bytes, channels;
+
+	if ((src->bpp != 1 && src->bpp != 2 && src->bpp != 4) || (dst->bpp != 1 && dst->bpp != 2 && dst->bpp != 4)) {
+		trfb_msg("Invalid framebuffer: BPP = %d -> %d", src->bpp, dst->bpp);
+		return -1;
+	}
+
+	memset(cv, 0, sizeof(trfb_converter_t));
+	cv->sbpp = src->bpp;
+	cv->dbpp = dst->bpp;
+
+	/* Pixels are not in host order */
+	sswap = src->bpp > 1 && !src->big_endian != !isBE();
+	dswap = dst->bpp > 1 && !dst->big_endian != !isBE();
+	cv->swap = dswap;
+
+	if (dst->bpp == src->bpp && sswap == dswap &&
+			!memcmp(smask, dmask, sizeof(smask)) && !memcmp(sshift, dshift, sizeof(sshift))) {
+		cv->row = cv->tail = convert_copy;
+		return 0;
+	}
+
+	for (k = 0; k < src->bpp; k++) {
+		/* Table k is used for k-th byte of pixel value loaded in host order */
+		sb = sswap? src->bpp - 1 - k: k;
+		for (v = 0; v < 256; v++) {
+			p = v << (8 * sb);
+			for (c = 0; c < 3; c++)
+				cv->tab[k][v] |= convert_channel(p, smask[c], sshift[c], dmask[c], dshift[c]);
+			if (dswap)
+				cv->tab[k][v] = swap_pixel(cv->tab[k][v], dst->bpp);
+		}
+	}
+
+	cv->row = cv->tail = table_kernel(src->bpp, dst->bpp);
+
+	/* Optimized kernels for source with 8-bit channels */
+	if (src->bpp != 4)
+		return 0;
+
+	bytes = dst->bpp == 4;
+	/* Only 16-bit channel kernels swap bytes */
+	channels = !sswap && (!dswap || dst->bpp == 2);
+	for (c = 0; c < 3; c++) {
+		if (!is_byte_channel(smask[c], sshift[c]))
+			return 0;
+		if (!is_byte_channel(dmask[c], dshift[c]))
+			bytes = 0;
+		/* Packing of SIMD kernels saturates so channel must fit destination pixel */
+		if (!is_channel_mask(dmask[c]) || dshift[c] >= 8 * dst->bpp ||
+				(dst->bpp < 4 && (dmask[c] << dshift[c]) >> (8 * dst->bpp)))
+			channels = 0;
+
+		cv->shr[c] = sshift[c] + dnorm[c];
+		cv->mask[c] = dmask[c];
+		cv->shl[c] = dshift[c];
+	}
+
+	if (bytes) {
+		memset(cv->shuffle, 0x80, sizeof(cv->shuffle));
+		for (k = 0; k < 16; k += 4) {
+			for (c = 0; c < 3; c++) {
+				/* Byte positions in memory: pixels are big-endian if swapped on little-endian host or not swapped on big-endian one */
+				sb = sshift[c] / 8;
+				db = dshift[c] / 8;
+				if (sswap == !isBE())
+					sb = 3 - sb;
+				if (dswap == !isBE())
+					db = 3 - db;
+				cv->shuffle[k + db] = k + sb;
+			}
+		}
+	}
+
+	features = trfb_cpu_features();
+	(void)features;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	if (bytes && (features & TRFB_CPU_AVX2)) {
+		cv->row = convert_shuffle_avx2;
+	} else if (bytes && (features & TRFB_CPU_SSSE3)) {
+		cv->row = convert_shuffle_ssse3;
+	} else if (channels && (features & TRFB_CPU_AVX2)) {
+		cv->row = dst->bpp == 4? convert_channels_avx2_4: dst->bpp == 2? convert_channels_avx2_2: convert_channels_avx2_1;
+	} else if (channels && (features & TRFB_CPU_SSE2)) {
+		cv->row = dst->bpp == 4? convert_channels_sse2_4: dst->bpp == 2? convert_channels_sse2_2: convert_channels_sse2_1;
+	}
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#if defined(__aarch64__)
+	if (bytes && (features & TRFB_CPU_NEON)) {
+		cv->row = convert_shuffle_neon;
+	} else
+#endif
+	if (channels && (features & TRFB_CPU_NEON)) {
+		cv->row = dst->bpp == 4? convert_channels_neon_4: dst->bpp == 2? convert_channels_neon_2: convert_channels_neon_1;
+	}
+#endif
+
+	return 0;
+}
+
+void trfb_converter_rows(const trfb_converter_t *cv, void *dst, size_t dst_stride,
+		const void *src, size_t src_stride, unsigned width, unsigned height)
+{
+	unsigned y;
+
+	if (!width || !height)
+		return;
+
+	/* Continuous rows are converted at once */
+	if (dst_stride == (size_t)width * cv->dbpp && src_stride == (size_t)width * cv->sbpp) {
+		cv->row(dst, src, width * height, cv);
+		return;
+	}
+
+	for (y = 0; y < height; y++) {
+		cv->row((unsigned char*)dst + y * dst_stride, (const unsigned char*)src + y * src_stride, width, cv);
+	}
+}
+
+void trfb_converter_rect(const trfb_converter_t *cv, trfb_framebuffer_t *dst, const trfb_framebuffer_t *src,
+		unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	size_t dst_stride = (size_t)dst->width * dst->bpp;
+	size_t src_stride = (size_t)src->width * src->bpp;
+
+	trfb_converter_rows(cv,
+			(unsigned char*)dst->pixels + y * dst_stride + (size_t)x * dst->bpp, dst_stride,
+			(const unsigned char*)src->pixels + y * src_stride + (size_t)x * src->bpp, src_stride,
+			width, height);
+}
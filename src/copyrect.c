@@ -0,0 +1,260 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * CopyRect encoding: client copies rectangle of its own framebuffer. Copies come from trfb_server_copy_rect
+ * or from scroll detection: hashes of rows of the new pixels are compared with hashes of rows of con->fb
+ * (last image sent to client) to find vertical shift of damaged area. Rows of found shift are compared
+ * with client image byte by byte: collision of hashes must not corrupt image of client.
+ */
+
+/* Smaller scrolls are not worth to be searched for */
+#define SCROLL_MIN_ROWS 16
+#define SCROLL_MIN_WIDTH 32
+
+typedef struct row_hash {
+	uint64_t hash;
+	unsigned y;
+} row_hash_t;
+
+static int cmp_row_hash(const void *a, const void *b)
+{
+	const row_hash_t *x = a;
+	const row_hash_t *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash? -1: 1;
+	return x->y < y->y? -1: x->y > y->y;
+}
+
+/* Row of old image with this hash or -1 if there is no such row or it is not unique */
+static int find_row(const row_hash_t *sorted, unsigned cnt, uint64_t hash)
+{
+	unsigned l = 0, r = cnt, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+		if (sorted[m].hash < hash)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	if (l >= cnt || sorted[l].hash != hash || (l + 1 < cnt && sorted[l + 1].hash == hash))
+		return -1;
+
+	return sorted[l].y;
+}
+
+/* Remove rows [y0, y1) from rectangles */
+static int cut_rows(trfb_rect_t **rects, int *rects_cnt, unsigned y0, unsigned y1)
+{
+	trfb_rect_t *res;
+	trfb_rect_t *r;
+	int cnt = 0;
+	int i;
+
+	res = malloc((*rects_cnt * 2 + 1) * sizeof(trfb_rect_t));
+	if (!res) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+
+	for (i = 0; i < *rects_cnt; i++) {
+		r = *rects + i;
+		if (r->y >= y1 || r->y + r->height <= y0) {
+			res[cnt++] = *r;
+			continue;
+		}
+
+		if (r->y < y0) {
+			res[cnt] = *r;
+			res[cnt++].height = y0 - r->y;
+		}
+
+		if (r->y + r->height > y1) {
+			res[cnt] = *r;
+			res[cnt].y = y1;
+			res[cnt++].height = r->y + r->height - y1;
+		}
+	}
+
+	free(*rects);
+	*rects = res;
+	*rects_cnt = cnt;
+
+	return 0;
+}
+
+/* Row y of server framebuffer converted to client format is equal to row oy of client image */
+static int same_row(trfb_connection_t *con, unsigned char *row, unsigned x, unsigned w, unsigned y, unsigned oy)
+{
+	trfb_framebuffer_t *sfb = con->server->fb;
+	trfb_framebuffer_t *fb = con->fb;
+
+	trfb_converter_rows(con->converter, row, 0, (unsigned char*)sfb->pixels + ((size_t)y * sfb->width + x) * sfb->bpp,
+			0, w, 1);
+
+	return !memcmp(row, (unsigned char*)fb->pixels + ((size_t)oy * fb->width + x) * fb->bpp, (size_t)w * fb->bpp);
+}
+
+int trfb_connection_find_scroll(trfb_connection_t *con, trfb_rect_t **rects, int *rects_cnt,
+		trfb_rect_t *dst, unsigned *sx, unsigned *sy)
+{
+	trfb_framebuffer_t *sfb = con->server->fb;
+	trfb_framebuffer_t *fb = con->fb;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	size_t sstride = (size_t)sfb->width * sfb->bpp;
+	unsigned x0 = ~0u, y0 = ~0u, x1 = 0, y1 = 0;
+	unsigned w, h, y, best_len, len, best_y;
+	row_hash_t *sorted = NULL;
+	uint64_t *old = NULL, *hashes = NULL;
+	unsigned *votes = NULL;
+	unsigned char *row = NULL;
+	int best, d, r;
+	int rv = -1;
+	int i;
+
+	/* Bounding box of damage */
+	for (i = 0; i < *rects_cnt; i++) {
+		if ((*rects)[i].x < x0)
+			x0 = (*rects)[i].x;
+		if ((*rects)[i].y < y0)
+			y0 = (*rects)[i].y;
+		if ((*rects)[i].x + (*rects)[i].width > x1)
+			x1 = (*rects)[i].x + (*rects)[i].width;
+		if ((*rects)[i].y + (*rects)[i].height > y1)
+			y1 = (*rects)[i].y + (*rects)[i].height;
+	}
+
+	if (x1 < x0 + SCROLL_MIN_WIDTH || y1 < y0 + 2 * SCROLL_MIN_ROWS)
+		return 0;
+	w = x1 - x0;
+	h = y1 - y0;
+
+	sorted = malloc(h * sizeof(row_hash_t));
+	old = malloc(h * sizeof(uint64_t));
+	hashes = malloc(h * sizeof(uint64_t));
+	votes = calloc(2 * h, sizeof(unsigned));
+	row = malloc((size_t)w * fb->bpp);
+	if (!sorted || !old || !hashes || !votes || !row) {
+		trfb_msg("Not enought memory");
+		goto done;
+	}
+
+	/* Rows of client image and the same rows of new image in client format */
+	for (y = 0; y < h; y++) {
+		old[y] = trfb_hash((unsigned char*)fb->pixels + (y0 + y) * stride + x0 * fb->bpp, (size_t)w * fb->bpp);
+		sorted[y].hash = old[y];
+		sorted[y].y = y;
+		trfb_converter_rows(con->converter, row, 0, (unsigned char*)sfb->pixels + (y0 + y) * sstride + x0 * sfb->bpp,
+				0, w, 1);
+		hashes[y] = trfb_hash(row, (size_t)w * fb->bpp);
+	}
+	qsort(sorted, h, sizeof(row_hash_t), cmp_row_hash);
+
+	/* Every changed row which is unique in the old image votes for shift */
+	for (y = 0; y < h; y++) {
+		if (hashes[y] == old[y])
+			continue;
+		r = find_row(sorted, h, hashes[y]);
+		if (r >= 0)
+			votes[r - (int)y + h]++;
+	}
+
+	best = 0;
+	for (d = 1 - (int)h; d < (int)h; d++) {
+		if (votes[d + h] > votes[best + h])
+			best = d;
+	}
+
+	rv = 0;
+	if (!best || votes[best + h] < SCROLL_MIN_ROWS / 2)
+		goto done;
+
+	/* The longest run of rows which are equal to shifted rows of old image */
+	best_len = len = 0;
+	best_y = 0;
+	for (y = best > 0? 0: -best; y < (best > 0? h - best: h); y++) {
+		if (hashes[y] == old[y + best] && same_row(con, row, x0, w, y0 + y, y0 + y + best)) {
+			if (++len > best_len) {
+				best_len = len;
+				best_y = y + 1 - len;
+			}
+		} else {
+			len = 0;
+		}
+	}
+
+	if (best_len < SCROLL_MIN_ROWS)
+		goto done;
+
+	dst->x = x0;
+	dst->y = y0 + best_y;
+	dst->width = w;
+	dst->height = best_len;
+	*sx = x0;
+	*sy = y0 + best_y + best;
+
+	if (cut_rows(rects, rects_cnt, dst->y, dst->y + dst->height)) {
+		rv = -1;
+		goto done;
+	}
+	rv = 1;
+
+done:
+	free(sorted);
+	free(old);
+	free(hashes);
+	free(votes);
+	free(row);
+
+	return rv;
+}
+
+int trfb_connection_copy_rect(trfb_connection_t *con, const trfb_rect_t *dst, unsigned sx, unsigned sy)
+{
+	unsigned char buf[4];
+
+	buf[0] = sx >> 8;
+	buf[1] = sx;
+	buf[2] = sy >> 8;
+	buf[3] = sy;
+
+	if (trfb_connection_rect_header(con, dst->x, dst->y, dst->width, dst->height, TRFB_ENCODING_COPYRECT) ||
+			trfb_connection_queue(con, buf, 4))
+		return -1;
+
+	return 0;
+}
+
+static ssize_t copyrect_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	unsigned sx, sy;
+
+	if (len < 4) {
+		*need = 4;
+		return 0;
+	}
+
+	sx = buf[0] * 256 + buf[1];
+	sy = buf[2] * 256 + buf[3];
+	if (sx + cl->rect.width > cl->fb->width || sy + cl->rect.height > cl->fb->height) {
+		trfb_msg("[%s] CopyRect source is out of screen", cl->name);
+		return -1;
+	}
+
+	trfb_framebuffer_copy_rect(cl->fb, sx, sy, cl->rect.x, cl->rect.y, cl->rect.width, cl->rect.height);
+	*need = 0;
+
+	return 4;
+}
+
+const trfb_decoder_t trfb_decoder_copyrect = {
+	TRFB_ENCODING_COPYRECT,
+	"CopyRect",
+	NULL,
+	NULL,
+	copyrect_decode
+};
@@ -0,0 +1,57 @@
+#include <trfb.h>
+
+/* Runtime detection of CPU features used by optimized kernels */
+
+/* Features allowed by trfb_cpu_limit */
+static unsigned limit = ~0u;
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+static unsigned cpu_detect(void)
+{
+	static unsigned features = 0;
+	static int detected = 0;
+	unsigned f = 0;
+
+	if (detected)
+		return features;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		f |= TRFB_CPU_SSE2;
+	if (__builtin_cpu_supports("ssse3"))
+		f |= TRFB_CPU_SSSE3;
+	if (__builtin_cpu_supports("avx2"))
+		f |= TRFB_CPU_AVX2;
+
+	features = f;
+	detected = 1;
+
+	return features;
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+static unsigned cpu_detect(void)
+{
+	return TRFB_CPU_NEON;
+}
+
+#else
+
+static unsigned cpu_detect(void)
+{
+	return 0;
+}
+
+#endif
+
+unsigned trfb_cpu_features(void)
+{
+	return cpu_detect() & limit;
+}
+
+void trfb_cpu_limit(unsigned features)
+{
+	limit = features;
+}
@@ -0,0 +1,361 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Cursor: clients which support Cursor pseudo-encoding draw it themselves, so pointer motion doesn't cost
+ * framebuffer updates for them. Other clients receive cursor drawn into their pixels and its motion damages
+ * only old and new area of cursor.
+ *
+ * Area of client framebuffer where cursor is drawn is kept in cursor_drawn: it is sent again when cursor
+ * leaves it and CopyRect could copy it.
+ */
+
+/* Bytes of cursor mask: rows are padded to bytes */
+#define MASK_SIZE(w, h) ((size_t)((w) + 7) / 8 * (h))
+
+static const trfb_rect_t no_rect;
+
+/* Area of cursor with hot spot at (px, py) clipped by framebuffer */
+static void cursor_area(unsigned w, unsigned h, unsigned hot_x, unsigned hot_y, unsigned px, unsigned py,
+		unsigned fb_w, unsigned fb_h, trfb_rect_t *r)
+{
+	long x0 = (long)px - hot_x;
+	long y0 = (long)py - hot_y;
+	long x1 = x0 + w;
+	long y1 = y0 + h;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > (long)fb_w)
+		x1 = fb_w;
+	if (y1 > (long)fb_h)
+		y1 = fb_h;
+
+	if (x0 >= x1 || y0 >= y1) {
+		*r = no_rect;
+		return;
+	}
+
+	r->x = x0;
+	r->y = y0;
+	r->width = x1 - x0;
+	r->height = y1 - y0;
+}
+
+static int intersect(const trfb_rect_t *a, const trfb_rect_t *b, trfb_rect_t *r)
+{
+	unsigned x0 = a->x > b->x? a->x: b->x;
+	unsigned y0 = a->y > b->y? a->y: b->y;
+	unsigned x1 = a->x + a->width < b->x + b->width? a->x + a->width: b->x + b->width;
+	unsigned y1 = a->y + a->height < b->y + b->height? a->y + a->height: b->y + b->height;
+
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	r->x = x0;
+	r->y = y0;
+	r->width = x1 - x0;
+	r->height = y1 - y0;
+
+	return 1;
+}
+
+static int inside(const trfb_rect_t *a, const trfb_rect_t *b)
+{
+	return !a->width || (a->x >= b->x && a->y >= b->y &&
+			a->x + a->width <= b->x + b->width && a->y + a->height <= b->y + b->height);
+}
+
+static int same(const trfb_rect_t *a, const trfb_rect_t *b)
+{
+	return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+/* Add area of server cursor at pointer of connection to its damage. Server and connection must be locked. */
+static void damage_area(trfb_server_t *srv, trfb_connection_t *con)
+{
+	trfb_rect_t r;
+
+	if (con->cursor_local || !srv->cursor)
+		return;
+
+	cursor_area(srv->cursor->width, srv->cursor->height, srv->cursor_hot_x, srv->cursor_hot_y,
+			con->pointer_x, con->pointer_y, srv->fb->width, srv->fb->height, &r);
+	trfb_region_add_rect(&con->damage, r.x, r.y, r.width, r.height);
+}
+
+/* Unlock connection and wake it up if it waits for update */
+static void wakeup(trfb_connection_t *con)
+{
+	int w = con->update_pending || con->cu_enabled;
+
+	mtx_unlock(&con->lock);
+
+	if (w)
+		trfb_connection_wakeup(con);
+}
+
+int trfb_server_set_cursor(trfb_server_t *srv, unsigned width, unsigned height, unsigned hot_x, unsigned hot_y,
+		const trfb_color_t *pixels, const unsigned char *mask)
+{
+	trfb_framebuffer_t *cursor = NULL;
+	unsigned char *m = NULL;
+	trfb_connection_t *con;
+	unsigned x, y;
+
+	if (!srv || !srv->fb)
+		return -1;
+
+	if (width && height && pixels) {
+		if (width > 0xffff || height > 0xffff || hot_x >= width || hot_y >= height) {
+			trfb_msg("Invalid cursor %ux%u with hot spot (%u, %u)", width, height, hot_x, hot_y);
+			return -1;
+		}
+
+		cursor = trfb_framebuffer_create(width, height, 4);
+		m = malloc(MASK_SIZE(width, height));
+		if (!cursor || !m) {
+			trfb_framebuffer_free(cursor);
+			free(m);
+			trfb_msg("Not enought memory");
+			return -1;
+		}
+
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				trfb_framebuffer_set_pixel(cursor, x, y, pixels[y * width + x]);
+
+		if (mask)
+			memcpy(m, mask, MASK_SIZE(width, height));
+		else
+			memset(m, 0xff, MASK_SIZE(width, height));
+	}
+
+	mtx_lock(&srv->lock);
+	for (con = srv->clients; con; con = con->next) {
+		mtx_lock(&con->lock);
+		damage_area(srv, con);
+		mtx_unlock(&con->lock);
+	}
+
+	trfb_framebuffer_free(srv->cursor);
+	free(srv->cursor_mask);
+	srv->cursor = cursor;
+	srv->cursor_mask = m;
+	srv->cursor_hot_x = hot_x;
+	srv->cursor_hot_y = hot_y;
+
+	for (con = srv->clients; con; con = con->next) {
+		mtx_lock(&con->lock);
+		damage_area(srv, con);
+		con->cursor_changed = 1;
+		wakeup(con);
+	}
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_server_set_pointer(trfb_server_t *srv, unsigned x, unsigned y)
+{
+	trfb_connection_t *con;
+
+	if (!srv)
+		return -1;
+
+	mtx_lock(&srv->lock);
+	if (x == srv->pointer_x && y == srv->pointer_y) {
+		mtx_unlock(&srv->lock);
+		return 0;
+	}
+
+	srv->pointer_x = x;
+	srv->pointer_y = y;
+	for (con = srv->clients; con; con = con->next) {
+		mtx_lock(&con->lock);
+		if (con->cursor_local || !srv->cursor) {
+			con->pointer_x = x;
+			con->pointer_y = y;
+			mtx_unlock(&con->lock);
+			continue;
+		}
+
+		/* Cursor is erased at old position and drawn at new one */
+		damage_area(srv, con);
+		con->pointer_x = x;
+		con->pointer_y = y;
+		damage_area(srv, con);
+		wakeup(con);
+	}
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_connection_sync_cursor(trfb_connection_t *con)
+{
+	trfb_server_t *srv = con->server;
+	trfb_framebuffer_t *cursor = NULL;
+	unsigned char *mask = NULL;
+	int had = con->cursor != NULL;
+
+	mtx_lock(&srv->lock);
+	if (srv->cursor) {
+		cursor = trfb_framebuffer_create_of_format(srv->cursor->width, srv->cursor->height, &con->format);
+		mask = malloc(MASK_SIZE(srv->cursor->width, srv->cursor->height));
+		if (!cursor || !mask || trfb_framebuffer_convert(cursor, srv->cursor)) {
+			mtx_unlock(&srv->lock);
+			trfb_framebuffer_free(cursor);
+			free(mask);
+			trfb_msg("[%s] Can not convert cursor to client format", con->name);
+			return -1;
+		}
+		memcpy(mask, srv->cursor_mask, MASK_SIZE(srv->cursor->width, srv->cursor->height));
+		con->cursor_hot_x = srv->cursor_hot_x;
+		con->cursor_hot_y = srv->cursor_hot_y;
+	}
+	mtx_unlock(&srv->lock);
+
+	trfb_framebuffer_free(con->cursor);
+	free(con->cursor_mask);
+	con->cursor = cursor;
+	con->cursor_mask = mask;
+
+	/* Client keeps its own cursor until server sets one */
+	if (con->cursor_local && (had || cursor))
+		con->cursor_send = 1;
+
+	return 0;
+}
+
+int trfb_connection_send_cursor(trfb_connection_t *con)
+{
+	trfb_framebuffer_t *c = con->cursor;
+
+	con->cursor_send = 0;
+
+	/* Empty cursor hides pointer */
+	if (!c)
+		return trfb_connection_rect_header(con, 0, 0, 0, 0, TRFB_ENCODING_CURSOR);
+
+	if (trfb_connection_rect_header(con, con->cursor_hot_x, con->cursor_hot_y, c->width, c->height,
+				TRFB_ENCODING_CURSOR) ||
+			trfb_connection_queue(con, c->pixels, (size_t)c->width * c->height * c->bpp) ||
+			trfb_connection_queue(con, con->cursor_mask, MASK_SIZE(c->width, c->height)))
+		return -1;
+
+	return 0;
+}
+
+void trfb_connection_cursor_damage(trfb_connection_t *con, unsigned px, unsigned py, int changed, trfb_rect_t *area)
+{
+	trfb_rect_t *d = &con->cursor_drawn;
+
+	if (con->cursor_local || !con->cursor)
+		*area = no_rect;
+	else
+		cursor_area(con->cursor->width, con->cursor->height, con->cursor_hot_x, con->cursor_hot_y, px, py,
+				con->damage.width, con->damage.height, area);
+
+	/* Cursor drawn to client framebuffer is still valid */
+	if (!changed && same(area, d))
+		return;
+
+	trfb_region_add_rect(&con->damage, d->x, d->y, d->width, d->height);
+	trfb_region_add_rect(&con->damage, area->x, area->y, area->width, area->height);
+}
+
+static int push(trfb_rect_t **rects, int *rects_cnt, const trfb_rect_t *r)
+{
+	trfb_rect_t *p;
+
+	p = realloc(*rects, (*rects_cnt + 1) * sizeof(trfb_rect_t));
+	if (!p) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+
+	p[(*rects_cnt)++] = *r;
+	*rects = p;
+
+	return 0;
+}
+
+int trfb_connection_cursor_copy(trfb_connection_t *con, trfb_rect_t **rects, int *rects_cnt, const trfb_rect_t *area,
+		const trfb_rect_t *dst, unsigned sx, unsigned sy)
+{
+	trfb_rect_t src = *dst;
+	trfb_rect_t r;
+
+	src.x = sx;
+	src.y = sy;
+
+	/* Client copies cursor too: pixels under copied cursor must be sent */
+	if (intersect(&con->cursor_drawn, &src, &r)) {
+		r.x = r.x - sx + dst->x;
+		r.y = r.y - sy + dst->y;
+		if (push(rects, rects_cnt, &r))
+			return -1;
+	}
+
+	/* Cursor is overwritten by copy: it must be drawn again */
+	if (intersect(area, dst, &r) && push(rects, rects_cnt, &r))
+		return -1;
+
+	return 0;
+}
+
+void trfb_connection_draw_cursor(trfb_connection_t *con, const trfb_rect_t *area, unsigned px, unsigned py,
+		const trfb_rect_t *rect)
+{
+	trfb_framebuffer_t *fb = con->fb;
+	trfb_framebuffer_t *c = con->cursor;
+	size_t mstride, bpp;
+	unsigned x, y, cx, cy;
+	trfb_rect_t r;
+
+	if (!c || !intersect(area, rect, &r))
+		return;
+
+	mstride = (c->width + 7) / 8;
+	bpp = fb->bpp;
+	for (y = r.y; y < r.y + r.height; y++) {
+		cy = y + con->cursor_hot_y - py;
+		for (x = r.x; x < r.x + r.width; x++) {
+			cx = x + con->cursor_hot_x - px;
+			if (con->cursor_mask[cy * mstride + cx / 8] & (0x80 >> (cx % 8)))
+				memcpy((unsigned char*)fb->pixels + ((size_t)y * fb->width + x) * bpp,
+						(unsigned char*)c->pixels + ((size_t)cy * c->width + cx) * bpp, bpp);
+		}
+	}
+}
+
+void trfb_connection_cursor_drawn(trfb_connection_t *con, const trfb_rect_t *area, const trfb_rect_t *rect)
+{
+	trfb_rect_t *d = &con->cursor_drawn;
+	unsigned x1, y1;
+
+	if (inside(d, rect) && inside(area, rect)) {
+		*d = *area;
+		return;
+	}
+
+	/* Parts out of rectangle are not sent yet: both cursors could be there */
+	if (!area->width)
+		return;
+
+	if (!d->width) {
+		*d = *area;
+		return;
+	}
+
+	x1 = d->x + d->width > area->x + area->width? d->x + d->width: area->x + area->width;
+	y1 = d->y + d->height > area->y + area->height? d->y + d->height: area->y + area->height;
+	d->x = d->x < area->x? d->x: area->x;
+	d->y = d->y < area->y? d->y: area->y;
+	d->width = x1 - d->x;
+	d->height = y1 - d->y;
+}
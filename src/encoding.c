@@ -0,0 +1,420 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Encoders registry. Raw must be always here because all clients support it. */
+static const trfb_encoder_t *encoders[TRFB_MAX_ENCODERS] = {
+	&trfb_encoder_raw,
+	&trfb_encoder_rre,
+	&trfb_encoder_corre,
+	&trfb_encoder_hextile,
+#if HAVE_ZLIB_H
+	&trfb_encoder_zrle,
+	&trfb_encoder_tight,
+#endif
+	NULL
+};
+
+int trfb_encoder_register(const trfb_encoder_t *enc)
+{
+	unsigned i;
+
+	if (!enc || !enc->encode) {
+		trfb_msg("Invalid encoder");
+		return -1;
+	}
+
+	for (i = 0; i < TRFB_MAX_ENCODERS; i++) {
+		if (!encoders[i] || encoders[i]->encoding == enc->encoding) {
+			encoders[i] = enc;
+			return 0;
+		}
+	}
+
+	trfb_msg("Too many encoders registered");
+	return -1;
+}
+
+static int encoder_index(const trfb_encoder_t *enc)
+{
+	int i;
+
+	for (i = 0; i < TRFB_MAX_ENCODERS && encoders[i]; i++)
+		if (encoders[i] == enc)
+			return i;
+
+	return -1;
+}
+
+const trfb_encoder_t* trfb_encoder_find(int32_t encoding)
+{
+	unsigned i;
+
+	for (i = 0; i < TRFB_MAX_ENCODERS && encoders[i]; i++)
+		if (encoders[i]->encoding == encoding)
+			return encoders[i];
+
+	return NULL;
+}
+
+const trfb_encoder_t* trfb_encoder_get(unsigned idx)
+{
+	if (idx >= TRFB_MAX_ENCODERS)
+		return NULL;
+
+	return encoders[idx];
+}
+
+int trfb_connection_has_encoding(trfb_connection_t *con, int32_t encoding)
+{
+	unsigned i;
+
+	for (i = 0; i < con->encodings_cnt; i++)
+		if (con->encodings[i] == encoding)
+			return 1;
+
+	return 0;
+}
+
+int trfb_connection_set_compress_level(trfb_connection_t *con, int level)
+{
+	if (level < 0 || level > 9) {
+		trfb_msg("[%s] Invalid compression level: %d", con->name, level);
+		return -1;
+	}
+
+	con->compress_level = level;
+
+	return 0;
+}
+
+int trfb_connection_set_jpeg_quality(trfb_connection_t *con, int quality)
+{
+	if (quality < 1 || quality > 100) {
+		trfb_msg("[%s] Invalid JPEG quality: %d", con->name, quality);
+		return -1;
+	}
+
+	con->jpeg_quality = quality;
+
+	return 0;
+}
+
+/* JPEG quality and subsampling of QualityLevel pseudo-encodings (the same as TigerVNC uses) */
+static const struct quality_level {
+	int quality;
+	int subsampling;
+} quality_levels[10] = {
+	{ 15, TRFB_SUBSAMPLING_420 },
+	{ 29, TRFB_SUBSAMPLING_420 },
+	{ 41, TRFB_SUBSAMPLING_420 },
+	{ 42, TRFB_SUBSAMPLING_422 },
+	{ 62, TRFB_SUBSAMPLING_422 },
+	{ 77, TRFB_SUBSAMPLING_422 },
+	{ 79, TRFB_SUBSAMPLING_444 },
+	{ 86, TRFB_SUBSAMPLING_444 },
+	{ 92, TRFB_SUBSAMPLING_444 },
+	{ 100, TRFB_SUBSAMPLING_444 }
+};
+
+/* Encoder parameters from pseudo-encodings: the first one of each kind is used */
+static void encoder_params(trfb_connection_t *con, const int32_t *encodings, unsigned cnt)
+{
+	int compress = -1, quality = -1, fine = -1, subsampling = -1;
+	int32_t e;
+	unsigned i;
+
+	for (i = 0; i < cnt; i++) {
+		e = encodings[i];
+		if (e >= TRFB_ENCODING_COMPRESS_LEVEL0 && e <= TRFB_ENCODING_COMPRESS_LEVEL9) {
+			if (compress < 0)
+				compress = e - TRFB_ENCODING_COMPRESS_LEVEL0;
+		} else if (e >= TRFB_ENCODING_QUALITY_LEVEL0 && e <= TRFB_ENCODING_QUALITY_LEVEL9) {
+			if (quality < 0)
+				quality = e - TRFB_ENCODING_QUALITY_LEVEL0;
+		} else if (e >= TRFB_ENCODING_FINE_QUALITY_LEVEL0 && e <= TRFB_ENCODING_FINE_QUALITY_LEVEL100) {
+			if (fine < 0)
+				fine = e - TRFB_ENCODING_FINE_QUALITY_LEVEL0;
+		} else if (e >= TRFB_ENCODING_SUBSAMPLING_444 && e <= TRFB_ENCODING_SUBSAMPLING_GRAY) {
+			if (subsampling < 0)
+				subsampling = e - TRFB_ENCODING_SUBSAMPLING_444;
+		}
+	}
+
+	/* Parameters which client doesn't send anymore return to defaults */
+	mtx_lock(&con->server->lock);
+	con->compress_level = compress >= 0? compress: con->server->compress_level;
+	con->jpeg_quality = con->server->jpeg_quality;
+	mtx_unlock(&con->server->lock);
+	con->jpeg_subsampling = TRFB_SUBSAMPLING_420;
+
+	if (quality >= 0) {
+		con->jpeg_quality = quality_levels[quality].quality;
+		con->jpeg_subsampling = quality_levels[quality].subsampling;
+	}
+
+	/* Fine-grained parameters are sent together with QualityLevel and override it */
+	if (fine >= 0)
+		con->jpeg_quality = fine? fine: 1;
+	if (subsampling >= 0)
+		con->jpeg_subsampling = subsampling;
+
+	/* Adaptive rate doesn't go above quality asked by client */
+	con->rate_quality = con->jpeg_quality;
+
+	trfb_msg("I:[%s] compression level %d, JPEG quality %d, subsampling %d", con->name, con->compress_level,
+			con->jpeg_quality, con->jpeg_subsampling);
+}
+
+/* Tiles of content sampled for estimates */
+#define CONTENT_TILE 16
+#define CONTENT_SAMPLES 256
+
+static uint32_t pixel_at(const trfb_framebuffer_t *fb, unsigned x, unsigned y)
+{
+	const unsigned char *p = (const unsigned char*)fb->pixels + ((size_t)y * fb->width + x) * fb->bpp;
+
+	if (fb->bpp == 1)
+		return *p;
+	else if (fb->bpp == 2)
+		return *(const uint16_t*)p;
+
+	return *(const uint32_t*)p;
+}
+
+/* Count of colours of tile: 1, 2 or 3 for more */
+static unsigned tile_colours(const trfb_framebuffer_t *fb, unsigned x0, unsigned y0)
+{
+	uint32_t c0 = pixel_at(fb, x0, y0);
+	uint32_t c1 = c0;
+	uint32_t c;
+	unsigned x, y;
+	unsigned n = 1;
+
+	for (y = y0; y < y0 + CONTENT_TILE; y++) {
+		for (x = x0; x < x0 + CONTENT_TILE; x++) {
+			c = pixel_at(fb, x, y);
+			if (c == c0 || c == c1)
+				continue;
+			if (n == 2)
+				return 3;
+			c1 = c;
+			n = 2;
+		}
+	}
+
+	return n;
+}
+
+void trfb_connection_content(trfb_connection_t *con, unsigned *solid, unsigned *two)
+{
+	const trfb_framebuffer_t *fb = con->fb;
+	unsigned tw, th, tiles, step;
+	unsigned k, n = 0;
+	unsigned cnt[4] = { 0, 0, 0, 0 };
+
+	/* Usual desktop: mostly flat background and text */
+	*solid = 600;
+	*two = 200;
+
+	if (!fb || fb->width < CONTENT_TILE || fb->height < CONTENT_TILE)
+		return;
+
+	tw = fb->width / CONTENT_TILE;
+	th = fb->height / CONTENT_TILE;
+	tiles = tw * th;
+	step = tiles / CONTENT_SAMPLES + 1;
+	for (k = 0; k < tiles; k += step, n++)
+		cnt[tile_colours(fb, k % tw * CONTENT_TILE, k / tw * CONTENT_TILE)]++;
+
+	*solid = cnt[1] * 1000 / n;
+	*two = cnt[2] * 1000 / n;
+}
+
+static size_t estimate(trfb_connection_t *con, const trfb_encoder_t *enc)
+{
+	if (!enc->estimate)
+		return trfb_encoder_raw.estimate(con, con->width, con->height);
+
+	return enc->estimate(con, con->width, con->height);
+}
+
+int trfb_connection_set_encodings(trfb_connection_t *con, const int32_t *encodings, unsigned cnt)
+{
+	const trfb_encoder_t *enc;
+	const trfb_encoder_t *best = &trfb_encoder_raw;
+	size_t best_cost = 0;
+	size_t cost;
+	int32_t *p = NULL;
+	unsigned i;
+
+	if (cnt) {
+		p = malloc(cnt * sizeof(int32_t));
+		if (!p) {
+			trfb_msg("Not enought memory");
+			return -1;
+		}
+		memcpy(p, encodings, cnt * sizeof(int32_t));
+	}
+
+	free(con->encodings);
+	con->encodings = p;
+	con->encodings_cnt = cnt;
+	encoder_params(con, encodings, cnt);
+
+	/* Client sends encodings in order of preference: the first one we support is used */
+	for (i = 0; i < cnt; i++) {
+		enc = trfb_encoder_find(encodings[i]);
+		if (enc) {
+			best = enc;
+			break;
+		}
+	}
+
+	/* Raw at the head of list is no preference: every client decodes it, so the other encodings of the list
+	 * are equal and the one with the least estimate is used (the first one of equal estimates). Raw is only
+	 * a fallback: LAN viewers which list it first get Hextile. */
+	if (best == &trfb_encoder_raw) {
+		for (i++; i < cnt; i++) {
+			enc = trfb_encoder_find(encodings[i]);
+			if (!enc || enc == &trfb_encoder_raw)
+				continue;
+
+			cost = estimate(con, enc);
+			if (best == &trfb_encoder_raw || cost < best_cost) {
+				best = enc;
+				best_cost = cost;
+			}
+		}
+	}
+
+	con->encoder = best;
+	trfb_msg("I:[%s] using encoding %s", con->name, best->name);
+
+	return 0;
+}
+
+void* trfb_connection_encoder_state(trfb_connection_t *con, const trfb_encoder_t *enc)
+{
+	int i = encoder_index(enc);
+
+	if (i < 0 || !enc->create)
+		return NULL;
+
+	if (!con->encoder_state[i])
+		con->encoder_state[i] = enc->create(con);
+
+	return con->encoder_state[i];
+}
+
+void trfb_connection_encoders_free(trfb_connection_t *con)
+{
+	unsigned i;
+
+	for (i = 0; i < TRFB_MAX_ENCODERS; i++) {
+		if (con->encoder_state[i] && encoders[i] && encoders[i]->destroy)
+			encoders[i]->destroy(con->encoder_state[i]);
+		con->encoder_state[i] = NULL;
+	}
+
+	free(con->encodings);
+	con->encodings = NULL;
+	con->encodings_cnt = 0;
+}
+
+int trfb_connection_rect_header(trfb_connection_t *con, unsigned x, unsigned y, unsigned width, unsigned height, int32_t encoding)
+{
+	unsigned char buf[12];
+	uint32_t enc = encoding;
+
+	buf[0] = x >> 8;
+	buf[1] = x;
+	buf[2] = y >> 8;
+	buf[3] = y;
+	buf[4] = width >> 8;
+	buf[5] = width;
+	buf[6] = height >> 8;
+	buf[7] = height;
+	buf[8] = enc >> 24;
+	buf[9] = enc >> 16;
+	buf[10] = enc >> 8;
+	buf[11] = enc;
+
+	return trfb_connection_queue(con, buf, 12);
+}
+
+#define SPLIT(len, max) ((max)? ((len) + (max) - 1) / (max): 1)
+
+unsigned trfb_encoder_count(const trfb_encoder_t *enc, unsigned width, unsigned height)
+{
+	if (!width || !height)
+		return 0;
+
+	return SPLIT(width, enc->max_width) * SPLIT(height, enc->max_height);
+}
+
+int trfb_connection_encode(trfb_connection_t *con, const trfb_encoder_t *enc, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	unsigned mw = enc->max_width? enc->max_width: width;
+	unsigned mh = enc->max_height? enc->max_height: height;
+	unsigned i, j, w, h;
+	void *state = NULL;
+
+	if (enc->create) {
+		state = trfb_connection_encoder_state(con, enc);
+		if (!state) {
+			trfb_msg("[%s] Can not create state for encoder %s", con->name, enc->name);
+			return -1;
+		}
+	}
+
+	for (j = 0; j < height; j += mh) {
+		h = height - j < mh? height - j: mh;
+		for (i = 0; i < width; i += mw) {
+			w = width - i < mw? width - i: mw;
+			if (enc->encode(con, state, x + i, y + j, w, h))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Raw encoding: pixels are sent as they are */
+static size_t raw_estimate(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	return (size_t)width * height * (con->format.bpp / 8);
+}
+
+static int raw_encode(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	trfb_framebuffer_t *fb = con->fb;
+	const unsigned char *p;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	unsigned j;
+
+	if (trfb_connection_rect_header(con, x, y, width, height, TRFB_ENCODING_RAW))
+		return -1;
+
+	p = (const unsigned char*)fb->pixels + y * stride + x * fb->bpp;
+	if (x == 0 && width == fb->width)
+		return trfb_connection_queue_ref(con, p, stride * height);
+
+	for (j = 0; j < height; j++, p += stride) {
+		if (trfb_connection_queue_ref(con, p, (size_t)width * fb->bpp))
+			return -1;
+	}
+
+	return 0;
+}
+
+const trfb_encoder_t trfb_encoder_raw = {
+	TRFB_ENCODING_RAW,
+	"Raw",
+	0, 0,
+	NULL,
+	NULL,
+	raw_estimate,
+	raw_encode,
+	0 /* pixels are referenced by output queue without copying */
+};
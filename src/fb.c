@@ -54,6 +54,7 @@ trfb_framebuffer_t* trfb_framebuffer_create(unsigned width, unsigned height, uns
 	fb->bpp = bpp;
 	fb->width = width;
 	fb->height = height;
+	fb->big_endian = isBE();
 	if (bpp == 1) {
 		fb->pixels = calloc(1, sz);
 		fb->rmask = TRFB_FB8_RMASK;
@@ -129,6 +130,13 @@ trfb_framebuffer_t* trfb_framebuffer_copy(trfb_framebuffer_t *fb)
 	}
 	c->free_pixels = 1;
 
+	if (mtx_init(&c->lock, mtx_plain) != thrd_success) {
+		free(c->pixels);
+		free(c);
+		trfb_msg("Can't create mutex");
+		return NULL;
+	}
+
 	memcpy(c->pixels, fb->pixels, len);
 
 	return c;
@@ -171,6 +179,7 @@ int trfb_framebuffer_resize(trfb_framebuffer_t *fb, unsigned width, unsigned hei
 		if (fb->free_pixels) \
 			free(fb->pixels); \
 		fb->pixels = np; \
+		fb->free_pixels = 1; \
 	} while (0)
 
 	if (fb->bpp == 1) {
@@ -193,7 +202,7 @@ int trfb_framebuffer_resize(trfb_framebuffer_t *fb, unsigned width, unsigned hei
 /* This is the main function for us */
 int trfb_framebuffer_convert(trfb_framebuffer_t *dst, trfb_framebuffer_t *src)
 {
-	unsigned y, x;
+	trfb_converter_t cv;
 
 	if (!dst || !src) {
 		trfb_msg("Invalid arguments");
@@ -235,26 +244,11 @@ int trfb_framebuffer_convert(trfb_framebuffer_t *dst, trfb_framebuffer_t *src)
 		dst->height = src->height;
 	}
 
-	if (
-		 dst->bpp == src->bpp &&
-		 dst->rmask == src->rmask &&
-		 dst->gmask == src->gmask &&
-		 dst->bmask == src->bmask &&
-		 dst->rshift == src->rshift &&
-		 dst->gshift == src->gshift &&
-		 dst->bshift == src->bshift
-	   ) { /* Format is the same! */
-		memcpy(dst->pixels, src->pixels, src->width * src->height * dst->bpp);
-		return 0;
+	if (trfb_converter_init(&cv, dst, src)) {
+		return -1;
 	}
 
-	/* Ok, so we need to do it slow way... */
-	/* TODO: it is too slow */
-	for (y = 0; y < src->height; y++) {
-		for (x = 0; x < src->width; x++) {
-			trfb_framebuffer_set_pixel(dst, x, y, trfb_framebuffer_get_pixel(src, x, y));
-		}
-	}
+	trfb_converter_rows(&cv, dst->pixels, dst->width * dst->bpp, src->pixels, src->width * src->bpp, src->width, src->height);
 
 	return 0;
 }
@@ -267,7 +261,7 @@ int trfb_framebuffer_format(trfb_framebuffer_t *fb, trfb_format_t *fmt)
 	}
 
 	fmt->bpp = fb->bpp * 8;
-	fmt->big_endian = isBE();
+	fmt->big_endian = fb->bpp == 1? isBE(): fb->big_endian;
 	if (fb->bpp == 1) {
 		fmt->depth = 8;
 	} else if (fb->bpp == 2) {
@@ -299,7 +293,7 @@ trfb_framebuffer_t* trfb_framebuffer_create_of_format(unsigned width, unsigned h
 		return NULL;
 	}
 
-	if (fmt->bpp != 1 && fmt->bpp != 2 && fmt->bpp != 4) {
+	if (fmt->bpp != 8 && fmt->bpp != 16 && fmt->bpp != 32) {
 		trfb_msg("Invalid format: BPP = %d", fmt->bpp);
 		return NULL;
 	}
@@ -315,6 +309,7 @@ trfb_framebuffer_t* trfb_framebuffer_create_of_format(unsigned width, unsigned h
 	fb->rshift = fmt->rshift;
 	fb->gshift = fmt->gshift;
 	fb->bshift = fmt->bshift;
+	fb->big_endian = fmt->big_endian != 0;
 
 	fb->rnorm = norm_from_mask(fb->rmask);
 	fb->gnorm = norm_from_mask(fb->gmask);
@@ -332,19 +327,33 @@ trfb_framebuffer_t* trfb_framebuffer_create_with_data(void *pixels, unsigned wid
 		return NULL;
 	}
 
-	if (fmt->bpp != 1 && fmt->bpp != 2 && fmt->bpp != 4) {
+	if (fmt->bpp != 8 && fmt->bpp != 16 && fmt->bpp != 32) {
 		trfb_msg("Invalid format: BPP = %d", fmt->bpp);
 		return NULL;
 	}
 
+	if (width > 0xffff || height > 0xffff) {
+		trfb_msg("Trying to create framebuffer of size %ux%u", width, height);
+		return NULL;
+	}
+
 	fb = calloc(1, sizeof(trfb_framebuffer_t));
 	if (!fb) {
 		trfb_msg("Not enought memory");
 		return NULL;
 	}
 
+	if (mtx_init(&fb->lock, mtx_plain) != thrd_success) {
+		free(fb);
+		trfb_msg("Can't create mutex");
+		return NULL;
+	}
+
 	fb->pixels = pixels;
 	fb->free_pixels = 0;
+	fb->width = width;
+	fb->height = height;
+	fb->bpp = fmt->bpp / 8;
 
 	fb->rmask = fmt->rmax;
 	fb->gmask = fmt->gmax;
@@ -352,6 +361,7 @@ trfb_framebuffer_t* trfb_framebuffer_create_with_data(void *pixels, unsigned wid
 	fb->rshift = fmt->rshift;
 	fb->gshift = fmt->gshift;
 	fb->bshift = fmt->bshift;
+	fb->big_endian = fmt->big_endian != 0;
 
 	fb->rnorm = norm_from_mask(fb->rmask);
 	fb->gnorm = norm_from_mask(fb->gmask);
@@ -378,10 +388,9 @@ void trfb_framebuffer_endian(trfb_framebuffer_t *fb, int is_be)
 		return;
 	if (fb->bpp == 1)
 		return;
-	if (isBE() && is_be)
-		return;
-	if (!isBE() && !is_be)
+	if (!fb->big_endian == !is_be)
 		return;
+	fb->big_endian = is_be != 0;
 
 	p = fb->pixels;
 	if (fb->bpp == 2) {
@@ -398,4 +407,24 @@ void trfb_framebuffer_endian(trfb_framebuffer_t *fb, int is_be)
 	}
 }
 
+void trfb_framebuffer_copy_rect(trfb_framebuffer_t *fb, unsigned sx, unsigned sy, unsigned dx, unsigned dy,
+		unsigned width, unsigned height)
+{
+	size_t stride = (size_t)fb->width * fb->bpp;
+	size_t len = (size_t)width * fb->bpp;
+	unsigned char *src = (unsigned char*)fb->pixels + sy * stride + sx * fb->bpp;
+	unsigned char *dst = (unsigned char*)fb->pixels + dy * stride + dx * fb->bpp;
+	unsigned y;
+
+	if (!height || (sx == dx && sy == dy))
+		return;
 
+	/* Rectangles could overlap: copy from the bottom when moving down */
+	if (dy > sy) {
+		for (y = height; y > 0; y--)
+			memmove(dst + (y - 1) * stride, src + (y - 1) * stride, len);
+	} else {
+		for (y = 0; y < height; y++)
+			memmove(dst + y * stride, src + y * stride, len);
+	}
+}
@@ -0,0 +1,415 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Pool of converted framebuffers. Connections with the same format which don't draw cursor into their pixels
+ * need the same converted image, so it is kept once per format. Each tile of image remembers frame its
+ * pixels were converted from: connection converts only tiles of its rectangles which are older than the
+ * current frame, and the next connection finds them ready.
+ *
+ * Image is read by encoders after server framebuffer is unlocked and Raw output references its pixels, so
+ * image referenced by connections is never changed: tiles of newer frame are converted into a copy which
+ * replaces it in pool (copy on write). Old image is kept as spare when the last connection releases it and
+ * the next copy is made in it: pixels of tile depend only on frame they are converted from, so only tiles
+ * whose frames differ are copied and tiles which are converted right after copy are not copied at all.
+ *
+ * Connection which supports CopyRect keeps image of its last update while it is equal to image of client:
+ * it is old image for scroll detection. Image is immutable, so it stays exact until the next update. Tiles
+ * converted meanwhile by other connections are newer, but they differ only in damage of this connection.
+ */
+
+#define TILE 64
+
+struct trfb_shared_fb {
+	trfb_framebuffer_t *fb;
+	trfb_converter_t converter;
+	/* Frame plus one which pixels of tile are converted from (0 if tile was not converted) */
+	unsigned long long *tiles;
+	unsigned tw, th;
+	/* References of pool (while image is current) and of connections */
+	unsigned refs;
+	/* Next spare image of format */
+	trfb_shared_fb_t *next;
+};
+
+/* Images kept for copies per format: connections release old image after the next one is current */
+#define SPARES 2
+
+struct trfb_fbpool_format {
+	trfb_format_t format;
+	/* Connections of this format */
+	unsigned users;
+	trfb_shared_fb_t *current;
+	/* Images nobody reads */
+	trfb_shared_fb_t *spare;
+	unsigned spares;
+	trfb_fbpool_format_t *next;
+};
+
+struct trfb_fbpool {
+	mtx_t lock;
+	trfb_fbpool_format_t *formats;
+};
+
+trfb_fbpool_t* trfb_fbpool_create(void)
+{
+	trfb_fbpool_t *pool;
+
+	pool = calloc(1, sizeof(trfb_fbpool_t));
+	if (!pool)
+		return NULL;
+
+	mtx_init(&pool->lock, mtx_plain);
+
+	return pool;
+}
+
+static void image_free(trfb_shared_fb_t *img)
+{
+	trfb_framebuffer_free(img->fb);
+	free(img->tiles);
+	free(img);
+}
+
+/* Pool must be locked. Image which nobody reads is kept as spare of format pf (if it is not NULL). */
+static void image_unref(trfb_fbpool_format_t *pf, trfb_shared_fb_t *img)
+{
+	if (!img || --img->refs)
+		return;
+
+	if (pf && pf->spares < SPARES) {
+		img->next = pf->spare;
+		pf->spare = img;
+		pf->spares++;
+		return;
+	}
+
+	image_free(img);
+}
+
+/* Pool must be locked */
+static void format_free(trfb_fbpool_format_t *pf)
+{
+	trfb_shared_fb_t *img;
+
+	image_unref(NULL, pf->current);
+	while ((img = pf->spare)) {
+		pf->spare = img->next;
+		image_free(img);
+	}
+	free(pf);
+}
+
+void trfb_fbpool_free(trfb_fbpool_t *pool)
+{
+	trfb_fbpool_format_t *pf;
+
+	if (!pool)
+		return;
+
+	while ((pf = pool->formats)) {
+		pool->formats = pf->next;
+		format_free(pf);
+	}
+
+	mtx_destroy(&pool->lock);
+	free(pool);
+}
+
+static int same_format(const trfb_format_t *a, const trfb_format_t *b)
+{
+	return a->bpp == b->bpp && a->depth == b->depth && a->big_endian == b->big_endian &&
+		a->true_color == b->true_color && a->rmax == b->rmax && a->gmax == b->gmax && a->bmax == b->bmax &&
+		a->rshift == b->rshift && a->gshift == b->gshift && a->bshift == b->bshift;
+}
+
+static trfb_shared_fb_t* image_create(trfb_framebuffer_t *sfb, trfb_format_t *fmt)
+{
+	trfb_shared_fb_t *img;
+
+	img = calloc(1, sizeof(trfb_shared_fb_t));
+	if (!img)
+		return NULL;
+
+	img->tw = (sfb->width + TILE - 1) / TILE;
+	img->th = (sfb->height + TILE - 1) / TILE;
+	img->tiles = calloc((size_t)img->tw * img->th + 1, sizeof(unsigned long long));
+	img->fb = trfb_framebuffer_create_of_format(sfb->width, sfb->height, fmt);
+	if (!img->tiles || !img->fb || trfb_converter_init(&img->converter, img->fb, sfb)) {
+		image_free(img);
+		return NULL;
+	}
+	img->refs = 1;
+
+	return img;
+}
+
+/* Copy pixels of tile x, y */
+static void copy_tile(trfb_framebuffer_t *dst, const trfb_framebuffer_t *src, unsigned x, unsigned y)
+{
+	size_t stride = (size_t)src->width * src->bpp;
+	size_t off = y * stride + (size_t)x * src->bpp;
+	size_t len = (size_t)(src->width - x < TILE? src->width - x: TILE) * src->bpp;
+	unsigned h = src->height - y < TILE? src->height - y: TILE;
+	unsigned i;
+
+	for (i = 0; i < h; i++, off += stride)
+		memcpy((unsigned char*)dst->pixels + off, (const unsigned char*)src->pixels + off, len);
+}
+
+/* Tiles of rectangles which are not converted from frame in src are converted into dst by caller: they get
+ * frame of src without copying */
+static void skip_stale(trfb_shared_fb_t *dst, const trfb_shared_fb_t *src, unsigned long long frame,
+		const trfb_rect_t *rects, int cnt)
+{
+	unsigned tx, ty, k;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (!rects[i].width || !rects[i].height)
+			continue;
+
+		for (ty = rects[i].y / TILE; ty <= (rects[i].y + rects[i].height - 1) / TILE && ty < src->th; ty++) {
+			for (tx = rects[i].x / TILE; tx <= (rects[i].x + rects[i].width - 1) / TILE && tx < src->tw; tx++) {
+				k = ty * src->tw + tx;
+				if (src->tiles[k] != frame + 1)
+					dst->tiles[k] = src->tiles[k];
+			}
+		}
+	}
+}
+
+/* Image equal to src after caller converts stale tiles of rectangles (copied may be NULL). Spare image is
+ * used if there is one of the same size: only tiles of other frames are copied into it. */
+static trfb_shared_fb_t* image_copy(trfb_fbpool_format_t *pf, trfb_shared_fb_t *src, trfb_framebuffer_t *sfb,
+		unsigned long long frame, const trfb_rect_t *rects, int cnt, const trfb_rect_t *copied)
+{
+	trfb_shared_fb_t *img;
+	unsigned tx, ty, k;
+
+	while ((img = pf->spare)) {
+		pf->spare = img->next;
+		pf->spares--;
+		if (img->fb->width == src->fb->width && img->fb->height == src->fb->height)
+			break;
+		image_free(img);
+	}
+
+	if (!img) {
+		img = image_create(sfb, &pf->format);
+		if (!img)
+			return NULL;
+	}
+	img->refs = 1;
+	img->next = NULL;
+
+	skip_stale(img, src, frame, rects, cnt);
+	if (copied)
+		skip_stale(img, src, frame, copied, 1);
+
+	for (ty = 0; ty < src->th; ty++) {
+		for (tx = 0; tx < src->tw; tx++) {
+			k = ty * src->tw + tx;
+			if (img->tiles[k] == src->tiles[k])
+				continue;
+
+			copy_tile(img->fb, src->fb, tx * TILE, ty * TILE);
+			img->tiles[k] = src->tiles[k];
+		}
+	}
+
+	return img;
+}
+
+/* Count tiles which rectangles cover and which are not converted from frame. They are converted from server
+ * framebuffer if sfb is not NULL. */
+static unsigned stale_tiles(trfb_shared_fb_t *img, trfb_framebuffer_t *sfb, unsigned long long frame,
+		const trfb_rect_t *rects, int cnt)
+{
+	unsigned tx, ty, x, y;
+	unsigned n = 0;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (!rects[i].width || !rects[i].height)
+			continue;
+
+		for (ty = rects[i].y / TILE; ty <= (rects[i].y + rects[i].height - 1) / TILE && ty < img->th; ty++) {
+			for (tx = rects[i].x / TILE; tx <= (rects[i].x + rects[i].width - 1) / TILE && tx < img->tw; tx++) {
+				if (img->tiles[ty * img->tw + tx] == frame + 1)
+					continue;
+
+				n++;
+				if (!sfb)
+					continue;
+
+				x = tx * TILE;
+				y = ty * TILE;
+				trfb_converter_rect(&img->converter, img->fb, sfb, x, y,
+						sfb->width - x < TILE? sfb->width - x: TILE,
+						sfb->height - y < TILE? sfb->height - y: TILE);
+				img->tiles[ty * img->tw + tx] = frame + 1;
+			}
+		}
+	}
+
+	return n;
+}
+
+/* Pool must be locked */
+static void leave(trfb_fbpool_t *pool, trfb_fbpool_format_t *pf)
+{
+	trfb_fbpool_format_t **p;
+
+	if (--pf->users)
+		return;
+
+	for (p = &pool->formats; *p; p = &(*p)->next) {
+		if (*p == pf) {
+			*p = pf->next;
+			break;
+		}
+	}
+
+	format_free(pf);
+}
+
+int trfb_connection_pool_users(trfb_connection_t *con)
+{
+	trfb_fbpool_t *pool = con->server->fbpool;
+	trfb_fbpool_format_t *pf = con->pool_format;
+	int users;
+
+	/* Image of previous format is not image of client */
+	if (pf && !same_format(&pf->format, &con->format)) {
+		trfb_connection_release_fb(con);
+		con->fb_stale = 1;
+	}
+
+	mtx_lock(&pool->lock);
+	if (pf && !same_format(&pf->format, &con->format)) {
+		leave(pool, pf);
+		pf = NULL;
+	}
+
+	if (!pf) {
+		for (pf = pool->formats; pf; pf = pf->next)
+			if (same_format(&pf->format, &con->format))
+				break;
+
+		if (!pf) {
+			pf = calloc(1, sizeof(trfb_fbpool_format_t));
+			if (!pf) {
+				mtx_unlock(&pool->lock);
+				con->pool_format = NULL;
+				trfb_msg("[%s] Not enought memory", con->name);
+				return -1;
+			}
+			pf->format = con->format;
+			pf->next = pool->formats;
+			pool->formats = pf;
+		}
+		pf->users++;
+	}
+	con->pool_format = pf;
+	users = pf->users;
+	mtx_unlock(&pool->lock);
+
+	return users;
+}
+
+int trfb_connection_share_fb(trfb_connection_t *con, unsigned long long frame, const trfb_rect_t *rects, int cnt,
+		const trfb_rect_t *copied)
+{
+	trfb_fbpool_t *pool = con->server->fbpool;
+	trfb_fbpool_format_t *pf = con->pool_format;
+	trfb_framebuffer_t *sfb = con->server->fb;
+	trfb_shared_fb_t *img, *copy;
+
+	mtx_lock(&pool->lock);
+	img = pf->current;
+	if (img && (img->fb->width != sfb->width || img->fb->height != sfb->height)) {
+		image_unref(pf, img);
+		img = pf->current = NULL;
+	}
+
+	if (!img) {
+		img = pf->current = image_create(sfb, &con->format);
+	} else if (img->refs > 1 && (stale_tiles(img, NULL, frame, rects, cnt) ||
+				(copied && stale_tiles(img, NULL, frame, copied, 1)))) {
+		/* Other connections could read image right now */
+		copy = image_copy(pf, img, sfb, frame, rects, cnt, copied);
+		if (copy) {
+			image_unref(pf, img);
+			img = pf->current = copy;
+		} else {
+			img = NULL;
+		}
+	}
+
+	if (!img) {
+		mtx_unlock(&pool->lock);
+		trfb_msg("[%s] Can not create shared framebuffer", con->name);
+		return -1;
+	}
+	img->refs++;
+	image_unref(pf, con->shared_fb);
+	mtx_unlock(&pool->lock);
+
+	/* Nobody else reads stale tiles: they are changed only while server framebuffer is locked. Copied
+	 * pixels are converted too: image must be equal to image of client after update. */
+	stale_tiles(img, sfb, frame, rects, cnt);
+	if (copied)
+		stale_tiles(img, sfb, frame, copied, 1);
+
+	con->shared_fb = img;
+	con->shared_fb_ref = 0;
+	con->fb = img->fb;
+
+	return 0;
+}
+
+int trfb_connection_shared_scroll(trfb_connection_t *con, trfb_rect_t **rects, int *rects_cnt,
+		trfb_rect_t *dst, unsigned *sx, unsigned *sy)
+{
+	int rv;
+
+	/* Image is only read: converter of image converts server pixels to compare them */
+	con->converter = &con->shared_fb->converter;
+	rv = trfb_connection_find_scroll(con, rects, rects_cnt, dst, sx, sy);
+	con->converter = NULL;
+
+	return rv;
+}
+
+void trfb_connection_release_fb(trfb_connection_t *con)
+{
+	trfb_fbpool_t *pool = con->server->fbpool;
+
+	if (!con->shared_fb)
+		return;
+
+	mtx_lock(&pool->lock);
+	image_unref(con->pool_format, con->shared_fb);
+	mtx_unlock(&pool->lock);
+
+	con->shared_fb = NULL;
+	con->shared_fb_ref = 0;
+	con->fb = NULL;
+}
+
+void trfb_connection_leave_pool(trfb_connection_t *con)
+{
+	trfb_fbpool_t *pool = con->server->fbpool;
+
+	trfb_connection_release_fb(con);
+	if (!con->pool_format)
+		return;
+
+	mtx_lock(&pool->lock);
+	leave(pool, con->pool_format);
+	mtx_unlock(&pool->lock);
+
+	con->pool_format = NULL;
+}
@@ -0,0 +1,127 @@
+#include <trfb.h>
+#include <string.h>
+
+/*
+ * Flow control of continuous updates. Client doesn't request updates so server must know how much data
+ * the link could take: fence request is sent after each continuous update and client answers it when
+ * everything before it is processed. Response gives round trip time and acknowledges data queued before
+ * the fence.
+ *
+ * Window of data in flight is delay based: it grows while round trip time stays near the minimum and
+ * shrinks when it grows (data waits in buffers of the link).
+ */
+
+#define WINDOW_MIN (16 * 1024)
+#define WINDOW_START (128 * 1024)
+#define WINDOW_MAX (32 * 1024 * 1024)
+/* Round trip time is not increased by queues if it is less than rtt_min * 3 / 2 + RTT_SLACK */
+#define RTT_SLACK 0.005
+
+int trfb_connection_fence(trfb_connection_t *con, uint32_t flags, const void *data, unsigned len)
+{
+	unsigned char buf[9 + 64];
+
+	if (len > 64) {
+		trfb_msg("[%s] Fence data is too long", con->name);
+		return -1;
+	}
+
+	buf[0] = 248; /* ServerFence */
+	buf[1] = buf[2] = buf[3] = 0;
+	buf[4] = flags >> 24;
+	buf[5] = flags >> 16;
+	buf[6] = flags >> 8;
+	buf[7] = flags;
+	buf[8] = len;
+	if (len)
+		memcpy(buf + 9, data, len);
+
+	return trfb_connection_queue(con, buf, 9 + len);
+}
+
+int trfb_connection_fence_ping(trfb_connection_t *con)
+{
+	trfb_fence_t *f;
+	unsigned char data[4];
+
+	if (!trfb_connection_has_encoding(con, TRFB_ENCODING_FENCE) || con->fences_cnt >= TRFB_MAX_FENCES)
+		return 0;
+
+	if (!con->window)
+		con->window = WINDOW_START;
+
+	f = con->fences + (con->fences_first + con->fences_cnt) % TRFB_MAX_FENCES;
+	f->id = ++con->fence_id;
+	f->time = trfb_client_time();
+	f->queued = con->queued;
+	con->fences_cnt++;
+
+	data[0] = f->id >> 24;
+	data[1] = f->id >> 16;
+	data[2] = f->id >> 8;
+	data[3] = f->id;
+
+	/* Fence is counted as acknowledged data too */
+	f->queued += 9 + sizeof(data);
+
+	return trfb_connection_fence(con, TRFB_FENCE_REQUEST, data, sizeof(data));
+}
+
+void trfb_connection_fence_response(trfb_connection_t *con, const unsigned char *data, unsigned len)
+{
+	trfb_fence_t *f;
+	uint32_t id;
+	double rtt;
+	unsigned i;
+
+	/* Response to the fence sent on SetEncodings or not ours */
+	if (len != 4)
+		return;
+
+	id = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+
+	/* Responses come in order of requests: earlier fences are answered too */
+	for (i = 0; i < con->fences_cnt; i++)
+		if (con->fences[(con->fences_first + i) % TRFB_MAX_FENCES].id == id)
+			break;
+
+	if (i == con->fences_cnt)
+		return;
+
+	f = con->fences + (con->fences_first + i) % TRFB_MAX_FENCES;
+	con->fences_first = (con->fences_first + i + 1) % TRFB_MAX_FENCES;
+	con->fences_cnt -= i + 1;
+
+	con->acked = f->queued;
+	rtt = trfb_client_time() - f->time;
+	con->rtt = rtt;
+	if (!con->rtt_min || rtt < con->rtt_min)
+		con->rtt_min = rtt;
+
+	if (rtt > con->rtt_min * 2 + RTT_SLACK) {
+		/* Link buffers are filled */
+		con->window = con->window * 3 / 4;
+		if (con->window < WINDOW_MIN)
+			con->window = WINDOW_MIN;
+	} else if (con->window_limited && rtt < con->rtt_min * 3 / 2 + RTT_SLACK) {
+		/* Window is not big enought to fill the link */
+		con->window *= 2;
+		if (con->window > WINDOW_MAX)
+			con->window = WINDOW_MAX;
+	}
+	con->window_limited = 0;
+}
+
+int trfb_connection_congested(trfb_connection_t *con)
+{
+	/* Data without fences after it could not be acknowledged */
+	if (!con->fences_cnt)
+		return 0;
+
+	if (con->fences_cnt < TRFB_MAX_FENCES && con->queued - con->acked <= con->window)
+		return 0;
+
+	con->window_limited = 1;
+
+	return 1;
+}
@@ -0,0 +1,565 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Hextile encoding: rectangle is split to 16x16 tiles. Every tile is solid, background with subrectangles
+ * of one or many colours or raw. Background and foreground are sent only when they change.
+ *
+ * Tile is classified first (one, two or more colours) by comparing its rows with one or two pixel values.
+ * Rows of tile are short (not more than 64 bytes) so SSE2/NEON compares are used, AVX2 does not pay off.
+ */
+
+#define TILE 16
+
+#define HEXTILE_RAW         0x01
+#define HEXTILE_BACKGROUND  0x02
+#define HEXTILE_FOREGROUND  0x04
+#define HEXTILE_SUBRECTS    0x08
+#define HEXTILE_COLOURED    0x10
+
+/* Subencoding, background, foreground, count of subrectangles and subrectangles */
+#define TILE_MAX (1 + 4 + 4 + 1 + TILE * TILE * (4 + 2))
+/* Tiles are collected to buffer: one queue call per tile costs more than encoding of solid tile */
+#define OUT_BUF (16 * TILE_MAX)
+
+/* Compare w x h pixels with values a and b. Returns count of pixels equal to a or -1 if some pixel differs from both. */
+typedef int (*match_fn)(const unsigned char *p, size_t stride, unsigned w, unsigned h, uint32_t a, uint32_t b);
+
+#define MATCH_SCALAR(bpp, type) \
+static inline int match_row_##bpp(const unsigned char *p, unsigned n, uint32_t a, uint32_t b) \
+{ \
+	const type *s = (const type*)p; \
+	unsigned i; \
+	int cnt = 0; \
+ \
+	for (i = 0; i < n; i++) { \
+		if (s[i] == (type)a) \
+			cnt++; \
+		else if (s[i] != (type)b) \
+			return -1; \
+	} \
+ \
+	return cnt; \
+} \
+ \
+static int match_scalar_##bpp(const unsigned char *p, size_t stride, unsigned w, unsigned h, uint32_t a, uint32_t b) \
+{ \
+	unsigned y; \
+	int cnt = 0; \
+	int r; \
+ \
+	for (y = 0; y < h; y++, p += stride) { \
+		r = match_row_##bpp(p, w, a, b); \
+		if (r < 0) \
+			return -1; \
+		cnt += r; \
+	} \
+ \
+	return cnt; \
+}
+
+MATCH_SCALAR(1, uint8_t)
+MATCH_SCALAR(2, uint16_t)
+MATCH_SCALAR(4, uint32_t)
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define MATCH_SSE2(bpp, bits, type) \
+__attribute__((target("sse2"))) \
+static int match_sse2_##bpp(const unsigned char *p, size_t stride, unsigned w, unsigned h, uint32_t a, uint32_t b) \
+{ \
+	__m128i va = _mm_set1_epi##bits((type)a); \
+	__m128i vb = _mm_set1_epi##bits((type)b); \
+	__m128i d, ea; \
+	unsigned i, y; \
+	int cnt = 0; \
+	int r; \
+ \
+	for (y = 0; y < h; y++, p += stride) { \
+		for (i = 0; i + 16 / bpp <= w; i += 16 / bpp) { \
+			d = _mm_loadu_si128((const __m128i*)(p + i * bpp)); \
+			ea = _mm_cmpeq_epi##bits(d, va); \
+			if (_mm_movemask_epi8(_mm_or_si128(ea, _mm_cmpeq_epi##bits(d, vb))) != 0xffff) \
+				return -1; \
+			cnt += __builtin_popcount(_mm_movemask_epi8(ea)) / bpp; \
+		} \
+ \
+		if (i < w) { \
+			r = match_row_##bpp(p + i * bpp, w - i, a, b); \
+			if (r < 0) \
+				return -1; \
+			cnt += r; \
+		} \
+	} \
+ \
+	return cnt; \
+}
+
+MATCH_SSE2(1, 8, char)
+MATCH_SSE2(2, 16, short)
+MATCH_SSE2(4, 32, int)
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__aarch64__)
+#include <arm_neon.h>
+
+/* Lanes of NEON compare results are all ones: count is sum of (lane & 1) */
+#define MATCH_NEON(bpp, bits, lanes) \
+static int match_neon_##bpp(const unsigned char *p, size_t stride, unsigned w, unsigned h, uint32_t a, uint32_t b) \
+{ \
+	uint##bits##x##lanes##_t va = vdupq_n_u##bits(a); \
+	uint##bits##x##lanes##_t vb = vdupq_n_u##bits(b); \
+	uint##bits##x##lanes##_t d, ea; \
+	unsigned i, y; \
+	int cnt = 0; \
+	int r; \
+ \
+	for (y = 0; y < h; y++, p += stride) { \
+		for (i = 0; i + lanes <= w; i += lanes) { \
+			d = vld1q_u##bits((const uint##bits##_t*)(p + i * bpp)); \
+			ea = vceqq_u##bits(d, va); \
+			if (vminvq_u##bits(vorrq_u##bits(ea, vceqq_u##bits(d, vb))) != (uint##bits##_t)~0u) \
+				return -1; \
+			cnt += vaddvq_u##bits(vandq_u##bits(ea, vdupq_n_u##bits(1))); \
+		} \
+ \
+		if (i < w) { \
+			r = match_row_##bpp(p + i * bpp, w - i, a, b); \
+			if (r < 0) \
+				return -1; \
+			cnt += r; \
+		} \
+	} \
+ \
+	return cnt; \
+}
+
+MATCH_NEON(1, 8, 16)
+MATCH_NEON(2, 16, 8)
+MATCH_NEON(4, 32, 4)
+#endif
+
+static match_fn get_match(unsigned bpp)
+{
+	match_fn m[3] = { match_scalar_1, match_scalar_2, match_scalar_4 };
+	unsigned f = trfb_cpu_features();
+
+	(void)f;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	if (f & TRFB_CPU_SSE2) {
+		m[0] = match_sse2_1;
+		m[1] = match_sse2_2;
+		m[2] = match_sse2_4;
+	}
+#endif
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__aarch64__)
+	if (f & TRFB_CPU_NEON) {
+		m[0] = match_neon_1;
+		m[1] = match_neon_2;
+		m[2] = match_neon_4;
+	}
+#endif
+
+	return m[bpp / 2];
+}
+
+static inline uint32_t get_pixel(const unsigned char *p, unsigned bpp)
+{
+	uint16_t v16;
+	uint32_t v32;
+
+	if (bpp == 1)
+		return *p;
+
+	if (bpp == 2) {
+		memcpy(&v16, p, 2);
+		return v16;
+	}
+
+	memcpy(&v32, p, 4);
+	return v32;
+}
+
+/* Pixel is written in the same byte order as it is stored in framebuffer */
+static inline unsigned char* put_pixel(unsigned char *p, uint32_t c, unsigned bpp)
+{
+	uint16_t v16 = c;
+
+	if (bpp == 1)
+		*p = c;
+	else if (bpp == 2)
+		memcpy(p, &v16, 2);
+	else
+		memcpy(p, &c, 4);
+
+	return p + bpp;
+}
+
+/* Returns count of colours in tile (1, 2 or 3 for more). c[0] is the first pixel, c[1] is the other colour.
+ * *n0 is set to count of pixels of colour c[0] if there are not more than 2 colours. */
+static unsigned tile_colours(match_fn match, const unsigned char *p, size_t stride, unsigned w, unsigned h,
+		unsigned bpp, uint32_t *c, unsigned *n0)
+{
+	unsigned x = 0, y;
+	int r;
+
+	c[0] = get_pixel(p, bpp);
+	if (match(p, stride, w, h, c[0], c[0]) >= 0) {
+		*n0 = w * h;
+		return 1;
+	}
+
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+			if (get_pixel(p + y * stride + x * bpp, bpp) != c[0])
+				goto found;
+found:
+	c[1] = get_pixel(p + y * stride + x * bpp, bpp);
+
+	r = match(p, stride, w, h, c[0], c[1]);
+	if (r < 0)
+		return 3;
+
+	*n0 = r;
+
+	return 2;
+}
+
+/* Write subrectangles of tile pixels px which are not bg. Returns length or -1 if it is longer than max. */
+static int subrects(const uint32_t *px, unsigned w, unsigned h, uint32_t bg, int coloured, unsigned bpp,
+		unsigned char *out, size_t max)
+{
+	unsigned char done[TILE * TILE];
+	unsigned char *p = out;
+	unsigned x, y, i, j;
+	unsigned hw, hh, vw, vh, rw, rh;
+	size_t len = coloured? bpp + 2: 2;
+	uint32_t c;
+
+	memset(done, 0, sizeof(done));
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			c = px[y * w + x];
+			if (c == bg || done[y * w + x])
+				continue;
+
+			if ((size_t)(p - out) + len > max)
+				return -1;
+
+			/* The widest run extended down and the highest run extended right: the bigger one is used.
+			 * Subrectangles could overlap with previous ones of the same colour. */
+			for (i = x + 1; i < w && px[y * w + i] == c; i++)
+				;
+			hw = i - x;
+			for (j = y + 1; j < h; j++) {
+				for (i = x; i < x + hw && px[j * w + i] == c; i++)
+					;
+				if (i < x + hw)
+					break;
+			}
+			hh = j - y;
+
+			for (j = y + 1; j < h && px[j * w + x] == c; j++)
+				;
+			vh = j - y;
+			for (i = x + 1; i < w; i++) {
+				for (j = y; j < y + vh && px[j * w + i] == c; j++)
+					;
+				if (j < y + vh)
+					break;
+			}
+			vw = i - x;
+
+			if (hw * hh >= vw * vh) {
+				rw = hw;
+				rh = hh;
+			} else {
+				rw = vw;
+				rh = vh;
+			}
+
+			for (j = y; j < y + rh; j++)
+				memset(done + j * w + x, 1, rw);
+
+			if (coloured)
+				p = put_pixel(p, c, bpp);
+			*p++ = (x << 4) | y;
+			*p++ = ((rw - 1) << 4) | (rh - 1);
+		}
+	}
+
+	return p - out;
+}
+
+typedef struct hextile_colours {
+	uint32_t bg, fg;
+	int bg_valid, fg_valid;
+} hextile_colours_t;
+
+/* Encode one tile to out. Returns length. */
+static size_t encode_tile(match_fn match, const unsigned char *p, size_t stride, unsigned w, unsigned h, unsigned bpp,
+		hextile_colours_t *st, unsigned char *out)
+{
+	uint32_t px[TILE * TILE];
+	uint32_t c[2];
+	uint32_t bg, fg = 0;
+	unsigned char *o = out + 1;
+	unsigned char flags = 0;
+	size_t raw = (size_t)w * h * bpp;
+	unsigned colours, n0, x, y, hruns, vruns;
+	int coloured, l;
+
+	colours = tile_colours(match, p, stride, w, h, bpp, c, &n0);
+
+	/* The most frequent colour is background when there are two colours */
+	if (colours == 2 && n0 < w * h - n0) {
+		bg = c[1];
+		fg = c[0];
+	} else {
+		bg = c[0];
+		fg = c[1];
+	}
+
+	if (!st->bg_valid || st->bg != bg) {
+		flags |= HEXTILE_BACKGROUND;
+		o = put_pixel(o, bg, bpp);
+	}
+
+	if (colours == 1)
+		goto done;
+
+	coloured = colours > 2;
+	if (!coloured && (!st->fg_valid || st->fg != fg)) {
+		flags |= HEXTILE_FOREGROUND;
+		o = put_pixel(o, fg, bpp);
+	}
+
+	/* Horizontal and vertical runs of pixels: when both are many there will be too many subrectangles.
+	 * So noisy tiles are sent raw without search of subrectangles. */
+	hruns = vruns = 0;
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			px[y * w + x] = get_pixel(p + y * stride + x * bpp, bpp);
+			hruns += x == 0 || px[y * w + x] != px[y * w + x - 1];
+			vruns += y == 0 || px[y * w + x] != px[(y - 1) * w + x];
+		}
+	}
+
+	/* Count of subrectangles is written when we know it */
+	l = -1;
+	if ((size_t)(o - out) + 1 < raw && (size_t)(hruns < vruns? hruns: vruns) * (coloured? bpp + 2: 2) <= raw)
+		l = subrects(px, w, h, bg, coloured, bpp, o + 1, raw - (o - out) - 1);
+
+	if (l < 0) {
+		/* Raw tile: background and foreground are not defined after it */
+		out[0] = HEXTILE_RAW;
+		o = out + 1;
+		for (y = 0; y < h; y++, o += w * bpp)
+			memcpy(o, p + y * stride, w * bpp);
+		st->bg_valid = 0;
+		st->fg_valid = 0;
+		return o - out;
+	}
+
+	flags |= HEXTILE_SUBRECTS;
+	if (coloured)
+		flags |= HEXTILE_COLOURED;
+	*o = l / (coloured? bpp + 2: 2);
+	o += 1 + l;
+
+	if (coloured) {
+		st->fg_valid = 0;
+	} else {
+		st->fg = fg;
+		st->fg_valid = 1;
+	}
+
+done:
+	st->bg = bg;
+	st->bg_valid = 1;
+	out[0] = flags;
+
+	return o - out;
+}
+
+/* Tile of one colour is one byte, two-colour tile has colours and about 16 subrectangles, others are raw.
+ * Classification of tiles is a quarter of byte per pixel and decoding is a copy. */
+static size_t hextile_estimate(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	unsigned bpp = con->format.bpp / 8;
+	unsigned solid, two;
+
+	trfb_connection_content(con, &solid, &two);
+
+	return (double)width * height / 256 *
+		(solid + two * (2.0 * bpp + 34) + (1000 - solid - two) * (1.0 + 256 * bpp) + 64 * 1000) / 1000;
+}
+
+static int hextile_encode(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	trfb_framebuffer_t *fb = con->fb;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	const unsigned char *p;
+	unsigned char out[OUT_BUF];
+	hextile_colours_t st;
+	match_fn match = get_match(fb->bpp);
+	unsigned tx, ty, tw, th;
+	size_t len = 0;
+
+	if (trfb_connection_rect_header(con, x, y, width, height, TRFB_ENCODING_HEXTILE))
+		return -1;
+
+	memset(&st, 0, sizeof(st));
+	for (ty = y; ty < y + height; ty += TILE) {
+		th = y + height - ty < TILE? y + height - ty: TILE;
+		for (tx = x; tx < x + width; tx += TILE) {
+			tw = x + width - tx < TILE? x + width - tx: TILE;
+			p = (const unsigned char*)fb->pixels + ty * stride + tx * fb->bpp;
+			len += encode_tile(match, p, stride, tw, th, fb->bpp, &st, out + len);
+			if (len > OUT_BUF - TILE_MAX) {
+				if (trfb_connection_queue(con, out, len))
+					return -1;
+				len = 0;
+			}
+		}
+	}
+
+	return trfb_connection_queue(con, out, len);
+}
+
+const trfb_encoder_t trfb_encoder_hextile = {
+	TRFB_ENCODING_HEXTILE,
+	"Hextile",
+	0, 0,
+	NULL,
+	NULL,
+	hextile_estimate,
+	hextile_encode,
+	TRFB_ENCODER_SHARED
+};
+
+/* Decoder: progress (cl->rect_row) is the index of the next tile */
+static void* hextile_create(trfb_client_t *cl)
+{
+	return calloc(1, sizeof(hextile_colours_t));
+}
+
+static void hextile_destroy(void *state)
+{
+	free(state);
+}
+
+static void fill(trfb_framebuffer_t *fb, unsigned x, unsigned y, unsigned w, unsigned h, uint32_t c)
+{
+	size_t stride = (size_t)fb->width * fb->bpp;
+	unsigned char *p = (unsigned char*)fb->pixels + y * stride + x * fb->bpp;
+	unsigned i, j;
+
+	for (j = 0; j < h; j++, p += stride)
+		for (i = 0; i < w; i++)
+			put_pixel(p + i * fb->bpp, c, fb->bpp);
+}
+
+static ssize_t hextile_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	hextile_colours_t *st = state;
+	trfb_framebuffer_t *fb = cl->fb;
+	unsigned bpp = fb->bpp;
+	unsigned cols = (cl->rect.width + TILE - 1) / TILE;
+	unsigned tiles = cols * ((cl->rect.height + TILE - 1) / TILE);
+	size_t stride = (size_t)fb->width * bpp;
+	const unsigned char *p;
+	size_t pos = 0;
+	size_t l;
+	unsigned tx, ty, tw, th, n, i, sx, sy;
+	unsigned char flags;
+	uint32_t c;
+
+	for (; cl->rect_row < tiles; cl->rect_row++) {
+		tx = cl->rect.x + (cl->rect_row % cols) * TILE;
+		ty = cl->rect.y + (cl->rect_row / cols) * TILE;
+		tw = cl->rect.x + cl->rect.width - tx < TILE? cl->rect.x + cl->rect.width - tx: TILE;
+		th = cl->rect.y + cl->rect.height - ty < TILE? cl->rect.y + cl->rect.height - ty: TILE;
+
+		/* Length of tile */
+		p = buf + pos;
+		if (len - pos < 1) {
+			*need = 1;
+			return pos;
+		}
+
+		flags = p[0];
+		l = 1;
+		if (flags & HEXTILE_RAW) {
+			l += (size_t)tw * th * bpp;
+		} else {
+			if (flags & HEXTILE_BACKGROUND)
+				l += bpp;
+			if (flags & HEXTILE_FOREGROUND)
+				l += bpp;
+			if (flags & HEXTILE_SUBRECTS) {
+				if (len - pos < l + 1) {
+					*need = l + 1;
+					return pos;
+				}
+				l += 1 + p[l] * ((flags & HEXTILE_COLOURED)? bpp + 2: 2);
+			}
+		}
+
+		if (len - pos < l) {
+			*need = l;
+			return pos;
+		}
+		pos += l;
+
+		if (flags & HEXTILE_RAW) {
+			for (i = 0, p++; i < th; i++, p += tw * bpp)
+				memcpy((unsigned char*)fb->pixels + (ty + i) * stride + tx * bpp, p, tw * bpp);
+			continue;
+		}
+
+		p++;
+		if (flags & HEXTILE_BACKGROUND) {
+			st->bg = get_pixel(p, bpp);
+			p += bpp;
+		}
+		if (flags & HEXTILE_FOREGROUND) {
+			st->fg = get_pixel(p, bpp);
+			p += bpp;
+		}
+		fill(fb, tx, ty, tw, th, st->bg);
+
+		if (!(flags & HEXTILE_SUBRECTS))
+			continue;
+
+		for (n = *p++; n; n--) {
+			c = st->fg;
+			if (flags & HEXTILE_COLOURED) {
+				c = get_pixel(p, bpp);
+				p += bpp;
+			}
+			sx = p[0] >> 4;
+			sy = p[0] & 15;
+			if (sx + (p[1] >> 4) + 1 > tw || sy + (p[1] & 15) + 1 > th) {
+				trfb_msg("[%s] Hextile subrectangle is out of tile", cl->name);
+				return -1;
+			}
+			fill(fb, tx + sx, ty + sy, (p[1] >> 4) + 1, (p[1] & 15) + 1, c);
+			p += 2;
+		}
+	}
+
+	*need = 0;
+
+	return pos;
+}
+
+const trfb_decoder_t trfb_decoder_hextile = {
+	TRFB_ENCODING_HEXTILE,
+	"Hextile",
+	hextile_create,
+	hextile_destroy,
+	hextile_decode
+};
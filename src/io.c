@@ -1,13 +1,28 @@
 #include <trfb.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+#endif
+
+/* Maximum count of chunks sent by one writev call (Linux limit) */
+#define IO_BATCH 1024
+/* Smaller sends are copied anyway: zero-copy doesn't worth it */
+#define IO_ZEROCOPY_MIN 65536
 
 static void sock_free(void *ctx);
 static ssize_t sock_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout);
 static ssize_t sock_write(trfb_io_t *io, const void *buf, ssize_t len, unsigned timeout);
+static ssize_t sock_writev(trfb_io_t *io, const struct iovec *iov, int cnt, unsigned flags, unsigned timeout);
+static int sock_complete(trfb_io_t *io, unsigned timeout);
 trfb_io_t* trfb_io_socket_wrap(int sock)
 {
 	trfb_io_t *io;
@@ -23,9 +38,23 @@ trfb_io_t* trfb_io_socket_wrap(int sock)
 		return NULL;
 	}
 
+	io->rbuf = malloc(TRFB_BUFSIZ);
+	io->wbuf = malloc(TRFB_BUFSIZ);
+	if (!io->rbuf || !io->wbuf) {
+		free(io->rbuf);
+		free(io->wbuf);
+		free(io->ctx);
+		free(io);
+		return NULL;
+	}
+	io->rsize = TRFB_BUFSIZ;
+	io->wsize = TRFB_BUFSIZ;
+
 	*((int*)io->ctx) = sock;
 	io->read = sock_read;
 	io->write = sock_write;
+	io->writev = sock_writev;
+	io->complete = sock_complete;
 	io->free = sock_free;
 	io->error = 0;
 
@@ -46,7 +75,11 @@ ssize_t trfb_io_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout)
 	}
 
 	if (io->rpos >= io->rlen) {
-		l = io->read(io, io->rbuf, TRFB_BUFSIZ, timeout);
+		/* Large reads don't need buffering */
+		if ((size_t)len >= io->rsize)
+			return io->read(io, buf, len, timeout);
+
+		l = io->read(io, io->rbuf, io->rsize, timeout);
 		if (l <= 0)
 			return l; /* We can not read data (error or timeout) */
 		io->rpos = 0;
@@ -67,11 +100,60 @@ ssize_t trfb_io_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout)
 	return l;
 }
 
+/* Copy data to free space of write ring. Returns count of bytes copied. */
+static size_t ring_put(trfb_io_t *io, const void *buf, size_t len)
+{
+	size_t off = io->wlen & (io->wsize - 1);
+	size_t l;
+
+	if (len > io->wsize - (io->wlen - io->wtail))
+		len = io->wsize - (io->wlen - io->wtail);
+
+	l = io->wsize - off;
+	if (l > len)
+		l = len;
+	memcpy(io->wbuf + off, buf, l);
+	memcpy(io->wbuf, (const unsigned char*)buf + l, len - l);
+	io->wlen += len;
+
+	return len;
+}
+
+/* Change size of write ring. Positions of unsent bytes are not changed. */
+static int ring_resize(trfb_io_t *io, size_t size)
+{
+	unsigned char *p;
+	size_t pos, l, n;
+
+	p = malloc(size);
+	if (!p) {
+		io->error = ENOMEM;
+		return -1;
+	}
+
+	for (pos = io->wtail; pos < io->wlen; pos += l) {
+		/* Longest part which is contiguous in both rings */
+		l = io->wlen - pos;
+		n = io->wsize - (pos & (io->wsize - 1));
+		if (l > n)
+			l = n;
+		n = size - (pos & (size - 1));
+		if (l > n)
+			l = n;
+		memcpy(p + (pos & (size - 1)), io->wbuf + (pos & (io->wsize - 1)), l);
+	}
+
+	free(io->wbuf);
+	io->wbuf = p;
+	io->wsize = size;
+
+	return 0;
+}
+
 ssize_t trfb_io_write(trfb_io_t *io, const void *buf, ssize_t len, unsigned timeout)
 {
 	const unsigned char *p = buf;
-	ssize_t pos = 0;
-	ssize_t l;
+	ssize_t pos;
 
 	if (!io) {
 		return -1;
@@ -82,39 +164,67 @@ ssize_t trfb_io_write(trfb_io_t *io, const void *buf, ssize_t len, unsigned time
 		return -1;
 	}
 
-	if (io->wlen < TRFB_BUFSIZ) { /* We have got some place here */
-		pos = TRFB_BUFSIZ - io->wlen; /* free space */
-		if (pos > len)
-			pos = len;
-		memcpy(io->wbuf + io->wlen, buf, pos);
-		io->wlen += pos;
-
-		if (pos == len) { /* We have written all the data! */
-			return len;
-		}
+	pos = ring_put(io, buf, len);
+	if (pos == len) { /* We have written all the data! */
+		return len;
 	}
 
 	if (trfb_io_flush(io, timeout) < 0) { /* It is error! */
 		return -1;
 	}
 
-	if (io->wlen < TRFB_BUFSIZ) { /* We could write some data! */
-		l = TRFB_BUFSIZ - io->wlen;
-		if (l > len - pos)
-			l = len - pos;
-		memcpy(io->wbuf + io->wlen, p + pos, l);
-		io->wlen += l;
-		pos += l;
-	}
+	/* Space of sent part of the queue could be used even if it is not sent completely */
+	pos += ring_put(io, p + pos, len - pos);
 
 	return pos;
 }
 
+int trfb_io_set_buffers(trfb_io_t *io, size_t rsize, size_t wsize)
+{
+	unsigned char *p;
+	size_t sz;
+
+	if (!io) {
+		return -1;
+	}
+
+	if (rsize && rsize != io->rsize) {
+		if (rsize < io->rlen - io->rpos)
+			rsize = io->rlen - io->rpos;
+
+		p = malloc(rsize);
+		if (!p) {
+			io->error = ENOMEM;
+			return -1;
+		}
+
+		if (io->rlen > io->rpos)
+			memcpy(p, io->rbuf + io->rpos, io->rlen - io->rpos);
+		io->rlen -= io->rpos;
+		io->rpos = 0;
+		free(io->rbuf);
+		io->rbuf = p;
+		io->rsize = rsize;
+	}
+
+	if (wsize) {
+		for (sz = 1; sz < wsize || sz < io->wlen - io->wtail; sz *= 2)
+			;
+		if (sz != io->wsize && ring_resize(io, sz))
+			return -1;
+	}
+
+	return 0;
+}
+
 void trfb_io_free(trfb_io_t *io)
 {
 	if (io) {
 		if (io->free)
 			io->free(io->ctx);
+		free(io->rbuf);
+		free(io->wbuf);
+		free(io->chunks);
 		memset(io, 0, sizeof(trfb_io_t));
 		free(io);
 	}
@@ -130,33 +240,22 @@ static void sock_free(void *ctx)
 	free(ctx);
 }
 
-static ssize_t sock_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout)
+/* Wait until socket is ready for reading or writing. Returns 1 if it is ready, 0 on timeout and -1 on error. */
+static int sock_wait(trfb_io_t *io, int sock, int wr, unsigned timeout)
 {
 	int rv;
-	fd_set fds;
-	int *sock;
-	struct timeval tv;
-	ssize_t sz;
+	struct pollfd pfd;
 
-	if (!io->ctx) {
-		io->error = EINVAL;
-		return -1;
-	}
-
-	sock = io->ctx;
+	if (io->flags & TRFB_IO_NONBLOCK)
+		return 1; /* Socket is non-blocking so we don't need to wait */
 
+	/* poll() because select() can't handle descriptors above FD_SETSIZE */
 	do {
-		FD_ZERO(&fds);
-		FD_SET(*sock, &fds);
+		pfd.fd = sock;
+		pfd.events = wr? POLLOUT: POLLIN;
+		pfd.revents = 0;
 
-		if (timeout) {
-			tv.tv_sec = timeout / 1000;
-			tv.tv_usec = 1000 * (timeout % 1000);
-
-			rv = select(*sock + 1, &fds, NULL, NULL, &tv);
-		} else {
-			rv = select(*sock + 1, &fds, NULL, NULL, NULL);
-		}
+		rv = poll(&pfd, 1, timeout? (int)timeout: -1);
 
 		if (rv < 0) {
 			if (errno == EINTR) {
@@ -168,13 +267,32 @@ static ssize_t sock_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout
 		}
 	} while (rv < 0);
 
-	if (rv == 0) {
-		return 0;
+	return rv;
+}
+
+static ssize_t sock_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout)
+{
+	int rv;
+	int *sock;
+	ssize_t sz;
+
+	if (!io->ctx) {
+		io->error = EINVAL;
+		return -1;
+	}
+
+	sock = io->ctx;
+
+	rv = sock_wait(io, *sock, 0, timeout);
+	if (rv <= 0) {
+		return rv;
 	}
 
 	for (;;) {
 		sz = recv(*sock, buf, len, 0);
 		if (sz < 0) {
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && (io->flags & TRFB_IO_NONBLOCK))
+				return 0;
 			if (errno == EAGAIN || errno == EINTR)
 				continue;
 			else {
@@ -195,9 +313,7 @@ static ssize_t sock_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout
 static ssize_t sock_write(trfb_io_t *io, const void *buf, ssize_t len, unsigned timeout)
 {
 	int rv;
-	fd_set fds;
 	int *sock;
-	struct timeval tv;
 	ssize_t sz;
 
 	if (!io->ctx) {
@@ -207,75 +323,413 @@ static ssize_t sock_write(trfb_io_t *io, const void *buf, ssize_t len, unsigned
 
 	sock = io->ctx;
 
-	do {
-		FD_ZERO(&fds);
-		FD_SET(*sock, &fds);
-
-		if (timeout) {
-			tv.tv_sec = timeout / 1000;
-			tv.tv_usec = 1000 * (timeout % 1000);
-
-			rv = select(*sock + 1, NULL, &fds, NULL, &tv);
-		} else {
-			rv = select(*sock + 1, NULL, &fds, NULL, NULL);
-		}
+	rv = sock_wait(io, *sock, 1, timeout);
+	if (rv <= 0) {
+		return rv;
+	}
 
-		if (rv < 0) {
-			if (errno == EINTR) {
+	for (;;) {
+		sz = send(*sock, buf, len, 0);
+		if (sz < 0) {
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && (io->flags & TRFB_IO_NONBLOCK))
+				return 0;
+			if (errno == EAGAIN || errno == EINTR)
 				continue;
-			} else {
+			else {
 				io->error = errno;
 				return -1;
 			}
+		} else if (sz == 0) {
+			io->error = EIO;
+			return -1;
 		}
-	} while (rv < 0);
 
-	if (rv == 0) {
-		return 0;
+		return sz;
+	}
+
+	return -1; /* not reached */
+}
+
+static ssize_t sock_writev(trfb_io_t *io, const struct iovec *iov, int cnt, unsigned flags, unsigned timeout)
+{
+	struct msghdr msg;
+	int send_flags = 0;
+	int rv;
+	int *sock;
+	ssize_t sz;
+	size_t len = 0;
+	int i;
+
+	if (!io->ctx) {
+		io->error = EINVAL;
+		return -1;
+	}
+
+	sock = io->ctx;
+
+	rv = sock_wait(io, *sock, 1, timeout);
+	if (rv <= 0) {
+		return rv;
 	}
 
+	for (i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+
+#ifdef MSG_MORE
+	/* Don't send partial segments between parts of one update */
+	if (flags & TRFB_IO_MORE)
+		send_flags |= MSG_MORE;
+#endif
+#if HAVE_ZEROCOPY
+	if ((flags & TRFB_IO_ZEROCOPY) && (io->flags & TRFB_IO_ZEROCOPY) && len >= IO_ZEROCOPY_MIN)
+		send_flags |= MSG_ZEROCOPY;
+#endif
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = cnt;
+
 	for (;;) {
-		sz = send(*sock, buf, len, 0);
+		sz = sendmsg(*sock, &msg, send_flags);
 		if (sz < 0) {
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && (io->flags & TRFB_IO_NONBLOCK))
+				return 0;
+#if HAVE_ZEROCOPY
+			if (errno == ENOBUFS && (send_flags & MSG_ZEROCOPY)) {
+				/* Out of memory for notifications: send it in usual way */
+				send_flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+#endif
 			if (errno == EAGAIN || errno == EINTR)
 				continue;
 			else {
 				io->error = errno;
 				return -1;
 			}
-		} else if (sz == 0) {
+		} else if (sz == 0 && len) {
 			io->error = EIO;
 			return -1;
 		}
 
+#if HAVE_ZEROCOPY
+		if (send_flags & MSG_ZEROCOPY)
+			io->zc_sent++;
+#endif
+
 		return sz;
 	}
 
 	return -1; /* not reached */
 }
 
-int trfb_io_flush(trfb_io_t *io, unsigned timeout)
+#if HAVE_ZEROCOPY
+/* Read zero-copy completions from error queue of socket */
+static int sock_reap(trfb_io_t *io, int sock)
 {
-	ssize_t r;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	char control[128];
 
-	if (io->wlen == 0)
-		return 0;
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			io->error = errno;
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+					(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			serr = (struct sock_extended_err*)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				io->error = serr->ee_errno;
+				return -1;
+			}
+
+			/* Sends [ee_info, ee_data] are completed */
+			io->zc_done += serr->ee_data - serr->ee_info + 1;
+		}
+	}
+}
+#endif
+
+static int sock_complete(trfb_io_t *io, unsigned timeout)
+{
+#if HAVE_ZEROCOPY
+	struct pollfd pfd;
+	int *sock = io->ctx;
+	int rv;
+
+	for (;;) {
+		if (sock_reap(io, *sock))
+			return -1;
+
+		if (io->zc_done == io->zc_sent)
+			return 1;
+
+		if (io->flags & TRFB_IO_NONBLOCK)
+			return 0; /* Event loop will be woken up by EPOLLERR */
+
+		/* Completions are signalled as error condition */
+		pfd.fd = *sock;
+		pfd.events = 0;
+		pfd.revents = 0;
+		rv = poll(&pfd, 1, timeout? (int)timeout: -1);
+		if (rv < 0 && errno != EINTR) {
+			io->error = errno;
+			return -1;
+		}
+
+		if (rv == 0)
+			return 0;
+	}
+#else
+	return 1;
+#endif
+}
+
+int trfb_io_zerocopy(trfb_io_t *io)
+{
+#if HAVE_ZEROCOPY
+	int one = 1;
 
-	r = io->write(io, io->wbuf, io->wlen, timeout);
-	if (r < 0) { /* It is error */
+	if (!io || io->writev != sock_writev) {
 		return -1;
-	} else if (r == 0) {
-		return 0; /* It is timeout */
-	} else {
-		if ((size_t)r < io->wlen) {
-			memmove(io->wbuf + r, io->wbuf, io->wlen - r); /* It is slow but I can't find better way */
-			io->wlen -= r;
+	}
+
+	if (setsockopt(*(int*)io->ctx, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+		return -1;
+	}
+
+	io->flags |= TRFB_IO_ZEROCOPY;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static int push_chunk(trfb_io_t *io, const unsigned char *ref, size_t off, size_t len)
+{
+	trfb_io_chunk_t *p;
+	unsigned sz;
+
+	/* Continuation of the last part of write buffer */
+	if (!ref && io->chunks_cnt > io->chunks_pos) {
+		p = io->chunks + io->chunks_cnt - 1;
+		if (!p->ref && p->off + p->len == off) {
+			p->len += len;
+			return 0;
+		}
+	}
+
+	if (io->chunks_cnt >= io->chunks_size) {
+		sz = io->chunks_size? io->chunks_size * 2: 16;
+		p = realloc(io->chunks, sz * sizeof(trfb_io_chunk_t));
+		if (!p) {
+			io->error = ENOMEM;
+			return -1;
+		}
+		io->chunks = p;
+		io->chunks_size = sz;
+	}
+
+	p = io->chunks + io->chunks_cnt++;
+	p->ref = ref;
+	p->off = off;
+	p->len = len;
+
+	return 0;
+}
+
+/* Put data written to wbuf into output queue */
+static int seal_wbuf(trfb_io_t *io)
+{
+	if (io->wlen > io->wmark) {
+		if (push_chunk(io, NULL, io->wmark, io->wlen - io->wmark))
+			return -1;
+		io->wmark = io->wlen;
+	}
+
+	return 0;
+}
+
+size_t trfb_io_pending(const trfb_io_t *io)
+{
+	size_t len = io->wlen - io->wmark;
+	unsigned i;
+
+	for (i = io->chunks_pos; i < io->chunks_cnt; i++)
+		len += io->chunks[i].len;
+
+	return len - io->chunk_sent;
+}
+
+int trfb_io_busy(const trfb_io_t *io)
+{
+	return io->wlen > 0 || io->chunks_cnt > 0 || io->zc_sent != io->zc_done;
+}
+
+/* Fill iov with bytes [pos, pos + len) of write ring. Returns count of iov used (part could wrap). */
+static int ring_iov(trfb_io_t *io, struct iovec *iov, size_t pos, size_t len)
+{
+	size_t off = pos & (io->wsize - 1);
+	size_t l = io->wsize - off;
+
+	iov[0].iov_base = io->wbuf + off;
+	if (len <= l) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+
+	iov[0].iov_len = l;
+	iov[1].iov_base = io->wbuf;
+	iov[1].iov_len = len - l;
+
+	return 2;
+}
+
+/* Send some chunks. Returns count of bytes sent, 0 on timeout and -1 on error. */
+static ssize_t flush_chunks(trfb_io_t *io, unsigned timeout)
+{
+	struct iovec iov[IO_BATCH];
+	trfb_io_chunk_t *c = io->chunks + io->chunks_pos;
+	size_t skip = io->chunk_sent;
+	unsigned flags = 0;
+	unsigned i;
+	ssize_t r, sent;
+	int cnt = 0;
+
+	/* With zero-copy referenced memory is sent separately: write buffer could be changed */
+	if (c->ref && (io->flags & TRFB_IO_ZEROCOPY))
+		flags |= TRFB_IO_ZEROCOPY;
+
+	for (i = io->chunks_pos; i < io->chunks_cnt && cnt + 2 <= IO_BATCH; i++, c++) {
+		if ((io->flags & TRFB_IO_ZEROCOPY) && !c->ref != !(flags & TRFB_IO_ZEROCOPY))
+			break;
+
+		if (c->ref) {
+			iov[cnt].iov_base = (void*)(c->ref + c->off + skip);
+			iov[cnt].iov_len = c->len - skip;
+			cnt++;
 		} else {
-			io->wlen = 0;
+			cnt += ring_iov(io, iov + cnt, c->off + skip, c->len - skip);
+		}
+		skip = 0;
+	}
+
+	if (!cnt)
+		return 0;
+
+	if (i < io->chunks_cnt)
+		flags |= TRFB_IO_MORE;
+
+	if (io->writev) {
+		r = io->writev(io, iov, cnt, flags, timeout);
+	} else {
+		r = io->write(io, iov[0].iov_base, iov[0].iov_len, timeout);
+	}
+
+	if (r <= 0)
+		return r;
+
+	/* Skip sent chunks and release space of write ring */
+	sent = r + io->chunk_sent;
+	c = io->chunks + io->chunks_pos;
+	while (io->chunks_pos < io->chunks_cnt && (size_t)sent >= c->len) {
+		if (!c->ref)
+			io->wtail = c->off + c->len;
+		sent -= c->len;
+		io->chunks_pos++;
+		c++;
+	}
+	io->chunk_sent = sent;
+	if (sent && !c->ref)
+		io->wtail = c->off + sent;
+
+	return r;
+}
+
+int trfb_io_flush(trfb_io_t *io, unsigned timeout)
+{
+	ssize_t r;
+	size_t pending;
+
+	if (seal_wbuf(io))
+		return -1;
+
+	while (io->chunks_pos < io->chunks_cnt) {
+		r = flush_chunks(io, timeout);
+		if (r < 0) { /* It is error */
+			return -1;
+		} else if (r == 0) { /* It is timeout */
+			pending = trfb_io_pending(io);
+			return pending > 0x7fffffff? 0x7fffffff: (int)pending; /* bytes remaining */
 		}
 	}
 
-	return io->wlen; /* bytes remaining */
+	/* Everything is sent: memory could be used after completion of zero-copy sends */
+	if (io->zc_sent != io->zc_done && io->complete) {
+		r = io->complete(io, timeout);
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			return 1;
+	}
+
+	io->chunks_cnt = io->chunks_pos = 0;
+	io->chunk_sent = 0;
+	io->wlen = io->wmark = io->wtail = 0;
+
+	return 0;
+}
+
+int trfb_io_queue(trfb_io_t *io, const void *buf, size_t len)
+{
+	size_t sz;
+
+	if (!io || (!buf && len)) {
+		return -1;
+	}
+
+	if (io->wlen - io->wtail + len > io->wsize) {
+		sz = io->wsize? io->wsize: TRFB_BUFSIZ;
+		while (sz < io->wlen - io->wtail + len)
+			sz *= 2;
+
+		if (ring_resize(io, sz))
+			return -1;
+	}
+
+	ring_put(io, buf, len);
+
+	return 0;
+}
+
+int trfb_io_queue_ref(trfb_io_t *io, const void *buf, size_t len)
+{
+	if (!io || (!buf && len)) {
+		return -1;
+	}
+
+	if (!len)
+		return 0;
+
+	if (seal_wbuf(io))
+		return -1;
+
+	return push_chunk(io, buf, 0, len);
 }
 
 int trfb_io_fgetc(trfb_io_t *io, unsigned timeout)
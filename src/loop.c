@@ -0,0 +1,530 @@
+#include <trfb.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+
+/*
+ * Event loop engine: few threads serve all the connections using epoll.
+ * Loop 0 also accepts new clients and distributes them between loops.
+ */
+
+#if HAVE_SYS_EPOLL_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define LOOP_EVENTS 64
+
+struct trfb_loop {
+	trfb_server_t *srv;
+	int epfd;
+	/* eventfd used to wake up loop thread */
+	int evfd;
+	thrd_t thread;
+
+	/* Connections waiting for update (protected by lock) */
+	mtx_t lock;
+	trfb_connection_t *ready;
+	/* Connections which will be updated later (loop thread only) */
+	trfb_connection_t *delayed;
+};
+
+static int set_nonblock(int sock)
+{
+	int flags;
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int loop_watch(trfb_connection_t *con, int op)
+{
+	struct epoll_event ev;
+	unsigned events = EPOLLIN;
+
+	if (trfb_io_pending(con->io))
+		events |= EPOLLOUT;
+
+	if (op == EPOLL_CTL_MOD && events == con->events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = con;
+	con->events = events;
+	if (epoll_ctl(con->loop->epfd, op, con->sock, &ev)) {
+		trfb_msg("[%s] epoll_ctl failed: %s", con->name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void loop_close(trfb_connection_t *con)
+{
+	trfb_server_t *srv = con->server;
+	trfb_connection_t *c;
+
+	trfb_msg("I:[%s] connection closed", con->name);
+	epoll_ctl(con->loop->epfd, EPOLL_CTL_DEL, con->sock, NULL);
+
+	/* Other threads schedule connections of server list: it can't be scheduled again after this */
+	mtx_lock(&srv->lock);
+	if (srv->clients == con) {
+		srv->clients = con->next;
+	} else {
+		for (c = srv->clients; c; c = c->next) {
+			if (c->next == con) {
+				c->next = con->next;
+				break;
+			}
+		}
+	}
+	mtx_unlock(&srv->lock);
+
+	mtx_lock(&con->loop->lock);
+	if (con->ready) {
+		if (con->loop->ready == con) {
+			con->loop->ready = con->ready_next;
+		} else {
+			for (c = con->loop->ready; c; c = c->ready_next) {
+				if (c->ready_next == con) {
+					c->ready_next = con->ready_next;
+					break;
+				}
+			}
+		}
+		con->ready = 0;
+	}
+	mtx_unlock(&con->loop->lock);
+
+	if (con->delayed) {
+		if (con->loop->delayed == con) {
+			con->loop->delayed = con->delay_next;
+		} else {
+			for (c = con->loop->delayed; c; c = c->delay_next) {
+				if (c->delay_next == con) {
+					c->delay_next = con->delay_next;
+					break;
+				}
+			}
+		}
+		con->delayed = 0;
+	}
+
+	trfb_connection_free(con);
+}
+
+static void loop_accept(trfb_loop_t *loop)
+{
+	trfb_server_t *srv = loop->srv;
+	trfb_connection_t *con;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int sock;
+
+	for (;;) {
+		addrlen = sizeof(addr);
+		sock = accept(srv->sock, (struct sockaddr*)&addr, &addrlen);
+		if (sock < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				trfb_msg("W:accept failed: %s", strerror(errno));
+			return;
+		}
+
+		trfb_msg("I:new client!");
+		if (set_nonblock(sock)) {
+			trfb_msg("W:can not set client socket to non-blocking mode");
+			close(sock);
+			continue;
+		}
+
+		con = trfb_connection_create(srv, sock, (struct sockaddr*)&addr, addrlen);
+		if (!con) {
+			trfb_msg("W:can not create new connection");
+			continue;
+		}
+
+		mtx_lock(&srv->lock);
+		con->loop = srv->loops + (srv->next_loop++ % srv->loops_cnt);
+		con->next = srv->clients;
+		srv->clients = con;
+		mtx_unlock(&srv->lock);
+
+		if (loop_watch(con, EPOLL_CTL_ADD)) {
+			loop_close(con);
+		}
+	}
+}
+
+static void loop_event(trfb_connection_t *con, unsigned events)
+{
+	/* Errors are detected by reading. EPOLLERR also signals zero-copy completions. */
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		if (trfb_connection_on_read(con)) {
+			loop_close(con);
+			return;
+		}
+	}
+
+	if (events & EPOLLOUT) {
+		if (trfb_connection_on_write(con)) {
+			loop_close(con);
+			return;
+		}
+	}
+
+	if (loop_watch(con, EPOLL_CTL_MOD)) {
+		loop_close(con);
+	}
+}
+
+static void loop_ready(trfb_loop_t *loop)
+{
+	trfb_connection_t *con;
+
+	for (;;) {
+		mtx_lock(&loop->lock);
+		con = loop->ready;
+		if (con) {
+			loop->ready = con->ready_next;
+			con->ready = 0;
+			con->ready_next = NULL;
+		}
+		mtx_unlock(&loop->lock);
+
+		if (!con)
+			break;
+
+		if (trfb_connection_update(con) || trfb_connection_on_write(con) || loop_watch(con, EPOLL_CTL_MOD)) {
+			loop_close(con);
+		}
+	}
+}
+
+static void loop_wakeup(trfb_loop_t *loop);
+
+void trfb_loop_delay(trfb_connection_t *con, double seconds)
+{
+	double t = trfb_client_time() + seconds;
+
+	if (!con->delayed) {
+		con->delayed = 1;
+		con->delay_time = t;
+		con->delay_next = con->loop->delayed;
+		con->loop->delayed = con;
+	} else if (t < con->delay_time) {
+		con->delay_time = t;
+	}
+}
+
+/* Schedule delayed connections which time has come. Returns timeout for epoll_wait. */
+static int loop_delayed(trfb_loop_t *loop)
+{
+	trfb_connection_t **p = &loop->delayed;
+	trfb_connection_t *con;
+	double now = trfb_client_time();
+	double next = -1;
+
+	while (*p) {
+		con = *p;
+		if (con->delay_time <= now) {
+			*p = con->delay_next;
+			con->delayed = 0;
+			con->delay_next = NULL;
+			trfb_loop_schedule(con);
+			continue;
+		}
+
+		if (next < 0 || con->delay_time < next)
+			next = con->delay_time;
+		p = &con->delay_next;
+	}
+
+	if (next < 0)
+		return -1;
+
+	/* Round up: connection must not wake up too early */
+	return (int)((next - now) * 1000) + 1;
+}
+
+void trfb_loop_schedule(trfb_connection_t *con)
+{
+	trfb_loop_t *loop = con->loop;
+	int wakeup = 0;
+
+	mtx_lock(&loop->lock);
+	if (!con->ready) {
+		con->ready = 1;
+		con->ready_next = loop->ready;
+		wakeup = !loop->ready;
+		loop->ready = con;
+	}
+	mtx_unlock(&loop->lock);
+
+	if (wakeup)
+		loop_wakeup(loop);
+}
+
+static int loop_thread(void *loop_in)
+{
+	trfb_loop_t *loop = loop_in;
+	trfb_server_t *srv = loop->srv;
+	struct epoll_event events[LOOP_EVENTS];
+	uint64_t cnt;
+	int n, i;
+	int ready;
+	int timeout;
+
+	for (;;) {
+		timeout = loop_delayed(loop);
+		n = epoll_wait(loop->epfd, events, LOOP_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			trfb_msg("epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+
+		ready = 0;
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == loop) {
+				if (read(loop->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+					trfb_msg("W:can not read eventfd");
+				}
+				ready = 1;
+			} else if (events[i].data.ptr == srv) {
+				loop_accept(loop);
+			} else {
+				loop_event(events[i].data.ptr, events[i].events);
+			}
+		}
+
+		/* Connections could be closed here so it must be done after processing of events */
+		if (ready) {
+			loop_ready(loop);
+		}
+
+		if (trfb_server_get_state(srv) == TRFB_STATE_STOP) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void loop_wakeup(trfb_loop_t *loop)
+{
+	uint64_t one = 1;
+
+	if (write(loop->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		trfb_msg("W:can not wake up event loop");
+	}
+}
+
+static int loop_init(trfb_server_t *srv, trfb_loop_t *loop)
+{
+	struct epoll_event ev;
+
+	loop->srv = srv;
+	loop->ready = NULL;
+	loop->delayed = NULL;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		trfb_msg("epoll_create failed: %s", strerror(errno));
+		return -1;
+	}
+
+	loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->evfd < 0) {
+		trfb_msg("eventfd failed: %s", strerror(errno));
+		close(loop->epfd);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = loop;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev)) {
+		trfb_msg("epoll_ctl failed: %s", strerror(errno));
+		close(loop->evfd);
+		close(loop->epfd);
+		return -1;
+	}
+
+	mtx_init(&loop->lock, mtx_plain);
+
+	return 0;
+}
+
+static void loop_done(trfb_loop_t *loop)
+{
+	mtx_destroy(&loop->lock);
+	close(loop->evfd);
+	close(loop->epfd);
+}
+
+static void free_loops(trfb_server_t *srv, unsigned cnt)
+{
+	unsigned i;
+
+	for (i = 0; i < cnt; i++)
+		loop_done(srv->loops + i);
+	free(srv->loops);
+	srv->loops = NULL;
+}
+
+int trfb_loop_start(trfb_server_t *srv)
+{
+	struct epoll_event ev;
+	unsigned i, j;
+	int rv;
+
+	mtx_lock(&srv->lock);
+	if (srv->clients || srv->state != TRFB_STATE_STOPPED) {
+		mtx_unlock(&srv->lock);
+		trfb_msg("E: server is always started but trfb_server_start called!");
+		return -1;
+	}
+	mtx_unlock(&srv->lock);
+
+	if (!srv->fb || srv->sock < 0 || !srv->loops_cnt) {
+		trfb_msg("Server parameters is not set. Invalid trfb_server content.");
+		return -1;
+	}
+
+	if (listen(srv->sock, 128)) {
+		trfb_msg("listen failed");
+		return -1;
+	}
+
+	if (set_nonblock(srv->sock)) {
+		trfb_msg("Can not set server socket to non-blocking mode");
+		return -1;
+	}
+
+	srv->loops = calloc(srv->loops_cnt, sizeof(trfb_loop_t));
+	if (!srv->loops) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+
+	for (i = 0; i < srv->loops_cnt; i++) {
+		if (loop_init(srv, srv->loops + i)) {
+			free_loops(srv, i);
+			return -1;
+		}
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = srv;
+	if (epoll_ctl(srv->loops[0].epfd, EPOLL_CTL_ADD, srv->sock, &ev)) {
+		trfb_msg("epoll_ctl failed: %s", strerror(errno));
+		free_loops(srv, srv->loops_cnt);
+		return -1;
+	}
+
+	mtx_lock(&srv->lock);
+	srv->state = TRFB_STATE_WORKING;
+	srv->next_loop = 0;
+	mtx_unlock(&srv->lock);
+
+	for (i = 0; i < srv->loops_cnt; i++) {
+		if (thrd_create(&srv->loops[i].thread, loop_thread, srv->loops + i) != thrd_success) {
+			trfb_msg("Can't start thread");
+
+			mtx_lock(&srv->lock);
+			srv->state = TRFB_STATE_STOP;
+			mtx_unlock(&srv->lock);
+
+			for (j = 0; j < i; j++) {
+				loop_wakeup(srv->loops + j);
+				thrd_join(srv->loops[j].thread, &rv);
+			}
+			free_loops(srv, srv->loops_cnt);
+
+			mtx_lock(&srv->lock);
+			srv->state = TRFB_STATE_ERROR;
+			mtx_unlock(&srv->lock);
+			return -1;
+		}
+	}
+
+	trfb_msg("I:server started with %u event loops!", srv->loops_cnt);
+
+	return 0;
+}
+
+int trfb_loop_stop(trfb_server_t *srv)
+{
+	trfb_connection_t *con;
+	unsigned i;
+	int rv;
+
+	mtx_lock(&srv->lock);
+	if (!srv->loops) {
+		mtx_unlock(&srv->lock);
+		return -1;
+	}
+	srv->state = TRFB_STATE_STOP;
+	mtx_unlock(&srv->lock);
+
+	for (i = 0; i < srv->loops_cnt; i++) {
+		loop_wakeup(srv->loops + i);
+	}
+
+	for (i = 0; i < srv->loops_cnt; i++) {
+		thrd_join(srv->loops[i].thread, &rv);
+	}
+
+	/* Loop threads are stopped so we could free connections safely */
+	mtx_lock(&srv->lock);
+	while (srv->clients) {
+		con = srv->clients;
+		srv->clients = con->next;
+		trfb_connection_free(con);
+	}
+	mtx_unlock(&srv->lock);
+
+	free_loops(srv, srv->loops_cnt);
+
+	mtx_lock(&srv->lock);
+	srv->state = TRFB_STATE_STOPPED;
+	mtx_unlock(&srv->lock);
+
+	trfb_msg("I:server stopped");
+
+	return 0;
+}
+
+#else
+
+int trfb_loop_start(trfb_server_t *srv)
+{
+	trfb_msg("Event loop is not supported on this platform");
+	return -1;
+}
+
+int trfb_loop_stop(trfb_server_t *srv)
+{
+	return -1;
+}
+
+void trfb_loop_schedule(trfb_connection_t *con)
+{
+}
+
+void trfb_loop_delay(trfb_connection_t *con, double seconds)
+{
+}
+
+#endif
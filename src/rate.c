@@ -0,0 +1,133 @@
+#include <trfb.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+# include <linux/sockios.h>
+#endif
+
+/*
+ * Adaptive rate (TRFB_SERVER_ADAPTIVE). Backlog is output queued for client and not delivered yet: data in
+ * output buffer plus data in socket which is not acknowledged by peer (or not acknowledged by fence if
+ * socket doesn't tell it). Bytes delivered per second while backlog was not drained is throughput of link,
+ * backlog divided by throughput is time new update waits before it reaches client.
+ *
+ * Update is sent when this latency is under target. JPEG quality goes down (multiplicatively) while the
+ * next update would be delivered later than target and returns to quality asked by client while link has
+ * headroom. Raw pixels need no CPU to encode, so they are used if client asked for them and the last update
+ * would be delivered quickly as Raw.
+ */
+
+/* Minimal time between throughput samples and between adjustments of encoding (seconds) */
+#define RATE_SAMPLE 0.01
+#define RATE_ADJUST 0.1
+/* Longest wait before the link is measured again (seconds) */
+#define RATE_WAIT_MAX 0.1
+#define RATE_QUALITY_MIN 10
+#define RATE_QUALITY_STEP 5
+
+/* Bytes in socket which are not acknowledged by peer or (size_t)-1 if it is unknown */
+static size_t socket_backlog(trfb_connection_t *con)
+{
+#ifdef SIOCOUTQ
+	int outq;
+
+	if (con->sock >= 0 && ioctl(con->sock, SIOCOUTQ, &outq) == 0 && outq >= 0)
+		return outq;
+#endif
+
+	return (size_t)-1;
+}
+
+static void sample(trfb_connection_t *con, double now)
+{
+	size_t outq = socket_backlog(con);
+	size_t backlog = trfb_io_pending(con->io);
+	unsigned long long sent;
+	double dt = now - con->rate_time;
+	double rate;
+
+	if (outq != (size_t)-1)
+		backlog += outq;
+	else if (con->fences_cnt && con->queued - con->acked > backlog)
+		backlog = con->queued - con->acked;
+
+	sent = con->queued > backlog? con->queued - backlog: 0;
+	if (sent < con->rate_sent)
+		sent = con->rate_sent;
+
+	if (con->rate_time && dt >= RATE_SAMPLE) {
+		rate = (sent - con->rate_sent) / dt;
+
+		/* Link was busy all the time only if previous backlog was not delivered completely. Otherwise
+		 * it is limited by updates and could be faster. */
+		if (sent - con->rate_sent < con->rate_backlog)
+			con->throughput = con->throughput? con->throughput * 0.875 + rate * 0.125: rate;
+		else if (rate > con->throughput)
+			con->throughput = con->throughput? con->throughput * 0.5 + rate * 0.5: rate;
+	}
+
+	if (!con->rate_time || dt >= RATE_SAMPLE) {
+		con->rate_time = now;
+		con->rate_sent = sent;
+		con->rate_backlog = backlog;
+	}
+
+	con->latency = con->throughput > 0? backlog / con->throughput: 0;
+	/* Fences measure delay of queues outside of this host too. It is known only while fences are not
+	 * answered: the last round trip time is not changed when everything is delivered. */
+	if (con->fences_cnt && con->rtt_min && con->rtt - con->rtt_min > con->latency)
+		con->latency = con->rtt - con->rtt_min;
+}
+
+static void adjust(trfb_connection_t *con, double now)
+{
+	double target = con->target_latency;
+	double delay;
+	int q = con->jpeg_quality;
+
+	if (now - con->rate_adjusted < RATE_ADJUST || !con->throughput)
+		return;
+	con->rate_adjusted = now;
+
+	/* The next update waits for backlog and takes about as long as the last one to transfer */
+	delay = con->latency + con->rate_update / con->throughput;
+	if (delay > target) {
+		q = q * 3 / 4;
+		if (q < RATE_QUALITY_MIN)
+			q = RATE_QUALITY_MIN;
+	} else if (delay < target / 2) {
+		q += RATE_QUALITY_STEP;
+	}
+
+	if (q > con->rate_quality)
+		q = con->rate_quality;
+	if (q != con->jpeg_quality && q >= 1)
+		con->jpeg_quality = q;
+
+	/* Hysteresis: Raw is chosen when latency and the last update as Raw take less than a quarter of target and
+	 * dropped when either of them takes more than a half of target */
+	if (con->rate_frame && trfb_connection_has_encoding(con, TRFB_ENCODING_RAW)) {
+		if (con->latency < target / 4 && con->rate_frame / con->throughput < target / 4)
+			con->rate_raw = 1;
+		else if (con->latency > target / 2 || con->rate_frame / con->throughput > target / 2)
+			con->rate_raw = 0;
+	}
+}
+
+double trfb_connection_rate(trfb_connection_t *con)
+{
+	double now = trfb_client_time();
+	double wait;
+
+	sample(con, now);
+	adjust(con, now);
+
+	if (con->latency <= con->target_latency)
+		return 0;
+
+	/* Part of backlog above target must be delivered first */
+	wait = con->latency - con->target_latency;
+	if (wait > RATE_WAIT_MAX)
+		wait = RATE_WAIT_MAX;
+
+	return wait;
+}
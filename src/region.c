@@ -0,0 +1,273 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Damage regions: bitmap of tiles. Every bit is one TRFB_REGION_TILE x TRFB_REGION_TILE square. */
+
+#define T TRFB_REGION_TILE
+
+int trfb_region_init(trfb_region_t *r, unsigned width, unsigned height)
+{
+	memset(r, 0, sizeof(trfb_region_t));
+
+	r->width = width;
+	r->height = height;
+	r->tw = (width + T - 1) / T;
+	r->th = (height + T - 1) / T;
+	r->stride = (r->tw + 31) / 32;
+
+	if (r->stride * r->th == 0)
+		return 0;
+
+	r->bits = calloc(r->stride * r->th, sizeof(uint32_t));
+	if (!r->bits) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+
+	return 0;
+}
+
+int trfb_region_resize(trfb_region_t *r, unsigned width, unsigned height)
+{
+	trfb_region_t n;
+
+	if (trfb_region_init(&n, width, height))
+		return -1;
+
+	trfb_region_free(r);
+	*r = n;
+
+	return 0;
+}
+
+void trfb_region_free(trfb_region_t *r)
+{
+	free(r->bits);
+	memset(r, 0, sizeof(trfb_region_t));
+}
+
+void trfb_region_clear(trfb_region_t *r)
+{
+	if (r->bits)
+		memset(r->bits, 0, r->stride * r->th * sizeof(uint32_t));
+}
+
+int trfb_region_is_empty(const trfb_region_t *r)
+{
+	unsigned i;
+
+	for (i = 0; i < r->stride * r->th; i++)
+		if (r->bits[i])
+			return 0;
+
+	return 1;
+}
+
+/* Set or clear bits [tx0, tx1] in row ty */
+static void set_bits(trfb_region_t *r, unsigned ty, unsigned tx0, unsigned tx1, int value)
+{
+	uint32_t *row = r->bits + ty * r->stride;
+	unsigned w0 = tx0 / 32;
+	unsigned w1 = tx1 / 32;
+	uint32_t m0 = ~0u << (tx0 % 32);
+	uint32_t m1 = ~0u >> (31 - tx1 % 32);
+	unsigned i;
+
+	if (w0 == w1) {
+		m0 &= m1;
+		if (value)
+			row[w0] |= m0;
+		else
+			row[w0] &= ~m0;
+		return;
+	}
+
+	if (value) {
+		row[w0] |= m0;
+		for (i = w0 + 1; i < w1; i++)
+			row[i] = ~0u;
+		row[w1] |= m1;
+	} else {
+		row[w0] &= ~m0;
+		for (i = w0 + 1; i < w1; i++)
+			row[i] = 0;
+		row[w1] &= ~m1;
+	}
+}
+
+void trfb_region_add_rect(trfb_region_t *r, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	unsigned ty;
+
+	if (x >= r->width || y >= r->height || !width || !height)
+		return;
+
+	if (width > r->width - x)
+		width = r->width - x;
+	if (height > r->height - y)
+		height = r->height - y;
+
+	for (ty = y / T; ty <= (y + height - 1) / T; ty++)
+		set_bits(r, ty, x / T, (x + width - 1) / T, 1);
+}
+
+void trfb_region_add(trfb_region_t *dst, const trfb_region_t *src)
+{
+	unsigned i;
+
+	if (dst->stride != src->stride || dst->th != src->th)
+		return;
+
+	for (i = 0; i < dst->stride * dst->th; i++)
+		dst->bits[i] |= src->bits[i];
+}
+
+void trfb_region_clear_rect(trfb_region_t *r, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	unsigned tx0, ty0, tx1, ty1;
+	unsigned ty;
+
+	if (x >= r->width || y >= r->height || !width || !height)
+		return;
+
+	if (width > r->width - x)
+		width = r->width - x;
+	if (height > r->height - y)
+		height = r->height - y;
+
+	/* Only tiles completely inside the rectangle. Tiles on the right and bottom border
+	 * of the framebuffer are smaller then others. */
+	tx0 = (x + T - 1) / T;
+	ty0 = (y + T - 1) / T;
+	tx1 = x + width == r->width? r->tw: (x + width) / T;
+	ty1 = y + height == r->height? r->th: (y + height) / T;
+
+	if (tx0 >= tx1 || ty0 >= ty1)
+		return;
+
+	for (ty = ty0; ty < ty1; ty++)
+		set_bits(r, ty, tx0, tx1 - 1, 0);
+}
+
+static inline int get_bit(const trfb_region_t *r, unsigned tx, unsigned ty)
+{
+	return (r->bits[ty * r->stride + tx / 32] >> (tx % 32)) & 1;
+}
+
+int trfb_region_intersects(const trfb_region_t *r, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	unsigned tx, ty;
+
+	if (x >= r->width || y >= r->height || !width || !height)
+		return 0;
+
+	if (width > r->width - x)
+		width = r->width - x;
+	if (height > r->height - y)
+		height = r->height - y;
+
+	for (ty = y / T; ty <= (y + height - 1) / T; ty++)
+		for (tx = x / T; tx <= (x + width - 1) / T; tx++)
+			if (get_bit(r, tx, ty))
+				return 1;
+
+	return 0;
+}
+
+static int push_rect(trfb_rect_t **rects, unsigned *cnt, unsigned *size, unsigned x, unsigned y, unsigned w, unsigned h)
+{
+	trfb_rect_t *p;
+
+	if (*cnt >= *size) {
+		*size = *size? *size * 2: 32;
+		p = realloc(*rects, *size * sizeof(trfb_rect_t));
+		if (!p) {
+			trfb_msg("Not enought memory");
+			return -1;
+		}
+		*rects = p;
+	}
+
+	(*rects)[*cnt].x = x;
+	(*rects)[*cnt].y = y;
+	(*rects)[*cnt].width = w;
+	(*rects)[*cnt].height = h;
+	(*cnt)++;
+
+	return 0;
+}
+
+int trfb_region_rects(const trfb_region_t *r, const trfb_rect_t *clip, trfb_rect_t **rects)
+{
+	trfb_rect_t *res = NULL;
+	unsigned cnt = 0, size = 0;
+	/* Rectangles which could be extended by next row are [prev, cnt) */
+	unsigned prev = 0, cur;
+	unsigned cx0, cy0, cx1, cy1;
+	unsigned tx, ty, tx0;
+	unsigned x0, x1, y0, y1;
+	unsigned i, j;
+
+	*rects = NULL;
+
+	cx0 = clip? clip->x: 0;
+	cy0 = clip? clip->y: 0;
+	cx1 = clip? clip->x + clip->width: r->width;
+	cy1 = clip? clip->y + clip->height: r->height;
+	if (cx1 > r->width)
+		cx1 = r->width;
+	if (cy1 > r->height)
+		cy1 = r->height;
+	if (cx0 >= cx1 || cy0 >= cy1)
+		return 0;
+
+	for (ty = cy0 / T; ty <= (cy1 - 1) / T; ty++) {
+		y0 = ty * T < cy0? cy0: ty * T;
+		y1 = (ty + 1) * T > cy1? cy1: (ty + 1) * T;
+		cur = cnt;
+
+		for (tx = cx0 / T; tx <= (cx1 - 1) / T; tx++) {
+			if (!get_bit(r, tx, ty))
+				continue;
+
+			tx0 = tx;
+			while (tx + 1 <= (cx1 - 1) / T && get_bit(r, tx + 1, ty))
+				tx++;
+
+			x0 = tx0 * T < cx0? cx0: tx0 * T;
+			x1 = (tx + 1) * T > cx1? cx1: (tx + 1) * T;
+
+			/* Try to extend rectangle from previous row */
+			for (i = prev; i < cur; i++) {
+				if (res[i].x == x0 && res[i].width == x1 - x0 && res[i].y + res[i].height == y0)
+					break;
+			}
+
+			if (i < cur) {
+				res[i].height += y1 - y0;
+				/* Keep extended rectangles in [prev, cur) for the next row: move it to the end */
+				if (push_rect(&res, &cnt, &size, res[i].x, res[i].y, res[i].width, res[i].height)) {
+					free(res);
+					return -1;
+				}
+				res[i].width = 0;
+			} else if (push_rect(&res, &cnt, &size, x0, y0, x1 - x0, y1 - y0)) {
+				free(res);
+				return -1;
+			}
+		}
+
+		prev = cur;
+	}
+
+	/* Remove rectangles which were moved */
+	for (i = j = 0; i < cnt; i++) {
+		if (res[i].width)
+			res[j++] = res[i];
+	}
+
+	*rects = res;
+
+	return j;
+}
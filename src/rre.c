@@ -0,0 +1,412 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * RRE and CoRRE encodings: background colour and subrectangles of other colours. CoRRE is RRE with one byte
+ * coordinates so rectangles are not bigger than 255x255.
+ *
+ * Background is the most frequent colour. Subrectangles are found greedily: the run of pixels of one colour
+ * is extended down while rows are the same. Search stops as soon as data becomes longer than raw pixels,
+ * then rectangle is sent as Raw.
+ */
+
+#define CORRE_MAX 255
+
+/* Colours counted for background: runs of colours which don't fit to the table are not counted */
+#define HASH_BITS 10
+#define HASH_SIZE (1 << HASH_BITS)
+#define HASH_PROBES 2
+
+typedef struct rre_state {
+	unsigned char *out;
+	size_t out_size;
+	/* Pixels which are covered by subrectangles */
+	unsigned char *done;
+	size_t done_size;
+} rre_state_t;
+
+static inline uint32_t get_pixel(const unsigned char *p, unsigned bpp)
+{
+	uint16_t v16;
+	uint32_t v32;
+
+	if (bpp == 1)
+		return *p;
+
+	if (bpp == 2) {
+		memcpy(&v16, p, 2);
+		return v16;
+	}
+
+	memcpy(&v32, p, 4);
+	return v32;
+}
+
+/* Pixel is written in the same byte order as it is stored in framebuffer */
+static inline unsigned char* put_pixel(unsigned char *p, uint32_t c, unsigned bpp)
+{
+	uint16_t v16 = c;
+
+	if (bpp == 1)
+		*p = c;
+	else if (bpp == 2)
+		memcpy(p, &v16, 2);
+	else
+		memcpy(p, &c, 4);
+
+	return p + bpp;
+}
+
+static inline unsigned char* put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+
+	return p + 4;
+}
+
+static inline unsigned char* put16(unsigned char *p, unsigned v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+
+	return p + 2;
+}
+
+/* Returns the most frequent colour. *runs is set to count of runs of pixels of other colours or to count
+ * of all runs (more than max_runs) if counting was stopped. */
+static uint32_t background(const unsigned char *p, size_t stride, unsigned w, unsigned h, unsigned bpp,
+		size_t max_runs, size_t *runs)
+{
+	uint32_t keys[HASH_SIZE];
+	unsigned counts[HASH_SIZE];
+	unsigned bg_runs[HASH_SIZE];
+	uint32_t c, best;
+	unsigned best_cnt = 0, best_k = HASH_SIZE;
+	unsigned x, y, run, i, k;
+	size_t total = 0;
+
+	memset(counts, 0, sizeof(counts));
+	memset(bg_runs, 0, sizeof(bg_runs));
+	best = get_pixel(p, bpp);
+	for (y = 0; y < h; y++, p += stride) {
+		if (total > max_runs) {
+			*runs = total;
+			return best;
+		}
+
+		for (x = 0; x < w; x += run) {
+			c = get_pixel(p + x * bpp, bpp);
+			for (run = 1; x + run < w && get_pixel(p + (x + run) * bpp, bpp) == c; run++)
+				;
+			total++;
+
+			k = (c * 2654435761u) >> (32 - HASH_BITS);
+			for (i = 0; i < HASH_PROBES; i++, k = (k + 1) % HASH_SIZE) {
+				if (!counts[k])
+					keys[k] = c;
+				if (keys[k] == c)
+					break;
+			}
+
+			if (i == HASH_PROBES)
+				continue;
+
+			counts[k] += run;
+			bg_runs[k]++;
+			if (counts[k] > best_cnt) {
+				best_cnt = counts[k];
+				best = c;
+				best_k = k;
+			}
+		}
+	}
+
+	*runs = total - (best_k < HASH_SIZE? bg_runs[best_k]: 0);
+
+	return best;
+}
+
+/* Write subrectangles to out. Returns count of subrectangles or -1 if there are more than max. */
+static long subrects(rre_state_t *st, const unsigned char *p, size_t stride, unsigned w, unsigned h, unsigned bpp,
+		uint32_t bg, int compact, unsigned char *out, size_t max)
+{
+	unsigned char *done = st->done;
+	unsigned x, y, i, j, rw, rh;
+	uint32_t c;
+	size_t n = 0;
+
+	memset(done, 0, (size_t)w * h);
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			if (done[y * w + x])
+				continue;
+
+			c = get_pixel(p + y * stride + x * bpp, bpp);
+			if (c == bg)
+				continue;
+
+			if (++n > max)
+				return -1;
+
+			/* Subrectangles could overlap with previous ones of the same colour */
+			for (i = x + 1; i < w && get_pixel(p + y * stride + i * bpp, bpp) == c; i++)
+				;
+			rw = i - x;
+			for (j = y + 1; j < h; j++) {
+				for (i = x; i < x + rw && get_pixel(p + j * stride + i * bpp, bpp) == c; i++)
+					;
+				if (i < x + rw)
+					break;
+			}
+			rh = j - y;
+
+			for (j = y; j < y + rh; j++)
+				memset(done + j * w + x, 1, rw);
+
+			out = put_pixel(out, c, bpp);
+			if (compact) {
+				*out++ = x;
+				*out++ = y;
+				*out++ = rw;
+				*out++ = rh;
+			} else {
+				out = put16(out, x);
+				out = put16(out, y);
+				out = put16(out, rw);
+				out = put16(out, rh);
+			}
+		}
+	}
+
+	return n;
+}
+
+static void* rre_create(trfb_connection_t *con)
+{
+	return calloc(1, sizeof(rre_state_t));
+}
+
+static void rre_destroy(void *state)
+{
+	rre_state_t *st = state;
+
+	free(st->out);
+	free(st->done);
+	free(st);
+}
+
+static int reserve(unsigned char **buf, size_t *size, size_t len)
+{
+	unsigned char *p;
+
+	if (*size >= len)
+		return 0;
+
+	p = realloc(*buf, len);
+	if (!p) {
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+	*buf = p;
+	*size = len;
+
+	return 0;
+}
+
+static int encode(trfb_connection_t *con, rre_state_t *st, unsigned x, unsigned y, unsigned width, unsigned height,
+		int compact)
+{
+	trfb_framebuffer_t *fb = con->fb;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	const unsigned char *p = (const unsigned char*)fb->pixels + y * stride + x * fb->bpp;
+	size_t raw = (size_t)width * height * fb->bpp;
+	size_t hdr = 4 + fb->bpp;
+	size_t sub = fb->bpp + (compact? 4: 8);
+	size_t max = (raw - hdr) / sub;
+	uint32_t bg;
+	size_t runs;
+	long n;
+
+	if (!st)
+		return -1;
+
+	/* Data must be shorter than raw pixels */
+	if (raw <= hdr)
+		return trfb_encoder_raw.encode(con, NULL, x, y, width, height);
+
+	if (reserve(&st->out, &st->out_size, raw) || reserve(&st->done, &st->done_size, (size_t)width * height))
+		return -1;
+
+	/* Runs of one row are merged to subrectangles only if rows are the same: too many runs mean Raw.
+	 * Background runs are not neighbours so at least a half of all runs (without one per row) are other ones. */
+	bg = background(p, stride, width, height, fb->bpp, 4 * max + height, &runs);
+	if (runs / 2 > max)
+		return trfb_encoder_raw.encode(con, NULL, x, y, width, height);
+
+	n = subrects(st, p, stride, width, height, fb->bpp, bg, compact, st->out + hdr, max);
+	if (n < 0)
+		return trfb_encoder_raw.encode(con, NULL, x, y, width, height);
+
+	put32(st->out, n);
+	put_pixel(st->out + 4, bg, fb->bpp);
+
+	if (trfb_connection_rect_header(con, x, y, width, height, compact? TRFB_ENCODING_CORRE: TRFB_ENCODING_RRE) ||
+			trfb_connection_queue(con, st->out, hdr + n * sub))
+		return -1;
+
+	return 0;
+}
+
+/* Subrectangles: about 16 per two-colour tile of 16x16 and a pixel of other tiles, but never more than Raw.
+ * Search of subrectangles is a byte per pixel. */
+static size_t estimate(trfb_connection_t *con, unsigned width, unsigned height, int compact)
+{
+	unsigned bpp = con->format.bpp / 8;
+	unsigned solid, two;
+	double raw = (double)width * height * bpp;
+	double n;
+
+	trfb_connection_content(con, &solid, &two);
+	n = (double)width * height / 256 * (two * 16.0 + (1000 - solid - two) * 256.0) / 1000;
+	n = 4 + bpp + n * (bpp + (compact? 4: 8));
+
+	return (n < raw? n: raw) + (double)width * height;
+}
+
+static size_t rre_estimate(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	return estimate(con, width, height, 0);
+}
+
+static size_t corre_estimate(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	return estimate(con, width, height, 1);
+}
+
+static int rre_encode(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	return encode(con, state, x, y, width, height, 0);
+}
+
+static int corre_encode(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	return encode(con, state, x, y, width, height, 1);
+}
+
+const trfb_encoder_t trfb_encoder_rre = {
+	TRFB_ENCODING_RRE,
+	"RRE",
+	0, 0,
+	rre_create,
+	rre_destroy,
+	rre_estimate,
+	rre_encode,
+	TRFB_ENCODER_SHARED
+};
+
+const trfb_encoder_t trfb_encoder_corre = {
+	TRFB_ENCODING_CORRE,
+	"CoRRE",
+	CORRE_MAX, CORRE_MAX,
+	rre_create,
+	rre_destroy,
+	corre_estimate,
+	corre_encode,
+	TRFB_ENCODER_SHARED
+};
+
+/* Decoder: the whole rectangle is decoded when all subrectangles are received */
+static void fill(trfb_framebuffer_t *fb, unsigned x, unsigned y, unsigned w, unsigned h, uint32_t c)
+{
+	size_t stride = (size_t)fb->width * fb->bpp;
+	unsigned char *p = (unsigned char*)fb->pixels + y * stride + x * fb->bpp;
+	unsigned i, j;
+
+	for (j = 0; j < h; j++, p += stride)
+		for (i = 0; i < w; i++)
+			put_pixel(p + i * fb->bpp, c, fb->bpp);
+}
+
+static ssize_t decode(trfb_client_t *cl, const unsigned char *buf, size_t len, size_t *need, int compact)
+{
+	trfb_framebuffer_t *fb = cl->fb;
+	unsigned bpp = fb->bpp;
+	size_t sub = bpp + (compact? 4: 8);
+	size_t total;
+	uint32_t n, i;
+	unsigned sx, sy, sw, sh;
+	const unsigned char *p;
+
+	if (len < 4 + bpp) {
+		*need = 4 + bpp;
+		return 0;
+	}
+
+	n = ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+	if (n > (uint32_t)cl->rect.width * cl->rect.height) {
+		trfb_msg("[%s] Too many RRE subrectangles", cl->name);
+		return -1;
+	}
+
+	total = 4 + bpp + (size_t)n * sub;
+	if (len < total) {
+		*need = total;
+		return 0;
+	}
+
+	fill(fb, cl->rect.x, cl->rect.y, cl->rect.width, cl->rect.height, get_pixel(buf + 4, bpp));
+	for (i = 0, p = buf + 4 + bpp; i < n; i++, p += sub) {
+		if (compact) {
+			sx = p[bpp];
+			sy = p[bpp + 1];
+			sw = p[bpp + 2];
+			sh = p[bpp + 3];
+		} else {
+			sx = p[bpp] * 256 + p[bpp + 1];
+			sy = p[bpp + 2] * 256 + p[bpp + 3];
+			sw = p[bpp + 4] * 256 + p[bpp + 5];
+			sh = p[bpp + 6] * 256 + p[bpp + 7];
+		}
+
+		if (sx + sw > cl->rect.width || sy + sh > cl->rect.height) {
+			trfb_msg("[%s] RRE subrectangle is out of rectangle", cl->name);
+			return -1;
+		}
+
+		fill(fb, cl->rect.x + sx, cl->rect.y + sy, sw, sh, get_pixel(p, bpp));
+	}
+
+	*need = 0;
+
+	return total;
+}
+
+static ssize_t rre_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	return decode(cl, buf, len, need, 0);
+}
+
+static ssize_t corre_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	return decode(cl, buf, len, need, 1);
+}
+
+const trfb_decoder_t trfb_decoder_rre = {
+	TRFB_ENCODING_RRE,
+	"RRE",
+	NULL,
+	NULL,
+	rre_decode
+};
+
+const trfb_decoder_t trfb_decoder_corre = {
+	TRFB_ENCODING_CORRE,
+	"CoRRE",
+	NULL,
+	NULL,
+	corre_decode
+};
@@ -15,6 +15,10 @@ static void xsleep(unsigned ms)
 
 int trfb_server_start(trfb_server_t *srv)
 {
+	if (srv->flags & TRFB_SERVER_EVENT_LOOP) {
+		return trfb_loop_start(srv);
+	}
+
 	mtx_lock(&srv->lock);
 	if (srv->clients || srv->state != TRFB_STATE_STOPPED) {
 		mtx_unlock(&srv->lock);
@@ -84,7 +88,7 @@ static int server(void *srv_in)
 	srv->state = TRFB_STATE_WORKING;
 	mtx_unlock(&srv->lock);
 
-	if (listen(srv->sock, 8)) {
+	if (listen(srv->sock, 128)) {
 		trfb_msg("listen failed");
 		EXIT_THREAD(TRFB_STATE_ERROR);
 	}
@@ -125,33 +129,38 @@ static int server(void *srv_in)
 			}
 		}
 
+		/* Remove finished connections from the list */
 		prev = NULL;
 		f = NULL;
+		mtx_lock(&srv->lock);
 		for (con = srv->clients; con;) {
 			mtx_lock(&con->lock);
 			if (con->state != TRFB_STATE_WORKING) {
 				mtx_unlock(&con->lock);
-				thrd_join(con->thread, &rv);
 
 				if (prev) {
 					prev->next = con->next;
-					f = con;
-					con = con->next;
 				} else {
 					srv->clients = con->next;
-					f = con;
-					con = con->next;
 				}
 
-				if (f) {
-					trfb_connection_free(f);
-					f = NULL;
-				}
+				con->next = f;
+				f = con;
+				con = prev? prev->next: srv->clients;
 			} else {
 				mtx_unlock(&con->lock);
+				prev = con;
 				con = con->next;
 			}
 		}
+		mtx_unlock(&srv->lock);
+
+		while (f) {
+			con = f;
+			f = f->next;
+			thrd_join(con->thread, &rv);
+			trfb_connection_free(con);
+		}
 	}
 
 	return 0;
@@ -161,6 +170,10 @@ int trfb_server_stop(trfb_server_t *srv)
 {
 	int res = 0;
 
+	if (srv->flags & TRFB_SERVER_EVENT_LOOP) {
+		return trfb_loop_stop(srv);
+	}
+
 	mtx_lock(&srv->lock);
 	srv->state = TRFB_STATE_STOP;
 	mtx_unlock(&srv->lock);
@@ -230,22 +243,154 @@ int trfb_server_lock_fb(trfb_server_t *srv, int w)
 	mtx_lock(&srv->fb->lock);
 	if (w) {
 		srv->updated = 0;
+		srv->frame++;
+		/* Pixels will be changed so JPEG image is not equal to them */
+		srv->jpeg_len = 0;
 	} else {
 		srv->updated++;
 	}
 
+	mtx_lock(&srv->lock);
+	srv->fb_writing = w;
+	mtx_unlock(&srv->lock);
+
 	return 0;
 }
 
+/* Send damage to all the connections */
+static void flush_damage(trfb_server_t *srv)
+{
+	trfb_connection_t *con;
+
+	for (con = srv->clients; con; con = con->next) {
+		trfb_connection_damage(con, &srv->damage);
+	}
+
+	trfb_region_clear(&srv->damage);
+	srv->damage_marked = 0;
+}
+
 int trfb_server_unlock_fb(trfb_server_t *srv)
 {
 	if (!srv || !srv->fb)
 		return -1;
+
+	mtx_lock(&srv->lock);
+	if (srv->fb_writing && !srv->damage_marked && srv->tilehash) {
+		/* Application doesn't report damage: find it by hashes. Framebuffer is still locked. */
+		mtx_unlock(&srv->lock);
+		if (trfb_tilehash_update(srv->tilehash, srv->fb, &srv->damage)) {
+			trfb_region_add_rect(&srv->damage, 0, 0, srv->fb->width, srv->fb->height);
+		}
+		mtx_lock(&srv->lock);
+		srv->damage_marked = 1;
+	}
+
+	if (srv->fb_writing) {
+		if (!srv->damage_marked) {
+			/* Application doesn't report damage so everything could be changed */
+			trfb_region_add_rect(&srv->damage, 0, 0, srv->fb->width, srv->fb->height);
+		}
+		flush_damage(srv);
+		srv->fb_writing = 0;
+	}
+	mtx_unlock(&srv->lock);
+
 	mtx_unlock(&srv->fb->lock);
 
 	return 0;
 }
 
+int trfb_server_mark_dirty(trfb_server_t *srv, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	if (!srv || !srv->fb)
+		return -1;
+
+	mtx_lock(&srv->lock);
+	trfb_region_add_rect(&srv->damage, x, y, width, height);
+	srv->damage_marked = 1;
+	if (!srv->fb_writing) {
+		flush_damage(srv);
+	}
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_server_copy_rect(trfb_server_t *srv, unsigned sx, unsigned sy, unsigned dx, unsigned dy,
+		unsigned width, unsigned height)
+{
+	trfb_connection_t *con;
+
+	if (!srv || !srv->fb)
+		return -1;
+
+	if (sx > srv->fb->width || width > srv->fb->width - sx || dx > srv->fb->width || width > srv->fb->width - dx ||
+			sy > srv->fb->height || height > srv->fb->height - sy ||
+			dy > srv->fb->height || height > srv->fb->height - dy) {
+		trfb_msg("Copied rectangle is out of framebuffer");
+		return -1;
+	}
+
+	if (!width || !height || (sx == dx && sy == dy))
+		return 0;
+
+	trfb_framebuffer_copy_rect(srv->fb, sx, sy, dx, dy, width, height);
+
+	mtx_lock(&srv->lock);
+	for (con = srv->clients; con; con = con->next) {
+		mtx_lock(&con->lock);
+		if (con->copy_pending || con->converting || trfb_region_intersects(&con->damage, sx, sy, width, height) ||
+				trfb_region_intersects(&srv->damage, sx, sy, width, height)) {
+			/* Client doesn't have actual source pixels: destination will be sent */
+			trfb_region_add_rect(&con->damage, dx, dy, width, height);
+		} else {
+			con->copy_pending = 1;
+			con->copy.x = dx;
+			con->copy.y = dy;
+			con->copy.width = width;
+			con->copy.height = height;
+			con->copy_sx = sx;
+			con->copy_sy = sy;
+			/* Old damage of destination is overwritten */
+			trfb_region_clear_rect(&con->damage, dx, dy, width, height);
+		}
+		mtx_unlock(&con->lock);
+	}
+
+	srv->damage_marked = 1;
+	if (!srv->fb_writing) {
+		flush_damage(srv);
+	}
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_server_resize(trfb_server_t *srv, unsigned width, unsigned height)
+{
+	int rv;
+
+	if (!srv || !srv->fb)
+		return -1;
+
+	trfb_server_lock_fb(srv, 1);
+	if (trfb_framebuffer_resize(srv->fb, width, height)) {
+		trfb_server_unlock_fb(srv);
+		return -1;
+	}
+
+	/* Connections see damage of new size on unlock and resize their state */
+	mtx_lock(&srv->lock);
+	rv = trfb_region_resize(&srv->damage, width, height);
+	trfb_region_add_rect(&srv->damage, 0, 0, width, height);
+	srv->damage_marked = 1;
+	mtx_unlock(&srv->lock);
+	trfb_server_unlock_fb(srv);
+
+	return rv;
+}
+
 int trfb_server_add_event(trfb_server_t *srv, trfb_event_t *event)
 {
 	if (!srv || !event) {
@@ -0,0 +1,1267 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Tight encoding. Every rectangle (at most 256x256) is analysed once:
+ *   - one colour is sent as fill;
+ *   - two colours are sent as 1-bit bitmap (mono palette filter);
+ *   - up to 256 colours are sent as 8-bit indexes (palette filter);
+ *   - other rectangles are sent as JPEG if client asked for quality level, as gradient filtered
+ *     data if image is smooth or as copy of pixels.
+ * Filtered data is compressed by one of four zlib streams which live as long as connection does.
+ * Colours are sent as TPIXELs: 3 bytes R, G, B for 32-bit formats of depth 24 and as pixels in other ones.
+ */
+
+#if HAVE_ZLIB_H
+#include <zlib.h>
+#if HAVE_JPEGLIB_H
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#define TIGHT_MAX 256
+#define TIGHT_STREAMS 4
+/* Shorter data is sent without compression */
+#define TIGHT_MIN_TO_COMPRESS 12
+#define TIGHT_PALETTE_MAX 256
+
+#define TIGHT_FILL 0x80
+#define TIGHT_JPEG 0x90
+#define TIGHT_EXPLICIT_FILTER 0x40
+
+#define TIGHT_FILTER_COPY 0
+#define TIGHT_FILTER_PALETTE 1
+#define TIGHT_FILTER_GRADIENT 2
+
+/* Streams for different kinds of data */
+#define STREAM_COPY 0
+#define STREAM_MONO 1
+#define STREAM_INDEXED 2
+#define STREAM_GRADIENT 3
+
+/* Gradient filter is used if average prediction error of component is less than this */
+#define GRADIENT_THRESHOLD 16
+
+typedef struct tpixel {
+	/* Bytes per pixel and per TPIXEL */
+	unsigned bpp, size;
+	int big_endian;
+	int true_color;
+	unsigned rmax, gmax, bmax;
+	unsigned rshift, gshift, bshift;
+} tpixel_t;
+
+static void tpixel_init(tpixel_t *tp, const trfb_format_t *fmt)
+{
+	tp->bpp = fmt->bpp / 8;
+	tp->big_endian = fmt->big_endian;
+	tp->true_color = fmt->true_color;
+	tp->rmax = fmt->rmax;
+	tp->gmax = fmt->gmax;
+	tp->bmax = fmt->bmax;
+	tp->rshift = fmt->rshift;
+	tp->gshift = fmt->gshift;
+	tp->bshift = fmt->bshift;
+
+	tp->size = tp->bpp;
+	if (fmt->bpp == 32 && fmt->depth == 24 && fmt->true_color && fmt->rmax == 255 && fmt->gmax == 255 && fmt->bmax == 255)
+		tp->size = 3;
+}
+
+/* Pixel in memory byte order (the same is written back by set_pixel) */
+static inline uint32_t get_pixel(const unsigned char *p, unsigned bpp)
+{
+	uint16_t v16;
+	uint32_t v32;
+
+	if (bpp == 1)
+		return *p;
+
+	if (bpp == 2) {
+		memcpy(&v16, p, 2);
+		return v16;
+	}
+
+	memcpy(&v32, p, 4);
+	return v32;
+}
+
+static inline void set_pixel(unsigned char *p, uint32_t c, unsigned bpp)
+{
+	uint16_t v16 = c;
+
+	if (bpp == 1)
+		*p = c;
+	else if (bpp == 2)
+		memcpy(p, &v16, 2);
+	else
+		memcpy(p, &c, 4);
+}
+
+/* Value of pixel in format byte order */
+static inline uint32_t get_value(const unsigned char *p, const tpixel_t *tp)
+{
+	if (tp->bpp == 1)
+		return p[0];
+
+	if (tp->bpp == 2)
+		return tp->big_endian? (p[0] << 8) | p[1]: p[0] | (p[1] << 8);
+
+	if (tp->big_endian)
+		return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void put_value(unsigned char *p, uint32_t v, const tpixel_t *tp)
+{
+	unsigned i;
+
+	for (i = 0; i < tp->bpp; i++)
+		p[tp->big_endian? tp->bpp - 1 - i: i] = v >> (8 * i);
+}
+
+static inline unsigned char* put_tpixel(unsigned char *o, const unsigned char *p, const tpixel_t *tp)
+{
+	uint32_t v;
+
+	if (tp->size != 3) {
+		memcpy(o, p, tp->size);
+		return o + tp->size;
+	}
+
+	v = get_value(p, tp);
+	o[0] = v >> tp->rshift;
+	o[1] = v >> tp->gshift;
+	o[2] = v >> tp->bshift;
+
+	return o + 3;
+}
+
+static inline unsigned char* put_length(unsigned char *o, size_t len)
+{
+	*o++ = (len & 0x7f) | (len > 0x7f? 0x80: 0);
+	if (len > 0x7f) {
+		*o++ = ((len >> 7) & 0x7f) | (len > 0x3fff? 0x80: 0);
+		if (len > 0x3fff)
+			*o++ = len >> 14;
+	}
+
+	return o;
+}
+
+/* Palette of rectangle: open addressing hash of colours */
+typedef struct palette {
+	uint32_t colours[TIGHT_PALETTE_MAX];
+	unsigned n;
+	/* Index + 1 of colour, 0 - empty slot */
+	uint16_t hash[1024];
+} palette_t;
+
+static inline unsigned hash_pixel(uint32_t c)
+{
+	return (c * 2654435761u) >> 22;
+}
+
+/* Returns index of colour or -1 if there are more than max colours */
+static inline int palette_insert(palette_t *pal, uint32_t c, unsigned max)
+{
+	unsigned h = hash_pixel(c);
+
+	for (; pal->hash[h]; h = (h + 1) & 1023)
+		if (pal->colours[pal->hash[h] - 1] == c)
+			return pal->hash[h] - 1;
+
+	if (pal->n >= max)
+		return -1;
+
+	pal->colours[pal->n] = c;
+	pal->hash[h] = ++pal->n;
+
+	return pal->n - 1;
+}
+
+static inline unsigned palette_index(const palette_t *pal, uint32_t c)
+{
+	unsigned h = hash_pixel(c);
+
+	while (pal->colours[pal->hash[h] - 1] != c)
+		h = (h + 1) & 1023;
+
+	return pal->hash[h] - 1;
+}
+
+/* Count colours of rectangle. Returns 0 if there are more than max colours. */
+static unsigned count_colours(palette_t *pal, const unsigned char *p, size_t stride, unsigned w, unsigned h,
+		unsigned bpp, unsigned max)
+{
+	unsigned x, y;
+	uint32_t c, last;
+
+	pal->n = 0;
+	memset(pal->hash, 0, sizeof(pal->hash));
+
+	last = get_pixel(p, bpp);
+	palette_insert(pal, last, max);
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			c = get_pixel(p + y * stride + x * bpp, bpp);
+			if (c != last && palette_insert(pal, c, max) < 0)
+				return 0;
+			last = c;
+		}
+	}
+
+	return pal->n;
+}
+
+static inline unsigned clamp(int v)
+{
+	return v < 0? 0: v > 255? 255: v;
+}
+
+/* Components of TPIXEL are predicted from left, upper and upper left pixels (0 out of rectangle) */
+static inline void gradient_row(unsigned char *o, const unsigned char *cur, const unsigned char *up, unsigned w)
+{
+	unsigned x;
+
+	for (x = 0; x < 3; x++)
+		o[x] = cur[x] - up[x];
+	for (; x < w * 3; x++)
+		o[x] = cur[x] - clamp(cur[x - 3] + up[x] - up[x - 3]);
+}
+
+static inline void ungradient_row(unsigned char *cur, const unsigned char *in, const unsigned char *up, unsigned w)
+{
+	unsigned x;
+
+	for (x = 0; x < 3; x++)
+		cur[x] = in[x] + up[x];
+	for (; x < w * 3; x++)
+		cur[x] = in[x] + clamp(cur[x - 3] + up[x] - up[x - 3]);
+}
+
+/* Sampled average prediction error of gradient filter */
+static int is_smooth(const unsigned char *p, size_t stride, unsigned w, unsigned h, const tpixel_t *tp)
+{
+	unsigned char row[2][TIGHT_MAX * 3], err[TIGHT_MAX * 3];
+	unsigned long sum = 0, cnt = 0;
+	unsigned x, y, k;
+	uint32_t v;
+
+	if (w < 4 || h < 4)
+		return 0;
+
+	for (y = 1; y < h; y += 4) {
+		for (k = 0; k < 2; k++) {
+			for (x = 0; x < w; x++) {
+				v = get_value(p + (y - 1 + k) * stride + x * 4, tp);
+				row[k][x * 3] = v >> tp->rshift;
+				row[k][x * 3 + 1] = v >> tp->gshift;
+				row[k][x * 3 + 2] = v >> tp->bshift;
+			}
+		}
+
+		gradient_row(err, row[1], row[0], w);
+		for (x = 3; x < w * 3; x++)
+			sum += err[x] < 128? err[x]: 256 - err[x];
+		cnt += w * 3 - 3;
+	}
+
+	return sum < cnt * GRADIENT_THRESHOLD;
+}
+
+typedef struct tight_state {
+	z_stream zs[TIGHT_STREAMS];
+	int zinit[TIGHT_STREAMS];
+	int level[TIGHT_STREAMS];
+	/* Filtered data of rectangle */
+	unsigned char *data;
+	/* Compressed data of rectangle */
+	unsigned char *out;
+	size_t out_len, out_size;
+	unsigned char rows[2][TIGHT_MAX * 3];
+#if HAVE_JPEGLIB_H
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_destination_mgr dest;
+	jmp_buf jmp;
+	int jinit;
+#endif
+} tight_state_t;
+
+static void* tight_create(trfb_connection_t *con)
+{
+	tight_state_t *st;
+
+	st = calloc(1, sizeof(tight_state_t));
+	if (!st)
+		return NULL;
+
+	st->data = malloc(TIGHT_MAX * TIGHT_MAX * 4);
+	st->out_size = 65536;
+	st->out = malloc(st->out_size);
+	if (!st->data || !st->out) {
+		free(st->data);
+		free(st->out);
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+static void tight_destroy(void *state)
+{
+	tight_state_t *st = state;
+	unsigned i;
+
+	for (i = 0; i < TIGHT_STREAMS; i++)
+		if (st->zinit[i])
+			deflateEnd(&st->zs[i]);
+#if HAVE_JPEGLIB_H
+	if (st->jinit)
+		jpeg_destroy_compress(&st->cinfo);
+#endif
+	free(st->data);
+	free(st->out);
+	free(st);
+}
+
+static int grow_out(tight_state_t *st)
+{
+	unsigned char *p;
+
+	p = realloc(st->out, st->out_size * 2);
+	if (!p)
+		return -1;
+	st->out = p;
+	st->out_size *= 2;
+
+	return 0;
+}
+
+/* Compress data by stream to st->out */
+static int compress_data(trfb_connection_t *con, tight_state_t *st, unsigned id, size_t len)
+{
+	z_stream *zs = st->zs + id;
+	int rv;
+
+	/* Output depends on stream of this connection */
+	con->capture_private = 1;
+	st->out_len = 0;
+	if (!st->zinit[id]) {
+		if (deflateInit(zs, con->compress_level) != Z_OK)
+			return -1;
+		st->zinit[id] = 1;
+		st->level[id] = con->compress_level;
+	}
+
+	if (st->level[id] != con->compress_level) {
+		/* deflateParams could write the end of previous block: it is sent with this data */
+		zs->next_in = NULL;
+		zs->avail_in = 0;
+		zs->next_out = st->out;
+		zs->avail_out = st->out_size;
+		if (deflateParams(zs, con->compress_level, Z_DEFAULT_STRATEGY) == Z_OK)
+			st->level[id] = con->compress_level;
+		st->out_len = st->out_size - zs->avail_out;
+	}
+
+	zs->next_in = st->data;
+	zs->avail_in = len;
+	do {
+		if (st->out_size - st->out_len < 64 && grow_out(st))
+			return -1;
+
+		zs->next_out = st->out + st->out_len;
+		zs->avail_out = st->out_size - st->out_len;
+		rv = deflate(zs, Z_SYNC_FLUSH);
+		st->out_len = st->out_size - zs->avail_out;
+		if (rv != Z_OK && rv != Z_BUF_ERROR)
+			return -1;
+	} while (zs->avail_in || zs->avail_out == 0);
+
+	return 0;
+}
+
+/* Send header and data of basic compression */
+static int send_basic(trfb_connection_t *con, tight_state_t *st, unsigned char *hdr, unsigned char *o, unsigned id, size_t len)
+{
+	if (len < TIGHT_MIN_TO_COMPRESS) {
+		memcpy(o, st->data, len);
+		return trfb_connection_queue(con, hdr, o + len - hdr);
+	}
+
+	if (compress_data(con, st, id, len)) {
+		/* Stream state is unknown now and client could not decode anything more */
+		trfb_msg("[%s] Tight compression failed", con->name);
+		return -1;
+	}
+
+	o = put_length(o, st->out_len);
+	if (trfb_connection_queue(con, hdr, o - hdr) ||
+			trfb_connection_queue(con, st->out, st->out_len))
+		return -1;
+
+	return 0;
+}
+
+#if HAVE_JPEGLIB_H
+static void jpeg_error(j_common_ptr cinfo)
+{
+	tight_state_t *st = cinfo->client_data;
+
+	longjmp(st->jmp, 1);
+}
+
+static void dest_init(j_compress_ptr cinfo)
+{
+	tight_state_t *st = cinfo->client_data;
+
+	st->dest.next_output_byte = st->out;
+	st->dest.free_in_buffer = st->out_size;
+}
+
+static boolean dest_empty(j_compress_ptr cinfo)
+{
+	tight_state_t *st = cinfo->client_data;
+	size_t len = st->out_size;
+
+	if (grow_out(st))
+		jpeg_error((j_common_ptr)cinfo);
+
+	st->dest.next_output_byte = st->out + len;
+	st->dest.free_in_buffer = st->out_size - len;
+
+	return TRUE;
+}
+
+static void dest_term(j_compress_ptr cinfo)
+{
+	tight_state_t *st = cinfo->client_data;
+
+	st->out_len = st->out_size - st->dest.free_in_buffer;
+}
+
+/* JPEG is used if client asked for quality level */
+static int jpeg_allowed(trfb_connection_t *con)
+{
+	int32_t i;
+
+	if (con->jpeg_quality <= 0 || con->format.bpp < 16 || !con->format.rmax || !con->format.gmax || !con->format.bmax)
+		return 0;
+
+	for (i = TRFB_ENCODING_QUALITY_LEVEL0; i <= TRFB_ENCODING_QUALITY_LEVEL9; i++)
+		if (trfb_connection_has_encoding(con, i))
+			return 1;
+
+	for (i = TRFB_ENCODING_FINE_QUALITY_LEVEL0; i <= TRFB_ENCODING_FINE_QUALITY_LEVEL100; i++)
+		if (trfb_connection_has_encoding(con, i))
+			return 1;
+
+	return 0;
+}
+
+static void compress_rows(tight_state_t *st, const unsigned char *p, size_t stride, unsigned w, unsigned h, const tpixel_t *tp)
+{
+	JSAMPROW row = st->rows[0];
+	unsigned x, y;
+	uint32_t v;
+
+	for (y = 0; y < h; y++, p += stride) {
+		for (x = 0; x < w; x++) {
+			v = get_value(p + x * tp->bpp, tp);
+			row[x * 3] = (((v >> tp->rshift) & tp->rmax) * 255 + tp->rmax / 2) / tp->rmax;
+			row[x * 3 + 1] = (((v >> tp->gshift) & tp->gmax) * 255 + tp->gmax / 2) / tp->gmax;
+			row[x * 3 + 2] = (((v >> tp->bshift) & tp->bmax) * 255 + tp->bmax / 2) / tp->bmax;
+		}
+		jpeg_write_scanlines(&st->cinfo, &row, 1);
+	}
+}
+
+/* Errors of libjpeg return to setjmp here, so the work is done by other functions */
+static int encode_jpeg(trfb_connection_t *con, tight_state_t *st, const unsigned char *p, size_t stride,
+		unsigned w, unsigned h, const tpixel_t *tp)
+{
+	if (!st->jinit) {
+		st->cinfo.err = jpeg_std_error(&st->jerr);
+		st->jerr.error_exit = jpeg_error;
+		st->cinfo.client_data = st;
+		if (setjmp(st->jmp))
+			return -1;
+		jpeg_create_compress(&st->cinfo);
+		st->dest.init_destination = dest_init;
+		st->dest.empty_output_buffer = dest_empty;
+		st->dest.term_destination = dest_term;
+		st->cinfo.dest = &st->dest;
+		st->jinit = 1;
+	}
+
+	if (setjmp(st->jmp)) {
+		jpeg_abort_compress(&st->cinfo);
+		return -1;
+	}
+
+	st->cinfo.image_width = w;
+	st->cinfo.image_height = h;
+	st->cinfo.input_components = 3;
+	st->cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&st->cinfo);
+	/* Default of libjpeg is 4:2:0 */
+	if (con->jpeg_subsampling == TRFB_SUBSAMPLING_GRAY) {
+		jpeg_set_colorspace(&st->cinfo, JCS_GRAYSCALE);
+	} else if (con->jpeg_subsampling == TRFB_SUBSAMPLING_444) {
+		st->cinfo.comp_info[0].h_samp_factor = 1;
+		st->cinfo.comp_info[0].v_samp_factor = 1;
+	} else if (con->jpeg_subsampling == TRFB_SUBSAMPLING_422) {
+		st->cinfo.comp_info[0].h_samp_factor = 2;
+		st->cinfo.comp_info[0].v_samp_factor = 1;
+	}
+	jpeg_set_quality(&st->cinfo, con->jpeg_quality, TRUE);
+	jpeg_start_compress(&st->cinfo, TRUE);
+	compress_rows(st, p, stride, w, h, tp);
+	jpeg_finish_compress(&st->cinfo);
+
+	return 0;
+}
+#else
+static int jpeg_allowed(trfb_connection_t *con)
+{
+	return 0;
+}
+#endif
+
+/* Like ZRLE: solid areas are fills, two-colour tiles are bitmaps compressed by zlib, others are compressed pixels
+ * or JPEG of about 1.5 bits per pixel. Analysis and zlib are two bytes per pixel, JPEG is four. */
+static size_t tight_estimate(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	unsigned tp = con->format.bpp == 32 && con->format.depth == 24? 3: con->format.bpp / 8;
+	unsigned solid, two;
+	double rich = jpeg_allowed(con)? 48 + 1024: 192.0 * tp + 512;
+
+	trfb_connection_content(con, &solid, &two);
+
+	return (double)width * height / 256 *
+		((solid + two) * 512.0 + solid * (1.0 + tp) / 16 + two * (1.0 + 2 * tp + 32) / 2 +
+		 (1000 - solid - two) * rich) / 1000;
+}
+
+static int tight_encode(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	tight_state_t *st = state;
+	trfb_framebuffer_t *fb = con->fb;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	const unsigned char *p = (const unsigned char*)fb->pixels + y * stride + x * fb->bpp;
+	unsigned char hdr[8 + TIGHT_PALETTE_MAX * 4 + TIGHT_MIN_TO_COMPRESS];
+	unsigned char colour[4];
+	unsigned char *o = hdr, *d;
+	unsigned i, j, n, max;
+	palette_t pal;
+	tpixel_t tp;
+	trfb_format_t fmt;
+	unsigned char b;
+
+	trfb_framebuffer_format(fb, &fmt);
+	tpixel_init(&tp, &fmt);
+
+	if (trfb_connection_rect_header(con, x, y, width, height, TRFB_ENCODING_TIGHT))
+		return -1;
+
+	/* Indexed palette is not smaller than 8-bit pixels */
+	max = tp.size == 1? 2: TIGHT_PALETTE_MAX;
+	if (max > width * height / 2)
+		max = width * height / 2 > 2? width * height / 2: 2;
+	n = count_colours(&pal, p, stride, width, height, fb->bpp, max);
+
+	if (n == 1) {
+		*o++ = TIGHT_FILL;
+		o = put_tpixel(o, p, &tp);
+		return trfb_connection_queue(con, hdr, o - hdr);
+	}
+
+	if (n) {
+		*o++ = ((n == 2? STREAM_MONO: STREAM_INDEXED) << 4) | TIGHT_EXPLICIT_FILTER;
+		*o++ = TIGHT_FILTER_PALETTE;
+		*o++ = n - 1;
+		for (i = 0; i < n; i++) {
+			set_pixel(colour, pal.colours[i], fb->bpp);
+			o = put_tpixel(o, colour, &tp);
+		}
+
+		d = st->data;
+		for (j = 0; j < height; j++, p += stride) {
+			if (n > 2) {
+				for (i = 0; i < width; i++)
+					*d++ = palette_index(&pal, get_pixel(p + i * fb->bpp, fb->bpp));
+				continue;
+			}
+
+			/* Rows are padded to byte, the first pixel is in the most significant bit */
+			b = 0;
+			for (i = 0; i < width; i++) {
+				b = (b << 1) | (get_pixel(p + i * fb->bpp, fb->bpp) != pal.colours[0]);
+				if ((i & 7) == 7) {
+					*d++ = b;
+					b = 0;
+				}
+			}
+			if (i & 7)
+				*d++ = b << (8 - (i & 7));
+		}
+
+		return send_basic(con, st, hdr, o, n == 2? STREAM_MONO: STREAM_INDEXED, d - st->data);
+	}
+
+#if HAVE_JPEGLIB_H
+	if (jpeg_allowed(con)) {
+		if (encode_jpeg(con, st, p, stride, width, height, &tp)) {
+			trfb_msg("[%s] JPEG compression failed", con->name);
+			return -1;
+		}
+
+		*o++ = TIGHT_JPEG;
+		o = put_length(o, st->out_len);
+		if (trfb_connection_queue(con, hdr, o - hdr) ||
+				trfb_connection_queue(con, st->out, st->out_len))
+			return -1;
+
+		return 0;
+	}
+#endif
+
+	d = st->data;
+	if (tp.size == 3 && is_smooth(p, stride, width, height, &tp)) {
+		*o++ = (STREAM_GRADIENT << 4) | TIGHT_EXPLICIT_FILTER;
+		*o++ = TIGHT_FILTER_GRADIENT;
+
+		memset(st->rows[0], 0, width * 3);
+		for (j = 0; j < height; j++, p += stride, d += width * 3) {
+			for (i = 0; i < width; i++)
+				put_tpixel(st->rows[1] + i * 3, p + i * 4, &tp);
+			gradient_row(d, st->rows[1], st->rows[0], width);
+			memcpy(st->rows[0], st->rows[1], width * 3);
+		}
+
+		return send_basic(con, st, hdr, o, STREAM_GRADIENT, d - st->data);
+	}
+
+	*o++ = STREAM_COPY << 4;
+	for (j = 0; j < height; j++, p += stride) {
+		if (tp.size == fb->bpp) {
+			memcpy(d, p, (size_t)width * fb->bpp);
+			d += (size_t)width * fb->bpp;
+		} else {
+			for (i = 0; i < width; i++)
+				d = put_tpixel(d, p + i * 4, &tp);
+		}
+	}
+
+	return send_basic(con, st, hdr, o, STREAM_COPY, d - st->data);
+}
+
+const trfb_encoder_t trfb_encoder_tight = {
+	TRFB_ENCODING_TIGHT,
+	"Tight",
+	TIGHT_MAX, TIGHT_MAX,
+	tight_create,
+	tight_destroy,
+	tight_estimate,
+	tight_encode,
+	TRFB_ENCODER_SHARED
+};
+
+#if HAVE_JPEGLIB_H
+/* JPEG decompressor reading from memory to framebuffer */
+typedef struct jpeg_reader {
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_source_mgr src;
+	jmp_buf jmp;
+	int init;
+	/* Row of RGB pixels */
+	unsigned char *row;
+	size_t row_size;
+	/* Unused byte of pixel for direct output */
+	unsigned pad;
+} jpeg_reader_t;
+
+static void reader_error(j_common_ptr cinfo)
+{
+	jpeg_reader_t *jr = cinfo->client_data;
+
+	longjmp(jr->jmp, 1);
+}
+
+static void src_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean src_fill(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+
+	/* Data is not complete: insert fake EOI marker */
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+
+	return TRUE;
+}
+
+static void src_skip(j_decompress_ptr cinfo, long len)
+{
+	if (len <= 0)
+		return;
+
+	if ((size_t)len > cinfo->src->bytes_in_buffer)
+		len = cinfo->src->bytes_in_buffer;
+	cinfo->src->next_input_byte += len;
+	cinfo->src->bytes_in_buffer -= len;
+}
+
+static void src_term(j_decompress_ptr cinfo)
+{
+}
+
+static void reader_free(jpeg_reader_t *jr)
+{
+	if (jr->init)
+		jpeg_destroy_decompress(&jr->dinfo);
+	free(jr->row);
+}
+
+/* libjpeg could write 32-bit pixels in memory order itself (JCS_RGB if it could not) */
+static J_COLOR_SPACE direct_space(const tpixel_t *tp)
+{
+#ifdef JCS_EXTENSIONS
+	unsigned r, g, b;
+
+	if (tp->bpp != 4 || tp->rmax != 255 || tp->gmax != 255 || tp->bmax != 255 ||
+			tp->rshift % 8 || tp->gshift % 8 || tp->bshift % 8)
+		return JCS_RGB;
+
+	/* Byte positions of components */
+	r = tp->big_endian? 3 - tp->rshift / 8: tp->rshift / 8;
+	g = tp->big_endian? 3 - tp->gshift / 8: tp->gshift / 8;
+	b = tp->big_endian? 3 - tp->bshift / 8: tp->bshift / 8;
+	if (r == 0 && g == 1 && b == 2)
+		return JCS_EXT_RGBX;
+	if (r == 2 && g == 1 && b == 0)
+		return JCS_EXT_BGRX;
+	if (r == 1 && g == 2 && b == 3)
+		return JCS_EXT_XRGB;
+	if (r == 3 && g == 2 && b == 1)
+		return JCS_EXT_XBGR;
+#endif
+
+	return JCS_RGB;
+}
+
+static inline void put_rgb(unsigned char *p, const unsigned char *c, const tpixel_t *tp)
+{
+	put_value(p, ((c[0] * tp->rmax + 127) / 255) << tp->rshift |
+			((c[1] * tp->gmax + 127) / 255) << tp->gshift |
+			((c[2] * tp->bmax + 127) / 255) << tp->bshift, tp);
+}
+
+static void read_rows(jpeg_reader_t *jr, trfb_framebuffer_t *fb, unsigned x, unsigned y, const tpixel_t *tp)
+{
+	size_t stride = (size_t)fb->width * fb->bpp;
+	unsigned char *d = (unsigned char*)fb->pixels + y * stride + x * fb->bpp;
+	JSAMPROW row;
+	unsigned i;
+
+	for (; jr->dinfo.output_scanline < jr->dinfo.output_height; d += stride) {
+		if (jr->dinfo.out_color_space != JCS_RGB) {
+			row = d;
+			jpeg_read_scanlines(&jr->dinfo, &row, 1);
+			/* libjpeg fills unused byte with 0xff, but we keep it zero */
+			for (i = 0; i < jr->dinfo.output_width; i++)
+				d[i * 4 + jr->pad] = 0;
+			continue;
+		}
+
+		row = jr->row;
+		jpeg_read_scanlines(&jr->dinfo, &row, 1);
+		for (i = 0; i < jr->dinfo.output_width; i++)
+			put_rgb(d + i * fb->bpp, row + i * 3, tp);
+	}
+}
+
+/* Decode JPEG image to rectangle of framebuffer. Image must be of the rectangle size. */
+static int reader_decode(jpeg_reader_t *jr, const unsigned char *p, size_t len, trfb_framebuffer_t *fb,
+		unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	unsigned char *row;
+	trfb_format_t fmt;
+	tpixel_t tp;
+
+	trfb_framebuffer_format(fb, &fmt);
+	tpixel_init(&tp, &fmt);
+	if (!tp.true_color || tp.bpp < 2)
+		return -1;
+
+	if (jr->row_size < (size_t)width * 3) {
+		row = realloc(jr->row, (size_t)width * 3);
+		if (!row)
+			return -1;
+		jr->row = row;
+		jr->row_size = (size_t)width * 3;
+	}
+
+	if (!jr->init) {
+		jr->dinfo.err = jpeg_std_error(&jr->jerr);
+		jr->jerr.error_exit = reader_error;
+		jr->dinfo.client_data = jr;
+		if (setjmp(jr->jmp))
+			return -1;
+		jpeg_create_decompress(&jr->dinfo);
+		jr->src.init_source = src_init;
+		jr->src.fill_input_buffer = src_fill;
+		jr->src.skip_input_data = src_skip;
+		jr->src.resync_to_restart = jpeg_resync_to_restart;
+		jr->src.term_source = src_term;
+		jr->dinfo.src = &jr->src;
+		jr->init = 1;
+	}
+
+	if (setjmp(jr->jmp)) {
+		jpeg_abort_decompress(&jr->dinfo);
+		return -1;
+	}
+
+	jr->src.next_input_byte = p;
+	jr->src.bytes_in_buffer = len;
+	jpeg_read_header(&jr->dinfo, TRUE);
+	jr->dinfo.out_color_space = direct_space(&tp);
+	jr->pad = 6 - tp.rshift / 8 - tp.gshift / 8 - tp.bshift / 8;
+	if (tp.big_endian)
+		jr->pad = 3 - jr->pad;
+	jpeg_start_decompress(&jr->dinfo);
+	if (jr->dinfo.output_width != width || jr->dinfo.output_height != height) {
+		jpeg_abort_decompress(&jr->dinfo);
+		return -1;
+	}
+
+	read_rows(jr, fb, x, y, &tp);
+	jpeg_finish_decompress(&jr->dinfo);
+
+	return 0;
+}
+#endif
+
+/* Decoder: all data of rectangle is collected before decoding */
+typedef struct tight_dstate {
+	z_stream zs[TIGHT_STREAMS];
+	int zinit[TIGHT_STREAMS];
+	unsigned char *buf;
+	size_t size;
+	unsigned char rows[2][TIGHT_MAX * 3];
+#if HAVE_JPEGLIB_H
+	jpeg_reader_t jr;
+#endif
+} tight_dstate_t;
+
+static void* tight_dcreate(trfb_client_t *cl)
+{
+	return calloc(1, sizeof(tight_dstate_t));
+}
+
+static void tight_ddestroy(void *state)
+{
+	tight_dstate_t *st = state;
+	unsigned i;
+
+	for (i = 0; i < TIGHT_STREAMS; i++)
+		if (st->zinit[i])
+			inflateEnd(&st->zs[i]);
+#if HAVE_JPEGLIB_H
+	reader_free(&st->jr);
+#endif
+	free(st->buf);
+	free(st);
+}
+
+/* Read compact length. Returns count of bytes or 0 if there is not enought data. */
+static size_t get_length(const unsigned char *p, size_t len, size_t *val)
+{
+	size_t i;
+
+	*val = 0;
+	for (i = 0; i < 3 && i < len; i++) {
+		*val |= (size_t)(i < 2? p[i] & 0x7f: p[i]) << (7 * i);
+		if (i == 2 || !(p[i] & 0x80))
+			return i + 1;
+	}
+
+	return 0;
+}
+
+/* TPIXEL to pixel in memory order */
+static inline void get_tpixel(unsigned char *p, const unsigned char *t, const tpixel_t *tp)
+{
+	if (tp->size == 3)
+		put_value(p, (uint32_t)t[0] << tp->rshift | (uint32_t)t[1] << tp->gshift | (uint32_t)t[2] << tp->bshift, tp);
+	else
+		memcpy(p, t, tp->size);
+}
+
+/* Inflate len bytes to exactly size bytes of st->buf */
+static int inflate_data(trfb_client_t *cl, tight_dstate_t *st, unsigned id, const unsigned char *p, size_t len, size_t size)
+{
+	z_stream *zs = st->zs + id;
+	unsigned char *b;
+	int rv;
+
+	/* Some space is left for the end of flushed block */
+	if (st->size < size + 64) {
+		b = realloc(st->buf, size + 64);
+		if (!b)
+			return -1;
+		st->buf = b;
+		st->size = size + 64;
+	}
+
+	if (!st->zinit[id]) {
+		if (inflateInit(zs) != Z_OK)
+			return -1;
+		st->zinit[id] = 1;
+	}
+
+	zs->next_in = (unsigned char*)p;
+	zs->avail_in = len;
+	zs->next_out = st->buf;
+	zs->avail_out = st->size;
+	while (zs->avail_in) {
+		rv = inflate(zs, Z_SYNC_FLUSH);
+		if ((rv != Z_OK && rv != Z_BUF_ERROR) || zs->avail_out == 0) {
+			trfb_msg("[%s] Tight inflate failed", cl->name);
+			return -1;
+		}
+		if (rv == Z_BUF_ERROR)
+			break;
+	}
+
+	if (st->size - zs->avail_out != size) {
+		trfb_msg("[%s] Invalid length of Tight data", cl->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Streams are reset by bits of control byte when all data of rectangle is received */
+static void reset_streams(tight_dstate_t *st, unsigned ctrl)
+{
+	unsigned i;
+
+	for (i = 0; i < TIGHT_STREAMS; i++)
+		if ((ctrl & (1 << i)) && st->zinit[i])
+			inflateReset(&st->zs[i]);
+}
+
+static ssize_t tight_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	tight_dstate_t *st = state;
+	trfb_framebuffer_t *fb = cl->fb;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	unsigned char *d = (unsigned char*)fb->pixels + cl->rect.y * stride + cl->rect.x * fb->bpp;
+	unsigned w = cl->rect.width, h = cl->rect.height;
+	unsigned char pal[TIGHT_PALETTE_MAX][4];
+	unsigned type, filter = TIGHT_FILTER_COPY, n = 0, i, x, y;
+	const unsigned char *data;
+	size_t pos = 1, size, clen, l;
+	trfb_format_t fmt;
+	tpixel_t tp;
+
+	trfb_framebuffer_format(fb, &fmt);
+	tpixel_init(&tp, &fmt);
+
+	*need = 1;
+	if (len < 1)
+		return 0;
+
+	type = buf[0] >> 4;
+	if (type > 9) {
+		trfb_msg("[%s] Unsupported Tight compression %u", cl->name, type);
+		return -1;
+	}
+
+	if (type == 8) {
+		*need = 1 + tp.size;
+		if (len < *need)
+			return 0;
+		reset_streams(st, buf[0]);
+		get_tpixel(pal[0], buf + 1, &tp);
+		for (y = 0; y < h; y++, d += stride)
+			for (x = 0; x < w; x++)
+				memcpy(d + x * fb->bpp, pal[0], fb->bpp);
+		*need = 0;
+		return 1 + tp.size;
+	}
+
+	/* Only JPEG rectangles could be wider */
+	if (type < 8 && w > TIGHT_MAX) {
+		trfb_msg("[%s] Tight rectangle is too wide", cl->name);
+		return -1;
+	}
+
+	if (type < 8 && (type & 4)) {
+		*need = pos + 1;
+		if (len < *need)
+			return 0;
+		filter = buf[pos++];
+	}
+
+	if (filter == TIGHT_FILTER_PALETTE) {
+		*need = pos + 1;
+		if (len < *need)
+			return 0;
+		n = buf[pos++] + 1;
+		*need = pos + n * tp.size;
+		if (len < *need)
+			return 0;
+		for (i = 0; i < n; i++, pos += tp.size)
+			get_tpixel(pal[i], buf + pos, &tp);
+		size = n == 2? (size_t)h * ((w + 7) / 8): (size_t)w * h;
+	} else if (filter == TIGHT_FILTER_GRADIENT && tp.size == 3) {
+		size = (size_t)w * h * 3;
+	} else if (filter == TIGHT_FILTER_COPY) {
+		size = (size_t)w * h * tp.size;
+	} else {
+		trfb_msg("[%s] Unsupported Tight filter %u", cl->name, filter);
+		return -1;
+	}
+
+	if (type != 9 && size < TIGHT_MIN_TO_COMPRESS) {
+		*need = pos + size;
+		if (len < *need)
+			return 0;
+		reset_streams(st, buf[0]);
+		data = buf + pos;
+		pos += size;
+	} else {
+		l = get_length(buf + pos, len - pos, &clen);
+		if (!l) {
+			*need = len + 1;
+			return 0;
+		}
+		pos += l;
+		*need = pos + clen;
+		if (len < *need)
+			return 0;
+		reset_streams(st, buf[0]);
+
+#if HAVE_JPEGLIB_H
+		if (type == 9) {
+			if (reader_decode(&st->jr, buf + pos, clen, fb, cl->rect.x, cl->rect.y, w, h)) {
+				trfb_msg("[%s] Invalid JPEG rectangle", cl->name);
+				return -1;
+			}
+			*need = 0;
+			return pos + clen;
+		}
+#else
+		if (type == 9) {
+			trfb_msg("[%s] JPEG is not supported", cl->name);
+			return -1;
+		}
+#endif
+
+		if (inflate_data(cl, st, type & 3, buf + pos, clen, size))
+			return -1;
+		data = st->buf;
+		pos += clen;
+	}
+
+	if (filter == TIGHT_FILTER_PALETTE) {
+		for (y = 0; y < h; y++, d += stride) {
+			for (x = 0; x < w; x++) {
+				if (n == 2) {
+					i = (data[y * ((w + 7) / 8) + x / 8] >> (7 - x % 8)) & 1;
+				} else {
+					i = data[y * w + x];
+					if (i >= n) {
+						trfb_msg("[%s] Invalid Tight palette index", cl->name);
+						return -1;
+					}
+				}
+				memcpy(d + x * fb->bpp, pal[i], fb->bpp);
+			}
+		}
+	} else if (filter == TIGHT_FILTER_GRADIENT) {
+		memset(st->rows[0], 0, w * 3);
+		for (y = 0; y < h; y++, d += stride, data += w * 3) {
+			ungradient_row(st->rows[1], data, st->rows[0], w);
+			for (x = 0; x < w; x++)
+				get_tpixel(d + x * fb->bpp, st->rows[1] + x * 3, &tp);
+			memcpy(st->rows[0], st->rows[1], w * 3);
+		}
+	} else {
+		for (y = 0; y < h; y++, d += stride)
+			for (x = 0; x < w; x++, data += tp.size)
+				get_tpixel(d + x * fb->bpp, data, &tp);
+	}
+
+	*need = 0;
+
+	return pos;
+}
+
+const trfb_decoder_t trfb_decoder_tight = {
+	TRFB_ENCODING_TIGHT,
+	"Tight",
+	tight_dcreate,
+	tight_ddestroy,
+	tight_decode
+};
+
+#endif
+
+#if HAVE_ZLIB_H && HAVE_JPEGLIB_H
+/* Standard Huffman tables (ITU T.81 K.3). Motion JPEG frames of cameras usually have no tables. */
+static const unsigned char std_dht[] = {
+	0xff, 0xc4, 0x01, 0xa2,
+	/* Luminance DC */
+	0x00,
+	0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+	/* Chrominance DC */
+	0x01,
+	0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+	/* Luminance AC */
+	0x10,
+	0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7d,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+	/* Chrominance AC */
+	0x11,
+	0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+/* Position of SOS marker or 0 if image has Huffman tables already or it is not valid */
+static size_t need_dht(const unsigned char *p, size_t len)
+{
+	size_t pos = 2;
+
+	if (len < 4 || p[0] != 0xff || p[1] != 0xd8)
+		return 0;
+
+	while (pos + 4 <= len && p[pos] == 0xff) {
+		if (p[pos + 1] == 0xff) {
+			pos++;
+			continue;
+		}
+
+		if (p[pos + 1] == 0xc4)
+			return 0;
+		if (p[pos + 1] == 0xda)
+			return pos;
+
+		pos += 2 + ((p[pos + 2] << 8) | p[pos + 3]);
+	}
+
+	return 0;
+}
+
+int trfb_connection_jpeg_allowed(trfb_connection_t *con)
+{
+	return trfb_connection_has_encoding(con, TRFB_ENCODING_TIGHT) && jpeg_allowed(con);
+}
+
+int trfb_connection_tight_jpeg(trfb_connection_t *con, unsigned x, unsigned y, unsigned width, unsigned height,
+		const void *data, size_t len)
+{
+	unsigned char hdr[4];
+
+	hdr[0] = TIGHT_JPEG;
+	if (trfb_connection_rect_header(con, x, y, width, height, TRFB_ENCODING_TIGHT) ||
+			trfb_connection_queue(con, hdr, put_length(hdr + 1, len) - hdr) ||
+			trfb_connection_queue(con, data, len))
+		return -1;
+
+	return 0;
+}
+
+int trfb_server_update_jpeg(trfb_server_t *srv, const void *data, size_t len)
+{
+	jpeg_reader_t jr;
+	unsigned char *p;
+	size_t sos;
+	int rv;
+
+	memset(&jr, 0, sizeof(jr));
+	trfb_server_lock_fb(srv, 1);
+	rv = reader_decode(&jr, data, len, srv->fb, 0, 0, srv->fb->width, srv->fb->height);
+	if (rv) {
+		trfb_msg("Invalid JPEG image");
+	} else {
+		/* Image is sent to clients as is, but they could need Huffman tables */
+		sos = need_dht(data, len);
+		if (srv->jpeg_size < len + sizeof(std_dht)) {
+			p = realloc(srv->jpeg, len + sizeof(std_dht));
+			if (p) {
+				srv->jpeg = p;
+				srv->jpeg_size = len + sizeof(std_dht);
+			}
+		}
+
+		if (srv->jpeg_size >= len + sizeof(std_dht)) {
+			if (sos) {
+				memcpy(srv->jpeg, data, sos);
+				memcpy(srv->jpeg + sos, std_dht, sizeof(std_dht));
+				memcpy(srv->jpeg + sos + sizeof(std_dht), (const unsigned char*)data + sos, len - sos);
+				srv->jpeg_len = len + sizeof(std_dht);
+			} else {
+				memcpy(srv->jpeg, data, len);
+				srv->jpeg_len = len;
+			}
+		}
+	}
+	trfb_server_mark_dirty(srv, 0, 0, srv->fb->width, srv->fb->height);
+	trfb_server_unlock_fb(srv);
+	reader_free(&jr);
+
+	return rv;
+}
+#else
+int trfb_connection_jpeg_allowed(trfb_connection_t *con)
+{
+	return 0;
+}
+
+int trfb_connection_tight_jpeg(trfb_connection_t *con, unsigned x, unsigned y, unsigned width, unsigned height,
+		const void *data, size_t len)
+{
+	trfb_msg("[%s] JPEG is not supported", con->name);
+	return -1;
+}
+
+int trfb_server_update_jpeg(trfb_server_t *srv, const void *data, size_t len)
+{
+	trfb_msg("JPEG is not supported");
+	return -1;
+}
+#endif
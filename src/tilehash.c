@@ -0,0 +1,444 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Damage detection by hashes of tiles.
+ *
+ * Hash is an accumulator of 8 64-bit lanes: every lane gets acc += lo32(k) * hi32(k) + d where
+ * k = d ^ key ^ (acc >> 31) for the next 8 bytes d of the stripe. Accumulator is mixed into the product, so
+ * the same stripes in other order (content moved inside of tile) give other hash. It is computed with one
+ * multiplication per 8 bytes so it could be done with SSE2, AVX2 or NEON. All implementations give the
+ * same result.
+ */
+
+#define STRIPE 64
+#define LANES 8
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static const uint64_t keys[LANES] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+
+typedef void (*accumulate_fn)(uint64_t *acc, const unsigned char *p, size_t stripes);
+
+static inline uint64_t load64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t mix(uint64_t acc, uint64_t d, uint64_t key)
+{
+	uint64_t dk = d ^ key ^ (acc >> 31);
+	return acc + (dk & 0xffffffff) * (dk >> 32) + d;
+}
+
+static void accumulate_scalar(uint64_t *acc, const unsigned char *p, size_t stripes)
+{
+	size_t s;
+	unsigned i;
+
+	for (s = 0; s < stripes; s++, p += STRIPE) {
+		for (i = 0; i < LANES; i++) {
+			acc[i] = mix(acc[i], load64(p + 8 * i), keys[i]);
+		}
+	}
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t *acc, const unsigned char *p, size_t stripes)
+{
+	__m128i a[4], k[4];
+	__m128i d, dk, hi;
+	size_t s;
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		a[i] = _mm_loadu_si128((const __m128i*)(acc + 2 * i));
+		k[i] = _mm_loadu_si128((const __m128i*)(keys + 2 * i));
+	}
+
+	for (s = 0; s < stripes; s++, p += STRIPE) {
+		for (i = 0; i < 4; i++) {
+			d = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+			dk = _mm_xor_si128(_mm_xor_si128(d, k[i]), _mm_srli_epi64(a[i], 31));
+			hi = _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1));
+			a[i] = _mm_add_epi64(a[i], _mm_add_epi64(_mm_mul_epu32(dk, hi), d));
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i*)(acc + 2 * i), a[i]);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const unsigned char *p, size_t stripes)
+{
+	__m256i a0, a1, k0, k1;
+	__m256i d, dk;
+	size_t s;
+
+	a0 = _mm256_loadu_si256((const __m256i*)acc);
+	a1 = _mm256_loadu_si256((const __m256i*)(acc + 4));
+	k0 = _mm256_loadu_si256((const __m256i*)keys);
+	k1 = _mm256_loadu_si256((const __m256i*)(keys + 4));
+
+	for (s = 0; s < stripes; s++, p += STRIPE) {
+		d = _mm256_loadu_si256((const __m256i*)p);
+		dk = _mm256_xor_si256(_mm256_xor_si256(d, k0), _mm256_srli_epi64(a0, 31));
+		a0 = _mm256_add_epi64(a0, _mm256_add_epi64(_mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32)), d));
+
+		d = _mm256_loadu_si256((const __m256i*)(p + 32));
+		dk = _mm256_xor_si256(_mm256_xor_si256(d, k1), _mm256_srli_epi64(a1, 31));
+		a1 = _mm256_add_epi64(a1, _mm256_add_epi64(_mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32)), d));
+	}
+
+	_mm256_storeu_si256((__m256i*)acc, a0);
+	_mm256_storeu_si256((__m256i*)(acc + 4), a1);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static void accumulate_neon(uint64_t *acc, const unsigned char *p, size_t stripes)
+{
+	uint64x2_t a[4], k[4];
+	uint64x2_t d, dk;
+	size_t s;
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		a[i] = vld1q_u64(acc + 2 * i);
+		k[i] = vld1q_u64(keys + 2 * i);
+	}
+
+	for (s = 0; s < stripes; s++, p += STRIPE) {
+		for (i = 0; i < 4; i++) {
+			d = vreinterpretq_u64_u8(vld1q_u8(p + 16 * i));
+			dk = veorq_u64(veorq_u64(d, k[i]), vshrq_n_u64(a[i], 31));
+			a[i] = vaddq_u64(a[i], vaddq_u64(vmull_u32(vmovn_u64(dk), vshrn_n_u64(dk, 32)), d));
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		vst1q_u64(acc + 2 * i, a[i]);
+}
+#endif
+
+static accumulate_fn get_accumulate(void)
+{
+	static accumulate_fn fn = NULL;
+	unsigned f;
+
+	if (fn)
+		return fn;
+
+	f = trfb_cpu_features();
+	fn = accumulate_scalar;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	if (f & TRFB_CPU_AVX2)
+		fn = accumulate_avx2;
+	else if (f & TRFB_CPU_SSE2)
+		fn = accumulate_sse2;
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	if (f & TRFB_CPU_NEON)
+		fn = accumulate_neon;
+#endif
+
+	return fn;
+}
+
+static inline void hash_init(uint64_t *acc)
+{
+	unsigned i;
+
+	for (i = 0; i < LANES; i++)
+		acc[i] = PRIME64_1 * (i + 1);
+}
+
+/* Bytes which do not fill the whole stripe */
+static inline void hash_tail(uint64_t *acc, const unsigned char *p, size_t len)
+{
+	uint64_t d;
+	unsigned i = 0;
+
+	for (; len >= 8; len -= 8, p += 8, i++)
+		acc[i] = mix(acc[i], load64(p), keys[i]);
+
+	if (len) {
+		d = 0;
+		memcpy(&d, p, len);
+		acc[i] = mix(acc[i], d, keys[i] ^ len);
+	}
+}
+
+static inline uint64_t hash_final(const uint64_t *acc, uint64_t len)
+{
+	uint64_t h = len * PRIME64_2;
+	unsigned i;
+
+	for (i = 0; i < LANES; i++) {
+		h ^= acc[i] * PRIME64_1;
+		h = (h << 31) | (h >> 33);
+		h *= PRIME64_2;
+	}
+
+	h ^= h >> 29;
+	h *= PRIME64_1;
+	h ^= h >> 32;
+
+	return h;
+}
+
+uint64_t trfb_hash(const void *data, size_t len)
+{
+	uint64_t acc[LANES];
+	const unsigned char *p = data;
+
+	hash_init(acc);
+	get_accumulate()(acc, p, len / STRIPE);
+	hash_tail(acc, p + len - len % STRIPE, len % STRIPE);
+
+	return hash_final(acc, len);
+}
+
+struct trfb_tilehash {
+	unsigned width, height, bpp;
+	/* Size in tiles */
+	unsigned tw, th;
+	uint64_t *hashes;
+	unsigned char *changed;
+	int valid;
+
+	accumulate_fn accumulate;
+
+	/* Current job and worker threads */
+	trfb_framebuffer_t *fb;
+	mtx_t lock;
+	cnd_t start, done;
+	unsigned generation;
+	unsigned next_row;
+	unsigned working;
+	int stop;
+	unsigned threads_cnt;
+	thrd_t *threads;
+};
+
+static void hash_row(trfb_tilehash_t *th, unsigned ty)
+{
+	trfb_framebuffer_t *fb = th->fb;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	const unsigned char *row = (const unsigned char*)fb->pixels + (size_t)ty * TRFB_HASH_TILE * stride;
+	const unsigned char *p;
+	uint64_t acc[LANES];
+	uint64_t h;
+	unsigned rows = fb->height - ty * TRFB_HASH_TILE;
+	unsigned tx, y;
+	size_t len;
+
+	if (rows > TRFB_HASH_TILE)
+		rows = TRFB_HASH_TILE;
+
+	for (tx = 0; tx < th->tw; tx++) {
+		len = fb->width - tx * TRFB_HASH_TILE;
+		if (len > TRFB_HASH_TILE)
+			len = TRFB_HASH_TILE;
+		len *= fb->bpp;
+
+		hash_init(acc);
+		p = row + (size_t)tx * TRFB_HASH_TILE * fb->bpp;
+		for (y = 0; y < rows; y++, p += stride) {
+			th->accumulate(acc, p, len / STRIPE);
+			if (len % STRIPE)
+				hash_tail(acc, p + len - len % STRIPE, len % STRIPE);
+		}
+		h = hash_final(acc, len * rows);
+
+		th->changed[ty * th->tw + tx] = !th->valid || th->hashes[ty * th->tw + tx] != h;
+		th->hashes[ty * th->tw + tx] = h;
+	}
+}
+
+/* Take rows from the job until there is nothing to do. Must be called with lock held. */
+static void hash_rows(trfb_tilehash_t *th)
+{
+	unsigned ty;
+
+	while (th->next_row < th->th) {
+		ty = th->next_row++;
+		mtx_unlock(&th->lock);
+		hash_row(th, ty);
+		mtx_lock(&th->lock);
+	}
+}
+
+static int worker(void *th_in)
+{
+	trfb_tilehash_t *th = th_in;
+	unsigned generation = 0;
+
+	mtx_lock(&th->lock);
+	for (;;) {
+		while (th->generation == generation && !th->stop)
+			cnd_wait(&th->start, &th->lock);
+
+		if (th->stop)
+			break;
+
+		generation = th->generation;
+		hash_rows(th);
+
+		if (--th->working == 0)
+			cnd_signal(&th->done);
+	}
+	mtx_unlock(&th->lock);
+
+	return 0;
+}
+
+trfb_tilehash_t* trfb_tilehash_create(unsigned threads)
+{
+	trfb_tilehash_t *th;
+	unsigned i;
+
+	th = calloc(1, sizeof(trfb_tilehash_t));
+	if (!th) {
+		trfb_msg("Not enought memory");
+		return NULL;
+	}
+
+	th->accumulate = get_accumulate();
+	mtx_init(&th->lock, mtx_plain);
+	cnd_init(&th->start);
+	cnd_init(&th->done);
+
+	/* Current thread works too */
+	if (threads > 1) {
+		th->threads = calloc(threads - 1, sizeof(thrd_t));
+		if (!th->threads) {
+			trfb_msg("Not enought memory");
+			trfb_tilehash_free(th);
+			return NULL;
+		}
+
+		for (i = 0; i < threads - 1; i++) {
+			if (thrd_create(th->threads + i, worker, th) != thrd_success) {
+				trfb_msg("W:Can't start hashing thread");
+				break;
+			}
+			th->threads_cnt++;
+		}
+	}
+
+	return th;
+}
+
+void trfb_tilehash_free(trfb_tilehash_t *th)
+{
+	unsigned i;
+	int rv;
+
+	if (!th)
+		return;
+
+	mtx_lock(&th->lock);
+	th->stop = 1;
+	cnd_broadcast(&th->start);
+	mtx_unlock(&th->lock);
+
+	for (i = 0; i < th->threads_cnt; i++)
+		thrd_join(th->threads[i], &rv);
+
+	free(th->threads);
+	cnd_destroy(&th->start);
+	cnd_destroy(&th->done);
+	mtx_destroy(&th->lock);
+	free(th->hashes);
+	free(th->changed);
+	free(th);
+}
+
+static int tilehash_resize(trfb_tilehash_t *th, trfb_framebuffer_t *fb)
+{
+	size_t cnt;
+
+	free(th->hashes);
+	free(th->changed);
+
+	th->width = fb->width;
+	th->height = fb->height;
+	th->bpp = fb->bpp;
+	th->tw = (fb->width + TRFB_HASH_TILE - 1) / TRFB_HASH_TILE;
+	th->th = (fb->height + TRFB_HASH_TILE - 1) / TRFB_HASH_TILE;
+	th->valid = 0;
+
+	cnt = (size_t)th->tw * th->th;
+	th->hashes = calloc(cnt? cnt: 1, sizeof(uint64_t));
+	th->changed = calloc(cnt? cnt: 1, 1);
+	if (!th->hashes || !th->changed) {
+		free(th->hashes);
+		free(th->changed);
+		th->hashes = NULL;
+		th->changed = NULL;
+		th->tw = th->th = 0;
+		trfb_msg("Not enought memory");
+		return -1;
+	}
+
+	return 0;
+}
+
+int trfb_tilehash_update(trfb_tilehash_t *th, trfb_framebuffer_t *fb, trfb_region_t *damage)
+{
+	unsigned tx, ty, tx0;
+
+	if (!th || !fb || !damage)
+		return -1;
+
+	if (th->width != fb->width || th->height != fb->height || th->bpp != fb->bpp || !th->hashes) {
+		if (tilehash_resize(th, fb))
+			return -1;
+	}
+
+	mtx_lock(&th->lock);
+	th->fb = fb;
+	th->next_row = 0;
+	if (th->threads_cnt && th->th > 1) {
+		th->working = th->threads_cnt;
+		th->generation++;
+		cnd_broadcast(&th->start);
+		hash_rows(th);
+		while (th->working)
+			cnd_wait(&th->done, &th->lock);
+	} else {
+		hash_rows(th);
+	}
+	th->fb = NULL;
+	th->valid = 1;
+	mtx_unlock(&th->lock);
+
+	for (ty = 0; ty < th->th; ty++) {
+		for (tx = 0; tx < th->tw; tx++) {
+			if (!th->changed[ty * th->tw + tx])
+				continue;
+
+			tx0 = tx;
+			while (tx + 1 < th->tw && th->changed[ty * th->tw + tx + 1])
+				tx++;
+
+			trfb_region_add_rect(damage, tx0 * TRFB_HASH_TILE, ty * TRFB_HASH_TILE,
+					(tx - tx0 + 1) * TRFB_HASH_TILE, TRFB_HASH_TILE);
+		}
+	}
+
+	return 0;
+}
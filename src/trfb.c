@@ -5,10 +5,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <sys/un.h>
 
 trfb_server_t *trfb_server_create(size_t width, size_t height, unsigned bpp)
+{
+	return trfb_server_create_ex(width, height, bpp, TRFB_SERVER_THREADED);
+}
+
+trfb_server_t *trfb_server_create_ex(size_t width, size_t height, unsigned bpp, unsigned flags)
 {
 	trfb_server_t *S;
+	long ncpu;
 
 	if (width > 0xffff || height > 0xffff) {
 		trfb_msg("Width or height is more then 0xFFFF");
@@ -22,6 +29,17 @@ trfb_server_t *trfb_server_create(size_t width, size_t height, unsigned bpp)
 
 	S->sock = -1;
 	S->state = TRFB_STATE_STOPPED;
+	S->flags = flags;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	S->loops_cnt = ncpu > TRFB_MAX_LOOPS? TRFB_MAX_LOOPS: ncpu;
+	S->rbuf_size = TRFB_BUFSIZ;
+	S->wbuf_size = TRFB_BUFSIZ;
+	S->compress_level = TRFB_COMPRESS_LEVEL;
+	S->jpeg_quality = TRFB_JPEG_QUALITY;
+	S->target_latency = TRFB_TARGET_LATENCY;
 	S->fb = trfb_framebuffer_create(width, height, bpp);
 	if (!S->fb) {
 		trfb_msg("Can't create framebuffer");
@@ -29,6 +47,41 @@ trfb_server_t *trfb_server_create(size_t width, size_t height, unsigned bpp)
 		return NULL;
 	}
 
+	if (trfb_region_init(&S->damage, width, height)) {
+		trfb_framebuffer_free(S->fb);
+		free(S);
+		return NULL;
+	}
+
+	if (flags & TRFB_SERVER_AUTO_DAMAGE) {
+		S->tilehash = trfb_tilehash_create(ncpu > 4? 4: ncpu);
+		if (!S->tilehash) {
+			trfb_region_free(&S->damage);
+			trfb_framebuffer_free(S->fb);
+			free(S);
+			return NULL;
+		}
+	}
+
+	S->cache = trfb_cache_create();
+	if (!S->cache) {
+		trfb_tilehash_free(S->tilehash);
+		trfb_region_free(&S->damage);
+		trfb_framebuffer_free(S->fb);
+		free(S);
+		return NULL;
+	}
+
+	S->fbpool = trfb_fbpool_create();
+	if (!S->fbpool) {
+		trfb_cache_free(S->cache);
+		trfb_tilehash_free(S->tilehash);
+		trfb_region_free(&S->damage);
+		trfb_framebuffer_free(S->fb);
+		free(S);
+		return NULL;
+	}
+
 	mtx_init(&S->lock, mtx_plain);
 
 	S->clients = NULL;
@@ -44,12 +97,94 @@ void trfb_server_destroy(trfb_server_t *server)
 
 	close(server->sock);
 	trfb_framebuffer_free(server->fb);
+	trfb_region_free(&server->damage);
+	trfb_tilehash_free(server->tilehash);
+	trfb_cache_free(server->cache);
+	trfb_fbpool_free(server->fbpool);
+	free(server->jpeg);
+	trfb_framebuffer_free(server->cursor);
+	free(server->cursor_mask);
 
 	/* TODO: remove all clients */
 
 	free(server);
 }
 
+int trfb_server_set_loops(trfb_server_t *srv, unsigned cnt)
+{
+	if (!cnt || cnt > TRFB_MAX_LOOPS) {
+		trfb_msg("Invalid count of event loops: %u", cnt);
+		return -1;
+	}
+
+	mtx_lock(&srv->lock);
+	if (srv->state != TRFB_STATE_STOPPED) {
+		mtx_unlock(&srv->lock);
+		trfb_msg("Server is working now");
+		return -1;
+	}
+
+	srv->loops_cnt = cnt;
+
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_server_set_buffers(trfb_server_t *srv, size_t rsize, size_t wsize)
+{
+	mtx_lock(&srv->lock);
+	if (rsize)
+		srv->rbuf_size = rsize;
+	if (wsize)
+		srv->wbuf_size = wsize;
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_server_set_compress_level(trfb_server_t *srv, int level)
+{
+	if (level < 0 || level > 9) {
+		trfb_msg("Invalid compression level: %d", level);
+		return -1;
+	}
+
+	mtx_lock(&srv->lock);
+	srv->compress_level = level;
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_server_set_jpeg_quality(trfb_server_t *srv, int quality)
+{
+	if (quality < 1 || quality > 100) {
+		trfb_msg("Invalid JPEG quality: %d", quality);
+		return -1;
+	}
+
+	mtx_lock(&srv->lock);
+	srv->jpeg_quality = quality;
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
+int trfb_server_set_target_latency(trfb_server_t *srv, double latency)
+{
+	if (!(latency > 0)) {
+		trfb_msg("Invalid target latency: %f", latency);
+		return -1;
+	}
+
+	mtx_lock(&srv->lock);
+	srv->target_latency = latency;
+	mtx_unlock(&srv->lock);
+
+	return 0;
+}
+
 unsigned trfb_server_get_state(trfb_server_t *S)
 {
 	unsigned res;
@@ -123,3 +258,32 @@ int trfb_server_bind(trfb_server_t *server, const char *host, const char *port)
 	return -1;
 }
 
+int trfb_server_bind_unix(trfb_server_t *server, const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		trfb_msg("Unix socket path is too long: %s", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		trfb_msg("Can't create Unix socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+		trfb_msg("Can't bind to %s", path);
+		close(sock);
+		return -1;
+	}
+
+	return trfb_server_set_socket(server, sock);
+}
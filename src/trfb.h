@@ -5,7 +5,9 @@
 #include <stdlib.h>
 #include <time.h>
 #include <c11threads.h>
+#include <trfb_config.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 /* Tiny RFB (VNC) server implementation */
 
@@ -15,14 +17,44 @@ extern "C" {
 
 #define TRFB_EOF    0xffff
 #define TRFB_BUFSIZ 2048
+/* Default zlib compression level of new connections */
+#define TRFB_COMPRESS_LEVEL 6
+/* Default JPEG quality of new connections */
+#define TRFB_JPEG_QUALITY 75
+/* Default target latency of updates (seconds, TRFB_SERVER_ADAPTIVE) */
+#define TRFB_TARGET_LATENCY 0.1
+/* Part of output queue: bytes [off, off + len) of write buffer (ref == NULL, off is ring position) or of referenced memory */
+typedef struct trfb_io_chunk {
+	const unsigned char *ref;
+	size_t off, len;
+} trfb_io_chunk_t;
+
 typedef struct trfb_io {
 	void *ctx;
 	int error;
+#define TRFB_IO_NONBLOCK 0x0001
+	/* With TRFB_IO_NONBLOCK read/write functions must not wait and return 0 if operation would block */
+#define TRFB_IO_ZEROCOPY 0x0002
+	/* Large parts of referenced memory are sent with MSG_ZEROCOPY (see trfb_io_zerocopy) */
+#define TRFB_IO_MORE     0x0004
+	/* Only for writev: more data will be sent right after this call */
+	unsigned flags;
 	/* read/write functions must not touch buf, pos and len! */
-	unsigned char rbuf[TRFB_BUFSIZ];
-	size_t rlen, rpos;
-	unsigned char wbuf[TRFB_BUFSIZ];
-	size_t wlen;
+	/* Read buffer is refilled only when it is empty so it never wraps */
+	unsigned char *rbuf;
+	size_t rlen, rpos, rsize;
+	/* Write buffer is a ring of wsize (power of 2) bytes: wtail, wmark and wlen are positions
+	 * which are never wrapped, byte at position p is wbuf[p & (wsize - 1)]. Bytes [wtail, wlen)
+	 * are not sent yet. Ring could grow with trfb_io_queue. */
+	unsigned char *wbuf;
+	size_t wlen, wsize, wtail;
+	/* Output queue. Bytes of wbuf after wmark are not in chunks yet. First sent bytes of
+	 * chunks[chunks_pos] is chunk_sent. Everything is reset when all the data is sent. */
+	trfb_io_chunk_t *chunks;
+	unsigned chunks_cnt, chunks_size, chunks_pos;
+	size_t wmark, chunk_sent;
+	/* Count of MSG_ZEROCOPY sends and completions */
+	uint32_t zc_sent, zc_done;
 
 	void (*free)(void *ctx);
 	/* This I/O functions must process I/O operation and return:
@@ -32,6 +64,12 @@ typedef struct trfb_io {
 	 */
 	ssize_t (*read)(struct trfb_io *io, void *buf, ssize_t len, unsigned timeout);
 	ssize_t (*write)(struct trfb_io *io, const void *buf, ssize_t len, unsigned timeout);
+	/* Optional: gather write. If flags contains TRFB_IO_ZEROCOPY memory of iov is not changed
+	 * until complete returns 1, so it could be sent without copying. */
+	ssize_t (*writev)(struct trfb_io *io, const struct iovec *iov, int cnt, unsigned flags, unsigned timeout);
+	/* Optional: wait for release of memory sent with zero-copy. Returns 1 if everything is released,
+	 * 0 on timeout and -1 on error. */
+	int (*complete)(struct trfb_io *io, unsigned timeout);
 } trfb_io_t;
 
 typedef enum trfb_protocol {
@@ -67,6 +105,9 @@ typedef struct trfb_framebuffer {
 	uint32_t rmask, gmask, bmask;
 	unsigned char rshift, gshift, bshift;
 	unsigned char rnorm, gnorm, bnorm;
+	/* Byte order of pixels. It is host order for framebuffers created by trfb_framebuffer_create and
+	 * pixel functions below work only with host order. Conversion takes it into account. */
+	unsigned char big_endian;
 
 	/* To get actual pixel you need to:
 	 * 1. Determine pixel type (uint8_t, uint16_t or uint32_t) looking at bpp
@@ -164,6 +205,37 @@ static inline void trfb_framebuffer_set_pixel(trfb_framebuffer_t *fb, unsigned x
 	return;
 }
 
+typedef struct trfb_rect {
+	unsigned x, y;
+	unsigned width, height;
+} trfb_rect_t;
+
+/* Region is a bitmap of TRFB_REGION_TILE x TRFB_REGION_TILE tiles */
+#define TRFB_REGION_TILE 16
+typedef struct trfb_region {
+	unsigned width, height;
+	/* Size in tiles and count of uint32_t words in one row of bitmap */
+	unsigned tw, th, stride;
+	uint32_t *bits;
+} trfb_region_t;
+
+int trfb_region_init(trfb_region_t *r, unsigned width, unsigned height);
+void trfb_region_free(trfb_region_t *r);
+/* Change size of region. Region becomes empty. Old region is kept on error. */
+int trfb_region_resize(trfb_region_t *r, unsigned width, unsigned height);
+void trfb_region_clear(trfb_region_t *r);
+int trfb_region_is_empty(const trfb_region_t *r);
+void trfb_region_add_rect(trfb_region_t *r, unsigned x, unsigned y, unsigned width, unsigned height);
+/* Add src to dst. Regions must be of the same size. */
+void trfb_region_add(trfb_region_t *dst, const trfb_region_t *src);
+/* Check if any tile of region intersects rectangle */
+int trfb_region_intersects(const trfb_region_t *r, unsigned x, unsigned y, unsigned width, unsigned height);
+/* Remove tiles which are completely inside rectangle */
+void trfb_region_clear_rect(trfb_region_t *r, unsigned x, unsigned y, unsigned width, unsigned height);
+/* Get rectangles of region clipped by clip rectangle. Returns count of rectangles or -1 on error.
+ * *rects must be freed with free(). */
+int trfb_region_rects(const trfb_region_t *r, const trfb_rect_t *clip, trfb_rect_t **rects);
+
 typedef struct trfb_client trfb_client_t;
 typedef struct trfb_server trfb_server_t;
 typedef struct trfb_connection trfb_connection_t;
@@ -195,10 +267,35 @@ typedef struct trfb_event {
 	} event;
 } trfb_event_t;
 
+typedef struct trfb_loop trfb_loop_t;
+typedef struct trfb_tilehash trfb_tilehash_t;
+typedef struct trfb_cache trfb_cache_t;
+typedef struct trfb_cache_entry trfb_cache_entry_t;
+typedef struct trfb_fbpool trfb_fbpool_t;
+typedef struct trfb_fbpool_format trfb_fbpool_format_t;
+typedef struct trfb_shared_fb trfb_shared_fb_t;
+typedef struct trfb_converter trfb_converter_t;
+
 struct trfb_server {
 	int sock;
 	thrd_t thread;
 
+#define TRFB_SERVER_THREADED    0x0000
+#define TRFB_SERVER_EVENT_LOOP  0x0001
+/* Find damage by comparing hashes of tiles if application doesn't mark it */
+#define TRFB_SERVER_AUTO_DAMAGE 0x0002
+/* Send large updates with MSG_ZEROCOPY where it is supported */
+#define TRFB_SERVER_ZEROCOPY    0x0004
+/* Adapt JPEG quality, encoding and update rate of each connection to its link */
+#define TRFB_SERVER_ADAPTIVE    0x0008
+	unsigned flags;
+
+	/* Event loop engine (TRFB_SERVER_EVENT_LOOP): */
+#define TRFB_MAX_LOOPS 16
+	unsigned loops_cnt;
+	trfb_loop_t *loops;
+	unsigned next_loop;
+
 #define TRFB_STATE_STOPPED  0x0000
 #define TRFB_STATE_WORKING  0x0001
 #define TRFB_STATE_STOP     0x0002
@@ -207,16 +304,52 @@ struct trfb_server {
 
 	trfb_framebuffer_t *fb;
 	unsigned updated;
+	/* Sequence number of framebuffer contents: it is changed when framebuffer is locked for writing
+	 * (protected by fb->lock) */
+	unsigned long long frame;
+	/* Rectangles encoded once for all connections with the same format and encoder parameters */
+	trfb_cache_t *cache;
+	/* Converted framebuffers shared by connections with the same format */
+	trfb_fbpool_t *fbpool;
+
+	/* Damage marked while framebuffer is locked for writing (protected by lock) */
+	trfb_region_t damage;
+	int fb_writing;
+	int damage_marked;
+	/* Hashes of framebuffer tiles (TRFB_SERVER_AUTO_DAMAGE) */
+	trfb_tilehash_t *tilehash;
+	/* JPEG image of the whole framebuffer from trfb_server_update_jpeg (protected by fb->lock).
+	 * It is dropped when framebuffer is locked for writing. */
+	unsigned char *jpeg;
+	size_t jpeg_len, jpeg_size;
+	/* Cursor from trfb_server_set_cursor (NULL if it is not set) and pointer position (protected by lock) */
+	trfb_framebuffer_t *cursor;
+	unsigned char *cursor_mask;
+	unsigned cursor_hot_x, cursor_hot_y;
+	unsigned pointer_x, pointer_y;
 
 	mtx_t lock;
 
 	trfb_connection_t *clients;
+	/* I/O buffer sizes of new connections */
+	size_t rbuf_size, wbuf_size;
+	/* zlib compression level, JPEG quality and target latency (TRFB_SERVER_ADAPTIVE) of new connections */
+	int compress_level;
+	int jpeg_quality;
+	double target_latency;
 
 #define TRFB_EVENTS_QUEUE_LEN 128
 	trfb_event_t events[TRFB_EVENTS_QUEUE_LEN];
 	unsigned event_cur, event_len;
 };
 
+/* Fence sent to client: time and count of bytes queued before it */
+typedef struct trfb_fence {
+	uint32_t id;
+	double time;
+	unsigned long long queued;
+} trfb_fence_t;
+
 struct trfb_connection {
 	trfb_server_t *server;
 
@@ -225,26 +358,160 @@ struct trfb_connection {
 	unsigned state;
 
 	/* Client information */
-	struct sockaddr addr;
+	struct sockaddr_storage addr;
 	socklen_t addrlen;
 	char name[64];
 
 	thrd_t thread;
 	mtx_t lock;
 
+	/* Protocol state machine: */
+#define TRFB_PHASE_VERSION  0
+#define TRFB_PHASE_SECURITY 1
+#define TRFB_PHASE_INIT     2
+#define TRFB_PHASE_NORMAL   3
+	unsigned phase;
+	unsigned char *in;
+	size_t inlen, insize;
+
+	/* Event loop this connection belongs to (TRFB_SERVER_EVENT_LOOP only) */
+	int sock;
+	trfb_loop_t *loop;
+	unsigned events;
+	/* Connection is in list of connections waiting for update (protected by loop) */
+	int ready;
+	trfb_connection_t *ready_next;
+	/* Connection is in list of delayed connections (loop thread only). Thread of threaded engine uses
+	 * delayed and delay_time for its own poll timeout. */
+	int delayed;
+	double delay_time;
+	trfb_connection_t *delay_next;
+	/* Pipe which wakes up thread of threaded engine (-1 for event loop) */
+	int wake[2];
+
+	/* Size of framebuffer known by client. ExtendedDesktopSize must be sent (answer to SetDesktopSize or
+	 * the first one after client has announced the extension) with this reason and status. */
+	unsigned width, height;
+	int desktop_pending;
+	unsigned desktop_reason, desktop_status;
+
+	/* Damage since last update and pending FramebufferUpdateRequest (protected by lock) */
+	trfb_region_t damage;
+	int update_pending;
+	int update_incremental;
+	trfb_rect_t update_rect;
+	/* Copy from trfb_server_copy_rect which is not sent yet: destination and source position (protected by lock) */
+	int copy_pending;
+	trfb_rect_t copy;
+	unsigned copy_sx, copy_sy;
+	/* Damage is taken by update but pixels are not converted yet (protected by lock) */
+	int converting;
+	/* ContinuousUpdates: damage of cu_rect is sent without update requests (protected by lock) */
+	int cu_enabled;
+	trfb_rect_t cu_rect;
+	/* EndOfContinuousUpdates and Fence were sent to client when it had announced the extensions */
+	int cu_announced, fence_announced;
+	/* Client draws cursor itself (Cursor pseudo-encoding), cursor of server is changed and pointer position
+	 * (protected by lock) */
+	int cursor_local;
+	int cursor_changed;
+	unsigned pointer_x, pointer_y;
+	/* Cursor in client format, Cursor rectangle must be sent and area of fb where cursor is drawn for
+	 * clients which don't draw it */
+	trfb_framebuffer_t *cursor;
+	unsigned char *cursor_mask;
+	unsigned cursor_hot_x, cursor_hot_y;
+	int cursor_send;
+	trfb_rect_t cursor_drawn;
+
+	/* Flow control of continuous updates: fence is sent after each update, its response acknowledges
+	 * data queued before it and gives round trip time. Updates wait while unacknowledged data don't fit
+	 * to window. */
+	unsigned long long queued, acked;
+#define TRFB_MAX_FENCES 16
+	trfb_fence_t fences[TRFB_MAX_FENCES];
+	unsigned fences_first, fences_cnt;
+	uint32_t fence_id;
+	double rtt, rtt_min;
+	size_t window;
+	/* Update was delayed by window since last fence response */
+	int window_limited;
+
+	/* Adaptive rate (TRFB_SERVER_ADAPTIVE). Output which is not sent or not acknowledged by client (backlog)
+	 * gives throughput of link and latency of the next update. Updates wait while latency is above target,
+	 * JPEG quality goes down to keep it there and Raw is used when link is fast enough for it. */
+	double target_latency;
+	double rate_time, rate_adjusted;
+	unsigned long long rate_sent;
+	size_t rate_backlog;
+	double throughput, latency;
+	/* Raw and encoded size of the last update, JPEG quality asked by client and Raw is used instead of encoder */
+	size_t rate_frame, rate_update;
+	int rate_quality;
+	int rate_raw;
+
 	/*
 	 * Array of pixels. Last state for this client.
 	 * Width and height are taken from server
 	 */
 	trfb_framebuffer_t *fb;
 	trfb_format_t format;
+	/* Conversion from server framebuffer to fb (created with fb) */
+	trfb_converter_t *converter;
+	/* fb is not equal to image of client (new one or JPEG images were sent as is) */
+	int fb_stale;
+	/* Image of pool which fb points to while it is shared (until output queue is sent or while it is image
+	 * of client for scroll detection) and entry of format of connection in pool */
+	trfb_shared_fb_t *shared_fb;
+	trfb_fbpool_format_t *pool_format;
+	/* Output queue references pixels of shared image */
+	int shared_fb_ref;
 
 	trfb_io_t *io;
 
+	/* Encodings supported by client (from SetEncodings) in order of preference */
+	int32_t *encodings;
+	unsigned encodings_cnt;
+	/* Encoder chosen for this connection and per-connection states of encoders */
+	const struct trfb_encoder *encoder;
+#define TRFB_MAX_ENCODERS 32
+	void *encoder_state[TRFB_MAX_ENCODERS];
+	/* zlib compression level (0-9) used by compressing encoders. Client sets it with CompressLevel. */
+	int compress_level;
+	/* JPEG quality (1-100) and chroma subsampling used by lossy encoders if client asked for quality level */
+	int jpeg_quality;
+#define TRFB_SUBSAMPLING_444  0
+#define TRFB_SUBSAMPLING_420  1
+#define TRFB_SUBSAMPLING_422  2
+#define TRFB_SUBSAMPLING_GRAY 3
+	int jpeg_subsampling;
+
+	/* Output of encoder is captured to cache entry instead of output queue. Encoder sets capture_private if
+	 * output depends on its state and can't be reused by other connections. */
+	trfb_cache_entry_t *capture;
+	int capture_private;
+	/* Cache entries referenced by output queue: they are released when queue is sent */
+	trfb_cache_entry_t **shared;
+	unsigned shared_cnt, shared_size;
+
 	trfb_connection_t *next;
 };
 
 trfb_server_t *trfb_server_create(size_t width, size_t height, unsigned bpp);
+/* Create server with flags. TRFB_SERVER_EVENT_LOOP serves all clients from few epoll threads
+ * instead of thread per client. */
+trfb_server_t *trfb_server_create_ex(size_t width, size_t height, unsigned bpp, unsigned flags);
+/* Set count of event loop threads. Must be called before trfb_server_start. */
+int trfb_server_set_loops(trfb_server_t *srv, unsigned cnt);
+/* Set sizes of read and write buffers for new connections (0 keeps current one). Default is TRFB_BUFSIZ.
+ * Large write buffer (hundreds of KB) helps clients on slow links. */
+int trfb_server_set_buffers(trfb_server_t *srv, size_t rsize, size_t wsize);
+/* Set zlib compression level (0-9) for new connections. Default is TRFB_COMPRESS_LEVEL. */
+int trfb_server_set_compress_level(trfb_server_t *srv, int level);
+/* Set JPEG quality (1-100) for new connections. Default is TRFB_JPEG_QUALITY. */
+int trfb_server_set_jpeg_quality(trfb_server_t *srv, int quality);
+/* Set latency (seconds) which TRFB_SERVER_ADAPTIVE keeps for new connections. Default is TRFB_TARGET_LATENCY. */
+int trfb_server_set_target_latency(trfb_server_t *srv, double latency);
 void trfb_server_destroy(trfb_server_t *server);
 int trfb_server_start(trfb_server_t *server);
 int trfb_server_stop(trfb_server_t *server);
@@ -252,6 +519,27 @@ unsigned trfb_server_get_state(trfb_server_t *S);
 
 int trfb_server_lock_fb(trfb_server_t *srv, int w);
 int trfb_server_unlock_fb(trfb_server_t *srv);
+/* Mark rectangle of framebuffer as changed. Call it while framebuffer is locked for writing:
+ * if nothing is marked the whole framebuffer is considered changed on unlock. */
+int trfb_server_mark_dirty(trfb_server_t *srv, unsigned x, unsigned y, unsigned width, unsigned height);
+/* Copy rectangle of framebuffer to (dx, dy) (scrolling or moving window). Clients which support CopyRect
+ * copy pixels themselves. Call it while framebuffer is locked for writing, it marks destination as changed. */
+int trfb_server_copy_rect(trfb_server_t *srv, unsigned sx, unsigned sy, unsigned dx, unsigned dy,
+		unsigned width, unsigned height);
+/* Change size of framebuffer: pixels are kept at top left corner and the rest is black. Clients receive
+ * DesktopSize or ExtendedDesktopSize, clients which support neither of them are disconnected.
+ * Framebuffer must not be locked. */
+int trfb_server_resize(trfb_server_t *srv, unsigned width, unsigned height);
+/* Replace framebuffer by JPEG image of the same size. Clients which accept Tight JPEG receive the image as is,
+ * other ones receive pixels decoded once for all of them. Framebuffer must not be locked. */
+int trfb_server_update_jpeg(trfb_server_t *srv, const void *data, size_t len);
+/* Set cursor: pixels are width * height colours (TRFB_RGB), mask has bit per pixel (rows are padded to bytes,
+ * the most significant bit is the left pixel). NULL mask means opaque cursor and NULL pixels remove cursor.
+ * Clients which support Cursor pseudo-encoding draw it themselves, other ones receive it drawn into pixels. */
+int trfb_server_set_cursor(trfb_server_t *srv, unsigned width, unsigned height, unsigned hot_x, unsigned hot_y,
+		const trfb_color_t *pixels, const unsigned char *mask);
+/* Move pointer (hot spot of cursor). Pointer events of clients move it too. */
+int trfb_server_set_pointer(trfb_server_t *srv, unsigned x, unsigned y);
 
 int trfb_server_add_event(trfb_server_t *srv, trfb_event_t *event);
 /* poll_event returns 1 on success and 0 if there is no events or error */
@@ -266,6 +554,8 @@ unsigned trfb_server_updated(trfb_server_t *srv);
 int trfb_server_set_socket(trfb_server_t *server, int sock);
 /* Bind to specified host and address: */
 int trfb_server_bind(trfb_server_t *server, const char *host, const char *port);
+/* Bind to Unix socket (existing file is removed) */
+int trfb_server_bind_unix(trfb_server_t *server, const char *path);
 
 /* You can set your own error print function. Default is fwrite(message, strlen(message), 1, stderr). */
 extern void (*trfb_log_cb)(const char *message);
@@ -285,6 +575,198 @@ void trfb_connection_read_all(trfb_connection_t *con, void *buf, ssize_t len);
 ssize_t trfb_connection_write(trfb_connection_t *con, const void *buf, ssize_t len);
 void trfb_connection_write_all(trfb_connection_t *con, const void *buf, ssize_t len);
 void trfb_connection_flush(trfb_connection_t *con);
+/* Append data to output buffer without any I/O. Returns 0 on success. */
+int trfb_connection_queue(trfb_connection_t *con, const void *buf, size_t len);
+/* Append reference to data to output (smaller than TRFB_QUEUE_REF_MIN is copied). Memory must not be
+ * changed until output is flushed: updates are not sent while output references client framebuffer. */
+#define TRFB_QUEUE_REF_MIN 1024
+int trfb_connection_queue_ref(trfb_connection_t *con, const void *buf, size_t len);
+/* Process all complete messages in input buffer. Returns -1 if connection must be closed. */
+int trfb_connection_process(trfb_connection_t *con);
+/* Send pending FramebufferUpdate if there is something to send. Returns -1 on error. */
+int trfb_connection_update(trfb_connection_t *con);
+/* Add damage to connection and wake it up if it waits for update */
+void trfb_connection_damage(trfb_connection_t *con, const trfb_region_t *damage);
+/* Make event loop or thread of connection call trfb_connection_update */
+void trfb_connection_wakeup(trfb_connection_t *con);
+/* Non-blocking handlers for event loop. Return -1 if connection must be closed. */
+int trfb_connection_on_read(trfb_connection_t *con);
+int trfb_connection_on_write(trfb_connection_t *con);
+
+/* Encodings: */
+#define TRFB_ENCODING_RAW 0
+#define TRFB_ENCODING_COPYRECT 1
+#define TRFB_ENCODING_RRE 2
+#define TRFB_ENCODING_CORRE 4
+#define TRFB_ENCODING_HEXTILE 5
+#define TRFB_ENCODING_TIGHT 7
+#define TRFB_ENCODING_ZRLE 16
+/* Pseudo-encodings: client allows JPEG and asks for its quality */
+#define TRFB_ENCODING_QUALITY_LEVEL0 -32
+#define TRFB_ENCODING_QUALITY_LEVEL9 -23
+/* Pseudo-encodings: zlib compression level */
+#define TRFB_ENCODING_COMPRESS_LEVEL0 -256
+#define TRFB_ENCODING_COMPRESS_LEVEL9 -247
+/* Pseudo-encodings of TurboVNC: JPEG quality 0-100 and chroma subsampling (TRFB_SUBSAMPLING_*) */
+#define TRFB_ENCODING_FINE_QUALITY_LEVEL0 -512
+#define TRFB_ENCODING_FINE_QUALITY_LEVEL100 -412
+#define TRFB_ENCODING_SUBSAMPLING_444 -768
+#define TRFB_ENCODING_SUBSAMPLING_GRAY -765
+/* Pseudo-encodings: client supports Fence and EnableContinuousUpdates messages */
+#define TRFB_ENCODING_FENCE -312
+#define TRFB_ENCODING_CONTINUOUS_UPDATES -313
+/* Pseudo-encodings: client could change size of its framebuffer */
+#define TRFB_ENCODING_DESKTOP_SIZE -223
+#define TRFB_ENCODING_EXTENDED_DESKTOP_SIZE -308
+/* Pseudo-encoding: client draws cursor itself */
+#define TRFB_ENCODING_CURSOR -239
+
+/* Fence flags */
+#define TRFB_FENCE_BLOCK_BEFORE 0x00000001u
+#define TRFB_FENCE_BLOCK_AFTER 0x00000002u
+#define TRFB_FENCE_SYNC_NEXT 0x00000004u
+#define TRFB_FENCE_REQUEST 0x80000000u
+
+typedef struct trfb_encoder {
+	/* RFB encoding type */
+	int32_t encoding;
+	const char *name;
+
+	/* Maximum size of one rectangle (0 - unlimited). Bigger rectangles are split. */
+	unsigned max_width, max_height;
+
+	/* Create and destroy per-connection state. Could be NULL if encoder has no state. */
+	void* (*create)(trfb_connection_t *con);
+	void (*destroy)(void *state);
+
+	/* Estimate cost of rectangle of content like con->fb (see trfb_connection_content) in bytes: size of
+	 * encoded data plus work of encoder and decoder counted as bytes sent by LAN meanwhile. Encodings advertised
+	 * by client with equal preference are compared by estimate (see trfb_connection_set_encodings). Could be
+	 * NULL: encoder is chosen only by order of client. */
+	size_t (*estimate)(trfb_connection_t *con, unsigned width, unsigned height);
+
+	/* Encode rectangle from con->fb: write exactly one rectangle (header and data). Returns 0 on success. */
+	int (*encode)(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height);
+
+	/* TRFB_ENCODER_SHARED: output depends only on pixels, format and encoder parameters of connection, so it
+	 * is encoded once for all connections (see trfb_connection_encode_shared) */
+#define TRFB_ENCODER_SHARED 0x0001
+	unsigned flags;
+} trfb_encoder_t;
+
+extern const trfb_encoder_t trfb_encoder_raw;
+extern const trfb_encoder_t trfb_encoder_rre;
+extern const trfb_encoder_t trfb_encoder_corre;
+extern const trfb_encoder_t trfb_encoder_hextile;
+#if TRFB_HAVE_ZLIB
+extern const trfb_encoder_t trfb_encoder_zrle;
+extern const trfb_encoder_t trfb_encoder_tight;
+#endif
+
+/* Register encoder. Encoder with the same type is replaced. You must register encoders before server start. */
+int trfb_encoder_register(const trfb_encoder_t *enc);
+const trfb_encoder_t* trfb_encoder_find(int32_t encoding);
+/* Get registered encoder by index (NULL if index is out of range) */
+const trfb_encoder_t* trfb_encoder_get(unsigned idx);
+/* Set encodings supported by client and choose the best encoder for connection: the first supported one of
+ * the list, or the one with the least estimate if client lists Raw first (Raw is no preference and it is used
+ * only if nothing else is listed; Hextile has the least estimate of built-in encoders for usual desktop).
+ * Compression level and JPEG parameters are taken from pseudo-encodings (server defaults if client doesn't
+ * send them). */
+int trfb_connection_set_encodings(trfb_connection_t *con, const int32_t *encodings, unsigned cnt);
+/* Content of client image for estimates of encoders: per mille of 16x16 tiles of one colour and of two colours.
+ * Tiles are sampled over con->fb, usual desktop is assumed before the first update. */
+void trfb_connection_content(trfb_connection_t *con, unsigned *solid, unsigned *two);
+int trfb_connection_has_encoding(trfb_connection_t *con, int32_t encoding);
+/* Set zlib compression level (0-9) of connection. It is applied to the next rectangle. */
+int trfb_connection_set_compress_level(trfb_connection_t *con, int level);
+/* Set JPEG quality (1-100) of connection. It is applied to the next rectangle. */
+int trfb_connection_set_jpeg_quality(trfb_connection_t *con, int quality);
+/* Get per-connection state of encoder (state is created on first use) */
+void* trfb_connection_encoder_state(trfb_connection_t *con, const trfb_encoder_t *enc);
+void trfb_connection_encoders_free(trfb_connection_t *con);
+/* Write rectangle header */
+int trfb_connection_rect_header(trfb_connection_t *con, unsigned x, unsigned y, unsigned width, unsigned height, int32_t encoding);
+/* Client accepts JPEG in Tight rectangles */
+int trfb_connection_jpeg_allowed(trfb_connection_t *con);
+/* Write Tight rectangle of JPEG image */
+int trfb_connection_tight_jpeg(trfb_connection_t *con, unsigned x, unsigned y, unsigned width, unsigned height,
+		const void *data, size_t len);
+/* Find vertical scroll of damaged rectangles comparing server framebuffer (must be locked) with con->fb.
+ * On success copied rows are removed from rects and 1 is returned: caller scrolls own con->fb. */
+int trfb_connection_find_scroll(trfb_connection_t *con, trfb_rect_t **rects, int *rects_cnt,
+		trfb_rect_t *dst, unsigned *sx, unsigned *sy);
+/* Write CopyRect rectangle */
+int trfb_connection_copy_rect(trfb_connection_t *con, const trfb_rect_t *dst, unsigned sx, unsigned sy);
+/* Send Fence message (data is up to 64 bytes) */
+int trfb_connection_fence(trfb_connection_t *con, uint32_t flags, const void *data, unsigned len);
+/* Send fence request after continuous update if client supports fences */
+int trfb_connection_fence_ping(trfb_connection_t *con);
+/* Process response to fence request: data is acknowledged and window is adjusted */
+void trfb_connection_fence_response(trfb_connection_t *con, const unsigned char *data, unsigned len);
+/* Continuous updates must wait: too much data is not acknowledged by client */
+int trfb_connection_congested(trfb_connection_t *con);
+/* Measure link of connection and adjust encoding parameters (TRFB_SERVER_ADAPTIVE). Returns time in seconds
+ * update must wait for the link to drain or 0 if it could be sent now. */
+double trfb_connection_rate(trfb_connection_t *con);
+/* Copy cursor of server to connection if it is changed. Cursor rectangle will be sent to clients drawing it. */
+int trfb_connection_sync_cursor(trfb_connection_t *con);
+/* Write Cursor rectangle */
+int trfb_connection_send_cursor(trfb_connection_t *con);
+/* Get area of cursor drawn at (px, py) for this update and damage old and new one if cursor is changed.
+ * Connection must be locked. */
+void trfb_connection_cursor_damage(trfb_connection_t *con, unsigned px, unsigned py, int changed, trfb_rect_t *area);
+/* Add rectangles which must be sent again because of CopyRect: copied and overwritten cursor */
+int trfb_connection_cursor_copy(trfb_connection_t *con, trfb_rect_t **rects, int *rects_cnt, const trfb_rect_t *area,
+		const trfb_rect_t *dst, unsigned sx, unsigned sy);
+/* Draw part of cursor inside of rect (converted pixels) to con->fb */
+void trfb_connection_draw_cursor(trfb_connection_t *con, const trfb_rect_t *area, unsigned px, unsigned py,
+		const trfb_rect_t *rect);
+/* Update area of drawn cursor after update of rect */
+void trfb_connection_cursor_drawn(trfb_connection_t *con, const trfb_rect_t *area, const trfb_rect_t *rect);
+/* Count of rectangles written by trfb_connection_encode for rectangle of this size */
+unsigned trfb_encoder_count(const trfb_encoder_t *enc, unsigned width, unsigned height);
+/* Encode rectangle using encoder (state is taken from connection). Rectangle is split if it is too big for encoder. */
+int trfb_connection_encode(trfb_connection_t *con, const trfb_encoder_t *enc, unsigned x, unsigned y, unsigned width, unsigned height);
+
+/* Encode-once cache. Rectangle converted from server frame is the same for all connections with the same
+ * format, so output of TRFB_ENCODER_SHARED encoders is found by (format, encoding, parameters, frame, rectangle).
+ * The first connection encodes it, other ones queue the same bytes. */
+trfb_cache_t* trfb_cache_create(void);
+void trfb_cache_free(trfb_cache_t *cache);
+/* Append output of encoder to entry captured by connection */
+int trfb_cache_append(trfb_cache_entry_t *e, const void *buf, size_t len);
+/* Encode rectangle of con->fb converted from server frame like trfb_connection_encode does using cache */
+int trfb_connection_encode_shared(trfb_connection_t *con, const trfb_encoder_t *enc, unsigned long long frame,
+		unsigned x, unsigned y, unsigned width, unsigned height);
+/* Release entries referenced by output queue. Queue must be sent. */
+void trfb_connection_release_shared(trfb_connection_t *con);
+
+/* Pool of converted framebuffers. Connections with the same format which don't draw cursor share one image:
+ * tiles are converted once per frame and image is copied on write if other connection reads it. */
+trfb_fbpool_t* trfb_fbpool_create(void);
+void trfb_fbpool_free(trfb_fbpool_t *pool);
+/* Count of connections with format of connection (it joins pool of its format). Server framebuffer must be locked. */
+int trfb_connection_pool_users(trfb_connection_t *con);
+/* Use image of pool with rectangles and destination of copy (may be NULL) converted from frame as con->fb.
+ * Image used before is released. Server framebuffer must be locked. */
+int trfb_connection_share_fb(trfb_connection_t *con, unsigned long long frame, const trfb_rect_t *rects, int cnt,
+		const trfb_rect_t *copied);
+/* trfb_connection_find_scroll for connection which keeps shared image last sent to client as con->fb */
+int trfb_connection_shared_scroll(trfb_connection_t *con, trfb_rect_t **rects, int *rects_cnt,
+		trfb_rect_t *dst, unsigned *sx, unsigned *sy);
+/* Release image used as con->fb. Output queue must be sent if it references image. */
+void trfb_connection_release_fb(trfb_connection_t *con);
+/* Release image and leave pool of format */
+void trfb_connection_leave_pool(trfb_connection_t *con);
+
+/* Event loop engine: */
+int trfb_loop_start(trfb_server_t *srv);
+int trfb_loop_stop(trfb_server_t *srv);
+/* Schedule trfb_connection_update call from event loop thread */
+void trfb_loop_schedule(trfb_connection_t *con);
+/* Schedule update after delay. Must be called from event loop thread of connection. */
+void trfb_loop_delay(trfb_connection_t *con, double seconds);
 
 /* Protocol messages: */
 ssize_t trfb_send_all(int sock, const void *buf, size_t len);
@@ -304,12 +786,27 @@ trfb_io_t* trfb_io_socket_wrap(int sock);
 ssize_t trfb_io_read(trfb_io_t *io, void *buf, ssize_t len, unsigned timeout);
 ssize_t trfb_io_write(trfb_io_t *io, const void *buf, ssize_t len, unsigned timeout);
 void trfb_io_free(trfb_io_t *io);
+/* Send queued data. Returns count of bytes which are not sent yet or 1 if everything is sent but
+ * some memory is still used by zero-copy send. So 0 means that the queue is empty. */
 int trfb_io_flush(trfb_io_t *io, unsigned timeout);
+/* Append all the data to write buffer (buffer grows if needed). Returns 0 on success. */
+int trfb_io_queue(trfb_io_t *io, const void *buf, size_t len);
+/* Append reference to memory to output queue. Memory must not be changed until trfb_io_flush returns 0. */
+int trfb_io_queue_ref(trfb_io_t *io, const void *buf, size_t len);
+/* Bytes in output queue */
+size_t trfb_io_pending(const trfb_io_t *io);
+/* Output queue is not empty or referenced memory is still used */
+int trfb_io_busy(const trfb_io_t *io);
+/* Change capacity of read and write buffers (0 keeps current one). Write capacity is rounded up to power
+ * of 2. Buffers never become smaller than data they contain. */
+int trfb_io_set_buffers(trfb_io_t *io, size_t rsize, size_t wsize);
+/* Enable MSG_ZEROCOPY for socket I/O. Returns -1 if it is not supported. */
+int trfb_io_zerocopy(trfb_io_t *io);
 int trfb_io_fgetc(trfb_io_t *io, unsigned timeout);
 int trfb_io_fputc(unsigned char c, trfb_io_t *io, unsigned timeout);
 
 #define trfb_io_getc(io, timeout) (((io)->rpos < (io)->rlen)? (io)->rbuf[(io)->rpos++]: trfb_io_fgetc(io, timeout))
-#define trfb_io_putc(c, io, timeout) (((io)->wlen < TRFB_BUFSIZ)? ((io)->wbuf[(io)->wlen++] = (c)): trfb_io_fputc(c, io, timeout))
+#define trfb_io_putc(c, io, timeout) (((io)->wlen - (io)->wtail < (io)->wsize)? ((io)->wbuf[(io)->wlen++ & ((io)->wsize - 1)] = (c)): trfb_io_fputc(c, io, timeout))
 
 trfb_framebuffer_t* trfb_framebuffer_create(unsigned width, unsigned height, unsigned char bpp);
 trfb_framebuffer_t* trfb_framebuffer_create_of_format(unsigned width, unsigned height, trfb_format_t *fmt);
@@ -318,8 +815,169 @@ void trfb_framebuffer_free(trfb_framebuffer_t *fb);
 int trfb_framebuffer_resize(trfb_framebuffer_t *fb, unsigned width, unsigned height);
 int trfb_framebuffer_convert(trfb_framebuffer_t *dst, trfb_framebuffer_t *src);
 int trfb_framebuffer_format(trfb_framebuffer_t *fb, trfb_format_t *fmt);
+/* Change byte order of pixels in place (conversion to framebuffer of required byte order is faster) */
 void trfb_framebuffer_endian(trfb_framebuffer_t *fb, int is_be);
 trfb_framebuffer_t* trfb_framebuffer_copy(trfb_framebuffer_t *fb);
+/* Copy rectangle of pixels inside of framebuffer (rectangles could overlap). Coordinates must be valid. */
+void trfb_framebuffer_copy_rect(trfb_framebuffer_t *fb, unsigned sx, unsigned sy, unsigned dx, unsigned dy,
+		unsigned width, unsigned height);
+
+/* Pixel format converter: prepared once for pair of framebuffer formats, then converts rows of pixels */
+typedef void (*trfb_convert_fn)(void *dst, const void *src, unsigned n, const trfb_converter_t *cv);
+struct trfb_converter {
+	unsigned char sbpp, dbpp;
+	/* Destination pixel is tab[0][byte 0] | tab[1][byte 1] | ... of source pixel */
+	uint32_t tab[4][256];
+	/* Source with 8-bit channels: destination channel is ((p >> shr) & mask) << shl */
+	unsigned char shr[3], shl[3];
+	uint32_t mask[3];
+	/* Byte shuffle for 32-bit -> 32-bit conversion (4 pixels) */
+	unsigned char shuffle[16];
+	/* Destination is not in host byte order */
+	int swap;
+	/* Row kernel and kernel for pixels left by SIMD kernels */
+	trfb_convert_fn row, tail;
+};
+int trfb_converter_init(trfb_converter_t *cv, const trfb_framebuffer_t *dst, const trfb_framebuffer_t *src);
+void trfb_converter_rows(const trfb_converter_t *cv, void *dst, size_t dst_stride,
+		const void *src, size_t src_stride, unsigned width, unsigned height);
+/* Convert rectangle of src to the same place of dst (framebuffers have the same size) */
+void trfb_converter_rect(const trfb_converter_t *cv, trfb_framebuffer_t *dst, const trfb_framebuffer_t *src,
+		unsigned x, unsigned y, unsigned width, unsigned height);
+
+/* CPU features for optimized kernels: */
+#define TRFB_CPU_SSE2  0x0001
+#define TRFB_CPU_SSSE3 0x0002
+#define TRFB_CPU_AVX2  0x0004
+#define TRFB_CPU_NEON  0x0100
+unsigned trfb_cpu_features(void);
+/* Kernels chosen after this call use only features of mask (tests and benchmarks compare kernels) */
+void trfb_cpu_limit(unsigned features);
+
+/* Tile hashes: damage detection by comparing hashes of TRFB_HASH_TILE x TRFB_HASH_TILE tiles */
+#define TRFB_HASH_TILE 64
+trfb_tilehash_t* trfb_tilehash_create(unsigned threads);
+void trfb_tilehash_free(trfb_tilehash_t *th);
+/* Hash framebuffer and add changed tiles to damage. First call marks everything. */
+int trfb_tilehash_update(trfb_tilehash_t *th, trfb_framebuffer_t *fb, trfb_region_t *damage);
+/* Hash of len bytes (the same function is used for tiles) */
+uint64_t trfb_hash(const void *data, size_t len);
+
+/*
+ * Headless client: does the handshake, requests updates and decodes them to client framebuffer.
+ * It is used to generate synthetic load. Client must be used from one thread.
+ */
+typedef struct trfb_decoder {
+	/* RFB encoding type */
+	int32_t encoding;
+	const char *name;
+
+	/* Create and destroy per-client state. Could be NULL if decoder has no state. */
+	void* (*create)(trfb_client_t *cl);
+	void (*destroy)(void *state);
+
+	/* Decode data of rectangle cl->rect to cl->fb. Returns count of bytes used or -1 on error.
+	 * *need is set to count of bytes required to continue or to 0 when rectangle is complete. */
+	ssize_t (*decode)(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need);
+} trfb_decoder_t;
+
+extern const trfb_decoder_t trfb_decoder_raw;
+extern const trfb_decoder_t trfb_decoder_copyrect;
+extern const trfb_decoder_t trfb_decoder_rre;
+extern const trfb_decoder_t trfb_decoder_corre;
+extern const trfb_decoder_t trfb_decoder_hextile;
+#if TRFB_HAVE_ZLIB
+extern const trfb_decoder_t trfb_decoder_zrle;
+extern const trfb_decoder_t trfb_decoder_tight;
+#endif
+extern const trfb_decoder_t trfb_decoder_desktop_size;
+extern const trfb_decoder_t trfb_decoder_extended_desktop_size;
+extern const trfb_decoder_t trfb_decoder_cursor;
+
+const trfb_decoder_t* trfb_decoder_find(int32_t encoding);
+/* Get decoder by index (NULL if index is out of range) */
+const trfb_decoder_t* trfb_decoder_get(unsigned idx);
+
+typedef struct trfb_client_stats {
+	/* Complete FramebufferUpdates, rectangles and bytes received */
+	unsigned long updates, rects;
+	unsigned long long bytes;
+	/* Time from FramebufferUpdateRequest to the end of FramebufferUpdate (seconds) */
+	unsigned long latency_cnt;
+	double latency_sum, latency_min, latency_max;
+} trfb_client_stats_t;
+
+struct trfb_client {
+	int sock;
+	trfb_io_t *io;
+	char name[64];
+
+	trfb_protocol_t version;
+#define TRFB_CLIENT_VERSION  0
+#define TRFB_CLIENT_SECURITY 1
+#define TRFB_CLIENT_RESULT   2
+#define TRFB_CLIENT_INIT     3
+#define TRFB_CLIENT_NORMAL   4
+	unsigned phase;
+	unsigned char *in;
+	size_t inlen, insize;
+
+	/* From ServerInit */
+	unsigned width, height;
+	trfb_format_t server_format;
+	char *desktop;
+
+	/* Format requested with SetPixelFormat (server format if it is not set) and framebuffer of this format */
+	int format_set;
+	trfb_format_t format;
+	trfb_framebuffer_t *fb;
+
+	/* Encodings sent with SetEncodings */
+	int32_t *encodings;
+	unsigned encodings_cnt;
+	void *decoder_state[TRFB_MAX_ENCODERS];
+
+	/* Current FramebufferUpdate: count of rectangles left and rectangle being decoded */
+	unsigned rects_left;
+	trfb_rect_t rect;
+	const trfb_decoder_t *decoder;
+	/* Decoder progress inside of rectangle */
+	unsigned rect_row;
+
+	/* Server supports continuous updates (EndOfContinuousUpdates is received) and they are enabled */
+	int cu_supported;
+	int cu_enabled;
+
+	/* FramebufferUpdateRequest is sent and update is not received yet */
+	int requested;
+	double request_time;
+	trfb_client_stats_t stats;
+
+	/* Callbacks: ServerInit is received, FramebufferUpdate is received completely */
+	void (*on_init)(trfb_client_t *cl);
+	void (*on_update)(trfb_client_t *cl);
+	void *user;
+};
+
+/* Connect to host:port or to Unix socket if host starts with '/' (port is ignored). Returns socket or -1.
+ * Non-blocking socket could be not connected yet. */
+int trfb_client_connect(const char *host, const char *port, int nonblock);
+/* Create client for connected socket. Socket is closed by trfb_client_free. */
+trfb_client_t* trfb_client_create(int sock);
+void trfb_client_free(trfb_client_t *cl);
+/* Set pixel format and encodings. They are sent after ServerInit or immediately if handshake is done. */
+int trfb_client_set_format(trfb_client_t *cl, const trfb_format_t *fmt);
+int trfb_client_set_encodings(trfb_client_t *cl, const int32_t *encodings, unsigned cnt);
+/* Queue FramebufferUpdateRequest for the whole screen */
+int trfb_client_request(trfb_client_t *cl, int incremental);
+/* Enable or disable continuous updates of the whole screen. Server must support them (cu_supported). */
+int trfb_client_continuous(trfb_client_t *cl, int enable);
+/* Read and process data. Returns 1 if something was read, 0 on timeout (or if read would block) and -1 on error. */
+int trfb_client_read(trfb_client_t *cl, unsigned timeout);
+/* Send queued messages. Returns the same as trfb_io_flush. */
+int trfb_client_flush(trfb_client_t *cl, unsigned timeout);
+/* Monotonic time in seconds */
+double trfb_client_time(void);
 
 /* extern "C" { */
 #ifdef __cplusplus
@@ -0,0 +1,692 @@
+#include <trfb.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * ZRLE encoding: rectangle is split to 64x64 tiles, every tile is raw, solid, packed palette, plain RLE
+ * or palette RLE (the smallest one is chosen by one pass over tile). Tiles are compressed by zlib stream
+ * which lives as long as connection does (client has one inflate stream for all ZRLE rectangles).
+ *
+ * Subencoded tiles are collected to arena and compressed by parts. Compressed data is collected to
+ * the second arena because length of data is sent before it. Both arenas are reused between updates.
+ */
+
+#if HAVE_ZLIB_H
+#include <zlib.h>
+
+#define TILE 64
+/* Subencoded tiles are compressed when there is so many bytes */
+#define CHUNK 65536
+/* Subencoding and raw pixels */
+#define TILE_MAX (1 + TILE * TILE * 4)
+#define PALETTE_MAX 127
+
+#define ZRLE_RAW          0
+#define ZRLE_SOLID        1
+#define ZRLE_PLAIN_RLE    128
+
+/* Compressed pixel: 3 bytes for 32-bit pixels of depth <= 24 when all colour bits are in 3 bytes */
+typedef struct cpixel {
+	unsigned bpp, size, offset;
+} cpixel_t;
+
+static void cpixel_init(cpixel_t *cp, const trfb_framebuffer_t *fb)
+{
+	trfb_format_t fmt;
+	uint32_t mask;
+
+	trfb_framebuffer_format((trfb_framebuffer_t*)fb, &fmt);
+	mask = ((uint32_t)fmt.rmax << fmt.rshift) | ((uint32_t)fmt.gmax << fmt.gshift) | ((uint32_t)fmt.bmax << fmt.bshift);
+
+	cp->bpp = fb->bpp;
+	cp->size = fb->bpp;
+	cp->offset = 0;
+	if (fmt.bpp == 32 && fmt.depth <= 24 && fmt.true_color) {
+		if (mask < 0x1000000) {
+			/* Least significant bytes */
+			cp->size = 3;
+			cp->offset = fb->big_endian? 1: 0;
+		} else if ((mask & 0xff) == 0) {
+			cp->size = 3;
+			cp->offset = fb->big_endian? 0: 1;
+		}
+	}
+}
+
+static inline uint32_t get_pixel(const unsigned char *p, unsigned bpp)
+{
+	uint16_t v16;
+	uint32_t v32;
+
+	if (bpp == 1)
+		return *p;
+
+	if (bpp == 2) {
+		memcpy(&v16, p, 2);
+		return v16;
+	}
+
+	memcpy(&v32, p, 4);
+	return v32;
+}
+
+/* Value returned by get_pixel is written back in the same byte order */
+static inline void set_pixel(unsigned char *p, uint32_t c, unsigned bpp)
+{
+	uint16_t v16 = c;
+
+	if (bpp == 1)
+		*p = c;
+	else if (bpp == 2)
+		memcpy(p, &v16, 2);
+	else
+		memcpy(p, &c, 4);
+}
+
+static inline unsigned char* put_cpixel(unsigned char *o, uint32_t c, const cpixel_t *cp)
+{
+	unsigned char b[4];
+
+	set_pixel(b, c, cp->bpp);
+	memcpy(o, b + cp->offset, cp->size);
+
+	return o + cp->size;
+}
+
+static inline unsigned char* put_length(unsigned char *o, unsigned len)
+{
+	for (len--; len >= 255; len -= 255)
+		*o++ = 255;
+	*o++ = len;
+
+	return o;
+}
+
+/* Palette of tile: open addressing hash of colours */
+typedef struct palette {
+	uint32_t colours[PALETTE_MAX];
+	unsigned n;
+	/* Index + 1 of colour, 0 - empty slot */
+	unsigned char hash[256];
+} palette_t;
+
+static inline unsigned hash_pixel(uint32_t c)
+{
+	return (c * 2654435761u) >> 24;
+}
+
+/* Returns index of colour or -1 if palette is full */
+static inline int palette_insert(palette_t *pal, uint32_t c)
+{
+	unsigned h = hash_pixel(c);
+
+	for (; pal->hash[h]; h = (h + 1) & 255)
+		if (pal->colours[pal->hash[h] - 1] == c)
+			return pal->hash[h] - 1;
+
+	if (pal->n >= PALETTE_MAX)
+		return -1;
+
+	pal->colours[pal->n] = c;
+	pal->hash[h] = ++pal->n;
+
+	return pal->n - 1;
+}
+
+static inline unsigned palette_index(const palette_t *pal, uint32_t c)
+{
+	unsigned h = hash_pixel(c);
+
+	while (pal->colours[pal->hash[h] - 1] != c)
+		h = (h + 1) & 255;
+
+	return pal->hash[h] - 1;
+}
+
+/* Encode tile to o. Returns end of data. */
+static unsigned char* encode_tile(unsigned char *o, const unsigned char *p, size_t stride, unsigned w, unsigned h,
+		const cpixel_t *cp)
+{
+	palette_t pal;
+	unsigned bpp = cp->bpp;
+	unsigned x, y, i, bits, run, runs = 0, singles = 0, extra = 0;
+	size_t raw, plain, prle = (size_t)-1, packed = (size_t)-1, best;
+	uint32_t c = 0, cur = 0;
+	unsigned char b;
+	int full = 0;
+
+	pal.n = 0;
+	memset(pal.hash, 0, sizeof(pal.hash));
+
+	/* Runs continue from row to row */
+	cur = get_pixel(p, bpp);
+	run = 0;
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			c = get_pixel(p + y * stride + x * bpp, bpp);
+			if (c == cur) {
+				run++;
+				continue;
+			}
+
+			runs++;
+			singles += run == 1;
+			extra += (run - 1) / 255;
+			if (!full && palette_insert(&pal, cur) < 0)
+				full = 1;
+			cur = c;
+			run = 1;
+		}
+	}
+	runs++;
+	singles += run == 1;
+	extra += (run - 1) / 255;
+	if (!full && palette_insert(&pal, cur) < 0)
+		full = 1;
+
+	if (!full && pal.n == 1) {
+		*o++ = ZRLE_SOLID;
+		return put_cpixel(o, cur, cp);
+	}
+
+	raw = (size_t)w * h * cp->size;
+	plain = (size_t)runs * (cp->size + 1) + extra;
+	bits = 0;
+	if (!full) {
+		prle = (size_t)pal.n * cp->size + (runs - singles) * 2 + singles + extra;
+		if (pal.n <= 16) {
+			bits = pal.n <= 2? 1: pal.n <= 4? 2: 4;
+			packed = (size_t)pal.n * cp->size + h * ((w * bits + 7) / 8);
+		}
+	}
+
+	best = raw;
+	if (plain < best)
+		best = plain;
+	if (prle < best)
+		best = prle;
+	if (packed < best)
+		best = packed;
+
+	if (best == raw) {
+		*o++ = ZRLE_RAW;
+		for (y = 0; y < h; y++) {
+			if (cp->size == bpp) {
+				memcpy(o, p + y * stride, (size_t)w * bpp);
+				o += (size_t)w * bpp;
+			} else {
+				for (x = 0; x < w; x++, o += 3)
+					memcpy(o, p + y * stride + x * 4 + cp->offset, 3);
+			}
+		}
+		return o;
+	}
+
+	if (best == packed) {
+		*o++ = pal.n;
+		for (i = 0; i < pal.n; i++)
+			o = put_cpixel(o, pal.colours[i], cp);
+
+		/* Rows are padded to byte, the first pixel is in the most significant bits */
+		for (y = 0; y < h; y++) {
+			b = 0;
+			i = 0;
+			for (x = 0; x < w; x++) {
+				b = (b << bits) | palette_index(&pal, get_pixel(p + y * stride + x * bpp, bpp));
+				i += bits;
+				if (i == 8) {
+					*o++ = b;
+					b = 0;
+					i = 0;
+				}
+			}
+			if (i)
+				*o++ = b << (8 - i);
+		}
+		return o;
+	}
+
+	if (best == prle) {
+		*o++ = ZRLE_PLAIN_RLE + pal.n;
+		for (i = 0; i < pal.n; i++)
+			o = put_cpixel(o, pal.colours[i], cp);
+	} else {
+		*o++ = ZRLE_PLAIN_RLE;
+	}
+
+	cur = get_pixel(p, bpp);
+	run = 0;
+	for (y = 0; y < h; y++) {
+		for (x = 0; x <= w; x++) {
+			/* Last pixel of tile ends the last run */
+			if (x == w) {
+				if (y + 1 < h)
+					break;
+			} else {
+				c = get_pixel(p + y * stride + x * bpp, bpp);
+				if (c == cur) {
+					run++;
+					continue;
+				}
+			}
+
+			if (best == prle) {
+				i = palette_index(&pal, cur);
+				if (run == 1) {
+					*o++ = i;
+				} else {
+					*o++ = i | 128;
+					o = put_length(o, run);
+				}
+			} else {
+				o = put_cpixel(o, cur, cp);
+				o = put_length(o, run);
+			}
+			cur = c;
+			run = 1;
+		}
+	}
+
+	return o;
+}
+
+typedef struct zrle_state {
+	z_stream zs;
+	int level;
+	/* Subencoded tiles waiting for compression */
+	unsigned char *raw;
+	size_t raw_len;
+	/* Compressed data of rectangle */
+	unsigned char *out;
+	size_t out_len, out_size;
+} zrle_state_t;
+
+static void* zrle_create(trfb_connection_t *con)
+{
+	zrle_state_t *st;
+
+	st = calloc(1, sizeof(zrle_state_t));
+	if (!st)
+		return NULL;
+
+	st->level = con->compress_level;
+	st->raw = malloc(CHUNK + TILE_MAX);
+	st->out_size = CHUNK;
+	st->out = malloc(st->out_size);
+	if (!st->raw || !st->out || deflateInit(&st->zs, st->level) != Z_OK) {
+		free(st->raw);
+		free(st->out);
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+static void zrle_destroy(void *state)
+{
+	zrle_state_t *st = state;
+
+	deflateEnd(&st->zs);
+	free(st->raw);
+	free(st->out);
+	free(st);
+}
+
+/* Compress everything from raw arena to out arena */
+static int zrle_compress(zrle_state_t *st, int flush)
+{
+	unsigned char *p;
+	size_t sz;
+	int rv;
+
+	st->zs.next_in = st->raw;
+	st->zs.avail_in = st->raw_len;
+	do {
+		if (st->out_size - st->out_len < 64) {
+			sz = st->out_size * 2;
+			p = realloc(st->out, sz);
+			if (!p)
+				return -1;
+			st->out = p;
+			st->out_size = sz;
+		}
+
+		st->zs.next_out = st->out + st->out_len;
+		st->zs.avail_out = st->out_size - st->out_len;
+		rv = deflate(&st->zs, flush);
+		st->out_len = st->out_size - st->zs.avail_out;
+		if (rv != Z_OK && rv != Z_BUF_ERROR)
+			return -1;
+	} while (st->zs.avail_in || st->zs.avail_out == 0);
+
+	st->raw_len = 0;
+
+	return 0;
+}
+
+/* Per 16x16 tile: solid tiles of 64x64 take a few bytes, two-colour ones are packed palette with 1 bit per pixel
+ * and others are compressed pixels. zlib halves packed data and takes a quarter of pixels. Analysis of tiles
+ * and zlib on both sides are two bytes per pixel. */
+static size_t zrle_estimate(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	unsigned cp = con->format.bpp == 32 && con->format.depth <= 24? 3: con->format.bpp / 8;
+	unsigned solid, two;
+
+	trfb_connection_content(con, &solid, &two);
+
+	return (double)width * height / 256 *
+		(solid * (1.0 + cp) / 16 + two * (1.0 + 2 * cp + 32) / 2 + (1000 - solid - two) * 192.0 * cp +
+		 512 * 1000) / 1000;
+}
+
+static int zrle_encode(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	zrle_state_t *st = state;
+	trfb_framebuffer_t *fb = con->fb;
+	size_t stride = (size_t)fb->width * fb->bpp;
+	const unsigned char *p;
+	unsigned char len[4];
+	unsigned tx, ty, tw, th;
+	cpixel_t cp;
+
+	st->raw_len = 0;
+	st->out_len = 0;
+	if (st->level != con->compress_level) {
+		/* deflateParams could write the end of previous block: it is sent with this rectangle */
+		st->zs.next_in = NULL;
+		st->zs.avail_in = 0;
+		st->zs.next_out = st->out;
+		st->zs.avail_out = st->out_size;
+		if (deflateParams(&st->zs, con->compress_level, Z_DEFAULT_STRATEGY) == Z_OK)
+			st->level = con->compress_level;
+		st->out_len = st->out_size - st->zs.avail_out;
+	}
+
+	cpixel_init(&cp, fb);
+	for (ty = y; ty < y + height; ty += TILE) {
+		th = y + height - ty < TILE? y + height - ty: TILE;
+		for (tx = x; tx < x + width; tx += TILE) {
+			tw = x + width - tx < TILE? x + width - tx: TILE;
+			p = (const unsigned char*)fb->pixels + ty * stride + tx * fb->bpp;
+			st->raw_len = encode_tile(st->raw + st->raw_len, p, stride, tw, th, &cp) - st->raw;
+			if (st->raw_len >= CHUNK && zrle_compress(st, Z_NO_FLUSH))
+				goto error;
+		}
+	}
+
+	/* Client must be able to decode everything received */
+	if (zrle_compress(st, Z_SYNC_FLUSH))
+		goto error;
+
+	len[0] = st->out_len >> 24;
+	len[1] = st->out_len >> 16;
+	len[2] = st->out_len >> 8;
+	len[3] = st->out_len;
+
+	if (trfb_connection_rect_header(con, x, y, width, height, TRFB_ENCODING_ZRLE) ||
+			trfb_connection_queue(con, len, 4) ||
+			trfb_connection_queue(con, st->out, st->out_len))
+		return -1;
+
+	return 0;
+
+error:
+	/* Stream state is unknown now and client could not decode anything more */
+	trfb_msg("[%s] ZRLE compression failed", con->name);
+	return -1;
+}
+
+const trfb_encoder_t trfb_encoder_zrle = {
+	TRFB_ENCODING_ZRLE,
+	"ZRLE",
+	0, 0,
+	zrle_create,
+	zrle_destroy,
+	zrle_estimate,
+	zrle_encode,
+	0 /* output depends on stream of connection */
+};
+
+/* Decoder: data is inflated to buffer and complete tiles are decoded from it. cl->rect_row is index of tile. */
+typedef struct zrle_dstate {
+	z_stream zs;
+	/* Length of rectangle data is read, compressed bytes left */
+	int started;
+	size_t left;
+	unsigned char *buf;
+	size_t len, size;
+} zrle_dstate_t;
+
+static void* zrle_dcreate(trfb_client_t *cl)
+{
+	zrle_dstate_t *st;
+
+	st = calloc(1, sizeof(zrle_dstate_t));
+	if (!st)
+		return NULL;
+
+	st->size = CHUNK;
+	st->buf = malloc(st->size);
+	if (!st->buf || inflateInit(&st->zs) != Z_OK) {
+		free(st->buf);
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+static void zrle_ddestroy(void *state)
+{
+	zrle_dstate_t *st = state;
+
+	inflateEnd(&st->zs);
+	free(st->buf);
+	free(st);
+}
+
+static inline uint32_t get_cpixel(const unsigned char *p, const cpixel_t *cp)
+{
+	unsigned char b[4] = { 0, 0, 0, 0 };
+
+	memcpy(b + cp->offset, p, cp->size);
+
+	return get_pixel(b, cp->bpp);
+}
+
+/* Read run length. Returns count of bytes or 0 if there is not enought data. */
+static size_t get_length(const unsigned char *p, size_t len, unsigned *run)
+{
+	size_t i;
+
+	*run = 1;
+	for (i = 0; i < len; i++) {
+		*run += p[i];
+		if (p[i] != 255)
+			return i + 1;
+	}
+
+	return 0;
+}
+
+/* Decode tile. Returns length of tile data, 0 if data is not complete or -1 on error. */
+static ssize_t decode_tile(trfb_framebuffer_t *fb, const cpixel_t *cp, const unsigned char *p, size_t len,
+		unsigned tx, unsigned ty, unsigned w, unsigned h)
+{
+	uint32_t pal[PALETTE_MAX];
+	size_t stride = (size_t)fb->width * fb->bpp;
+	unsigned char *d = (unsigned char*)fb->pixels + ty * stride + tx * fb->bpp;
+	size_t pos = 1, l;
+	unsigned sub, n, i, bits, x, y, run, pix = 0;
+	uint32_t c;
+
+	if (len < 1)
+		return 0;
+
+	sub = p[0];
+	if (sub == ZRLE_RAW) {
+		if (len < 1 + (size_t)w * h * cp->size)
+			return 0;
+		for (y = 0; y < h; y++)
+			for (x = 0; x < w; x++, pos += cp->size)
+				set_pixel(d + y * stride + x * fb->bpp, get_cpixel(p + pos, cp), fb->bpp);
+		return pos;
+	}
+
+	if ((sub > 16 && sub < 128) || sub == 129) {
+		trfb_msg("Invalid ZRLE subencoding %u", sub);
+		return -1;
+	}
+
+	n = sub < 128? sub: sub - 128;
+	if (len < pos + (size_t)n * cp->size)
+		return 0;
+	for (i = 0; i < n; i++, pos += cp->size)
+		pal[i] = get_cpixel(p + pos, cp);
+
+	if (sub == ZRLE_SOLID) {
+		for (y = 0; y < h; y++)
+			for (x = 0; x < w; x++)
+				set_pixel(d + y * stride + x * fb->bpp, pal[0], fb->bpp);
+		return pos;
+	}
+
+	if (sub < 128) {
+		bits = n <= 2? 1: n <= 4? 2: 4;
+		if (len < pos + h * ((w * bits + 7) / 8))
+			return 0;
+		for (y = 0; y < h; y++) {
+			for (x = 0; x < w; x++) {
+				i = (p[pos + x * bits / 8] >> (8 - bits - (x * bits) % 8)) & ((1 << bits) - 1);
+				if (i >= n)
+					return -1;
+				set_pixel(d + y * stride + x * fb->bpp, pal[i], fb->bpp);
+			}
+			pos += (w * bits + 7) / 8;
+		}
+		return pos;
+	}
+
+	/* RLE: the whole tile must be here, so runs are checked before pixels are written */
+	while (pix < w * h) {
+		if (sub == ZRLE_PLAIN_RLE) {
+			if (len < pos + cp->size)
+				return 0;
+			c = get_cpixel(p + pos, cp);
+			pos += cp->size;
+			l = get_length(p + pos, len - pos, &run);
+		} else {
+			if (len < pos + 1)
+				return 0;
+			i = p[pos++];
+			if ((i & 127) >= n)
+				return -1;
+			c = pal[i & 127];
+			run = 1;
+			l = 1;
+			if (i & 128)
+				l = get_length(p + pos, len - pos, &run);
+			else
+				pos--;
+		}
+		if (!l)
+			return 0;
+		pos += l;
+
+		if (pix + run > w * h)
+			return -1;
+		for (; run; run--, pix++)
+			set_pixel(d + (pix / w) * stride + (pix % w) * fb->bpp, c, fb->bpp);
+	}
+
+	return pos;
+}
+
+static ssize_t zrle_decode(trfb_client_t *cl, void *state, const unsigned char *buf, size_t len, size_t *need)
+{
+	zrle_dstate_t *st = state;
+	unsigned cols = (cl->rect.width + TILE - 1) / TILE;
+	unsigned tiles = cols * ((cl->rect.height + TILE - 1) / TILE);
+	size_t used = 0, pos = 0;
+	unsigned char *p;
+	unsigned tx, ty;
+	ssize_t l;
+	cpixel_t cp;
+	int rv;
+
+	if (!st->started) {
+		if (len < 4) {
+			*need = 4;
+			return 0;
+		}
+		st->left = ((size_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+		st->started = 1;
+		st->len = 0;
+		used = 4;
+	}
+
+	/* Inflate what we have */
+	st->zs.next_in = (unsigned char*)buf + used;
+	st->zs.avail_in = len - used < st->left? len - used: st->left;
+	while (st->zs.avail_in) {
+		if (st->size - st->len < CHUNK) {
+			p = realloc(st->buf, st->size * 2);
+			if (!p)
+				return -1;
+			st->buf = p;
+			st->size *= 2;
+		}
+
+		st->zs.next_out = st->buf + st->len;
+		st->zs.avail_out = st->size - st->len;
+		rv = inflate(&st->zs, Z_SYNC_FLUSH);
+		st->len = st->size - st->zs.avail_out;
+		if (rv != Z_OK && rv != Z_BUF_ERROR) {
+			trfb_msg("[%s] ZRLE inflate failed", cl->name);
+			return -1;
+		}
+	}
+	l = (len - used < st->left? len - used: st->left);
+	st->left -= l;
+	used += l;
+
+	cpixel_init(&cp, cl->fb);
+	for (; cl->rect_row < tiles; cl->rect_row++) {
+		tx = cl->rect.x + (cl->rect_row % cols) * TILE;
+		ty = cl->rect.y + (cl->rect_row / cols) * TILE;
+		l = decode_tile(cl->fb, &cp, st->buf + pos, st->len - pos, tx, ty,
+				cl->rect.x + cl->rect.width - tx < TILE? cl->rect.x + cl->rect.width - tx: TILE,
+				cl->rect.y + cl->rect.height - ty < TILE? cl->rect.y + cl->rect.height - ty: TILE);
+		if (l < 0)
+			return -1;
+		if (l == 0)
+			break;
+		pos += l;
+	}
+
+	memmove(st->buf, st->buf + pos, st->len - pos);
+	st->len -= pos;
+
+	if (cl->rect_row == tiles && st->left == 0) {
+		st->started = 0;
+		*need = 0;
+	} else if (st->left == 0) {
+		trfb_msg("[%s] ZRLE data is not complete", cl->name);
+		return -1;
+	} else {
+		*need = 1;
+	}
+
+	return used;
+}
+
+const trfb_decoder_t trfb_decoder_zrle = {
+	TRFB_ENCODING_ZRLE,
+	"ZRLE",
+	zrle_dcreate,
+	zrle_ddestroy,
+	zrle_decode
+};
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef TRFB_TEST_H
+#define TRFB_TEST_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+/* Checks of unit tests: each prints its result and failed one makes exit status of test non-zero */
+
+static int failed = 0;
+
+static void check(int ok, const char *what, ...)
+{
+	va_list args;
+
+	va_start(args, what);
+	vprintf(what, args);
+	va_end(args);
+	printf(": %s\n", ok? "ok": "FAILED");
+	if (!ok)
+		failed = 1;
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include <trfb.h>
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Pixels encoded by server and decoded by client are pixels of server converted into format of client */
+
+/* Odd size: the last tiles of every encoding are partial */
+#define W 203
+#define H 141
+#define FRAMES 6
+
+static trfb_format_t formats[] = {
+	{ 32, 24, 0, 1, 255, 255, 255, 16, 8, 0 },
+	{ 32, 24, 1, 1, 255, 255, 255, 0, 8, 16 },
+	{ 32, 30, 0, 1, 1023, 1023, 1023, 20, 10, 0 },
+	{ 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 },
+	{ 16, 16, 1, 1, 31, 63, 31, 11, 5, 0 },
+	{ 16, 15, 0, 1, 31, 31, 31, 10, 5, 0 },
+	{ 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 },
+};
+#define FORMATS_CNT (sizeof(formats) / sizeof(formats[0]))
+
+static const int32_t encodings[] = {
+	TRFB_ENCODING_RAW,
+	TRFB_ENCODING_RRE,
+	TRFB_ENCODING_CORRE,
+	TRFB_ENCODING_HEXTILE,
+#if TRFB_HAVE_ZLIB
+	TRFB_ENCODING_ZRLE,
+	TRFB_ENCODING_TIGHT,
+#endif
+};
+#define ENCODINGS_CNT (sizeof(encodings) / sizeof(encodings[0]))
+
+static uint32_t rnd;
+
+static uint32_t next(void)
+{
+	rnd = rnd * 1103515245 + 12345;
+	return rnd >> 8;
+}
+
+/* The first frame is noise, the next ones change solid, two-colour, gradient and noisy rectangles
+ * of odd sizes and positions */
+static void draw(trfb_server_t *srv, unsigned frame)
+{
+	uint32_t *p = srv->fb->pixels;
+	unsigned i, x, y, x0, y0, w, h;
+	uint32_t c0, c1;
+
+	rnd = frame + 1;
+	if (!frame) {
+		for (i = 0; i < W * H; i++)
+			p[i] = next() & 0xffffff;
+	}
+
+	for (i = 0; i < 8; i++) {
+		w = 1 + next() % 90;
+		h = 1 + next() % 70;
+		x0 = next() % (W - w);
+		y0 = next() % (H - h);
+		c0 = next() & 0xffffff;
+		c1 = next() & 0xffffff;
+		for (y = y0; y < y0 + h; y++) {
+			for (x = x0; x < x0 + w; x++) {
+				switch (i % 4) {
+				case 0:
+					p[y * W + x] = c0;
+					break;
+				case 1:
+					p[y * W + x] = (x / 3 + y / 5) % 2? c0: c1;
+					break;
+				case 2:
+					p[y * W + x] = ((x - x0) * 255 / w) << 16 | ((y - y0) * 255 / h) << 8 | (c0 & 0xff);
+					break;
+				default:
+					p[y * W + x] = next() & 0xffffff;
+				}
+			}
+		}
+		if (frame)
+			trfb_server_mark_dirty(srv, x0, y0, w, h);
+	}
+}
+
+static int done;
+
+static void on_update(trfb_client_t *cl)
+{
+	done = 1;
+}
+
+/* Count of updates after which image of client differs from server frame or -1 on error */
+static int run(trfb_format_t *fmt, int32_t enc)
+{
+	trfb_framebuffer_t *truth = NULL;
+	trfb_client_t *cl = NULL;
+	trfb_server_t *srv;
+	char path[64];
+	unsigned k;
+	int wrong = -1;
+	int sock;
+
+	snprintf(path, sizeof(path), "/tmp/trfb_test_codec%d.sock", (int)getpid());
+	unlink(path);
+
+	srv = trfb_server_create_ex(W, H, 4, TRFB_SERVER_EVENT_LOOP);
+	if (!srv)
+		return -1;
+
+	draw(srv, 0);
+	truth = trfb_framebuffer_create_of_format(W, H, fmt);
+	if (!truth || trfb_server_bind_unix(srv, path) || trfb_server_start(srv))
+		goto done;
+
+	sock = trfb_client_connect(path, NULL, 0);
+	if (sock < 0 || !(cl = trfb_client_create(sock)))
+		goto done;
+	cl->on_update = on_update;
+	trfb_client_set_format(cl, fmt);
+	trfb_client_set_encodings(cl, &enc, 1);
+	while (cl->phase != TRFB_CLIENT_NORMAL)
+		if (trfb_client_flush(cl, 1000) < 0 || trfb_client_read(cl, 1000) < 0)
+			goto done;
+
+	wrong = 0;
+	for (k = 0; k < FRAMES; k++) {
+		trfb_server_lock_fb(srv, 1);
+		if (k)
+			draw(srv, k);
+		trfb_framebuffer_convert(truth, srv->fb);
+		trfb_server_unlock_fb(srv);
+
+		done = 0;
+		trfb_client_request(cl, k > 0);
+		trfb_client_flush(cl, 1000);
+		while (!done) {
+			if (trfb_client_read(cl, 3000) <= 0) {
+				wrong = -1;
+				goto done;
+			}
+		}
+
+		if (memcmp(cl->fb->pixels, truth->pixels, (size_t)W * H * truth->bpp))
+			wrong++;
+	}
+
+done:
+	trfb_client_free(cl);
+	trfb_server_destroy(srv);
+	trfb_framebuffer_free(truth);
+	unlink(path);
+
+	return wrong;
+}
+
+int main(void)
+{
+	unsigned f, e;
+
+	signal(SIGPIPE, SIG_IGN);
+	trfb_log_cb = NULL;
+
+	for (f = 0; f < FORMATS_CNT; f++)
+		for (e = 0; e < ENCODINGS_CNT; e++)
+			check(run(formats + f, encodings[e]) == 0, "encoding %d (%u bpp, depth %u, %s endian)",
+					encodings[e], formats[f].bpp, formats[f].depth, formats[f].big_endian? "big": "little");
+
+	return failed;
+}
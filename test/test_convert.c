@@ -0,0 +1,168 @@
+#include <trfb.h>
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Conversion kernels give the same pixels as conversion of every pixel by its format, with and without SIMD */
+
+#define H 3
+
+static trfb_format_t formats[] = {
+	{ 32, 24, 0, 1, 255, 255, 255, 16, 8, 0 },
+	{ 32, 24, 0, 1, 255, 255, 255, 0, 8, 16 },
+	{ 32, 24, 1, 1, 255, 255, 255, 16, 8, 0 },
+	{ 32, 24, 1, 1, 255, 255, 255, 8, 16, 24 },
+	{ 32, 30, 0, 1, 1023, 1023, 1023, 20, 10, 0 },
+	{ 32, 30, 1, 1, 1023, 1023, 1023, 0, 10, 20 },
+	{ 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 },
+	{ 16, 16, 1, 1, 31, 63, 31, 11, 5, 0 },
+	{ 16, 15, 0, 1, 31, 31, 31, 10, 5, 0 },
+	{ 16, 15, 1, 1, 31, 31, 31, 0, 5, 10 },
+	{ 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 },
+	{ 8, 8, 0, 1, 7, 7, 3, 5, 2, 0 },
+};
+#define FORMATS_CNT (sizeof(formats) / sizeof(formats[0]))
+
+/* Odd widths leave pixels for tail of every SIMD kernel */
+static const unsigned widths[] = { 1, 3, 5, 7, 9, 15, 17, 31, 33, 63, 65, 101 };
+#define WIDTHS_CNT (sizeof(widths) / sizeof(widths[0]))
+
+/* CPU features used by kernels: all of them, fewer and none */
+static const unsigned limits[] = {
+	~0u,
+	~(unsigned)TRFB_CPU_AVX2,
+	~(unsigned)(TRFB_CPU_AVX2 | TRFB_CPU_SSSE3),
+	0,
+};
+#define LIMITS_CNT (sizeof(limits) / sizeof(limits[0]))
+
+static uint32_t rnd;
+
+static uint32_t next(void)
+{
+	rnd = rnd * 1103515245 + 12345;
+	return rnd >> 8;
+}
+
+static unsigned bits(unsigned max)
+{
+	unsigned n = 0;
+
+	while (max >> n)
+		n++;
+
+	return n;
+}
+
+static uint32_t load(const unsigned char *p, const trfb_format_t *fmt)
+{
+	uint32_t v = 0;
+	unsigned i, n = fmt->bpp / 8;
+
+	for (i = 0; i < n; i++)
+		v |= (uint32_t)p[i] << 8 * (fmt->big_endian? n - 1 - i: i);
+
+	return v;
+}
+
+/* Channel of source pixel as channel of destination: the most significant bits are kept */
+static uint32_t channel(uint32_t v, unsigned max, unsigned shift, unsigned dmax, unsigned dshift)
+{
+	unsigned c = (v >> shift) & max;
+	unsigned n = bits(max), dn = bits(dmax);
+
+	return (uint32_t)(n > dn? c >> (n - dn): c << (dn - n)) << dshift;
+}
+
+/* Bits of channels (bits outside of them are not defined) */
+static uint32_t channels(const trfb_format_t *fmt)
+{
+	return (uint32_t)fmt->rmax << fmt->rshift | (uint32_t)fmt->gmax << fmt->gshift |
+		(uint32_t)fmt->bmax << fmt->bshift;
+}
+
+static uint32_t reference(uint32_t v, const trfb_format_t *d, const trfb_format_t *s)
+{
+	return channel(v, s->rmax, s->rshift, d->rmax, d->rshift) |
+		channel(v, s->gmax, s->gshift, d->gmax, d->gshift) |
+		channel(v, s->bmax, s->bshift, d->bmax, d->bshift);
+}
+
+/* Converts the whole framebuffer (rows at once) and rectangle without the first and the last column (row by row) */
+static int converts(trfb_format_t *d, trfb_format_t *s, unsigned w)
+{
+	trfb_framebuffer_t *src, *dst, *part;
+	trfb_converter_t cv;
+	uint32_t want, mask = channels(d);
+	unsigned char *p;
+	unsigned i, x;
+	int ok = 0;
+
+	src = trfb_framebuffer_create_of_format(w, H, s);
+	dst = trfb_framebuffer_create_of_format(w, H, d);
+	part = trfb_framebuffer_create_of_format(w, H, d);
+	if (!src || !dst || !part || trfb_converter_init(&cv, dst, src))
+		goto done;
+
+	/* Bits outside of channels are random too */
+	p = src->pixels;
+	for (i = 0; i < w * H * src->bpp; i++)
+		p[i] = next();
+	memset(part->pixels, 0xa5, (size_t)w * H * part->bpp);
+
+	trfb_framebuffer_convert(dst, src);
+	if (w > 2)
+		trfb_converter_rect(&cv, part, src, 1, 0, w - 2, H);
+
+	ok = 1;
+	for (i = 0; i < w * H; i++) {
+		want = reference(load((unsigned char*)src->pixels + i * src->bpp, s), d, s);
+		if ((load((unsigned char*)dst->pixels + i * dst->bpp, d) & mask) != want)
+			ok = 0;
+
+		/* Pixels outside of rectangle stay untouched */
+		x = i % w;
+		if (w > 2 && x > 0 && x < w - 1) {
+			if ((load((unsigned char*)part->pixels + i * part->bpp, d) & mask) != want)
+				ok = 0;
+		} else if (load((unsigned char*)part->pixels + i * part->bpp, d) != (0xa5a5a5a5u >> (32 - d->bpp))) {
+			ok = 0;
+		}
+	}
+
+done:
+	trfb_framebuffer_free(src);
+	trfb_framebuffer_free(dst);
+	trfb_framebuffer_free(part);
+
+	return ok;
+}
+
+int main(void)
+{
+	unsigned l, s, d, w;
+	int ok;
+
+	trfb_log_cb = NULL;
+	printf("CPU features: 0x%04x\n", trfb_cpu_features());
+
+	for (l = 0; l < LIMITS_CNT; l++) {
+		trfb_cpu_limit(limits[l]);
+		for (s = 0; s < FORMATS_CNT; s++) {
+			for (d = 0; d < FORMATS_CNT; d++) {
+				ok = 1;
+				rnd = s * FORMATS_CNT + d;
+				for (w = 0; w < WIDTHS_CNT; w++)
+					ok = converts(formats + d, formats + s, widths[w]) && ok;
+				check(ok, "features 0x%04x: depth %u (%u/%u/%u) %s -> depth %u (%u/%u/%u) %s",
+						trfb_cpu_features(),
+						formats[s].depth, formats[s].rshift, formats[s].gshift, formats[s].bshift,
+						formats[s].big_endian? "BE": "LE",
+						formats[d].depth, formats[d].rshift, formats[d].gshift, formats[d].bshift,
+						formats[d].big_endian? "BE": "LE");
+			}
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,106 @@
+#include <trfb.h>
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Encoder of connection follows order of client encodings, estimates break ties when client lists Raw first:
+ * Hextile is the default then */
+
+#define W 128
+#define H 96
+#define ENCODING_TEST 0x54455354
+
+/* Encoder of application which states that it is the cheapest one */
+static size_t test_estimate(trfb_connection_t *con, unsigned width, unsigned height)
+{
+	return 1;
+}
+
+static int test_encode(trfb_connection_t *con, void *state, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	return -1;
+}
+
+static const trfb_encoder_t test_encoder = {
+	ENCODING_TEST,
+	"Test",
+	0, 0,
+	NULL,
+	NULL,
+	test_estimate,
+	test_encode,
+	0
+};
+
+static int32_t negotiate(trfb_connection_t *con, const int32_t *encodings, unsigned cnt)
+{
+	if (trfb_connection_set_encodings(con, encodings, cnt))
+		return -1;
+
+	return con->encoder->encoding;
+}
+
+#define NEGOTIATE(con, ...) \
+	negotiate(con, (const int32_t[]){ __VA_ARGS__ }, sizeof((const int32_t[]){ __VA_ARGS__ }) / sizeof(int32_t))
+
+int main(void)
+{
+	trfb_server_t *srv;
+	trfb_connection_t con;
+	uint32_t *p;
+	unsigned i;
+
+	trfb_log_cb = NULL;
+	srv = trfb_server_create(W, H, 4);
+	if (!srv || trfb_encoder_register(&test_encoder)) {
+		printf("Can't create server\n");
+		return 1;
+	}
+
+	memset(&con, 0, sizeof(con));
+	con.server = srv;
+	con.width = W;
+	con.height = H;
+	trfb_framebuffer_format(srv->fb, &con.format);
+
+	check(negotiate(&con, NULL, 0) == TRFB_ENCODING_RAW, "no encodings: Raw");
+	check(NEGOTIATE(&con, 12345) == TRFB_ENCODING_RAW, "no supported encodings: Raw");
+	check(NEGOTIATE(&con, TRFB_ENCODING_CORRE, TRFB_ENCODING_HEXTILE) == TRFB_ENCODING_CORRE,
+			"the first encoding of client");
+	check(NEGOTIATE(&con, TRFB_ENCODING_HEXTILE, TRFB_ENCODING_CORRE) == TRFB_ENCODING_HEXTILE,
+			"the first encoding of client (reversed)");
+	check(NEGOTIATE(&con, TRFB_ENCODING_CURSOR, 12345, TRFB_ENCODING_RRE, TRFB_ENCODING_RAW) == TRFB_ENCODING_RRE,
+			"unknown encodings are skipped");
+	check(NEGOTIATE(&con, TRFB_ENCODING_HEXTILE, ENCODING_TEST) == TRFB_ENCODING_HEXTILE,
+			"estimate doesn't override order of client");
+	check(NEGOTIATE(&con, TRFB_ENCODING_RAW) == TRFB_ENCODING_RAW, "only Raw");
+	check(NEGOTIATE(&con, TRFB_ENCODING_RAW, TRFB_ENCODING_ZRLE, TRFB_ENCODING_TIGHT, TRFB_ENCODING_RRE,
+				TRFB_ENCODING_CORRE, TRFB_ENCODING_HEXTILE) == TRFB_ENCODING_HEXTILE,
+			"Raw first: Hextile before the first update");
+	check(NEGOTIATE(&con, 12345, TRFB_ENCODING_RAW, TRFB_ENCODING_HEXTILE) == TRFB_ENCODING_HEXTILE,
+			"Raw first after unknown encoding: Hextile");
+	check(NEGOTIATE(&con, TRFB_ENCODING_RAW, TRFB_ENCODING_HEXTILE, ENCODING_TEST) == ENCODING_TEST,
+			"Raw first: encoder of application with the least estimate");
+
+	/* Estimates depend on content of client image */
+	con.fb = trfb_framebuffer_create_of_format(W, H, &con.format);
+	if (!con.fb) {
+		printf("Can't create client framebuffer\n");
+		return 1;
+	}
+	memset(con.fb->pixels, 0, (size_t)W * H * 4);
+	check(NEGOTIATE(&con, TRFB_ENCODING_RAW, TRFB_ENCODING_ZRLE, TRFB_ENCODING_RRE, TRFB_ENCODING_HEXTILE) ==
+			TRFB_ENCODING_HEXTILE, "Raw first: Hextile for solid image");
+
+	p = con.fb->pixels;
+	for (i = 0; i < W * H; i++)
+		p[i] = i * 2654435761u >> 8;
+	check(NEGOTIATE(&con, TRFB_ENCODING_RAW, TRFB_ENCODING_RRE, TRFB_ENCODING_HEXTILE) == TRFB_ENCODING_HEXTILE,
+			"Raw first: Hextile rather than Raw for noise");
+
+	trfb_framebuffer_free(con.fb);
+	free(con.encodings);
+	trfb_server_destroy(srv);
+
+	return failed;
+}
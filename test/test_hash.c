@@ -0,0 +1,83 @@
+#include <trfb.h>
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Hashes must depend on position of content: moved content is damage */
+
+static void sprite(trfb_framebuffer_t *fb, unsigned x0, unsigned y0)
+{
+	uint32_t *p = fb->pixels;
+	unsigned x, y;
+
+	memset(fb->pixels, 0, (size_t)fb->width * fb->height * fb->bpp);
+	for (y = y0; y < y0 + 4; y++)
+		for (x = x0; x < x0 + 16; x++)
+			p[y * fb->width + x] = 0x00ff8000 + (x - x0) * 3 + (y - y0);
+}
+
+/* Count of damaged pixels found after framebuffer is changed */
+static unsigned damaged(trfb_tilehash_t *th, trfb_framebuffer_t *fb)
+{
+	trfb_region_t damage;
+	trfb_rect_t all = { 0, 0, fb->width, fb->height };
+	trfb_rect_t *rects = NULL;
+	unsigned n = 0;
+	int cnt, i;
+
+	trfb_region_init(&damage, fb->width, fb->height);
+	trfb_tilehash_update(th, fb, &damage);
+	cnt = trfb_region_rects(&damage, &all, &rects);
+	for (i = 0; i < cnt; i++)
+		n += rects[i].width * rects[i].height;
+	free(rects);
+	trfb_region_free(&damage);
+
+	return n;
+}
+
+int main(void)
+{
+	unsigned char buf[1024], swapped[1024];
+	trfb_framebuffer_t *fb;
+	trfb_tilehash_t *th;
+	unsigned i;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7 + i / 64;
+
+	memcpy(swapped, buf + 64, 64);
+	memcpy(swapped + 64, buf, 64);
+	memcpy(swapped + 128, buf + 128, sizeof(buf) - 128);
+	check(trfb_hash(buf, sizeof(buf)) != trfb_hash(swapped, sizeof(swapped)), "hash of swapped stripes");
+
+	memcpy(swapped, buf + 512, 512);
+	memcpy(swapped + 512, buf, 512);
+	check(trfb_hash(buf, sizeof(buf)) != trfb_hash(swapped, sizeof(swapped)), "hash of swapped halves");
+	check(trfb_hash(buf, sizeof(buf)) == trfb_hash(buf, sizeof(buf)), "hash of the same data");
+
+	fb = trfb_framebuffer_create(128, 128, 4);
+	th = trfb_tilehash_create(1);
+	if (!fb || !th) {
+		printf("Can't create framebuffer\n");
+		return 1;
+	}
+
+	sprite(fb, 8, 8);
+	damaged(th, fb);
+	check(damaged(th, fb) == 0, "tile without changes");
+
+	sprite(fb, 24, 8);
+	check(damaged(th, fb) != 0, "sprite moved right by 16 pixels");
+
+	sprite(fb, 24, 13);
+	check(damaged(th, fb) != 0, "sprite moved down by 5 rows");
+
+	sprite(fb, 24, 29);
+	check(damaged(th, fb) != 0, "sprite moved down by 16 rows");
+
+	trfb_tilehash_free(th);
+	trfb_framebuffer_free(fb);
+
+	return failed;
+}
@@ -0,0 +1,128 @@
+#include <trfb.h>
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Shared image of connection is server frame converted into its format after update and it doesn't change
+ * while connection keeps it, however other connections update and copy images of pool */
+
+#define W 300
+#define H 200
+#define CONNECTIONS 4
+#define FRAMES 40
+#define RECTS 4
+
+static trfb_format_t rgb565 = { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 };
+
+typedef struct client {
+	trfb_connection_t con;
+	/* Damage since the last update */
+	trfb_rect_t damage[FRAMES * RECTS];
+	int damage_cnt;
+	/* Hash of image after the last update */
+	uint64_t hash;
+} client_t;
+
+static uint32_t rnd = 1;
+
+static uint32_t next(void)
+{
+	rnd = rnd * 1103515245 + 12345;
+	return rnd >> 8;
+}
+
+static uint64_t image_hash(trfb_connection_t *con)
+{
+	return trfb_hash(con->fb->pixels, (size_t)W * H * con->fb->bpp);
+}
+
+/* Rectangles of frame get new pixels and they are damage of every connection */
+static void draw(trfb_server_t *srv, client_t *cl)
+{
+	uint32_t *p = srv->fb->pixels;
+	trfb_rect_t r;
+	unsigned i, x, y;
+	int k;
+
+	for (k = 0; k < RECTS; k++) {
+		r.width = 1 + next() % 120;
+		r.height = 1 + next() % 80;
+		r.x = next() % (W - r.width);
+		r.y = next() % (H - r.height);
+		for (y = r.y; y < r.y + r.height; y++)
+			for (x = r.x; x < r.x + r.width; x++)
+				p[y * W + x] = next() & 0xffffff;
+
+		for (i = 0; i < CONNECTIONS; i++)
+			cl[i].damage[cl[i].damage_cnt++] = r;
+	}
+}
+
+int main(void)
+{
+	client_t cl[CONNECTIONS];
+	trfb_framebuffer_t *truth;
+	trfb_server_t *srv;
+	unsigned long long frame;
+	unsigned i;
+	int held = 1, exact = 1, shared = 1;
+
+	trfb_log_cb = NULL;
+	srv = trfb_server_create(W, H, 4);
+	truth = trfb_framebuffer_create_of_format(W, H, &rgb565);
+	if (!srv || !truth) {
+		printf("Can't create server\n");
+		return 1;
+	}
+
+	memset(srv->fb->pixels, 0, (size_t)W * H * 4);
+	memset(cl, 0, sizeof(cl));
+	for (i = 0; i < CONNECTIONS; i++) {
+		cl[i].con.server = srv;
+		cl[i].con.format = rgb565;
+		cl[i].damage[0].width = W;
+		cl[i].damage[0].height = H;
+		cl[i].damage_cnt = 1;
+		if (trfb_connection_pool_users(&cl[i].con) < 0) {
+			printf("Can't join pool\n");
+			return 1;
+		}
+	}
+
+	for (frame = 0; frame < FRAMES; frame++) {
+		if (frame)
+			draw(srv, cl);
+		trfb_framebuffer_convert(truth, srv->fb);
+
+		/* Connection i updates every (i + 1)-th frame and keeps its image meanwhile */
+		for (i = 0; i < CONNECTIONS; i++) {
+			if (frame % (i + 1))
+				continue;
+
+			if (cl[i].con.fb && image_hash(&cl[i].con) != cl[i].hash)
+				held = 0;
+
+			if (trfb_connection_share_fb(&cl[i].con, frame, cl[i].damage, cl[i].damage_cnt, NULL)) {
+				printf("Can't share image\n");
+				return 1;
+			}
+			cl[i].damage_cnt = 0;
+			cl[i].hash = image_hash(&cl[i].con);
+			if (memcmp(cl[i].con.fb->pixels, truth->pixels, (size_t)W * H * truth->bpp))
+				exact = 0;
+			if (i && !frame && cl[i].con.fb != cl[0].con.fb)
+				shared = 0;
+		}
+	}
+
+	check(shared, "connections share one image");
+	check(exact, "image after update is server frame");
+	check(held, "kept image doesn't change");
+
+	for (i = 0; i < CONNECTIONS; i++)
+		trfb_connection_leave_pool(&cl[i].con);
+	trfb_framebuffer_free(truth);
+	trfb_server_destroy(srv);
+
+	return failed;
+}
@@ -0,0 +1,120 @@
+#include <trfb.h>
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Scroll detection finds known shift and CopyRect never gives pixels different from server */
+
+#define W 160
+#define H 120
+
+static trfb_format_t rgb565 = { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 };
+
+static uint32_t pixel(unsigned x, unsigned y)
+{
+	return ((y * 37 + x * 11) & 0xff) << 16 | ((y * 5 + x * x) & 0xff) << 8 | ((y * y + x) & 0xff);
+}
+
+/* Server image is client image with row y taken from row src(y) */
+static void draw(trfb_framebuffer_t *fb, int shift, unsigned xshift)
+{
+	uint32_t *p = fb->pixels;
+	unsigned x, y, sy;
+
+	for (y = 0; y < H; y++) {
+		sy = y + shift;
+		for (x = 0; x < W; x++)
+			p[y * W + x] = sy < H? pixel((x + xshift) % W, sy): pixel(x, y) ^ 0x808080;
+	}
+}
+
+/* Copy found by scroll detection is applied to client image: it must be equal to new image */
+static int copy_is_exact(trfb_connection_t *con, const trfb_rect_t *dst)
+{
+	trfb_framebuffer_t *c = trfb_framebuffer_create_of_format(W, H, &rgb565);
+	size_t bpp = c->bpp;
+	unsigned y;
+	int ok = 1;
+
+	trfb_framebuffer_convert(c, con->server->fb);
+	for (y = dst->y; y < dst->y + dst->height; y++)
+		if (memcmp((unsigned char*)c->pixels + ((size_t)y * W + dst->x) * bpp,
+					(unsigned char*)con->fb->pixels + ((size_t)y * W + dst->x) * bpp, dst->width * bpp))
+			ok = 0;
+
+	trfb_framebuffer_free(c);
+
+	return ok;
+}
+
+static int scroll(trfb_connection_t *con, int shift, unsigned xshift, trfb_rect_t *dst, unsigned *sy)
+{
+	trfb_rect_t *rects = malloc(sizeof(trfb_rect_t));
+	unsigned sx;
+	int cnt = 1;
+	int rv;
+
+	draw(con->server->fb, 0, 0);
+	trfb_framebuffer_convert(con->fb, con->server->fb);
+	draw(con->server->fb, shift, xshift);
+
+	rects[0].x = 0;
+	rects[0].y = 0;
+	rects[0].width = W;
+	rects[0].height = H;
+	rv = trfb_connection_find_scroll(con, &rects, &cnt, dst, &sx, sy);
+	free(rects);
+
+	/* Client image is scrolled by caller like client does it */
+	if (rv == 1)
+		trfb_framebuffer_copy_rect(con->fb, sx, *sy, dst->x, dst->y, dst->width, dst->height);
+
+	return rv;
+}
+
+int main(void)
+{
+	trfb_server_t *srv;
+	trfb_connection_t con;
+	trfb_converter_t cv;
+	trfb_rect_t dst;
+	unsigned sy;
+	int rv;
+
+	srv = trfb_server_create(W, H, 4);
+	if (!srv) {
+		printf("Can't create server\n");
+		return 1;
+	}
+
+	memset(&con, 0, sizeof(con));
+	con.server = srv;
+	con.format = rgb565;
+	con.fb = trfb_framebuffer_create_of_format(W, H, &rgb565);
+	con.converter = &cv;
+	if (!con.fb || trfb_converter_init(&cv, con.fb, srv->fb)) {
+		printf("Can't create client framebuffer\n");
+		return 1;
+	}
+
+	rv = scroll(&con, 20, 0, &dst, &sy);
+	check(rv == 1 && sy == dst.y + 20 && dst.height >= H - 40, "scroll up by 20 rows");
+	check(rv != 1 || copy_is_exact(&con, &dst), "scroll up by 20 rows: copied pixels");
+
+	rv = scroll(&con, -33, 0, &dst, &sy);
+	check(rv == 1 && dst.y == sy + 33, "scroll down by 33 rows");
+	check(rv != 1 || copy_is_exact(&con, &dst), "scroll down by 33 rows: copied pixels");
+
+	/* Rows are moved by 16 pixels (32 bytes) too: they are not equal to old rows */
+	rv = scroll(&con, 20, 16, &dst, &sy);
+	check(rv == 0, "scroll with horizontal shift");
+	check(rv != 1 || copy_is_exact(&con, &dst), "scroll with horizontal shift: copied pixels");
+
+	rv = scroll(&con, 0, 0, &dst, &sy);
+	check(rv == 0, "no scroll");
+
+	trfb_framebuffer_free(con.fb);
+	trfb_server_destroy(srv);
+
+	return failed;
+}
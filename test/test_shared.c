@@ -0,0 +1,220 @@
+#include <trfb.h>
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Connections of one format get from encode-once cache and from shared image the same updates as they get
+ * encoding their own framebuffers */
+
+#define W 256
+#define H 192
+#define CLIENTS 3
+#define FRAMES 12
+#define SCROLL 24
+
+static trfb_format_t formats[] = {
+	{ 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 },
+	{ 32, 24, 0, 1, 255, 255, 255, 0, 8, 16 },
+};
+#define FORMATS_CNT (sizeof(formats) / sizeof(formats[0]))
+
+static const int32_t encodings[] = {
+	TRFB_ENCODING_RAW,
+	TRFB_ENCODING_RRE,
+	TRFB_ENCODING_CORRE,
+	TRFB_ENCODING_HEXTILE,
+	TRFB_ENCODING_ZRLE,
+	TRFB_ENCODING_TIGHT,
+};
+#define ENCODINGS_CNT (sizeof(encodings) / sizeof(encodings[0]))
+
+/* Bytes of update and hash of client image after it for each client and frame (0 - frame was skipped),
+ * count of updates after which client image differs from server frame converted into format of client */
+typedef struct result {
+	unsigned long long bytes[CLIENTS][FRAMES];
+	uint64_t image[CLIENTS][FRAMES];
+	unsigned wrong;
+} result_t;
+
+static uint32_t rnd;
+
+static uint32_t next(void)
+{
+	rnd = rnd * 1103515245 + 12345;
+	return rnd >> 8;
+}
+
+/* Frame has solid, two-colour and noisy rectangles over noise. Two frames of five are scrolled: the second
+ * scroll is found comparing with image which got copied rows of the first one. */
+static void draw(trfb_server_t *srv, unsigned frame)
+{
+	uint32_t *p = srv->fb->pixels;
+	unsigned i, x, y, x0, y0, w, h;
+	uint32_t c0, c1;
+
+	rnd = frame + 1;
+	if (!frame) {
+		for (i = 0; i < W * H; i++)
+			p[i] = next() & 0xffffff;
+	} else if (frame % 5 >= 3) {
+		memmove(p, p + SCROLL * W, (size_t)W * (H - SCROLL) * 4);
+		for (i = W * (H - SCROLL); i < W * H; i++)
+			p[i] = next() & 0xffffff;
+		return;
+	}
+
+	for (i = 0; i < (frame? 6: 40); i++) {
+		w = 8 + next() % 96;
+		h = 8 + next() % 64;
+		x0 = next() % (W - w);
+		y0 = next() % (H - h);
+		c0 = next() & 0xffffff;
+		c1 = next() & 0xffffff;
+		for (y = y0; y < y0 + h; y++) {
+			for (x = x0; x < x0 + w; x++) {
+				switch (i % 3) {
+				case 0:
+					p[y * W + x] = c0;
+					break;
+				case 1:
+					p[y * W + x] = (x / 3 + y / 5) % 2? c0: c1;
+					break;
+				default:
+					p[y * W + x] = next() & 0xffffff;
+				}
+			}
+		}
+	}
+}
+
+/* Client 0 misses some frames: it gets damage of several frames at once */
+static int wants(unsigned client, unsigned frame)
+{
+	return !(client == 0 && frame % 4 == 2);
+}
+
+static int done;
+
+static void on_update(trfb_client_t *cl)
+{
+	done = 1;
+}
+
+/* Clients [first, last) receive frames one by one */
+static int run(const trfb_format_t *fmt, int32_t enc, unsigned first, unsigned last, int cache, result_t *res)
+{
+	trfb_client_t *cl[CLIENTS];
+	int32_t encs[2] = { enc, TRFB_ENCODING_COPYRECT };
+	trfb_framebuffer_t *truth = NULL;
+	trfb_server_t *srv;
+	char path[64];
+	unsigned long long bytes;
+	unsigned i, k;
+	int rv = -1;
+	int sock;
+
+	memset(cl, 0, sizeof(cl));
+	snprintf(path, sizeof(path), "/tmp/trfb_test_shared%d.sock", (int)getpid());
+	unlink(path);
+
+	srv = trfb_server_create_ex(W, H, 4, TRFB_SERVER_EVENT_LOOP);
+	if (!srv)
+		return -1;
+
+	/* Without cache every connection encodes rectangles itself */
+	if (!cache) {
+		trfb_cache_free(srv->cache);
+		srv->cache = NULL;
+	}
+
+	draw(srv, 0);
+	truth = trfb_framebuffer_create_of_format(W, H, (trfb_format_t *)fmt);
+	if (!truth || trfb_server_bind_unix(srv, path) || trfb_server_start(srv))
+		goto done;
+
+	for (i = first; i < last; i++) {
+		sock = trfb_client_connect(path, NULL, 0);
+		if (sock < 0 || !(cl[i] = trfb_client_create(sock)))
+			goto done;
+		cl[i]->on_update = on_update;
+		trfb_client_set_format(cl[i], fmt);
+		trfb_client_set_encodings(cl[i], encs, 2);
+		while (cl[i]->phase != TRFB_CLIENT_NORMAL)
+			if (trfb_client_flush(cl[i], 1000) < 0 || trfb_client_read(cl[i], 1000) < 0)
+				goto done;
+	}
+
+	for (k = 0; k < FRAMES; k++) {
+		trfb_server_lock_fb(srv, 1);
+		if (k)
+			draw(srv, k);
+		trfb_framebuffer_convert(truth, srv->fb);
+		trfb_server_unlock_fb(srv);
+
+		for (i = first; i < last; i++) {
+			if (!wants(i, k))
+				continue;
+
+			bytes = cl[i]->stats.bytes;
+			done = 0;
+			/* The first client could get the first frame before others join pool */
+			trfb_client_request(cl[i], k > 1);
+			trfb_client_flush(cl[i], 1000);
+			while (!done)
+				if (trfb_client_read(cl[i], 3000) <= 0)
+					goto done;
+
+			res->bytes[i][k] = cl[i]->stats.bytes - bytes;
+			res->image[i][k] = trfb_hash(cl[i]->fb->pixels, (size_t)W * H * cl[i]->fb->bpp);
+			if (memcmp(cl[i]->fb->pixels, truth->pixels, (size_t)W * H * truth->bpp))
+				res->wrong++;
+		}
+	}
+	rv = 0;
+
+done:
+	for (i = first; i < last; i++)
+		trfb_client_free(cl[i]);
+	trfb_server_destroy(srv);
+	trfb_framebuffer_free(truth);
+	unlink(path);
+
+	return rv;
+}
+
+int main(void)
+{
+	result_t pooled, cached, alone;
+	unsigned f, e, i;
+	int rv;
+
+	signal(SIGPIPE, SIG_IGN);
+	trfb_log_cb = NULL;
+
+	for (f = 0; f < FORMATS_CNT; f++) {
+		for (e = 0; e < ENCODINGS_CNT; e++) {
+			memset(&pooled, 0, sizeof(pooled));
+			memset(&cached, 0, sizeof(cached));
+			memset(&alone, 0, sizeof(alone));
+
+			rv = run(formats + f, encodings[e], 0, CLIENTS, 0, &pooled) ||
+				run(formats + f, encodings[e], 0, CLIENTS, 1, &cached);
+			check(!rv && !pooled.wrong && !cached.wrong,
+					"client images are server frames (%u bpp, encoding %d)", formats[f].bpp, encodings[e]);
+			check(!rv && !memcmp(&cached, &pooled, sizeof(cached)),
+					"cache gives the same updates as encoders (%u bpp, encoding %d)",
+					formats[f].bpp, encodings[e]);
+
+			/* Single client of format converts pixels into its own framebuffer */
+			for (i = 0; !rv && i < CLIENTS; i++)
+				rv = run(formats + f, encodings[e], i, i + 1, 0, &alone);
+			check(!rv && !memcmp(&pooled, &alone, sizeof(pooled)),
+					"shared image gives the same updates as own framebuffer (%u bpp, encoding %d)",
+					formats[f].bpp, encodings[e]);
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,755 @@
+#include <trfb.h>
+#include <libwebcam.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Benchmarks of pixel conversion, encoders, webcam colorspace conversion and loopback
+ * FramebufferUpdate throughput. Results are written as JSON.
+ */
+
+static unsigned min_time = 200; /* Minimum time of one measurement (ms) */
+static unsigned duration = 2000; /* Duration of loopback measurement (ms) */
+static FILE *out;
+static int results_cnt = 0;
+
+typedef struct bench_size {
+	unsigned width, height;
+} bench_size_t;
+
+#define MAX_SIZES 8
+static bench_size_t sizes[MAX_SIZES] = {
+	{ 640, 480 },
+	{ 1280, 720 },
+	{ 1920, 1080 }
+};
+static unsigned sizes_cnt = 3;
+
+#define MAX_CLIENTS_CNT 8
+static unsigned clients[MAX_CLIENTS_CNT] = { 1, 4, 16 };
+static unsigned clients_cnt = 3;
+
+static const struct {
+	const char *name;
+	trfb_format_t fmt;
+} formats[] = {
+	{ "rgb32", { 32, 24, 0, 1, 255, 255, 255, 16, 8, 0 } },
+	{ "rgb32be", { 32, 24, 1, 1, 255, 255, 255, 16, 8, 0 } },
+	{ "bgr32", { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16 } },
+	{ "rgb565", { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 } },
+	{ "rgb555", { 16, 15, 0, 1, 31, 31, 31, 10, 5, 0 } },
+	{ "rgb332", { 8, 8, 0, 1, 7, 7, 3, 5, 2, 0 } },
+	{ "bgr233", { 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 } }
+};
+#define FORMATS_CNT (sizeof(formats) / sizeof(formats[0]))
+
+static const struct {
+	const char *name;
+	webcam_colorspace_t cs;
+} colorspaces[] = {
+	{ "RGB24", WEBCAM_RGB24 },
+	{ "BGR24", WEBCAM_BGR24 },
+	{ "RGB555", WEBCAM_RGB555 },
+	{ "RGB565", WEBCAM_RGB565 },
+	{ "RGB332", WEBCAM_RGB332 },
+	{ "BGR233", WEBCAM_BGR233 },
+	{ "YUV", WEBCAM_YUV },
+	{ "YUV422", WEBCAM_YUV422 },
+	{ "GRAY", WEBCAM_GRAY }
+};
+#define COLORSPACES_CNT (sizeof(colorspaces) / sizeof(colorspaces[0]))
+
+static const struct {
+	const char *name;
+	unsigned flag;
+} cpu_features[] = {
+	{ "sse2", TRFB_CPU_SSE2 },
+	{ "ssse3", TRFB_CPU_SSSE3 },
+	{ "avx2", TRFB_CPU_AVX2 },
+	{ "neon", TRFB_CPU_NEON }
+};
+#define CPU_FEATURES_CNT (sizeof(cpu_features) / sizeof(cpu_features[0]))
+
+/* Synthetic content */
+static const char *contents[] = { "gradient", "text", "noise", "static" };
+#define CONTENTS_CNT (sizeof(contents) / sizeof(contents[0]))
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+static uint32_t clamp(int v)
+{
+	return v < 0? 0: v > 255? 255: v;
+}
+
+/* Fill image 0x00rrggbb with content. Frame number moves content. */
+static void fill(uint32_t *p, unsigned width, unsigned height, unsigned content, unsigned frame)
+{
+	unsigned x, y, cx, cy;
+	uint32_t glyph;
+	int n;
+
+	rnd_state = 1 + frame;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++, p++) {
+			switch (content) {
+			case 0: /* Smooth gradient */
+				*p = TRFB_RGB((x + frame) & 0xff, y & 0xff, ((x + y) >> 2) & 0xff);
+				break;
+			case 1: /* Dark glyphs 6x10 in cells 8x16 on light background */
+				cx = (x + frame) % 8;
+				cy = y % 16;
+				glyph = ((x + frame) / 8) * 2654435761u ^ (y / 16) * 40503u;
+				if (cx < 6 && cy >= 3 && cy < 13 && ((glyph >> ((cy - 3) * 3 + cx / 2)) & 1))
+					*p = TRFB_RGB(0x20, 0x20, 0x20);
+				else
+					*p = TRFB_RGB(0xf0, 0xf0, 0xe8);
+				break;
+			case 2: /* Camera: gradient with sensor noise */
+				n = (int)(rnd() % 33) - 16;
+				*p = TRFB_RGB(clamp(((x + frame) & 0xff) + n), clamp((y & 0xff) + n), clamp(128 + n));
+				break;
+			default: /* Nothing changes */
+				*p = TRFB_RGB(0x30, 0x50, 0x70);
+				break;
+			}
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void result_begin(const char *bench)
+{
+	fprintf(out, "%s\n\t\t{ \"bench\": \"%s\"", results_cnt? ",": "", bench);
+	results_cnt++;
+}
+
+static void result_end(void)
+{
+	fprintf(out, " }");
+	fflush(out);
+}
+
+/* Run function until min_time is spent. Returns seconds per iteration. */
+#define MEASURE(res, iters, code) \
+	do { \
+		double t0_, t_; \
+		unsigned n_ = 1, i_; \
+		code; /* Warm up */ \
+		for (;;) { \
+			t0_ = now(); \
+			for (i_ = 0; i_ < n_; i_++) { \
+				code; \
+			} \
+			t_ = now() - t0_; \
+			if (t_ * 1000 >= min_time) \
+				break; \
+			n_ = t_ > 0? (unsigned)(n_ * (min_time / (t_ * 1000)) * 1.2) + 1: n_ * 2; \
+		} \
+		res = t_ / n_; \
+		iters = n_; \
+	} while (0)
+
+static void result_time(double t, unsigned iters, unsigned width, unsigned height)
+{
+	fprintf(out, ", \"iterations\": %u, \"ns_per_op\": %.0f, \"mpix_per_s\": %.2f",
+			iters, t * 1e9, (double)width * height / t * 1e-6);
+}
+
+static trfb_framebuffer_t* content_fb(unsigned width, unsigned height, unsigned content, unsigned frame)
+{
+	trfb_framebuffer_t *fb;
+
+	fb = trfb_framebuffer_create(width, height, 4);
+	if (!fb)
+		return NULL;
+
+	fill(fb->pixels, width, height, content, frame);
+
+	return fb;
+}
+
+static trfb_framebuffer_t* format_fb(trfb_framebuffer_t *src, const trfb_format_t *fmt)
+{
+	trfb_format_t f = *fmt;
+	trfb_framebuffer_t *fb;
+
+	fb = trfb_framebuffer_create_of_format(src->width, src->height, &f);
+	if (!fb)
+		return NULL;
+
+	if (trfb_framebuffer_convert(fb, src)) {
+		trfb_framebuffer_free(fb);
+		return NULL;
+	}
+
+	return fb;
+}
+
+static void bench_convert(void)
+{
+	trfb_framebuffer_t *base, *src, *dst;
+	unsigned s, i, j, iters;
+	double t;
+
+	for (s = 0; s < sizes_cnt; s++) {
+		base = content_fb(sizes[s].width, sizes[s].height, 0, 0);
+		if (!base)
+			continue;
+
+		for (i = 0; i < FORMATS_CNT; i++) {
+			src = format_fb(base, &formats[i].fmt);
+			for (j = 0; src && j < FORMATS_CNT; j++) {
+				dst = format_fb(base, &formats[j].fmt);
+				if (!dst)
+					continue;
+
+				MEASURE(t, iters, trfb_framebuffer_convert(dst, src));
+
+				result_begin("convert");
+				fprintf(out, ", \"src\": \"%s\", \"dst\": \"%s\", \"width\": %u, \"height\": %u",
+						formats[i].name, formats[j].name, sizes[s].width, sizes[s].height);
+				result_time(t, iters, sizes[s].width, sizes[s].height);
+				result_end();
+
+				trfb_framebuffer_free(dst);
+			}
+			trfb_framebuffer_free(src);
+		}
+
+		trfb_framebuffer_free(base);
+	}
+}
+
+/* Output of encoders is counted and dropped */
+static ssize_t null_write(trfb_io_t *io, const void *buf, ssize_t len, unsigned timeout)
+{
+	return len;
+}
+
+static ssize_t null_writev(trfb_io_t *io, const struct iovec *iov, int cnt, unsigned flags, unsigned timeout)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+
+	return len;
+}
+
+static size_t encode_frame(trfb_connection_t *con, const trfb_encoder_t *enc)
+{
+	size_t len;
+
+	if (trfb_connection_encode(con, enc, 0, 0, con->fb->width, con->fb->height))
+		return 0;
+
+	len = trfb_io_pending(con->io);
+	trfb_io_flush(con->io, 0);
+
+	return len;
+}
+
+static void bench_encode(trfb_server_t *srv)
+{
+	const trfb_encoder_t *enc;
+	trfb_connection_t *con;
+	unsigned s, c, e, iters;
+	size_t len = 0;
+	double t;
+
+	con = calloc(1, sizeof(trfb_connection_t));
+	if (!con)
+		return;
+
+	con->io = calloc(1, sizeof(trfb_io_t));
+	if (!con->io || trfb_io_set_buffers(con->io, TRFB_BUFSIZ, 65536)) {
+		trfb_io_free(con->io);
+		free(con);
+		return;
+	}
+	con->io->write = null_write;
+	con->io->writev = null_writev;
+	con->server = srv;
+	trfb_framebuffer_format(srv->fb, &con->format);
+	strcpy(con->name, "bench");
+
+	for (s = 0; s < sizes_cnt; s++) {
+		for (c = 0; c < CONTENTS_CNT; c++) {
+			con->fb = content_fb(sizes[s].width, sizes[s].height, c, 0);
+			if (!con->fb)
+				continue;
+
+			for (e = 0; (enc = trfb_encoder_get(e)) != NULL; e++) {
+				MEASURE(t, iters, len = encode_frame(con, enc));
+
+				result_begin("encode");
+				fprintf(out, ", \"encoder\": \"%s\", \"content\": \"%s\", \"width\": %u, \"height\": %u, \"bytes\": %lu, \"ratio\": %.4f",
+						enc->name, contents[c], sizes[s].width, sizes[s].height, (unsigned long)len,
+						(double)len / ((double)sizes[s].width * sizes[s].height * con->fb->bpp));
+				result_time(t, iters, sizes[s].width, sizes[s].height);
+				result_end();
+			}
+
+			/* Encoder states could depend on framebuffer */
+			trfb_connection_encoders_free(con);
+			trfb_framebuffer_free(con->fb);
+			con->fb = NULL;
+		}
+	}
+
+	trfb_io_free(con->io);
+	free(con);
+}
+
+/* Conversion of camera-like image from RGB32 to every colorspace and back */
+static void bench_webcam(void)
+{
+	unsigned s, i, iters;
+	uint32_t *rgb, *back;
+	void *buf;
+	size_t size, rgb_size, back_size;
+	double t;
+
+	for (s = 0; s < sizes_cnt; s++) {
+		rgb_size = (size_t)sizes[s].width * sizes[s].height * 4;
+		rgb = malloc(rgb_size);
+		back = malloc(rgb_size);
+		buf = malloc(rgb_size); /* Enough for every colorspace */
+		if (!rgb || !back || !buf) {
+			free(rgb);
+			free(back);
+			free(buf);
+			continue;
+		}
+		fill(rgb, sizes[s].width, sizes[s].height, 2, 0);
+
+		for (i = 0; i < COLORSPACES_CNT; i++) {
+			size = rgb_size;
+			MEASURE(t, iters, webcam_convert_image(sizes[s].width, sizes[s].height, WEBCAM_RGB32, rgb, rgb_size,
+						colorspaces[i].cs, buf, &size));
+
+			result_begin("webcam_convert");
+			fprintf(out, ", \"from\": \"RGB32\", \"to\": \"%s\", \"width\": %u, \"height\": %u",
+					colorspaces[i].name, sizes[s].width, sizes[s].height);
+			result_time(t, iters, sizes[s].width, sizes[s].height);
+			result_end();
+
+			back_size = rgb_size;
+			MEASURE(t, iters, webcam_convert_image(sizes[s].width, sizes[s].height, colorspaces[i].cs, buf, size,
+						WEBCAM_RGB32, back, &back_size));
+
+			result_begin("webcam_convert");
+			fprintf(out, ", \"from\": \"%s\", \"to\": \"RGB32\", \"width\": %u, \"height\": %u",
+					colorspaces[i].name, sizes[s].width, sizes[s].height);
+			result_time(t, iters, sizes[s].width, sizes[s].height);
+			result_end();
+		}
+
+		free(rgb);
+		free(back);
+		free(buf);
+	}
+}
+
+/* Loopback clients: request incremental updates as fast as possible and count them */
+typedef struct bench_client {
+	thrd_t thread;
+	int started;
+	unsigned short port;
+	int sock;
+	volatile int ready;
+	volatile int stop;
+	unsigned long updates;
+	unsigned long long bytes;
+	int error;
+} bench_client_t;
+
+static int recv_all(int sock, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	ssize_t l;
+
+	while (len > 0) {
+		l = recv(sock, p, len, 0);
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			return -1;
+		p += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+static int skip_all(int sock, size_t len)
+{
+	unsigned char buf[65536];
+	size_t l;
+
+	while (len > 0) {
+		l = len > sizeof(buf)? sizeof(buf): len;
+		if (recv_all(sock, buf, l))
+			return -1;
+		len -= l;
+	}
+
+	return 0;
+}
+
+static int send_all(int sock, const void *buf, size_t len)
+{
+	return trfb_send_all(sock, buf, len) == (ssize_t)len? 0: -1;
+}
+
+static int request_update(int sock, int incremental, unsigned width, unsigned height)
+{
+	unsigned char msg[10] = { 3, incremental, 0, 0, 0, 0, width >> 8, width, height >> 8, height };
+
+	return send_all(sock, msg, sizeof(msg));
+}
+
+static int client_session(bench_client_t *cl)
+{
+	static const unsigned char set_encodings[8] = { 2, 0, 0, 1, 0, 0, 0, 0 };
+	unsigned char buf[256];
+	struct sockaddr_in addr;
+	unsigned width, height, bpp, n, i, w, h;
+	uint32_t len;
+	int one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(cl->port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(cl->sock, (struct sockaddr*)&addr, sizeof(addr)))
+		return -1;
+	setsockopt(cl->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	/* Version, security None and ClientInit (shared) */
+	if (recv_all(cl->sock, buf, 12) || send_all(cl->sock, "RFB 003.008\n", 12))
+		return -1;
+	if (recv_all(cl->sock, buf, 1) || !buf[0] || recv_all(cl->sock, buf + 1, buf[0]))
+		return -1;
+	if (send_all(cl->sock, "\1", 1) || recv_all(cl->sock, buf, 4) || buf[0] || buf[1] || buf[2] || buf[3])
+		return -1;
+	if (send_all(cl->sock, "\1", 1) || recv_all(cl->sock, buf, 24))
+		return -1;
+
+	width = (buf[0] << 8) | buf[1];
+	height = (buf[2] << 8) | buf[3];
+	bpp = buf[4] / 8;
+	len = ((uint32_t)buf[20] << 24) | (buf[21] << 16) | (buf[22] << 8) | buf[23];
+	if (skip_all(cl->sock, len))
+		return -1;
+
+	/* Only Raw: decoding of other encodings is not measured here */
+	if (send_all(cl->sock, set_encodings, sizeof(set_encodings)) || request_update(cl->sock, 0, width, height))
+		return -1;
+
+	cl->ready = 1;
+
+	while (!cl->stop) {
+		if (recv_all(cl->sock, buf, 1))
+			return -1;
+
+		switch (buf[0]) {
+		case 0: /* FramebufferUpdate */
+			if (recv_all(cl->sock, buf, 3))
+				return -1;
+			n = (buf[1] << 8) | buf[2];
+			for (i = 0; i < n; i++) {
+				if (recv_all(cl->sock, buf, 12))
+					return -1;
+				w = (buf[4] << 8) | buf[5];
+				h = (buf[6] << 8) | buf[7];
+				if (skip_all(cl->sock, (size_t)w * h * bpp))
+					return -1;
+				cl->bytes += 12 + (size_t)w * h * bpp;
+			}
+			cl->bytes += 4;
+			cl->updates++;
+
+			if (request_update(cl->sock, 1, width, height))
+				return -1;
+			break;
+		case 2: /* Bell */
+			break;
+		case 3: /* ServerCutText */
+			if (recv_all(cl->sock, buf, 7))
+				return -1;
+			len = ((uint32_t)buf[3] << 24) | (buf[4] << 16) | (buf[5] << 8) | buf[6];
+			if (skip_all(cl->sock, len))
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int client_thread(void *arg)
+{
+	bench_client_t *cl = arg;
+
+	/* Socket is shut down to stop the client: it is not an error */
+	if (client_session(cl) && !cl->stop)
+		cl->error = 1;
+	cl->ready = 1;
+
+	return 0;
+}
+
+static void bench_loopback(unsigned flags, const char *engine, unsigned width, unsigned height, unsigned cnt)
+{
+	trfb_server_t *srv;
+	bench_client_t *cl;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	unsigned long updates = 0, frames = 0;
+	unsigned long long bytes = 0;
+	unsigned i, errors = 0;
+	double t0, t;
+	int rv;
+
+	srv = trfb_server_create_ex(width, height, 4, flags);
+	if (!srv)
+		return;
+
+	if (trfb_server_bind(srv, "127.0.0.1", "0") || getsockname(srv->sock, (struct sockaddr*)&addr, &addrlen) ||
+			trfb_server_start(srv)) {
+		trfb_server_destroy(srv);
+		return;
+	}
+
+	cl = calloc(cnt, sizeof(bench_client_t));
+	if (!cl) {
+		trfb_server_destroy(srv);
+		return;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		cl[i].port = ntohs(addr.sin_port);
+		cl[i].sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (cl[i].sock >= 0 && thrd_create(&cl[i].thread, client_thread, cl + i) == thrd_success) {
+			cl[i].started = 1;
+		} else {
+			cl[i].error = 1;
+			cl[i].ready = 1;
+		}
+	}
+
+	/* Wait for all clients to connect */
+	t0 = now();
+	for (i = 0; i < cnt; i++) {
+		while (!cl[i].ready && now() - t0 < 10)
+			usleep(1000);
+	}
+
+	t0 = now();
+	do {
+		trfb_server_lock_fb(srv, 1);
+		fill(srv->fb->pixels, width, height, 0, frames++);
+		trfb_server_mark_dirty(srv, 0, 0, width, height);
+		trfb_server_unlock_fb(srv);
+
+		usleep(1000);
+		t = now() - t0;
+	} while (t * 1000 < duration);
+
+	for (i = 0; i < cnt; i++) {
+		cl[i].stop = 1;
+		if (cl[i].sock >= 0)
+			shutdown(cl[i].sock, SHUT_RDWR);
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (cl[i].started)
+			thrd_join(cl[i].thread, &rv);
+		if (cl[i].sock >= 0)
+			close(cl[i].sock);
+		updates += cl[i].updates;
+		bytes += cl[i].bytes;
+		errors += cl[i].error;
+	}
+
+	trfb_server_stop(srv);
+	trfb_server_destroy(srv);
+	free(cl);
+
+	result_begin("loopback");
+	fprintf(out, ", \"engine\": \"%s\", \"clients\": %u, \"width\": %u, \"height\": %u, \"seconds\": %.3f, \"frames\": %lu, "
+			"\"updates\": %lu, \"updates_per_s\": %.1f, \"updates_per_client_s\": %.1f, \"mbytes_per_s\": %.1f, \"errors\": %u",
+			engine, cnt, width, height, t, frames, updates, updates / t, updates / t / cnt, bytes / t * 1e-6, errors);
+	result_end();
+}
+
+static int parse_list(const char *s, unsigned *list, unsigned max)
+{
+	unsigned cnt = 0;
+	char *end;
+
+	while (*s && cnt < max) {
+		list[cnt++] = strtoul(s, &end, 0);
+		if (end == s)
+			return -1;
+		s = *end == ','? end + 1: end;
+	}
+
+	return cnt;
+}
+
+static int parse_sizes(const char *s)
+{
+	unsigned cnt = 0;
+	char *end;
+
+	while (*s && cnt < MAX_SIZES) {
+		sizes[cnt].width = strtoul(s, &end, 10);
+		if (*end != 'x')
+			return -1;
+		s = end + 1;
+		sizes[cnt].height = strtoul(s, &end, 10);
+		if (end == s || !sizes[cnt].width || !sizes[cnt].height)
+			return -1;
+		cnt++;
+		s = *end == ','? end + 1: end;
+	}
+
+	sizes_cnt = cnt;
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] [convert] [encode] [webcam] [loopback]\n"
+			"  -s WxH[,WxH...]  image sizes (default 640x480,1280x720,1920x1080)\n"
+			"  -c N[,N...]      count of loopback clients (default 1,4,16)\n"
+			"  -t ms            minimum time of one measurement (default 200)\n"
+			"  -d ms            duration of loopback measurement (default 2000)\n"
+			"  -o file          write results to file instead of stdout\n"
+			"  -v               show library messages\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	trfb_server_t *srv;
+	unsigned cpu = trfb_cpu_features();
+	int run_convert = 0, run_encode = 0, run_webcam = 0, run_loopback = 0;
+	int verbose = 0;
+	const char *outname = NULL;
+	unsigned i;
+	int k, r;
+
+	for (k = 1; k < argc; k++) {
+		if (!strcmp(argv[k], "-s") && k + 1 < argc) {
+			if (parse_sizes(argv[++k])) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[k], "-c") && k + 1 < argc) {
+			r = parse_list(argv[++k], clients, MAX_CLIENTS_CNT);
+			if (r <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			clients_cnt = r;
+		} else if (!strcmp(argv[k], "-t") && k + 1 < argc) {
+			min_time = strtoul(argv[++k], NULL, 0);
+		} else if (!strcmp(argv[k], "-d") && k + 1 < argc) {
+			duration = strtoul(argv[++k], NULL, 0);
+		} else if (!strcmp(argv[k], "-o") && k + 1 < argc) {
+			outname = argv[++k];
+		} else if (!strcmp(argv[k], "-v")) {
+			verbose = 1;
+		} else if (!strcmp(argv[k], "convert")) {
+			run_convert = 1;
+		} else if (!strcmp(argv[k], "encode")) {
+			run_encode = 1;
+		} else if (!strcmp(argv[k], "webcam")) {
+			run_webcam = 1;
+		} else if (!strcmp(argv[k], "loopback")) {
+			run_loopback = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!run_convert && !run_encode && !run_webcam && !run_loopback)
+		run_convert = run_encode = run_webcam = run_loopback = 1;
+
+	if (!verbose)
+		trfb_log_cb = NULL;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	out = stdout;
+	if (outname) {
+		out = fopen(outname, "w");
+		if (!out) {
+			fprintf(stderr, "Error: can't open %s\n", outname);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n\t\"cpu\": [");
+	for (i = 0, k = 0; i < CPU_FEATURES_CNT; i++) {
+		if (cpu & cpu_features[i].flag)
+			fprintf(out, "%s\"%s\"", k++? ", ": "", cpu_features[i].name);
+	}
+	fprintf(out, "],\n\t\"results\": [");
+
+	if (run_convert)
+		bench_convert();
+
+	if (run_encode) {
+		/* Encoders need server only for its format */
+		srv = trfb_server_create(16, 16, 4);
+		if (srv) {
+			bench_encode(srv);
+			trfb_server_destroy(srv);
+		}
+	}
+
+	if (run_webcam)
+		bench_webcam();
+
+	if (run_loopback) {
+		for (i = 0; i < clients_cnt; i++) {
+			bench_loopback(TRFB_SERVER_THREADED, "threaded", sizes[0].width, sizes[0].height, clients[i]);
+			bench_loopback(TRFB_SERVER_EVENT_LOOP, "event_loop", sizes[0].width, sizes[0].height, clients[i]);
+		}
+	}
+
+	fprintf(out, "\n\t]\n}\n");
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
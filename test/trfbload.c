@@ -0,0 +1,600 @@
+#include <trfb.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * Synthetic load generator: thousands of headless clients served by few epoll threads.
+ * Clients could connect to external server or to server started inside of this process.
+ */
+
+typedef struct load_client {
+	trfb_client_t *cl;
+	struct load_thread *thread;
+	unsigned id;
+	int failed;
+	/* Time of ServerInit and time when next request must be sent (rate limited clients) */
+	double init_time;
+	double next_request;
+	int request_due;
+	unsigned events;
+} load_client_t;
+
+typedef struct load_thread {
+	thrd_t thread;
+	int epfd;
+	/* Clients are added by main thread while test is running */
+	mtx_t lock;
+	load_client_t **clients;
+	unsigned clients_cnt;
+} load_thread_t;
+
+static double rate = 0; /* Requests per second per client (0 - after every update) */
+static int continuous = 0; /* Continuous updates instead of requests if server supports them */
+static trfb_format_t format;
+static int format_set = 0;
+static int32_t encodings[TRFB_MAX_ENCODERS];
+static unsigned encodings_cnt = 0;
+static volatile int stop = 0;
+/* Count of clients finished handshake (clients are connected gradually to not overflow listen queue) */
+static mtx_t init_lock;
+static unsigned init_cnt = 0;
+
+static const struct {
+	const char *name;
+	trfb_format_t fmt;
+} formats[] = {
+	{ "rgb32", { 32, 24, 0, 1, 255, 255, 255, 16, 8, 0 } },
+	{ "rgb32be", { 32, 24, 1, 1, 255, 255, 255, 16, 8, 0 } },
+	{ "bgr32", { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16 } },
+	{ "rgb565", { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 } },
+	{ "rgb555", { 16, 15, 0, 1, 31, 31, 31, 10, 5, 0 } },
+	{ "rgb332", { 8, 8, 0, 1, 7, 7, 3, 5, 2, 0 } },
+	{ "bgr233", { 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 } }
+};
+#define FORMATS_CNT (sizeof(formats) / sizeof(formats[0]))
+
+static void client_fail(load_client_t *lc);
+
+static void on_init(trfb_client_t *cl)
+{
+	load_client_t *lc = cl->user;
+
+	lc->init_time = trfb_client_time();
+	lc->next_request = lc->init_time;
+
+	mtx_lock(&init_lock);
+	init_cnt++;
+	mtx_unlock(&init_lock);
+
+	trfb_client_request(cl, 0);
+}
+
+static void on_update(trfb_client_t *cl)
+{
+	load_client_t *lc = cl->user;
+	double t;
+
+	/* Server knows about extension after SetEncodings which is sent before the first request */
+	if (continuous && cl->cu_supported) {
+		if (!cl->cu_enabled && trfb_client_continuous(cl, 1))
+			client_fail(lc);
+		return;
+	}
+
+	if (rate <= 0) {
+		trfb_client_request(cl, 1);
+		return;
+	}
+
+	/* Next request is sent by thread when it is time */
+	t = trfb_client_time();
+	lc->next_request += 1.0 / rate;
+	if (lc->next_request < t)
+		lc->next_request = t;
+	lc->request_due = 1;
+}
+
+static void client_fail(load_client_t *lc)
+{
+	if (lc->failed)
+		return;
+
+	lc->failed = 1;
+	epoll_ctl(lc->thread->epfd, EPOLL_CTL_DEL, lc->cl->sock, NULL);
+	shutdown(lc->cl->sock, SHUT_RDWR);
+}
+
+static void client_watch(load_client_t *lc)
+{
+	struct epoll_event ev;
+	unsigned events = EPOLLIN;
+
+	if (lc->failed)
+		return;
+
+	if (trfb_io_pending(lc->cl->io))
+		events |= EPOLLOUT;
+
+	if (events == lc->events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = lc;
+	lc->events = events;
+	if (epoll_ctl(lc->thread->epfd, EPOLL_CTL_MOD, lc->cl->sock, &ev))
+		client_fail(lc);
+}
+
+static void client_event(load_client_t *lc, unsigned events)
+{
+	int r;
+
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		while ((r = trfb_client_read(lc->cl, 0)) > 0)
+			;
+		if (r < 0) {
+			client_fail(lc);
+			return;
+		}
+	}
+
+	if (trfb_client_flush(lc->cl, 0) < 0) {
+		client_fail(lc);
+		return;
+	}
+
+	client_watch(lc);
+}
+
+static int load_thread(void *arg)
+{
+	load_thread_t *th = arg;
+	struct epoll_event events[64];
+	load_client_t *lc;
+	double t;
+	int n, i;
+	unsigned j, cnt;
+
+	while (!stop) {
+		n = epoll_wait(th->epfd, events, 64, rate > 0? 1: 100);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++)
+			client_event(events[i].data.ptr, events[i].events);
+
+		if (rate <= 0)
+			continue;
+
+		mtx_lock(&th->lock);
+		cnt = th->clients_cnt;
+		mtx_unlock(&th->lock);
+
+		t = trfb_client_time();
+		for (j = 0; j < cnt; j++) {
+			lc = th->clients[j];
+			if (lc->request_due && !lc->failed && t >= lc->next_request) {
+				lc->request_due = 0;
+				if (trfb_client_request(lc->cl, 1)) {
+					client_fail(lc);
+					continue;
+				}
+				client_event(lc, 0);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Server started inside of this process: moving gradient at fps frames per second */
+static trfb_server_t *srv = NULL;
+static unsigned srv_fps = 30;
+/* Local server switches between full and half size every resize_period seconds (0 - never) */
+static double resize_period = 0;
+static unsigned srv_width = 0, srv_height = 0;
+
+static int producer(void *arg)
+{
+	unsigned frame = 0;
+	unsigned x, y;
+	uint32_t *p;
+	double t = trfb_client_time();
+	double resize_time = t + resize_period;
+	int half = 0;
+
+	while (!stop) {
+		if (resize_period > 0 && t >= resize_time) {
+			half = !half;
+			trfb_server_resize(srv, half? srv_width / 2: srv_width, half? srv_height / 2: srv_height);
+			resize_time += resize_period;
+		}
+
+		trfb_server_lock_fb(srv, 1);
+		p = srv->fb->pixels;
+		for (y = 0; y < srv->fb->height; y++)
+			for (x = 0; x < srv->fb->width; x++)
+				*p++ = TRFB_RGB((x + frame) & 0xff, y & 0xff, (x + y) >> 2 & 0xff);
+		trfb_server_mark_dirty(srv, 0, 0, srv->fb->width, srv->fb->height);
+		trfb_server_unlock_fb(srv);
+		frame++;
+
+		t += 1.0 / srv_fps;
+		while (!stop && trfb_client_time() < t)
+			usleep(1000);
+	}
+
+	return 0;
+}
+
+static int parse_encodings(char *s)
+{
+	const trfb_decoder_t *dec;
+	char *tok, *end;
+	unsigned i;
+
+	encodings_cnt = 0;
+	for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		if (encodings_cnt >= TRFB_MAX_ENCODERS)
+			return -1;
+
+		encodings[encodings_cnt] = strtol(tok, &end, 0);
+		if (*end) {
+			for (i = 0; (dec = trfb_decoder_get(i)) != NULL; i++)
+				if (!strcasecmp(dec->name, tok))
+					break;
+			if (!dec) {
+				fprintf(stderr, "Error: unknown encoding %s\n", tok);
+				return -1;
+			}
+			encodings[encodings_cnt] = dec->encoding;
+		}
+		encodings_cnt++;
+	}
+
+	return 0;
+}
+
+/* Append encoding to list if it is not there */
+static void add_encoding(int32_t enc)
+{
+	unsigned i;
+
+	for (i = 0; i < encodings_cnt; i++)
+		if (encodings[i] == enc)
+			return;
+
+	if (encodings_cnt < TRFB_MAX_ENCODERS)
+		encodings[encodings_cnt++] = enc;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] [host[:port] | /unix/socket]\n"
+			"  -c N          count of clients (default 10)\n"
+			"  -t N          count of client threads (default 4)\n"
+			"  -r rate       update requests per second per client (default 0: request after every update)\n"
+			"  -C            continuous updates (with fences) instead of update requests\n"
+			"  -d seconds    duration of test (default 10)\n"
+			"  -R N          maximum count of simultaneous handshakes while connecting (default 64)\n"
+			"  -e enc[,enc]  encodings by name or number (default: all supported)\n"
+			"  -f format     pixel format: rgb32, rgb32be, bgr32, rgb565, rgb555, rgb332, bgr233\n"
+			"  -S WxH        start local server of this size (on random port or Unix socket)\n"
+			"  -E            local server uses event loop engine\n"
+			"  -F fps        frames per second of local server (default 30)\n"
+			"  -Z seconds    local server switches between full and half size with this period\n"
+			"  -q            print summary only\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *target = "localhost:5913";
+	char host[256];
+	char port[16];
+	char *p;
+	unsigned clients_cnt = 10, threads_cnt = 4, duration = 10, ramp = 64;
+	unsigned srv_flags = TRFB_SERVER_THREADED;
+	int quiet = 0;
+	load_thread_t *threads;
+	load_client_t *clients, *lc;
+	struct epoll_event ev;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct rlimit rl;
+	thrd_t prod;
+	const trfb_decoder_t *dec;
+	double t0, t, fps, lat, fps_min = 0, fps_max = 0, fps_sum = 0, lat_sum = 0, lat_max = 0;
+	unsigned long long bytes = 0;
+	unsigned long updates = 0, lat_cnt = 0;
+	unsigned i, connected = 0, failed = 0, started = 0;
+	int k, rv, sock;
+
+	for (k = 1; k < argc; k++) {
+		if (!strcmp(argv[k], "-c") && k + 1 < argc) {
+			clients_cnt = strtoul(argv[++k], NULL, 0);
+		} else if (!strcmp(argv[k], "-t") && k + 1 < argc) {
+			threads_cnt = strtoul(argv[++k], NULL, 0);
+		} else if (!strcmp(argv[k], "-r") && k + 1 < argc) {
+			rate = strtod(argv[++k], NULL);
+		} else if (!strcmp(argv[k], "-C")) {
+			continuous = 1;
+		} else if (!strcmp(argv[k], "-d") && k + 1 < argc) {
+			duration = strtoul(argv[++k], NULL, 0);
+		} else if (!strcmp(argv[k], "-R") && k + 1 < argc) {
+			ramp = strtoul(argv[++k], NULL, 0);
+		} else if (!strcmp(argv[k], "-e") && k + 1 < argc) {
+			if (parse_encodings(argv[++k])) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[k], "-f") && k + 1 < argc) {
+			k++;
+			for (i = 0; i < FORMATS_CNT; i++)
+				if (!strcmp(formats[i].name, argv[k]))
+					break;
+			if (i >= FORMATS_CNT) {
+				usage(argv[0]);
+				return 1;
+			}
+			format = formats[i].fmt;
+			format_set = 1;
+		} else if (!strcmp(argv[k], "-S") && k + 1 < argc) {
+			if (sscanf(argv[++k], "%ux%u", &srv_width, &srv_height) != 2 || !srv_width || !srv_height) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[k], "-E")) {
+			srv_flags = TRFB_SERVER_EVENT_LOOP;
+		} else if (!strcmp(argv[k], "-F") && k + 1 < argc) {
+			srv_fps = strtoul(argv[++k], NULL, 0);
+		} else if (!strcmp(argv[k], "-Z") && k + 1 < argc) {
+			resize_period = strtod(argv[++k], NULL);
+		} else if (!strcmp(argv[k], "-q")) {
+			quiet = 1;
+		} else if (argv[k][0] != '-') {
+			target = argv[k];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!clients_cnt || !threads_cnt || !srv_fps || !ramp) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!encodings_cnt) {
+		for (i = 0; (dec = trfb_decoder_get(i)) != NULL && i < TRFB_MAX_ENCODERS; i++)
+			encodings[encodings_cnt++] = dec->encoding;
+	}
+
+	if (continuous && encodings_cnt + 2 <= TRFB_MAX_ENCODERS) {
+		encodings[encodings_cnt++] = TRFB_ENCODING_CONTINUOUS_UPDATES;
+		encodings[encodings_cnt++] = TRFB_ENCODING_FENCE;
+	}
+
+	/* Server resizes framebuffer: clients must announce they can follow */
+	if (resize_period > 0) {
+		add_encoding(TRFB_ENCODING_DESKTOP_SIZE);
+		add_encoding(TRFB_ENCODING_EXTENDED_DESKTOP_SIZE);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	trfb_log_cb = NULL;
+	mtx_init(&init_lock, mtx_plain);
+
+	/* Every client needs descriptor (and one more for local server) */
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (target[0] == '/') {
+		snprintf(host, sizeof(host), "%s", target);
+		port[0] = 0;
+	} else {
+		snprintf(host, sizeof(host), "%s", target);
+		p = strrchr(host, ':');
+		if (p) {
+			*p = 0;
+			snprintf(port, sizeof(port), "%s", p + 1);
+		} else {
+			snprintf(port, sizeof(port), "5913");
+		}
+	}
+
+	if (srv_width) {
+		srv = trfb_server_create_ex(srv_width, srv_height, 4, srv_flags);
+		if (!srv) {
+			fprintf(stderr, "Error: can't create server!\n");
+			return 1;
+		}
+
+		if (host[0] == '/') {
+			rv = trfb_server_bind_unix(srv, host);
+		} else {
+			/* Random port of loopback interface */
+			rv = trfb_server_bind(srv, "127.0.0.1", "0") || getsockname(srv->sock, (struct sockaddr*)&addr, &addrlen);
+			snprintf(host, sizeof(host), "127.0.0.1");
+			snprintf(port, sizeof(port), "%u", ntohs(addr.sin_port));
+		}
+
+		if (rv || trfb_server_start(srv)) {
+			fprintf(stderr, "Error: can't start server!\n");
+			return 1;
+		}
+
+		if (thrd_create(&prod, producer, NULL) != thrd_success) {
+			fprintf(stderr, "Error: can't start producer thread!\n");
+			return 1;
+		}
+	}
+
+	threads = calloc(threads_cnt, sizeof(load_thread_t));
+	clients = calloc(clients_cnt, sizeof(load_client_t));
+	if (!threads || !clients) {
+		fprintf(stderr, "Error: not enought memory!\n");
+		return 1;
+	}
+
+	for (i = 0; i < threads_cnt; i++) {
+		threads[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+		threads[i].clients = calloc(clients_cnt / threads_cnt + 1, sizeof(load_client_t*));
+		mtx_init(&threads[i].lock, mtx_plain);
+		if (threads[i].epfd < 0 || !threads[i].clients) {
+			fprintf(stderr, "Error: can't create thread!\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < threads_cnt; i++) {
+		if (thrd_create(&threads[i].thread, load_thread, threads + i) != thrd_success) {
+			fprintf(stderr, "Error: can't start thread!\n");
+			return 1;
+		}
+	}
+
+	/* Handshake is done by threads: */
+	t0 = trfb_client_time();
+	for (i = 0; i < clients_cnt && trfb_client_time() - t0 < duration; i++) {
+		for (;;) {
+			mtx_lock(&init_lock);
+			k = started - init_cnt < ramp;
+			mtx_unlock(&init_lock);
+			if (k || trfb_client_time() - t0 >= duration)
+				break;
+			usleep(1000);
+		}
+
+		lc = clients + i;
+		lc->id = i;
+		lc->thread = threads + i % threads_cnt;
+		lc->failed = 1;
+
+		sock = trfb_client_connect(host, port, 1);
+		if (sock < 0)
+			continue;
+
+		lc->cl = trfb_client_create(sock);
+		if (!lc->cl) {
+			close(sock);
+			continue;
+		}
+
+		lc->cl->user = lc;
+		lc->cl->on_init = on_init;
+		lc->cl->on_update = on_update;
+		if ((format_set && trfb_client_set_format(lc->cl, &format)) ||
+				trfb_client_set_encodings(lc->cl, encodings, encodings_cnt))
+			continue;
+
+		/* Client must be ready before it is seen by thread */
+		lc->failed = 0;
+		lc->events = EPOLLIN;
+		mtx_lock(&lc->thread->lock);
+		lc->thread->clients[lc->thread->clients_cnt++] = lc;
+		mtx_unlock(&lc->thread->lock);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = lc;
+		if (epoll_ctl(lc->thread->epfd, EPOLL_CTL_ADD, sock, &ev)) {
+			lc->failed = 1;
+			continue;
+		}
+
+		started++;
+	}
+
+	while (trfb_client_time() - t0 < duration)
+		usleep(10000);
+
+	stop = 1;
+	t = trfb_client_time();
+	for (i = 0; i < threads_cnt; i++)
+		thrd_join(threads[i].thread, &rv);
+
+	if (srv) {
+		thrd_join(prod, &rv);
+	}
+
+	printf("{\n\t\"config\": { \"clients\": %u, \"threads\": %u, \"rate\": %.1f, \"duration\": %u, \"format\": \"%s\", \"encodings\": [",
+			clients_cnt, threads_cnt, rate, duration, format_set? "custom": "server");
+	for (i = 0; i < encodings_cnt; i++)
+		printf("%s%d", i? ", ": "", encodings[i]);
+	printf("] },\n");
+
+	if (!quiet)
+		printf("\t\"clients\": [");
+
+	for (i = 0; i < clients_cnt; i++) {
+		lc = clients + i;
+		if (!lc->cl || !lc->init_time) {
+			failed++;
+			if (!quiet)
+				printf("%s\n\t\t{ \"id\": %u, \"connected\": false }", i? ",": "", i);
+			continue;
+		}
+
+		connected++;
+		failed += lc->failed;
+		fps = lc->cl->stats.updates / (t - lc->init_time);
+		lat = lc->cl->stats.latency_cnt? lc->cl->stats.latency_sum / lc->cl->stats.latency_cnt: 0;
+		if (connected == 1 || fps < fps_min)
+			fps_min = fps;
+		if (fps > fps_max)
+			fps_max = fps;
+		fps_sum += fps;
+		updates += lc->cl->stats.updates;
+		bytes += lc->cl->stats.bytes;
+		lat_sum += lc->cl->stats.latency_sum;
+		lat_cnt += lc->cl->stats.latency_cnt;
+		if (lc->cl->stats.latency_max > lat_max)
+			lat_max = lc->cl->stats.latency_max;
+
+		if (!quiet) {
+			printf("%s\n\t\t{ \"id\": %u, \"connected\": true, \"failed\": %s, \"updates\": %lu, \"fps\": %.2f, \"bytes\": %llu, "
+					"\"mbytes_per_s\": %.3f, \"latency_avg_ms\": %.3f, \"latency_min_ms\": %.3f, \"latency_max_ms\": %.3f }",
+					i? ",": "", i, lc->failed? "true": "false", lc->cl->stats.updates, fps, lc->cl->stats.bytes,
+					lc->cl->stats.bytes / (t - lc->init_time) * 1e-6, lat * 1e3, lc->cl->stats.latency_min * 1e3,
+					lc->cl->stats.latency_max * 1e3);
+		}
+	}
+
+	if (!quiet)
+		printf("\n\t],\n");
+
+	printf("\t\"summary\": { \"connected\": %u, \"failed\": %u, \"updates\": %lu, \"fps_avg\": %.2f, \"fps_min\": %.2f, \"fps_max\": %.2f, "
+			"\"bytes\": %llu, \"mbytes_per_s\": %.3f, \"latency_avg_ms\": %.3f, \"latency_max_ms\": %.3f }\n}\n",
+			connected, failed, updates, connected? fps_sum / connected: 0, fps_min, fps_max,
+			bytes, bytes / (t - t0) * 1e-6, lat_cnt? lat_sum / lat_cnt * 1e3: 0, lat_max * 1e3);
+
+	for (i = 0; i < clients_cnt; i++)
+		trfb_client_free(clients[i].cl);
+
+	for (i = 0; i < threads_cnt; i++) {
+		close(threads[i].epfd);
+		mtx_destroy(&threads[i].lock);
+		free(threads[i].clients);
+	}
+	free(threads);
+	free(clients);
+	mtx_destroy(&init_lock);
+
+	if (srv) {
+		trfb_server_stop(srv);
+		trfb_server_destroy(srv);
+	}
+
+	return 0;
+}
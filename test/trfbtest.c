@@ -16,11 +16,64 @@ static void sigint(int sig)
 	}
 }
 
+/* Arrow cursor: X is black, . is white */
+static const char *arrow[] = {
+	"X       ",
+	"XX      ",
+	"X.X     ",
+	"X..X    ",
+	"X...X   ",
+	"X....X  ",
+	"X.....X ",
+	"X..XXXXX",
+	"X.X     ",
+	"XX      ",
+	"X       "
+};
+
+static void set_cursor(trfb_server_t *srv)
+{
+	trfb_color_t pixels[11 * 8];
+	unsigned char mask[11];
+	unsigned x, y;
+
+	for (y = 0; y < 11; y++) {
+		mask[y] = 0;
+		for (x = 0; x < 8; x++) {
+			pixels[y * 8 + x] = arrow[y][x] == '.'? TRFB_RGB(255, 255, 255): TRFB_RGB(0, 0, 0);
+			if (arrow[y][x] != ' ')
+				mask[y] |= 0x80 >> x;
+		}
+	}
+
+	trfb_server_set_cursor(srv, 8, 11, 0, 0, pixels, mask);
+}
+
 int main(int argc, char *argv[])
 {
 	trfb_server_t *srv;
 	unsigned i, j, di = 0;
 	trfb_event_t event;
+	unsigned flags = TRFB_SERVER_THREADED;
+	size_t wsize = 0;
+	int cursor = 0;
+	int k;
+
+	for (k = 1; k < argc; k++) {
+		if (!strcmp(argv[k], "-e")) {
+			flags |= TRFB_SERVER_EVENT_LOOP;
+		} else if (!strcmp(argv[k], "-a")) {
+			flags |= TRFB_SERVER_AUTO_DAMAGE;
+		} else if (!strcmp(argv[k], "-z")) {
+			flags |= TRFB_SERVER_ZEROCOPY;
+		} else if (!strcmp(argv[k], "-A")) {
+			flags |= TRFB_SERVER_ADAPTIVE;
+		} else if (!strcmp(argv[k], "-c")) {
+			cursor = 1;
+		} else if (!strcmp(argv[k], "-w") && k + 1 < argc) {
+			wsize = strtoul(argv[++k], NULL, 0);
+		}
+	}
 
 	signal(SIGINT, sigint);
 
@@ -30,12 +83,16 @@ int main(int argc, char *argv[])
 	signal(SIGUSR2, sigint);
 	signal(SIGCHLD, SIG_IGN);
 
-	srv = trfb_server_create(640, 480, 4);
+	srv = trfb_server_create_ex(640, 480, 4, flags);
 	if (!srv) {
 		fprintf(stderr, "Error: can't create server!\n");
 		return 1;
 	}
 
+	trfb_server_set_buffers(srv, 0, wsize);
+	if (cursor)
+		set_cursor(srv);
+
 	if (trfb_server_bind(srv, "localhost", "5913")) {
 		fprintf(stderr, "Error: can't bind!\n");
 		return 1;
@@ -53,6 +110,9 @@ int main(int argc, char *argv[])
 				trfb_framebuffer_set_pixel(srv->fb, (i + di) % 256, j, TRFB_RGB(i, j, 100));
 			}
 		}
+		if (!(flags & TRFB_SERVER_AUTO_DAMAGE)) {
+			trfb_server_mark_dirty(srv, 0, 0, 256, 256);
+		}
 		trfb_server_unlock_fb(srv);
 		// di = (di + 10) % 256;
 